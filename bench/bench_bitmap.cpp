@@ -0,0 +1,121 @@
+// Time to answer every IS_BLAST_OVER of a file: the old record-by-record
+// scan of a vector<bool> versus RecordBitmap (per-blast counters, 64
+// records per word), under several loss patterns.
+//
+// Usage: ./bench_bitmap [records] [blast_size]
+
+#include "../protocol.h"
+#include "../record_bitmap.h"
+#include <iostream>
+#include <chrono>
+#include <random>
+
+using namespace std;
+
+// The scan find_missing_records used to do
+static size_t scan_vector(const vector<bool>& received, uint32_t start_rec, uint32_t end_rec,
+                          vector<Segment>& missing) {
+    missing.clear();
+    uint32_t segment_start = 0;
+    bool in_segment = false;
+    for (uint32_t rec = start_rec; rec <= end_rec; rec++) {
+        if (!received[rec]) {
+            if (!in_segment) {
+                segment_start = rec;
+                in_segment = true;
+            }
+        } else if (in_segment) {
+            missing.push_back(Segment(segment_start, rec - 1));
+            in_segment = false;
+        }
+    }
+    if (in_segment) {
+        missing.push_back(Segment(segment_start, end_rec));
+    }
+    return missing.size();
+}
+
+static size_t scan_bitmap(const RecordBitmap& received, uint32_t start_rec, uint32_t end_rec,
+                          vector<Segment>& missing) {
+    missing.clear();
+    received.for_each_missing(start_rec, end_rec, [&missing](uint32_t first, uint32_t last) {
+        missing.push_back(Segment(first, last));
+        return true;
+    });
+    return missing.size();
+}
+
+struct Pattern {
+    const char* name;
+    double loss;        // fraction of records lost
+    uint32_t burst;     // records lost together
+};
+
+int main(int argc, char* argv[]) {
+    uint32_t records = (argc > 1) ? atoi(argv[1]) : 10000000;
+    uint32_t blast_size = (argc > 2) ? atoi(argv[2]) : DEFAULT_BLAST_SIZE;
+
+    const Pattern patterns[] = {
+        {"no loss", 0.0, 1},
+        {"0.1% random", 0.001, 1},
+        {"1% random", 0.01, 1},
+        {"1% bursts of 64", 0.01, 64},
+        {"10% random", 0.10, 1},
+        {"50% random", 0.50, 1},
+    };
+
+    cout << "=== Missing-record tracking benchmark ===" << endl;
+    cout << records << " records, blast size " << blast_size << endl;
+    printf("%-18s %10s %12s %12s %8s\n", "pattern", "segments", "vector ms", "bitmap ms", "speedup");
+
+    mt19937 rng(42);
+    vector<Segment> missing;
+    missing.reserve(records / 2 + 1);
+
+    for (const Pattern& p : patterns) {
+        vector<bool> vec(records + 1, false);
+        RecordBitmap bitmap;
+        bitmap.reset(records, blast_size);
+
+        // Mark everything received except the lost bursts
+        uniform_real_distribution<double> coin(0.0, 1.0);
+        double start_prob = p.loss / p.burst;
+        uint32_t lost_left = 0;
+        for (uint32_t rec = 1; rec <= records; rec++) {
+            if (lost_left == 0 && coin(rng) < start_prob) {
+                lost_left = p.burst;
+            }
+            if (lost_left > 0) {
+                lost_left--;
+                continue;
+            }
+            vec[rec] = true;
+            bitmap.set(rec);
+        }
+
+        size_t segs_vec = 0, segs_bitmap = 0;
+        auto t0 = chrono::steady_clock::now();
+        for (uint32_t start = 1; start <= records; start += blast_size) {
+            uint32_t end = min<uint64_t>((uint64_t)start + blast_size - 1, records);
+            segs_vec += scan_vector(vec, start, end, missing);
+        }
+        auto t1 = chrono::steady_clock::now();
+        for (uint32_t start = 1; start <= records; start += blast_size) {
+            uint32_t end = min<uint64_t>((uint64_t)start + blast_size - 1, records);
+            segs_bitmap += scan_bitmap(bitmap, start, end, missing);
+        }
+        auto t2 = chrono::steady_clock::now();
+
+        if (segs_vec != segs_bitmap) {
+            cerr << "Mismatch for " << p.name << ": " << segs_vec << " vs " << segs_bitmap << endl;
+            return 1;
+        }
+
+        double ms_vec = chrono::duration<double, milli>(t1 - t0).count();
+        double ms_bitmap = chrono::duration<double, milli>(t2 - t1).count();
+        printf("%-18s %10zu %12.2f %12.2f %7.1fx\n", p.name, segs_vec, ms_vec, ms_bitmap,
+               ms_vec / max(ms_bitmap, 1e-6));
+    }
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+// DATA packet encode/decode cost: the owning DataPacket path (vector of
+// packets per blast, payload grown per record, copied into the send slot,
+// copied out again on receive) versus the in-place codec the sender and
+// receiver use (header written into the send slot, records read straight
+// behind it, views over the receive buffer). Both paths include the
+// per-packet CRC32C. Counts heap allocations by
+// replacing the global operator new. Nothing is sent: a full batch is
+// simply cleared, so only encoding and decoding are timed.
+//
+// Usage: ./bench_codec [record_size] [blasts] [blast_size]
+
+#include "../protocol.h"
+#include "../file_source.h"
+#include "../udp_batch.h"
+#include <iostream>
+#include <chrono>
+#include <new>
+#include <unistd.h>
+
+using namespace std;
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Where received records end up (stands in for the output file)
+static vector<uint8_t> sink_buffer;
+
+static void store(uint32_t rec, const uint8_t* data, uint16_t record_size) {
+    memcpy(sink_buffer.data() + (size_t)(rec - 1) * record_size, data, record_size);
+}
+
+// The old path: create_data_packets + serialize + DataPacket::deserialize
+// Records per DATA packet (what a 1500-byte MTU path gives 256-byte records)
+static const uint32_t PACKET_RECORDS = 5;
+
+static void owning_blast(const FileSource& source, uint32_t start, uint32_t end,
+                         uint16_t record_size, SendBatch& batch) {
+    vector<DataPacket> packets;
+    uint32_t rec = start;
+    while (rec <= end) {
+        DataPacket pkt;
+        uint32_t first = rec;
+        for (int i = 0; i < (int)PACKET_RECORDS && rec <= end; i++, rec++) {
+            size_t offset = pkt.data.size();
+            pkt.data.resize(offset + record_size);
+            source.read_record(rec, pkt.data.data() + offset);
+        }
+        pkt.segments[pkt.num_segments++] = Segment(first, rec - 1);
+        packets.push_back(pkt);
+    }
+
+    for (size_t i = 0; i < packets.size(); i++) {
+        uint8_t* slot = batch.next_slot();
+        size_t size = packets[i].serialize(slot, batch.slot_capacity());
+        batch.commit(size);
+
+        DataPacket rx;
+        rx.deserialize(slot, size);
+        size_t offset = 0;
+        for (uint32_t r = rx.segments[0].start_record; r <= rx.segments[0].end_record; r++) {
+            store(r, rx.data.data() + offset, record_size);
+            offset += record_size;
+        }
+        if (batch.full()) batch.clear();
+    }
+}
+
+// The current path: what BlastStream::send_blast and
+// ReceiveSession::process_data_packet do
+static void inplace_blast(const FileSource& source, uint32_t start, uint32_t end,
+                          uint16_t record_size, SendBatch& batch) {
+    uint32_t rec = start;
+    while (rec <= end) {
+        uint32_t count = min(end - rec + 1, PACKET_RECORDS);
+        uint8_t* slot = batch.next_slot();
+        Segment segment(rec, rec + count - 1);
+        size_t header = write_data_header(slot, &segment, 1);
+        for (uint32_t i = 0; i < count; i++) {
+            source.read_record(rec + i, slot + header + (size_t)i * record_size);
+        }
+        size_t size = header + (size_t)count * record_size;
+        seal_packet(slot, size);
+        batch.commit(size);
+
+        DataPacketView rx;
+        if (!packet_intact(slot, size)) continue;
+        rx.parse(slot, size);
+        Segment seg = rx.segment(0);
+        size_t offset = 0;
+        for (uint32_t r = seg.start_record; r <= seg.end_record; r++) {
+            store(r, rx.data + offset, record_size);
+            offset += record_size;
+        }
+        rec += count;
+        if (batch.full()) batch.clear();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    uint16_t record_size = (argc > 1) ? atoi(argv[1]) : 1024;
+    uint32_t blasts = (argc > 2) ? atoi(argv[2]) : 200;
+    uint32_t blast_size = (argc > 3) ? atoi(argv[3]) : DEFAULT_BLAST_SIZE;
+
+    // A file to read records from
+    char path[] = "/tmp/bench_codec_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    size_t file_size = (size_t)blast_size * record_size;
+    vector<uint8_t> content(file_size);
+    for (size_t i = 0; i < file_size; i++) content[i] = (uint8_t)(i * 131);
+    if (write(fd, content.data(), file_size) != (ssize_t)file_size) {
+        perror("write");
+        return 1;
+    }
+    close(fd);
+
+    FileSource source;
+    if (!source.open_file(path, record_size)) {
+        cerr << "Cannot open " << path << endl;
+        return 1;
+    }
+    sink_buffer.assign(file_size, 0);
+
+    cout << "=== DATA codec benchmark ===" << endl;
+    cout << blasts << " blasts of " << blast_size << " records, " << record_size
+         << "-byte records" << endl;
+    printf("%-10s %14s %14s %12s\n", "path", "allocations", "allocs/packet", "ns/packet");
+
+    uint32_t packets_per_blast = (blast_size + PACKET_RECORDS - 1) / PACKET_RECORDS;
+    const char* names[2] = {"owning", "in-place"};
+    for (int mode = 0; mode < 2; mode++) {
+        SendBatch batch(SEND_BATCH_SIZE, MAX_DATA_PACKET_SIZE);
+        // Warm up, then count only the steady state
+        for (int w = 0; w < 2; w++) {
+            if (mode == 0) owning_blast(source, 1, blast_size, record_size, batch);
+            else inplace_blast(source, 1, blast_size, record_size, batch);
+        }
+
+        size_t before = allocations;
+        auto start = chrono::steady_clock::now();
+        for (uint32_t b = 0; b < blasts; b++) {
+            if (mode == 0) owning_blast(source, 1, blast_size, record_size, batch);
+            else inplace_blast(source, 1, blast_size, record_size, batch);
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        size_t allocs = allocations - before;
+        double packets = (double)blasts * packets_per_blast;
+
+        printf("%-10s %14zu %14.2f %12.1f\n", names[mode], allocs, allocs / packets, ns / packets);
+        if (memcmp(sink_buffer.data(), content.data(), file_size) != 0) {
+            cerr << "Records came out wrong" << endl;
+            return 1;
+        }
+    }
+
+    source.close_file();
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Goodput with and without --compress over a rate-limited loopback link:
+# text of the kind test.sh sends and random data that does not compress.
+#
+# Usage: bench/bench_compress.sh [size_mb] [rate_mbps] [loss_rate]
+#
+# --rate paces each stream at a fixed rate, standing in for a link slower
+# than the compressor; goodput is file bytes over the sender's total time.
+# zstd is included when the sender was built with make ZSTD=1.
+
+set -e
+
+SIZE_MB=${1:-50}
+RATE=${2:-200}
+LOSS=${3:-0.01}
+PORT=9950
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+seq 1 $((SIZE_MB * 12000)) | awk '{ printf "Line %d: The quick brown fox jumps over the lazy dog. Testing UDP file transfer protocol.\n", $1 }' \
+    | head -c $((SIZE_MB * 1024 * 1024)) > "$WORK/text.txt"
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$WORK/random.bin"
+
+CODECS="none lz4"
+if grep -q ZSTD_compressCCtx "$ROOT/sender"; then
+    CODECS="$CODECS zstd"
+fi
+
+echo "=== Compression benchmark (loopback, ${RATE} Mbps link) ==="
+echo "Files: ${SIZE_MB} MB, record 1024 B, blast 4000, loss ${LOSS}"
+printf "%-8s %-6s %12s %10s %12s\n" "data" "codec" "goodput Mbps" "ratio" "raw blasts"
+
+for FILE in text.txt random.bin; do
+    for CODEC in $CODECS; do
+        (cd "$WORK" && exec "$ROOT/receiver" $PORT > receiver.log 2>&1) &
+        RECEIVER=$!
+        sleep 0.3
+
+        "$ROOT/sender" 127.0.0.1 $PORT "$WORK/$FILE" 1024 4000 $LOSS \
+            --rate $RATE --compress $CODEC > "$WORK/sender.log" 2>&1
+        kill $RECEIVER 2>/dev/null || true
+        wait $RECEIVER 2>/dev/null || true
+
+        awk -v f=${FILE%.*} -v c=$CODEC '
+            /^Throughput:/ { goodput = $2 }
+            /^Compression: [0-9.]+x/ { ratio = $2; raw = $(NF - 1) }
+            END { printf "%-8s %-6s %12.2f %10s %12s\n", f, c, goodput, ratio != "" ? ratio : "-", raw != "" ? raw : "-" }
+        ' "$WORK/sender.log"
+
+        rm -rf "$WORK/received_files"
+        PORT=$((PORT + 1))
+    done
+done
@@ -0,0 +1,87 @@
+// CRC32C cost: the SSE4.2 three-stream kernel versus the slicing-by-8
+// fallback, over single packets (what seal_packet/packet_intact hash per
+// DATA packet) and over a large buffer (the whole-file digest). The last
+// column is the share of one core a 10 Gbps stream of such packets would
+// spend checksumming, counted once per side.
+//
+// Usage: ./bench_crc [megabytes]
+
+#include "../crc32c.h"
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+typedef uint32_t (*CrcFn)(const uint8_t*, size_t, uint32_t);
+
+// ns per call of fn over len bytes, repeated until total bytes are hashed
+static double time_crc(CrcFn fn, const vector<uint8_t>& buf, size_t len, size_t total,
+                       uint32_t& sink) {
+    size_t calls = total / len;
+    if (calls == 0) calls = 1;
+    size_t offsets = buf.size() / len;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; i++) {
+        sink ^= fn(buf.data() + (i % offsets) * len, len, 0);
+    }
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / calls;
+}
+
+int main(int argc, char* argv[]) {
+    size_t megabytes = (argc > 1) ? atoi(argv[1]) : 256;
+    size_t total = megabytes * 1024 * 1024;
+
+    vector<uint8_t> buf(16 * 1024 * 1024);
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = (uint8_t)(i * 2654435761u >> 13);
+
+    // The standard check value, and both kernels agreeing on odd lengths
+    const char* check = "123456789";
+    if (crc32c((const uint8_t*)check, 9) != 0xe3069283) {
+        cerr << "CRC32C check value is wrong" << endl;
+        return 1;
+    }
+#if defined(__x86_64__)
+    if (crc32c_hardware()) {
+        for (size_t len = 0; len < 30000; len += 997) {
+            if (crc32c_hw(buf.data() + 3, len, 7) != crc32c_sw(buf.data() + 3, len, 7)) {
+                cerr << "Kernels disagree at " << len << " bytes" << endl;
+                return 1;
+            }
+        }
+    }
+#endif
+
+    vector<CrcFn> fns;
+    vector<const char*> names;
+    fns.push_back(crc32c_sw);
+    names.push_back("software");
+#if defined(__x86_64__)
+    if (crc32c_hardware()) {
+        fns.push_back(crc32c_hw);
+        names.push_back("sse4.2");
+    }
+#endif
+
+    const size_t sizes[3] = {1472, 65000, 16 * 1024 * 1024};
+    const char* labels[3] = {"1500 MTU", "64K GSO", "16 MB"};
+
+    cout << "=== CRC32C benchmark ===" << endl;
+    cout << megabytes << " MB hashed per row" << endl;
+    printf("%-10s %-10s %12s %10s %14s\n", "kernel", "buffer", "ns/buffer", "GB/s", "10G core %");
+
+    uint32_t sink = 0;
+    for (size_t f = 0; f < fns.size(); f++) {
+        for (int s = 0; s < 3; s++) {
+            time_crc(fns[f], buf, sizes[s], total / 8, sink);       // warm up
+            double ns = time_crc(fns[f], buf, sizes[s], total, sink);
+            double gbps = sizes[s] / ns;
+            // 10 Gbps is 1.25 bytes per ns
+            printf("%-10s %-10s %12.1f %10.2f %13.1f%%\n", names[f], labels[s], ns, gbps,
+                   100.0 * 1.25 / gbps);
+        }
+    }
+    return sink == 0x12345678 ? 2 : 0;
+}
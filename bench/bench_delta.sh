@@ -0,0 +1,75 @@
+#!/bin/bash
+# Completion time of a full send vs --delta when the receiver already has
+# an older copy of the file: a copy with scattered small edits and one
+# with bytes inserted near the start (every later block shifted).
+#
+# Usage: bench/bench_delta.sh [size_mb] [rate_mbps]
+#
+# --rate paces the sender at a fixed rate, standing in for a link far
+# slower than loopback; the receiver's signature rate is its own line.
+
+set -e
+
+SIZE_MB=${1:-50}
+RATE=${2:-1000}
+PORT=9960
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$WORK/old.bin"
+
+# 1% of the file rewritten in 100-byte edits at random 100-byte slots
+cp "$WORK/old.bin" "$WORK/edited.bin"
+SLOTS=$((SIZE_MB * 1024 * 1024 / 100))
+for i in $(seq 1 $((SLOTS / 100))); do
+    dd if=/dev/urandom of="$WORK/edited.bin" bs=100 count=1 conv=notrunc status=none \
+        seek=$(( (RANDOM * 32768 + RANDOM) % SLOTS ))
+done
+
+# 104 bytes inserted 1 MB in
+{ head -c 1048576 "$WORK/old.bin"; head -c 104 /dev/urandom; tail -c +1048577 "$WORK/old.bin"; } > "$WORK/inserted.bin"
+
+run() {
+    local file=$1 mode=$2 flags=$3
+    mkdir -p "$WORK/rx"
+    cp "$WORK/old.bin" "$WORK/f.bin"
+    (cd "$WORK/rx" && exec "$ROOT/receiver" $PORT > receiver.log 2>&1) &
+    RECEIVER=$!
+    sleep 0.3
+    "$ROOT/sender" 127.0.0.1 $PORT "$WORK/f.bin" 1024 4000 0 --rate $RATE > /dev/null 2>&1
+    until ls "$WORK"/rx/received_files/*/f.bin > /dev/null 2>&1; do
+        sleep 0.05                           # renamed out of partial/ when complete
+    done
+    kill $RECEIVER 2>/dev/null || true
+    wait $RECEIVER 2>/dev/null || true
+    PORT=$((PORT + 1))
+    sleep 1.1                                # a new timestamped directory
+
+    cp "$WORK/$file" "$WORK/f.bin"
+    (cd "$WORK/rx" && exec "$ROOT/receiver" $PORT > receiver.log 2>&1) &
+    RECEIVER=$!
+    sleep 0.3
+    "$ROOT/sender" 127.0.0.1 $PORT "$WORK/f.bin" 1024 4000 0 --rate $RATE $flags > "$WORK/sender.log" 2>&1
+    kill $RECEIVER 2>/dev/null || true
+    wait $RECEIVER 2>/dev/null || true
+    PORT=$((PORT + 1))
+
+    awk -v f=${file%.*} -v m=$mode '
+        /^Total time:/ { secs = $3 }
+        /^Delta: [0-9]+ record\(s\) copied/ { copied = $2 }
+        END { printf "%-10s %-6s %10.2f %14s\n", f, m, secs, copied != "" ? copied : "-" }
+    ' "$WORK/sender.log"
+    grep -h "^Signatures:" "$WORK/rx/receiver.log" | sed 's/^/    /' || true
+    rm -rf "$WORK/rx"
+}
+
+echo "=== Delta sync benchmark (loopback, ${RATE} Mbps link) ==="
+echo "Files: ${SIZE_MB} MB random, record 1024 B, blast 4000, no loss"
+printf "%-10s %-6s %10s %14s\n" "data" "mode" "seconds" "records copied"
+
+for FILE in edited.bin inserted.bin; do
+    run $FILE full ""
+    run $FILE delta "--delta"
+done
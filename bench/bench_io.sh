@@ -0,0 +1,58 @@
+#!/bin/bash
+# Blocking syscalls (--io sync) versus io_uring (--io uring) over loopback,
+# with the received file on tmpfs and on a real disk.
+#
+# Usage: bench/bench_io.sh [size_mb] [disk_dir] [rec_size] [blast_size] [loss_rate]
+#
+# Time is measured from sender start until the receiver has written and
+# fdatasync'd the whole file, so on a disk target the write path counts.
+# Receiver CPU is user + system time of the receiver process.
+
+set -e
+
+SIZE_MB=${1:-200}
+DISK_DIR=${2:-/var/tmp}
+REC_SIZE=${3:-1024}
+BLAST_SIZE=${4:-4096}
+LOSS=${5:-0}
+PORT=9800
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TMPFS_WORK=$(mktemp -d -p /dev/shm)
+DISK_WORK=$(mktemp -d -p "$DISK_DIR")
+trap 'rm -rf "$TMPFS_WORK" "$DISK_WORK"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$TMPFS_WORK/payload.bin"
+cp "$TMPFS_WORK/payload.bin" "$DISK_WORK/payload.bin"
+TICKS=$(getconf CLK_TCK)
+
+echo "=== I/O engine benchmark (loopback) ==="
+echo "File: ${SIZE_MB} MB, record ${REC_SIZE} B, blast ${BLAST_SIZE}, loss ${LOSS}"
+printf "%-6s %-6s %12s %12s %14s\n" "target" "engine" "seconds" "Mbps" "receiver CPU s"
+
+for TARGET in tmpfs disk; do
+    WORK=$TMPFS_WORK
+    [ $TARGET = disk ] && WORK=$DISK_WORK
+    for ENGINE in sync uring; do
+        sync
+        (cd "$WORK" && exec "$ROOT/receiver" $PORT --io $ENGINE > receiver.log 2>&1) &
+        RECEIVER=$!
+        sleep 0.3
+
+        START=$(date +%s.%N)
+        # The sender waits for the receiver's verdict, given once the file
+        # is flushed, and the receiver lingers a moment after it
+        "$ROOT/sender" 127.0.0.1 $PORT "$WORK/payload.bin" $REC_SIZE $BLAST_SIZE $LOSS \
+            --io $ENGINE > "$WORK/sender.log" 2>&1
+        END=$(date +%s.%N)
+        CPU=$(awk -v t=$TICKS '{ printf "%.2f", ($14 + $15) / t }' /proc/$RECEIVER/stat)
+        kill $RECEIVER 2>/dev/null || true
+        wait $RECEIVER 2>/dev/null || true
+
+        awk -v s=$START -v e=$END -v mb=$SIZE_MB -v t=$TARGET -v n=$ENGINE -v c=$CPU \
+            'BEGIN { d = e - s; printf "%-6s %-6s %12.2f %12.2f %14s\n", t, n, d, mb * 8.388608 / d, c }'
+
+        rm -rf "$WORK/received_files"
+        PORT=$((PORT + 10))
+    done
+done
@@ -0,0 +1,48 @@
+#!/bin/bash
+# Loss recovery latency with and without mid-blast NACKs: the same lossy,
+# delayed, rate-limited transfer with the receiver's NACKs acted on and
+# with --no-nack (retransmissions only after IS_BLAST_OVER). Repair is the
+# time from a record's first send to its retransmission.
+#
+# Usage: bench/bench_midblast.sh [size_mb] [blast_size] [rate_mbps] [loss] [delay_ms]
+#
+# One blast in flight at a time, so each blast's completion time is its
+# send time plus what its losses add.
+
+set -e
+
+SIZE_MB=${1:-50}
+BLAST=${2:-10000}
+RATE=${3:-400}
+LOSS=${4:-0.01}
+DELAY=${5:-10}
+PORT=9920
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $RECEIVER 2>/dev/null || true; rm -rf "$WORK"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$WORK/payload.bin"
+
+(cd "$WORK" && exec "$ROOT/receiver" $PORT --server > receiver.log 2>&1) &
+RECEIVER=$!
+sleep 0.3
+
+echo "=== Mid-blast NACK benchmark (loopback) ==="
+echo "${SIZE_MB} MB, blast ${BLAST} records, ${RATE} Mbps, loss ${LOSS}, delay ${DELAY} ms"
+printf "%-10s %12s %12s %12s %12s %8s %10s\n" "mode" "repair p50" "repair p99" "blast p50" "blast p99" \
+       "resent" "Mbps"
+
+for mode in nack no-nack; do
+    flags=""
+    [ $mode = no-nack ] && flags="--no-nack"
+    "$ROOT/sender" 127.0.0.1 $PORT "$WORK/payload.bin" 1024 $BLAST 0 --window 1 --mtu 1500 \
+        --rate $RATE --impair loss=$LOSS,delay=$DELAY,seed=1 $flags > "$WORK/sender.log" 2>&1
+    awk -v mode=$mode '
+        /^Loss repair:/ { p50 = $4; p99 = $7 }
+        /^Blast completion:/ { b50 = $4; b99 = $7 }
+        /^Retransmissions:/ { resent = $2 }
+        /^Throughput:/ { mbps = $2 }
+        END { printf "%-10s %9.1f ms %9.1f ms %9.1f ms %9.1f ms %8d %10.1f\n",
+                     mode, p50 / 1000, p99 / 1000, b50, b99, resent, mbps }' "$WORK/sender.log"
+done
@@ -0,0 +1,106 @@
+// REC_MISS size and cost per loss pattern: the missing runs of a 10000
+// record blast and of a 1M record RESUME_MAP, as the old fixed format
+// sent them (8 bytes a run, at most 1000 runs per reply, so one round
+// trip per 1000 runs) and as split_rec_miss parts (varint ranges or a
+// bitmap, whichever is smaller, in unfragmented datagrams), with the time
+// to split and serialize them and to parse them back.
+//
+// Usage: ./bench_nack [repeats]
+
+#include "../protocol.h"
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+
+using namespace std;
+
+static const size_t OLD_HEADER = 15;
+static const size_t OLD_MAX_RUNS = 1000;
+
+// The runs of [1, records] a loss pattern leaves missing
+static RecMissPacket make_reply(uint32_t records, const char* pattern, mt19937& rng) {
+    RecMissPacket reply;
+    reply.start_record = 1;
+    reply.end_record = records;
+    bool lost = false;
+    for (uint32_t r = 1; r <= records; r++) {
+        uint32_t dice = rng() % 10000;
+        string p = pattern;
+        if (p == "random 0.1%") lost = dice < 10;
+        else if (p == "random 1%") lost = dice < 100;
+        else if (p == "random 10%") lost = dice < 1000;
+        else if (p == "random 50%") lost = dice < 5000;
+        else if (p == "bursts of ~20") lost = lost ? dice >= 500 : dice < 50;
+        else lost = (r - 1) % 64 < 63 ? lost : !lost;      // one big hole in two
+        if (!lost) continue;
+        if (!reply.missing.empty() && reply.missing.back().end_record == r - 1) {
+            reply.missing.back().end_record = r;
+        } else {
+            reply.missing.push_back(Segment(r, r));
+        }
+        reply.missing_records++;
+    }
+    return reply;
+}
+
+int main(int argc, char* argv[]) {
+    int repeats = (argc > 1) ? atoi(argv[1]) : 20;
+    const char* patterns[] = {"random 0.1%", "random 1%", "random 10%", "random 50%",
+                              "bursts of ~20", "alternating 64"};
+    const uint32_t ranges[] = {10000, 1000000};
+    mt19937 rng(1);
+
+    printf("%-8s %-15s %8s | %10s %6s | %10s %6s %10s %10s\n", "records", "loss", "runs",
+           "old bytes", "trips", "new bytes", "parts", "encode us", "decode us");
+
+    for (uint32_t records : ranges) {
+        for (const char* pattern : patterns) {
+            RecMissPacket reply = make_reply(records, pattern, rng);
+            size_t runs = reply.missing.size();
+            size_t trips = max((size_t)1, (runs + OLD_MAX_RUNS - 1) / OLD_MAX_RUNS);
+            size_t old_bytes = trips * OLD_HEADER + runs * 8;
+
+            vector<RecMissPacket> parts;
+            vector<vector<uint8_t>> wire;
+            size_t new_bytes = 0;
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < repeats; i++) {
+                split_rec_miss(reply, REC_MISS_MAX_SIZE, parts);
+                wire.assign(parts.size(), vector<uint8_t>(REC_MISS_MAX_SIZE));
+                new_bytes = 0;
+                for (size_t p = 0; p < parts.size(); p++) {
+                    size_t size = parts[p].serialize(wire[p].data(), REC_MISS_MAX_SIZE);
+                    wire[p].resize(size);
+                    new_bytes += size;
+                }
+            }
+            double encode_us = chrono::duration<double, micro>(
+                chrono::steady_clock::now() - start).count() / repeats;
+
+            RecMissPacket parsed;
+            size_t decoded = 0;
+            start = chrono::steady_clock::now();
+            for (int i = 0; i < repeats; i++) {
+                decoded = 0;
+                for (const auto& datagram : wire) {
+                    parsed.deserialize(datagram.data(), datagram.size());
+                    for (const Segment& run : parsed.missing) {
+                        decoded += run.end_record - run.start_record + 1;
+                    }
+                }
+            }
+            double decode_us = chrono::duration<double, micro>(
+                chrono::steady_clock::now() - start).count() / repeats;
+            if (decoded != reply.missing_records) {
+                cerr << "Decoded " << decoded << " of " << reply.missing_records << " records" << endl;
+                return 1;
+            }
+
+            printf("%-8u %-15s %8zu | %10zu %6zu | %10zu %6zu %10.1f %10.1f\n", records, pattern,
+                   runs, old_bytes, trips, new_bytes, parts.size(), encode_us, decode_us);
+        }
+    }
+    return 0;
+}
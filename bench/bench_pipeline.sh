@@ -0,0 +1,62 @@
+#!/bin/bash
+# The receive loop on one thread per stream (--io sync) versus split into
+# drain, placement and disk threads (--io pipeline), over loopback with
+# the received file on tmpfs and on a real disk. Besides the time, shows
+# how much of the loss the receiving host caused itself: packets the
+# kernel dropped for a full socket buffer (SO_RXQ_OVFL) and the records
+# that had to be requested again.
+#
+# Usage: bench/bench_pipeline.sh [size_mb] [disk_dir] [streams] [loss_rate]
+
+set -e
+
+SIZE_MB=${1:-200}
+DISK_DIR=${2:-/var/tmp}
+STREAMS=${3:-1}
+LOSS=${4:-0}
+PORT=9700
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TMPFS_WORK=$(mktemp -d -p /dev/shm)
+DISK_WORK=$(mktemp -d -p "$DISK_DIR")
+trap 'rm -rf "$TMPFS_WORK" "$DISK_WORK"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$TMPFS_WORK/payload.bin"
+cp "$TMPFS_WORK/payload.bin" "$DISK_WORK/payload.bin"
+
+# The number after a label in the receiver log, 0 if it is not there
+stat_of() {
+    grep -o "$1 [0-9]*" "$2" | awk '{ n = $NF } END { print n + 0 }'
+}
+
+echo "=== Receive pipeline benchmark (loopback) ==="
+echo "File: ${SIZE_MB} MB, ${STREAMS} stream(s), loss ${LOSS}"
+printf "%-6s %-9s %10s %10s %14s %12s\n" "target" "engine" "seconds" "Mbps" "kernel drops" "repaired"
+
+for TARGET in tmpfs disk; do
+    WORK=$TMPFS_WORK
+    [ $TARGET = disk ] && WORK=$DISK_WORK
+    for ENGINE in sync pipeline; do
+        sync
+        (cd "$WORK" && exec "$ROOT/receiver" $PORT --io $ENGINE > receiver.log 2>&1) &
+        RECEIVER=$!
+        sleep 0.3
+
+        # The sender waits for the receiver's verdict, given once the file
+        # is flushed
+        START=$(date +%s.%N)
+        "$ROOT/sender" 127.0.0.1 $PORT "$WORK/payload.bin" 1024 4096 $LOSS \
+            --streams $STREAMS > "$WORK/sender.log" 2>&1
+        END=$(date +%s.%N)
+        wait $RECEIVER 2>/dev/null || true
+
+        DROPS=$(stat_of "Kernel drops (SO_RXQ_OVFL):" "$WORK/receiver.log")
+        REPAIRED=$(stat_of "Records lost and repaired:" "$WORK/receiver.log")
+        awk -v s=$START -v e=$END -v mb=$SIZE_MB -v t=$TARGET -v n=$ENGINE -v d=$DROPS -v r=$REPAIRED \
+            'BEGIN { x = e - s; printf "%-6s %-9s %10.2f %10.2f %14d %12d\n", t, n, x, mb * 8.388608 / x, d, r }'
+        grep -E "^(Drain|Placement) ->" "$WORK/receiver.log" | sed 's/^/    /' || true
+
+        rm -rf "$WORK/received_files"
+        PORT=$((PORT + 10))
+    done
+done
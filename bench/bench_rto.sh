@@ -0,0 +1,46 @@
+#!/bin/bash
+# Completion time of many small lossy transfers over loopback: the tail is
+# set by how long a lost IS_BLAST_OVER (or its REC_MISS) goes unnoticed.
+#
+# Usage: bench/bench_rto.sh [transfers] [size_kb] [loss_rate] [probe_loss]
+#
+# DATA packets are dropped at loss_rate and IS_BLAST_OVER packets at
+# probe_loss (--probe-loss). One receiver in --server mode takes every
+# transfer; times are the sender's FILE_HDR-to-last-REC_MISS time.
+
+set -e
+
+TRANSFERS=${1:-200}
+SIZE_KB=${2:-64}
+LOSS=${3:-0.05}
+PROBE_LOSS=${4:-0.1}
+PORT=9900
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $RECEIVER 2>/dev/null || true; rm -rf "$WORK"' EXIT
+
+head -c $((SIZE_KB * 1024)) /dev/urandom > "$WORK/payload.bin"
+
+(cd "$WORK" && exec "$ROOT/receiver" $PORT --server > receiver.log 2>&1) &
+RECEIVER=$!
+sleep 0.3
+
+echo "=== Small-transfer tail latency benchmark (loopback) ==="
+echo "$TRANSFERS transfers of ${SIZE_KB} KB, DATA loss ${LOSS}, IS_BLAST_OVER loss ${PROBE_LOSS}"
+
+for i in $(seq $TRANSFERS); do
+    "$ROOT/sender" 127.0.0.1 $PORT "$WORK/payload.bin" 1024 1000 $LOSS \
+        --probe-loss $PROBE_LOSS > "$WORK/sender.log" 2>&1
+    awk '/^Total time:/ { print $3 * 1000 }' "$WORK/sender.log" >> "$WORK/times"
+    awk '/^IS_BLAST_OVER timeouts:/ { print $3 }' "$WORK/sender.log" >> "$WORK/timeouts"
+done
+
+sort -n "$WORK/times" | awk -v t="$(awk '{ s += $1 } END { print s }' "$WORK/timeouts")" '
+    { v[NR] = $1 }
+    END {
+        printf "%10s %10s %10s %10s %10s %10s\n", "p50 ms", "p90 ms", "p99 ms", "max ms", "mean ms", "timeouts"
+        for (i = 1; i <= NR; i++) sum += v[i]
+        printf "%10.2f %10.2f %10.2f %10.2f %10.2f %10d\n", v[int(NR * 0.5 + 0.5)], v[int(NR * 0.9 + 0.5)],
+               v[int(NR * 0.99 + 0.5)], v[NR], sum / NR, t
+    }'
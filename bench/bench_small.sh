@@ -0,0 +1,65 @@
+#!/bin/bash
+# Per-transfer latency of small files: how long one sender run takes from
+# start to the receiver's verdict, with the first blast sent behind
+# FILE_HDR (0-RTT) and with --no-0rtt, over a link with delay_ms each way;
+# and how soon a single-transfer receiver is done and can be started for
+# the next file.
+#
+# Usage: bench/bench_small.sh [files] [size_kb] [delay_ms]
+
+set -e
+
+FILES=${1:-20}
+SIZE_KB=${2:-64}
+DELAY=${3:-10}
+PORT=9990
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $RECEIVER 2>/dev/null || true; rm -rf "$WORK"' EXIT
+
+head -c $((SIZE_KB * 1024)) /dev/urandom > "$WORK/payload.bin"
+
+now() { date +%s.%N; }
+since() { awk -v a=$1 -v b=$(now) 'BEGIN { printf "%.4f", b - a }'; }
+
+# p50 and p99 of the times in a file, in milliseconds
+percentiles() {
+    sort -n "$1" | awk '{ t[NR] = $1 * 1000 }
+        END { printf "%10.1f %10.1f", t[int(NR * 0.5 + 0.5)], t[int(NR * 0.99 + 0.5)] }'
+}
+
+echo "=== Small file latency benchmark (loopback) ==="
+echo "${FILES} transfers of ${SIZE_KB} KB, ${DELAY} ms delay each way"
+printf "%-22s %10s %10s\n" "mode" "p50 ms" "p99 ms"
+
+(cd "$WORK" && exec "$ROOT/receiver" $PORT --server --impair delay=$DELAY > receiver.log 2>&1) &
+RECEIVER=$!
+sleep 0.3
+
+for mode in 0rtt no-0rtt; do
+    flags=""
+    [ $mode = no-0rtt ] && flags="--no-0rtt"
+    : > "$WORK/$mode.times"
+    for i in $(seq $FILES); do
+        start=$(now)
+        "$ROOT/sender" 127.0.0.1 $PORT "$WORK/payload.bin" 1024 1000 0 --impair delay=$DELAY \
+            $flags > "$WORK/sender.log" 2>&1
+        since $start >> "$WORK/$mode.times"
+    done
+    printf "%-22s %s\n" "server, $mode" "$(percentiles "$WORK/$mode.times")"
+done
+kill $RECEIVER
+wait $RECEIVER 2>/dev/null || true
+
+# One receiver process per file, each started once the last has exited
+: > "$WORK/single.times"
+for i in $(seq $FILES); do
+    start=$(now)
+    (cd "$WORK" && exec "$ROOT/receiver" $PORT > receiver.log 2>&1) &
+    RECEIVER=$!
+    "$ROOT/sender" 127.0.0.1 $PORT "$WORK/payload.bin" 1024 1000 0 > "$WORK/sender.log" 2>&1
+    wait $RECEIVER
+    since $start >> "$WORK/single.times"
+done
+printf "%-22s %s\n" "single, to exit" "$(percentiles "$WORK/single.times")"
@@ -0,0 +1,45 @@
+#!/bin/bash
+# Throughput over loopback for 1, 2, 4 and 8 streams (--streams n).
+#
+# Usage: bench/bench_streams.sh [size_mb] [rec_size] [blast_size] [loss_rate]
+#
+# Each stream gets its own socket pair and thread on both ends, so the
+# speedup is bounded by the cores available (nproc) as much as by the link.
+
+set -e
+
+SIZE_MB=${1:-200}
+REC_SIZE=${2:-1024}
+BLAST_SIZE=${3:-4096}
+LOSS=${4:-0}
+PORT=9700
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$WORK/payload.bin"
+
+echo "=== Multi-stream scaling benchmark (loopback) ==="
+echo "File: ${SIZE_MB} MB, record ${REC_SIZE} B, blast ${BLAST_SIZE}, loss ${LOSS}, cores $(nproc)"
+
+BASE=""
+for N in 1 2 4 8; do
+    (cd "$WORK" && exec "$ROOT/receiver" $PORT > receiver.log 2>&1) &
+    RECEIVER=$!
+    sleep 0.3
+
+    "$ROOT/sender" 127.0.0.1 $PORT "$WORK/payload.bin" $REC_SIZE $BLAST_SIZE $LOSS \
+        --streams $N > "$WORK/sender.log" 2>&1
+    # No need to sit through the receiver's linger
+    kill $RECEIVER 2>/dev/null || true
+    wait $RECEIVER 2>/dev/null || true
+
+    MBPS=$(awk '/^Throughput:/ {print $2}' "$WORK/sender.log")
+    BASE=${BASE:-$MBPS}
+    awk -v n=$N -v m="$MBPS" -v b="$BASE" \
+        'BEGIN { printf "streams %d : %10.2f Mbps  (x%.2f)\n", n, m, m / b }'
+
+    rm -rf "$WORK/received_files"
+    PORT=$((PORT + 10))
+done
@@ -0,0 +1,371 @@
+// Transfer benchmark matrix: the real sender and receiver, run as child
+// processes over loopback, for every combination of file size, record
+// size, blast size, loss rate and link profile. Per run it reports
+// goodput, the share of DATA packets that were retransmissions, p50/p99
+// blast completion time (first DATA to the empty REC_MISS) and CPU
+// seconds per GB on each side, and writes the lot as JSON so results
+// can be compared across commits.
+//
+// Loss is the sender's simulated loss with a fixed --seed and the files
+// are generated from fixed seeds, so reruns drop the same packets of the
+// same data. Profiles pace the sender with --rate to stand in for a link
+// slower than loopback, and "wan" adds 20 ms each way through --impair.
+//
+// Usage: ./bench_suite [--quick] [--json file] [--commit id] [--repeat n]
+//                      [--sizes mb,..] [--records b,..] [--blasts n,..]
+//                      [--loss p,..] [--profiles name,..] [--bin dir]
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <ctime>
+#include <csignal>
+#include <chrono>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+struct Profile {
+    const char* name;
+    double rate_mbps;                  // --rate, 0 = unpaced
+    const char* impair;                // --impair on both sides, "" = none
+};
+
+static const Profile PROFILES[] = {
+    {"loopback", 0, ""},
+    {"1gbps", 1000, ""},
+    {"100mbps", 100, ""},
+    {"wan", 100, "delay=20,jitter=1"},
+};
+
+static const unsigned LOSS_SEED = 12345;
+static const int FIRST_PORT = 10100;
+
+struct Result {
+    bool ok;
+    double seconds;
+    double goodput_mbps;
+    double retransmit_ratio;
+    double blast_p50_ms;
+    double blast_p99_ms;
+    double sender_cpu_per_gb;          // CPU seconds (user + system) per GB
+    double receiver_cpu_per_gb;
+
+    Result() : ok(false), seconds(0), goodput_mbps(0), retransmit_ratio(0), blast_p50_ms(0),
+               blast_p99_ms(0), sender_cpu_per_gb(0), receiver_cpu_per_gb(0) {}
+};
+
+template <typename T>
+static vector<T> parse_list(const string& spec) {
+    vector<T> values;
+    stringstream in(spec);
+    string item;
+    while (getline(in, item, ',')) {
+        stringstream field(item);
+        T value;
+        if (field >> value) values.push_back(value);
+    }
+    return values;
+}
+
+static double cpu_seconds(const struct rusage& ru) {
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// The first number after `key` on the line starting with it, or 0
+static double field_after(const string& log, const string& key) {
+    size_t at = log.find("\n" + key);
+    if (at == string::npos) return 0;
+    return atof(log.c_str() + at + 1 + key.size());
+}
+
+static bool write_file(const string& path, size_t bytes, unsigned seed) {
+    ofstream out(path.c_str(), ios::binary);
+    mt19937_64 rng(seed);
+    vector<uint64_t> chunk(1 << 16);
+    for (size_t done = 0; done < bytes; ) {
+        for (auto& word : chunk) word = rng();
+        size_t n = min(bytes - done, chunk.size() * sizeof(uint64_t));
+        out.write((const char*)chunk.data(), n);
+        done += n;
+    }
+    return (bool)out;
+}
+
+static bool same_contents(const string& a, const string& b) {
+    ifstream fa(a.c_str(), ios::binary), fb(b.c_str(), ios::binary);
+    if (!fa || !fb) return false;
+    vector<char> ba(1 << 20), bb(1 << 20);
+    while (true) {
+        fa.read(ba.data(), ba.size());
+        fb.read(bb.data(), bb.size());
+        if (fa.gcount() != fb.gcount() || memcmp(ba.data(), bb.data(), fa.gcount()) != 0) {
+            return false;
+        }
+        if (fa.gcount() == 0) return true;
+    }
+}
+
+// Where the receiver in rx_dir put `name` once it was complete, or ""
+static string received_path(const string& rx_dir, const string& name) {
+    string root = rx_dir + "/received_files";
+    DIR* dir = opendir(root.c_str());
+    if (!dir) return "";
+    string found;
+    while (struct dirent* entry = readdir(dir)) {
+        string sub = entry->d_name;
+        if (sub == "." || sub == ".." || sub == "partial") continue;
+        string path = root + "/" + sub + "/" + name;
+        if (access(path.c_str(), F_OK) == 0) found = path;
+    }
+    closedir(dir);
+    return found;
+}
+
+// Fork and exec argv in dir with stdout going to out_fd (or /dev/null)
+static pid_t spawn(const vector<string>& argv, const string& dir, int out_fd) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    if (chdir(dir.c_str()) != 0) _exit(127);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(out_fd >= 0 ? out_fd : null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    vector<char*> args;
+    for (const string& arg : argv) args.push_back((char*)arg.c_str());
+    args.push_back(NULL);
+    execv(args[0], args.data());
+    _exit(127);
+}
+
+static Result run_once(const string& bin, const string& work, const string& file, size_t bytes,
+                       int record_size, int blast_size, double loss, const Profile& profile,
+                       int port) {
+    Result result;
+    string rx_dir = work + "/rx";
+    mkdir(rx_dir.c_str(), 0755);
+
+    vector<string> receiver_args = {bin + "/receiver", to_string(port)};
+    if (profile.impair[0]) {
+        receiver_args.push_back("--impair");
+        receiver_args.push_back(string(profile.impair) + ",seed=" + to_string(LOSS_SEED + 1));
+    }
+    pid_t receiver = spawn(receiver_args, rx_dir, -1);
+    this_thread::sleep_for(chrono::milliseconds(100));
+
+    ostringstream loss_arg;
+    loss_arg << loss;
+    vector<string> args = {bin + "/sender", "127.0.0.1", to_string(port), file,
+                           to_string(record_size), to_string(blast_size), loss_arg.str(),
+                           "--seed", to_string(LOSS_SEED)};
+    if (profile.rate_mbps > 0) {
+        args.push_back("--rate");
+        args.push_back(to_string((int)profile.rate_mbps));
+    }
+    if (profile.impair[0]) {
+        args.push_back("--impair");
+        args.push_back(profile.impair);
+    }
+
+    int out[2];
+    if (pipe(out) != 0) return result;
+    pid_t sender = spawn(args, work, out[1]);
+    close(out[1]);
+    string log = "\n";
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(out[0], buf, sizeof(buf))) > 0) log.append(buf, n);
+    close(out[0]);
+
+    int status = 0;
+    struct rusage sender_ru, receiver_ru;
+    wait4(sender, &status, 0, &sender_ru);
+
+    // Let the receiver move the file out of partial/, then skip its linger
+    string name = file.substr(file.rfind('/') + 1);
+    string output;
+    for (int i = 0; i < 100 && (output = received_path(rx_dir, name)).empty(); i++) {
+        this_thread::sleep_for(chrono::milliseconds(20));
+    }
+    kill(receiver, SIGTERM);
+    int receiver_status;
+    wait4(receiver, &receiver_status, 0, &receiver_ru);
+
+    double gb = bytes / 1e9;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && !output.empty() &&
+                same_contents(file, output);
+    result.goodput_mbps = field_after(log, "Throughput:");
+    result.seconds = result.goodput_mbps > 0 ? bytes * 8.0 / result.goodput_mbps / 1e6 : 0;
+    double retransmitted = field_after(log, "Retransmissions:");
+    double attempted = field_after(log, "Data packets sent:") + field_after(log, "Packets lost:");
+    result.retransmit_ratio = attempted > 0 ? retransmitted / attempted : 0;
+    result.blast_p50_ms = field_after(log, "Blast completion: p50");
+    size_t p99 = log.find(", p99 ", log.find("\nBlast completion:"));
+    result.blast_p99_ms = p99 != string::npos ? atof(log.c_str() + p99 + 6) : 0;
+    result.sender_cpu_per_gb = cpu_seconds(sender_ru) / gb;
+    result.receiver_cpu_per_gb = cpu_seconds(receiver_ru) / gb;
+
+    system(("rm -rf '" + rx_dir + "'").c_str());
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    vector<int> sizes = {4, 32};
+    vector<int> records = {256, 512, 1024};
+    vector<int> blasts = {1000, 4000};
+    vector<double> losses = {0, 0.01, 0.05};
+    vector<string> profiles = {"loopback", "1gbps"};
+    string json_path = "bench_results.json";
+    string commit = "unknown";
+    string bin = ".";
+    int repeat = 1;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--quick") {
+            sizes = {4};
+            losses = {0, 0.01};
+            profiles = {"loopback"};
+        } else if (arg == "--json" && has_value) {
+            json_path = argv[++i];
+        } else if (arg == "--commit" && has_value) {
+            commit = argv[++i];
+        } else if (arg == "--bin" && has_value) {
+            bin = argv[++i];
+        } else if (arg == "--repeat" && has_value) {
+            repeat = max(1, atoi(argv[++i]));
+        } else if (arg == "--sizes" && has_value) {
+            sizes = parse_list<int>(argv[++i]);
+        } else if (arg == "--records" && has_value) {
+            records = parse_list<int>(argv[++i]);
+        } else if (arg == "--blasts" && has_value) {
+            blasts = parse_list<int>(argv[++i]);
+        } else if (arg == "--loss" && has_value) {
+            losses = parse_list<double>(argv[++i]);
+        } else if (arg == "--profiles" && has_value) {
+            profiles = parse_list<string>(argv[++i]);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--quick] [--json file] [--commit id] [--repeat n]"
+                 << " [--sizes mb,..] [--records b,..] [--blasts n,..] [--loss p,..]"
+                 << " [--profiles loopback,1gbps,100mbps,wan] [--bin dir]" << endl;
+            return 1;
+        }
+    }
+
+    vector<Profile> chosen;
+    for (const string& name : profiles) {
+        bool known = false;
+        for (const Profile& p : PROFILES) {
+            if (name == p.name) {
+                chosen.push_back(p);
+                known = true;
+            }
+        }
+        if (!known) {
+            cerr << "Unknown profile " << name << " (loopback, 1gbps, 100mbps or wan)" << endl;
+            return 1;
+        }
+    }
+
+    char work_template[] = "/tmp/bench_suite.XXXXXX";
+    if (!mkdtemp(work_template)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    string work = work_template;
+    char resolved[PATH_MAX];
+    if (!realpath(bin.c_str(), resolved)) {
+        perror(bin.c_str());
+        return 1;
+    }
+    bin = resolved;
+
+    cout << "=== Transfer benchmark matrix (loopback, " << thread::hardware_concurrency()
+         << " core(s)) ===" << endl;
+    printf("%-9s %6s %6s %6s %6s %10s %9s %9s %9s %9s %9s\n", "profile", "MB", "rec", "blast",
+           "loss", "goodput", "retx", "p50 ms", "p99 ms", "tx s/GB", "rx s/GB");
+
+    ostringstream runs;
+    int port = FIRST_PORT;
+    int failures = 0;
+    for (int mb : sizes) {
+        string file = work + "/payload_" + to_string(mb) + "mb.bin";
+        size_t bytes = (size_t)mb * 1024 * 1024;
+        if (!write_file(file, bytes, mb)) {
+            cerr << "Cannot write " << file << endl;
+            return 1;
+        }
+        for (const Profile& profile : chosen) {
+            for (int record_size : records) {
+                for (int blast_size : blasts) {
+                    for (double loss : losses) {
+                        for (int r = 0; r < repeat; r++) {
+                            Result res = run_once(bin, work, file, bytes, record_size, blast_size,
+                                                  loss, profile, port);
+                            port = port < FIRST_PORT + 500 ? port + 1 : FIRST_PORT;
+                            if (!res.ok) failures++;
+                            printf("%-9s %6d %6d %6d %6.3f %10.1f %9.4f %9.2f %9.2f %9.3f %9.3f%s\n",
+                                   profile.name, mb, record_size, blast_size, loss,
+                                   res.goodput_mbps, res.retransmit_ratio, res.blast_p50_ms,
+                                   res.blast_p99_ms, res.sender_cpu_per_gb,
+                                   res.receiver_cpu_per_gb, res.ok ? "" : "  FAILED");
+                            fflush(stdout);
+
+                            if (runs.tellp() > 0) runs << ",\n";
+                            runs << "    {\"profile\": \"" << profile.name << "\""
+                                 << ", \"rate_mbps\": " << profile.rate_mbps
+                                 << ", \"impair\": \"" << profile.impair << "\""
+                                 << ", \"size_mb\": " << mb
+                                 << ", \"record_size\": " << record_size
+                                 << ", \"blast_size\": " << blast_size
+                                 << ", \"loss\": " << loss
+                                 << ", \"repeat\": " << r
+                                 << ", \"ok\": " << (res.ok ? "true" : "false")
+                                 << ", \"seconds\": " << res.seconds
+                                 << ", \"goodput_mbps\": " << res.goodput_mbps
+                                 << ", \"retransmit_ratio\": " << res.retransmit_ratio
+                                 << ", \"blast_p50_ms\": " << res.blast_p50_ms
+                                 << ", \"blast_p99_ms\": " << res.blast_p99_ms
+                                 << ", \"sender_cpu_s_per_gb\": " << res.sender_cpu_per_gb
+                                 << ", \"receiver_cpu_s_per_gb\": " << res.receiver_cpu_per_gb
+                                 << "}";
+                        }
+                    }
+                }
+            }
+        }
+    }
+    system(("rm -rf '" + work + "'").c_str());
+
+    time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    ofstream json(json_path.c_str());
+    json << "{\n  \"commit\": \"" << commit << "\",\n  \"date\": \"" << date
+         << "\",\n  \"cores\": " << thread::hardware_concurrency()
+         << ",\n  \"loss_seed\": " << LOSS_SEED << ",\n  \"runs\": [\n" << runs.str()
+         << "\n  ]\n}\n";
+    if (!json) {
+        cerr << "Cannot write " << json_path << endl;
+        return 1;
+    }
+    cout << "Results written to " << json_path;
+    if (failures > 0) cout << " (" << failures << " run(s) FAILED)";
+    cout << endl;
+    return failures > 0 ? 1 : 0;
+}
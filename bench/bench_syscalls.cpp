@@ -0,0 +1,153 @@
+// Packets/sec over loopback: one sendto/recvfrom per datagram versus
+// SEND_BATCH_SIZE/RECV_BATCH_SIZE datagrams per sendmmsg/recvmmsg, and
+// sendmmsg with UDP GSO packing up to GSO_MAX_SEGMENTS datagrams per message.
+//
+// Usage: ./bench_syscalls [packet_size] [packets]
+
+#include "../protocol.h"
+#include "../udp_batch.h"
+#include <iostream>
+#include <chrono>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+using namespace std;
+
+static int make_socket(struct sockaddr_in& addr, bool bind_it) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (bind_it) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("bind");
+            exit(1);
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(fd, (struct sockaddr*)&addr, &len);
+    }
+    return fd;
+}
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Send `count` datagrams at a sink nobody reads (the kernel discards them
+// once its queue is full), so only the send path is timed
+static double bench_send(size_t pkt_size, int count, bool batched, bool gso) {
+    struct sockaddr_in dest;
+    int sink = make_socket(dest, true);
+    int fd = make_socket(dest, false);
+
+    vector<uint8_t> payload(pkt_size, 0xAB);
+    SendBatch batch(SEND_BATCH_SIZE, gso ? GSO_MAX_BYTES : pkt_size);
+    if (gso) batch.set_segment_size(pkt_size);
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        if (batched) {
+            memcpy(batch.next_slot(), payload.data(), pkt_size);
+            batch.commit(pkt_size);
+            if (batch.full()) batch.flush(fd, dest);
+        } else {
+            sendto(fd, payload.data(), pkt_size, 0, (struct sockaddr*)&dest, sizeof(dest));
+        }
+    }
+    if (batched) batch.flush(fd, dest);
+    double elapsed = seconds_since(start);
+
+    close(fd);
+    close(sink);
+    return count / elapsed;
+}
+
+// Queue a round of datagrams, then time draining them; repeated until
+// `count` datagrams have been received. Only the drain is timed.
+static double bench_recv(size_t pkt_size, int count, bool batched) {
+    struct sockaddr_in addr;
+    int rx = make_socket(addr, true);
+    int tx = make_socket(addr, false);
+    fcntl(rx, F_SETFL, O_NONBLOCK);
+
+    // As deep a queue as the kernel allows (SO_RCVBUFFORCE needs CAP_NET_ADMIN)
+    int rcvbuf = 32 * 1024 * 1024;
+    if (setsockopt(rx, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    socklen_t len = sizeof(rcvbuf);
+    getsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+    int round = max(1, min(count, rcvbuf / (int)(2 * pkt_size + 1024)));
+
+    vector<uint8_t> payload(pkt_size, 0xCD);
+    RecvBatch batch(RECV_BATCH_SIZE, MAX_UDP_PAYLOAD);
+    vector<uint8_t> buffer(MAX_UDP_PAYLOAD);
+
+    int drained = 0;
+    double elapsed = 0.0;
+    while (drained < count) {
+        for (int i = 0; i < round; i++) {
+            sendto(tx, payload.data(), pkt_size, 0, (struct sockaddr*)&addr, sizeof(addr));
+        }
+
+        int before = drained;
+        auto start = chrono::steady_clock::now();
+        while (true) {
+            int n;
+            if (batched) {
+                n = batch.receive(rx);
+            } else {
+                n = (recvfrom(rx, buffer.data(), buffer.size(), 0, NULL, NULL) < 0) ? 0 : 1;
+            }
+            if (n == 0) break;
+            drained += n;
+        }
+        elapsed += seconds_since(start);
+        if (drained == before) break;  // nothing got queued
+    }
+
+    close(rx);
+    close(tx);
+    return drained / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    // Default: a full DATA packet of 256-byte records on a 1500-byte MTU path
+    size_t pkt_size = (argc > 1) ? atoi(argv[1]) :
+        data_header_size(1) + records_per_packet(DEFAULT_PATH_MTU - IP_UDP_HEADER_SIZE, 256) * 256;
+    int count = (argc > 2) ? atoi(argv[2]) : 200000;
+
+    cout << "=== Syscall batching benchmark (loopback) ===" << endl;
+    cout << "Packet size: " << pkt_size << " bytes, " << count << " packets" << endl;
+
+    double send_single = bench_send(pkt_size, count, false, false);
+    double send_batch = bench_send(pkt_size, count, true, false);
+    printf("send  sendto   : %12.0f pkts/sec\n", send_single);
+    printf("send  sendmmsg : %12.0f pkts/sec  (x%.2f)\n", send_batch, send_batch / send_single);
+    if (pkt_size * 2 <= GSO_MAX_BYTES) {
+        int probe = socket(AF_INET, SOCK_DGRAM, 0);
+        bool have_gso = udp_gso_supported(probe);
+        close(probe);
+        if (have_gso) {
+            double send_gso = bench_send(pkt_size, count, true, true);
+            printf("send  +GSO     : %12.0f pkts/sec  (x%.2f)\n", send_gso, send_gso / send_single);
+        } else {
+            printf("send  +GSO     : not supported by this kernel\n");
+        }
+    }
+
+    double recv_single = bench_recv(pkt_size, count, false);
+    double recv_batch = bench_recv(pkt_size, count, true);
+    printf("recv  recvfrom : %12.0f pkts/sec\n", recv_single);
+    printf("recv  recvmmsg : %12.0f pkts/sec  (x%.2f)\n", recv_batch, recv_batch / recv_single);
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+// Cost of the --telemetry instrumentation on the hot paths: a counter
+// add, a histogram record, and the two clock reads that time a syscall,
+// from one thread and from several at once (the stream threads share
+// one set of metrics). The last rows are what one dump costs to render.
+//
+// Usage: ./bench_telemetry [operations] [threads]
+
+#include "../telemetry.h"
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <thread>
+
+using namespace std;
+
+template <typename Op>
+static double ns_per_op(size_t ops, int threads, Op op) {
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&op, ops, t] {
+            for (size_t i = 0; i < ops; i++) op(i, t);
+        }));
+    }
+    for (auto& w : workers) w.join();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ops;
+}
+
+int main(int argc, char* argv[]) {
+    size_t ops = (argc > 1) ? atol(argv[1]) : 20000000;
+    int threads = (argc > 2) ? atoi(argv[2]) : 4;
+    Telemetry& telemetry = Telemetry::instance();
+    Counter& counter = telemetry.counter("bench_counter_total", "Bench counter");
+    Histogram& histogram = telemetry.histogram("bench_histogram", "Bench histogram");
+    Histogram& timed = telemetry.histogram("bench_timed_ns", "Bench clock reads");
+
+    printf("%-36s %12s %12s\n", "", "1 thread", to_string(threads).append(" threads").c_str());
+
+    double one = ns_per_op(ops, 1, [&](size_t, int) { counter.add(); });
+    double many = ns_per_op(ops, threads, [&](size_t, int) { counter.add(); });
+    printf("%-36s %9.1f ns %9.1f ns\n", "Counter::add", one, many);
+
+    // Values spread over several buckets, as latencies are
+    one = ns_per_op(ops, 1, [&](size_t i, int) { histogram.record(500 + (i & 4095)); });
+    many = ns_per_op(ops, threads, [&](size_t i, int t) { histogram.record(500 + ((i + t) & 4095)); });
+    printf("%-36s %9.1f ns %9.1f ns\n", "Histogram::record", one, many);
+
+    one = ns_per_op(ops / 4, 1, [&](size_t, int) {
+        auto start = chrono::steady_clock::now();
+        timed.record(elapsed_ns(start));
+    });
+    printf("%-36s %9.1f ns\n", "steady_clock x2 + record", one);
+
+    // The histogram filled above, 50 times over, both formats
+    const int RENDERS = 50;
+    size_t bytes = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < RENDERS; i++) bytes += telemetry.render(TELEMETRY_PROMETHEUS).size();
+    printf("%-36s %9.1f us (%zu bytes)\n", "render, Prometheus",
+           chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / RENDERS,
+           bytes / RENDERS);
+    bytes = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < RENDERS; i++) bytes += telemetry.render(TELEMETRY_JSON).size();
+    printf("%-36s %9.1f us (%zu bytes)\n", "render, JSON",
+           chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / RENDERS,
+           bytes / RENDERS);
+
+    printf("p50 %llu, p99 %llu of %llu values in 500..4595\n",
+           (unsigned long long)histogram.quantile(0.5), (unsigned long long)histogram.quantile(0.99),
+           (unsigned long long)histogram.count());
+    return 0;
+}
@@ -0,0 +1,74 @@
+#!/bin/bash
+# A directory of many small files sent as one tree transfer vs one sender
+# run per file (what sending a directory took before), both into a
+# --server receiver. Times are wall clock from the first sender start to
+# the receiver reporting the last file complete.
+#
+# Usage: bench/bench_tree.sh [files] [size_kb] [loop_files]
+#
+# loop_files runs of the per-file loop (default: all of them); with fewer
+# the loop's total is extrapolated from their rate.
+
+set -e
+
+FILES=${1:-10000}
+SIZE_KB=${2:-4}
+LOOP=${3:-$FILES}
+PORT=9980
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $RECEIVER 2>/dev/null || true; rm -rf "$WORK"' EXIT
+
+mkdir -p "$WORK/tree"
+head -c $((FILES * SIZE_KB * 1024)) /dev/urandom | \
+    split -a 5 -d -b $((SIZE_KB * 1024)) - "$WORK/tree/f"
+for d in $(seq 0 9); do
+    mkdir "$WORK/tree/d$d"
+    mv "$WORK"/tree/f*$d "$WORK/tree/d$d/"
+done
+
+mkdir -p "$WORK/rx"
+(cd "$WORK/rx" && exec "$ROOT/receiver" $PORT --server --max-sessions $((LOOP + 16)) \
+    > receiver.log 2>&1) &
+RECEIVER=$!
+sleep 0.3
+
+now() { date +%s.%N; }
+since() { awk -v a=$1 -v b=$(now) 'BEGIN { printf "%.3f", b - a }'; }
+
+# Wait for the receiver to have finished n sessions in all
+wait_complete() {
+    until [ "$(grep -c 'complete:' "$WORK/rx/receiver.log")" -ge $1 ]; do
+        sleep 0.01
+    done
+}
+
+echo "=== Directory tree benchmark (loopback) ==="
+echo "${FILES} files x ${SIZE_KB} KB in 10 directories"
+printf "%-16s %8s %10s %12s %10s\n" "mode" "files" "seconds" "files/s" "Mbps"
+
+report() {
+    awk -v m="$1" -v n=$2 -v s=$3 -v kb=$SIZE_KB \
+        'BEGIN { printf "%-16s %8d %10.3f %12.0f %10.1f\n", m, n, s, n / s, n * kb * 8192 / s / 1e6 }'
+}
+
+start=$(now)
+"$ROOT/sender" 127.0.0.1 $PORT "$WORK/tree" 1024 4000 0 > "$WORK/sender.log" 2>&1
+wait_complete 1
+tree_secs=$(since $start)
+report "tree" $FILES $tree_secs
+diff -r "$WORK/tree" "$WORK"/rx/received_files/*/*/tree > /dev/null || echo "tree: MISMATCH"
+
+start=$(now)
+ls "$WORK"/tree/d*/* | head -n $LOOP | while read f; do
+    "$ROOT/sender" 127.0.0.1 $PORT "$f" 1024 4000 0 > /dev/null 2>&1
+done
+wait_complete $((LOOP + 1))
+loop_secs=$(since $start)
+report "sender per file" $LOOP $loop_secs
+if [ $LOOP -lt $FILES ]; then
+    report "  (all, est.)" $FILES $(awk -v s=$loop_secs -v n=$FILES -v k=$LOOP 'BEGIN { print s * n / k }')
+fi
+awk -v t=$tree_secs -v l=$loop_secs -v n=$FILES -v k=$LOOP \
+    'BEGIN { printf "tree speedup: %.1fx\n", l * n / k / t }'
@@ -0,0 +1,377 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+enum Codec : uint8_t {
+    CODEC_NONE = 0,
+    CODEC_LZ4 = 1,
+    CODEC_ZSTD = 2
+};
+
+const int DEFAULT_LZ4_LEVEL = 1;             // LZ4 acceleration, 1 = best ratio
+const int DEFAULT_ZSTD_LEVEL = 3;
+const size_t MAX_FRAME_BYTES = 1 << 20;      // records in one compressed packet, raw
+const double MAX_COMPRESSED_RATIO = 0.9;     // worse than this is sent raw
+const size_t COMPRESS_LOOKAHEAD = 4;         // blasts compressed ahead of the send thread
+const uint32_t COMPRESS_BACKOFF_BLASTS = 16; // raw blasts before compressing is retried
+
+// ============================================================================
+// LZ4 BLOCK CODEC
+// ============================================================================
+//
+// The LZ4 block format (what LZ4_compress_fast / LZ4_decompress_safe
+// produce and accept), so any LZ4 implementation can read the output:
+// sequences of [token][literal length][literals][offset][match length],
+// matches found through a 4K-entry hash of the next 4 bytes. Level is
+// LZ4's acceleration: every miss skips ahead further the higher it is.
+// The decoder checks every length and offset against both buffers.
+
+const int LZ4_HASH_BITS = 12;
+const size_t LZ4_MIN_MATCH = 4;
+const size_t LZ4_LAST_LITERALS = 5;          // a block ends with this many literals
+const size_t LZ4_MFLIMIT = 12;               // no match starts closer to the end
+const size_t LZ4_MAX_OFFSET = 65535;
+
+inline uint32_t lz4_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint64_t lz4_read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// Append a length's 255-continuation bytes; false if dst is too small
+inline bool lz4_put_length(uint8_t*& op, const uint8_t* oend, size_t len) {
+    while (len >= 255) {
+        if (op >= oend) return false;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return false;
+    *op++ = (uint8_t)len;
+    return true;
+}
+
+// Compress n bytes into dst; the compressed size, or 0 if it does not fit
+// in cap bytes
+inline size_t lz4_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap, int level) {
+    uint32_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t acceleration = level > 0 ? level : 1;
+
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* const end = src + n;
+    uint8_t* op = dst;
+    uint8_t* const oend = dst + cap;
+
+    if (n > LZ4_MFLIMIT) {
+        const uint8_t* const mflimit = end - LZ4_MFLIMIT;
+        const uint8_t* const matchlimit = end - LZ4_LAST_LITERALS;
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq = lz4_read32(ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || (size_t)(ip - ref) > LZ4_MAX_OFFSET || lz4_read32(ref) != seq) {
+                ip += acceleration + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            // Grow the match backwards over pending literals, then forwards
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* mp = ip + LZ4_MIN_MATCH;
+            const uint8_t* rp = ref + LZ4_MIN_MATCH;
+            while (mp + 8 <= matchlimit) {
+                uint64_t diff = lz4_read64(mp) ^ lz4_read64(rp);
+                if (diff) {
+                    mp += __builtin_ctzll(diff) >> 3;
+                    goto matched;
+                }
+                mp += 8;
+                rp += 8;
+            }
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+        matched:
+            size_t literals = ip - anchor;
+            size_t match = mp - ip - LZ4_MIN_MATCH;
+            uint16_t offset = (uint16_t)(ip - ref);
+
+            if (op >= oend) return 0;
+            uint8_t* token = op++;
+            *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+            if (literals >= 15 && !lz4_put_length(op, oend, literals - 15)) return 0;
+            if ((size_t)(oend - op) < literals + 2) return 0;
+            memcpy(op, anchor, literals);
+            op += literals;
+            memcpy(op, &offset, 2);              // little-endian hosts
+            op += 2;
+            *token |= (uint8_t)(match >= 15 ? 15 : match);
+            if (match >= 15 && !lz4_put_length(op, oend, match - 15)) return 0;
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    // The rest goes out as literals
+    size_t literals = end - anchor;
+    if (op >= oend) return 0;
+    uint8_t* token = op++;
+    *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15 && !lz4_put_length(op, oend, literals - 15)) return 0;
+    if ((size_t)(oend - op) < literals) return 0;
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+// Decompress n bytes into dst; the decompressed size, or 0 if the input is
+// malformed or would overrun cap bytes
+inline size_t lz4_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    const uint8_t* ip = src;
+    const uint8_t* const iend = src + n;
+    uint8_t* op = dst;
+    uint8_t* const oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return 0;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)) return 0;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == iend) break;                   // last sequence has no match
+
+        if (iend - ip < 2) return 0;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return 0;
+
+        size_t match = token & 15;
+        if (match == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return 0;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += LZ4_MIN_MATCH;
+        if (match > (size_t)(oend - op)) return 0;
+
+        const uint8_t* from = op - offset;
+        if (offset >= match) {
+            memcpy(op, from, match);
+        } else {
+            for (size_t i = 0; i < match; i++) op[i] = from[i];  // overlapping run
+        }
+        op += match;
+    }
+    return op - dst;
+}
+
+// ============================================================================
+// CODECS
+// ============================================================================
+
+#ifdef HAVE_ZSTD
+// One context per thread, reused for every frame it handles
+struct ZstdContexts {
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+    ZstdContexts() : cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {}
+    ~ZstdContexts() {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+};
+
+inline ZstdContexts& zstd_contexts() {
+    static thread_local ZstdContexts contexts;
+    return contexts;
+}
+#endif
+
+inline bool codec_available(uint8_t codec) {
+    if (codec == CODEC_NONE || codec == CODEC_LZ4) return true;
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) return true;
+#endif
+    return false;
+}
+
+inline const char* codec_name(uint8_t codec) {
+    switch (codec) {
+        case CODEC_NONE: return "none";
+        case CODEC_LZ4: return "lz4";
+        case CODEC_ZSTD: return "zstd";
+        default: return "unknown";
+    }
+}
+
+// "lz4", "zstd" or "none", optionally ":level"; false if not understood
+inline bool parse_codec(const std::string& spec, uint8_t& codec, int& level) {
+    std::string name = spec.substr(0, spec.find(':'));
+    if (name == "none") codec = CODEC_NONE;
+    else if (name == "lz4") codec = CODEC_LZ4;
+    else if (name == "zstd") codec = CODEC_ZSTD;
+    else return false;
+
+    level = codec == CODEC_ZSTD ? DEFAULT_ZSTD_LEVEL : DEFAULT_LZ4_LEVEL;
+    if (spec.size() > name.size()) {
+        level = atoi(spec.c_str() + name.size() + 1);
+        if (level < 1 || level > 22) return false;
+    }
+    return true;
+}
+
+// Compressed size, or 0 if the output does not fit in cap bytes
+inline size_t codec_compress(uint8_t codec, int level, const uint8_t* src, size_t n,
+                             uint8_t* dst, size_t cap) {
+    if (codec == CODEC_LZ4) {
+        return lz4_compress(src, n, dst, cap, level);
+    }
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) {
+        size_t r = ZSTD_compressCCtx(zstd_contexts().cctx, dst, cap, src, n, level);
+        return ZSTD_isError(r) ? 0 : r;
+    }
+#endif
+    return 0;
+}
+
+// Decompressed size, or 0 if the input is damaged or larger than cap
+inline size_t codec_decompress(uint8_t codec, const uint8_t* src, size_t n,
+                               uint8_t* dst, size_t cap) {
+    if (codec == CODEC_LZ4) {
+        return lz4_decompress(src, n, dst, cap);
+    }
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) {
+        size_t r = ZSTD_decompressDCtx(zstd_contexts().dctx, dst, cap, src, n);
+        return ZSTD_isError(r) ? 0 : r;
+    }
+#endif
+    return 0;
+}
+
+// ============================================================================
+// WORKER POOL
+// ============================================================================
+//
+// A fixed set of threads running queued jobs in FIFO order. The sender
+// compresses blasts ahead of the send thread on it, the receiver
+// decompresses packets off its receive threads. Jobs still queued when
+// the pool is destroyed are dropped; running ones are finished.
+
+class WorkerPool {
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    bool stopping;
+
+    void run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeup.wait(guard, [this] { return stopping || !jobs.empty(); });
+                if (stopping) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+    explicit WorkerPool(unsigned count) : stopping(false) {
+        for (unsigned i = 0; i < (count > 0 ? count : 1); i++) {
+            threads.push_back(std::thread([this] { run(); }));
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    size_t size() const { return threads.size(); }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(std::move(job));
+        }
+        wakeup.notify_one();
+    }
+};
+
+// Threads for a pool sharing the machine with `busy` other threads
+inline unsigned worker_count(unsigned busy) {
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores > busy ? cores - busy : 1;
+}
+
+// Run job(0) .. job(n - 1) on the pool and wait for all of them
+inline void run_parallel(WorkerPool& pool, size_t n, const std::function<void(size_t)>& job) {
+    std::mutex lock;
+    std::condition_variable done;
+    size_t left = n;
+    for (size_t i = 0; i < n; i++) {
+        pool.submit([&, i]() {
+            job(i);
+            std::lock_guard<std::mutex> guard(lock);
+            if (--left == 0) done.notify_all();
+        });
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&left] { return left == 0; });
+}
+
+#endif // COMPRESS_H
@@ -0,0 +1,259 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <time.h>
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+const double CC_INITIAL_RATE = 12.5e6;       // bytes/sec (100 Mbps)
+const double CC_MIN_RATE = 1.0e6;            // bytes/sec (8 Mbps)
+const double CC_MAX_RATE = 12.5e9;           // bytes/sec (100 Gbps)
+const double AIMD_LOSS_TOLERANCE = 0.02;     // loss fraction treated as noise
+const double AIMD_DECREASE = 0.7;            // multiplicative decrease
+const double AIMD_INCREASE = 12.5e6;         // bytes/sec added per RTT
+const int BBR_BW_WINDOW = 10;                // feedback rounds in the max filter
+const double BBR_STARTUP_GAIN = 2.885;       // 2/ln(2)
+const int PACING_SLACK_US = 50;              // packets due this soon go in the same batch
+
+// ============================================================================
+// RATE SAMPLE
+// ============================================================================
+
+// What one REC_MISS tells us about the round of DATA it answers
+struct RateSample {
+    double sent_bytes;          // bytes sent in the round
+    double lost_bytes;          // bytes the receiver reported missing
+    double delivery_rate;       // bytes/sec delivered since the round started
+    double rtt;                 // IS_BLAST_OVER -> REC_MISS, seconds (0 if ambiguous)
+
+    RateSample() : sent_bytes(0), lost_bytes(0), delivery_rate(0), rtt(0) {}
+};
+
+// ============================================================================
+// RATE CONTROLLER INTERFACE
+// ============================================================================
+
+class RateController {
+public:
+    virtual ~RateController() {}
+    virtual const char* name() const = 0;
+
+    // Rate DATA packets should be paced at, bytes/sec
+    virtual double pacing_rate() const = 0;
+
+    virtual void on_feedback(const RateSample& rs) = 0;
+};
+
+// ============================================================================
+// AIMD
+// ============================================================================
+//
+// Loss-based, TCP Reno style but on a rate instead of a window: the rate
+// doubles every RTT until the first loss, then grows by AIMD_INCREASE per
+// RTT and is cut by AIMD_DECREASE (at most once per RTT) whenever a round
+// loses more than AIMD_LOSS_TOLERANCE of its bytes.
+
+class AimdController : public RateController {
+private:
+    double rate;
+    double srtt;
+    bool slow_start;
+    std::chrono::steady_clock::time_point last_decrease;
+
+public:
+    AimdController() : rate(CC_INITIAL_RATE), srtt(0.001), slow_start(true) {}
+
+    const char* name() const { return "aimd"; }
+    double pacing_rate() const { return rate; }
+
+    void on_feedback(const RateSample& rs) {
+        if (rs.rtt > 0) {
+            srtt = 0.875 * srtt + 0.125 * rs.rtt;
+        }
+        if (rs.sent_bytes <= 0) return;
+
+        auto now = std::chrono::steady_clock::now();
+        double acked = rs.sent_bytes - rs.lost_bytes;
+
+        if (rs.lost_bytes > rs.sent_bytes * AIMD_LOSS_TOLERANCE) {
+            if (now - last_decrease > std::chrono::duration<double>(srtt)) {
+                rate *= AIMD_DECREASE;
+                slow_start = false;
+                last_decrease = now;
+            }
+        } else if (slow_start) {
+            rate += acked / srtt;
+        } else {
+            rate += AIMD_INCREASE * std::min(1.0, acked / (rate * srtt));
+        }
+
+        rate = std::max(CC_MIN_RATE, std::min(CC_MAX_RATE, rate));
+    }
+};
+
+// ============================================================================
+// BBR-LIKE
+// ============================================================================
+//
+// Model-based: estimates bottleneck bandwidth as the max delivery rate over
+// the last BBR_BW_WINDOW rounds and paces at gain * bandwidth. Random loss
+// does not move the rate, only a change in delivery rate does.
+//   STARTUP   gain 2.885 until bandwidth stops growing by 25% for 3 rounds
+//   DRAIN     gain 1/2.885 for one round to empty the queue STARTUP built
+//   PROBE_BW  cycle through 1.25, 0.75, 1 x6, one phase per min RTT
+
+class BbrController : public RateController {
+private:
+    enum State { STARTUP, DRAIN, PROBE_BW };
+
+    State state;
+    double bw_samples[BBR_BW_WINDOW];
+    int next_sample;
+    double btl_bw;
+    double min_rtt;
+    double full_bw;
+    int full_bw_rounds;
+    int cycle_index;
+    std::chrono::steady_clock::time_point cycle_start;
+
+    double gain() const {
+        static const double cycle[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+        switch (state) {
+            case STARTUP: return BBR_STARTUP_GAIN;
+            case DRAIN: return 1.0 / BBR_STARTUP_GAIN;
+            default: return cycle[cycle_index];
+        }
+    }
+
+public:
+    BbrController() : state(STARTUP), next_sample(0), btl_bw(0), min_rtt(0),
+                      full_bw(0), full_bw_rounds(0), cycle_index(0) {
+        for (int i = 0; i < BBR_BW_WINDOW; i++) bw_samples[i] = 0;
+    }
+
+    const char* name() const { return "bbr"; }
+
+    double pacing_rate() const {
+        if (btl_bw <= 0) return CC_INITIAL_RATE * BBR_STARTUP_GAIN;
+        return std::max(CC_MIN_RATE, std::min(CC_MAX_RATE, gain() * btl_bw));
+    }
+
+    void on_feedback(const RateSample& rs) {
+        if (rs.rtt > 0 && (min_rtt == 0 || rs.rtt < min_rtt)) {
+            min_rtt = rs.rtt;
+        }
+        if (rs.delivery_rate <= 0) return;
+
+        // Windowed max filter over the last rounds
+        bw_samples[next_sample] = rs.delivery_rate;
+        next_sample = (next_sample + 1) % BBR_BW_WINDOW;
+        btl_bw = *std::max_element(bw_samples, bw_samples + BBR_BW_WINDOW);
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (state == STARTUP) {
+            if (btl_bw >= full_bw * 1.25) {
+                full_bw = btl_bw;
+                full_bw_rounds = 0;
+            } else if (++full_bw_rounds >= 3) {
+                state = DRAIN;
+            }
+        } else if (state == DRAIN) {
+            state = PROBE_BW;
+            cycle_index = 0;
+            cycle_start = now;
+        } else {
+            double phase = std::max(min_rtt, 0.0001);
+            if (now - cycle_start > std::chrono::duration<double>(phase)) {
+                cycle_index = (cycle_index + 1) % 8;
+                cycle_start = now;
+            }
+        }
+    }
+};
+
+// ============================================================================
+// FIXED RATE
+// ============================================================================
+//
+// Paces at a set rate whatever the feedback says (--rate): the sender then
+// behaves like it is behind a link of that bandwidth.
+
+class FixedRateController : public RateController {
+private:
+    double rate;
+
+public:
+    explicit FixedRateController(double bytes_per_sec) : rate(bytes_per_sec) {}
+
+    const char* name() const { return "fixed"; }
+    double pacing_rate() const { return rate; }
+    void on_feedback(const RateSample&) {}
+};
+
+// Controller by name, NULL for "none" or an unknown name
+inline RateController* make_rate_controller(const std::string& name) {
+    if (name == "aimd") return new AimdController();
+    if (name == "bbr") return new BbrController();
+    return NULL;
+}
+
+// ============================================================================
+// PACER
+// ============================================================================
+//
+// Spaces packets at the controller's rate. Each packet is given a departure
+// time; the caller flushes its current batch and waits whenever the next
+// departure is more than PACING_SLACK_US away. The wait sleeps for the bulk
+// of the gap and spins the last stretch, since nanosleep alone overshoots
+// by tens of microseconds.
+
+class Pacer {
+private:
+    std::chrono::steady_clock::time_point next_send;
+
+public:
+    Pacer() : next_send(std::chrono::steady_clock::now()) {}
+
+    // True if the next packet may go out now (within the slack)
+    bool ready() const {
+        return next_send <= std::chrono::steady_clock::now() +
+                            std::chrono::microseconds(PACING_SLACK_US);
+    }
+
+    // Account for a packet of `bytes` sent at `rate` bytes/sec
+    void on_send(size_t bytes, double rate) {
+        auto now = std::chrono::steady_clock::now();
+        // An idle sender does not bank credit for a later burst
+        if (next_send < now - std::chrono::microseconds(PACING_SLACK_US)) {
+            next_send = now - std::chrono::microseconds(PACING_SLACK_US);
+        }
+        next_send += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(bytes / rate));
+    }
+
+    void wait() const {
+        using namespace std::chrono;
+        auto now = steady_clock::now();
+        auto gap = duration_cast<microseconds>(next_send - now).count();
+        if (gap > 200) {
+            struct timespec ts;
+            long sleep_us = gap - 100;
+            ts.tv_sec = sleep_us / 1000000;
+            ts.tv_nsec = (sleep_us % 1000000) * 1000;
+            nanosleep(&ts, NULL);
+        }
+        while (steady_clock::now() < next_send) {
+            // spin the remainder
+        }
+    }
+};
+
+#endif // CONGESTION_H
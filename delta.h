@@ -0,0 +1,447 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include "protocol.h"
+#include "file_source.h"
+#include "compress.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+const uint32_t DELTA_NOT_FOUND = UINT32_MAX;
+const uint32_t SIGNATURE_PIECE_BLOCKS = 4096;   // blocks signed per pool job
+const uint64_t MATCH_PIECE_BYTES = 4 << 20;     // least of the new file one job scans
+
+// ============================================================================
+// WEAK CHECKSUM
+// ============================================================================
+//
+// rsync's rolling checksum over a block x_0..x_{L-1}:
+//   a = sum x_i,  b = sum (L - i) x_i,  weak = (a mod 2^16) | (b mod 2^16) << 16
+// Sliding the block one byte, out -> in, is three additions:
+//   a' = a - out + in,  b' = b - L * out + a'
+// so the sender can look for a block at every byte offset of its file. a
+// and b are kept as plain 32-bit sums, whose low 16 bits wrap the same way.
+//
+// Whole blocks are summed with AVX2 where the CPU has it, 32 bytes per
+// step: vpsadbw adds up each 8-byte lane, vpmaddubsw/vpmaddwd weigh the
+// bytes by their distance from the end of the step, and a running total
+// of the step sums (as Adler-32 implementations do) stands in for the
+// distance of the step from the end of the block:
+//   b = 32 * sum_k (n - 1 - k) S_k + sum_k sum_j (32 - j) x_{32k+j}
+
+inline uint32_t delta_weak_value(uint32_t a, uint32_t b) {
+    return (a & 0xffff) | (b << 16);
+}
+
+inline void delta_weak_sw(const uint8_t* p, size_t len, uint32_t& a, uint32_t& b) {
+    a = 0;
+    b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += p[i];
+        b += a;                              // x_i is added L - i times
+    }
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// len must be a multiple of 32 (and at most 64K, so the sums fit)
+__attribute__((target("avx2")))
+inline void delta_weak_avx2(const uint8_t* p, size_t len, uint32_t& a, uint32_t& b) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21,
+                                             20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9,
+                                             8, 7, 6, 5, 4, 3, 2, 1);
+    __m256i sums = zero;                     // S_k so far, 4 x u64
+    __m256i earlier = zero;                  // sum over steps of the sums before them
+    __m256i weighted = zero;                 // in-step weighted sums, 8 x i32
+    for (size_t i = 0; i < len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        earlier = _mm256_add_epi64(earlier, sums);
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(v, zero));
+        weighted = _mm256_add_epi32(weighted,
+                                    _mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), ones));
+    }
+
+    uint64_t s[4], e[4];
+    uint32_t w[8];
+    _mm256_storeu_si256((__m256i*)s, sums);
+    _mm256_storeu_si256((__m256i*)e, earlier);
+    _mm256_storeu_si256((__m256i*)w, weighted);
+    uint32_t total = (uint32_t)(s[0] + s[1] + s[2] + s[3]);
+    uint32_t before = (uint32_t)(e[0] + e[1] + e[2] + e[3]);
+    uint32_t inside = w[0] + w[1] + w[2] + w[3] + w[4] + w[5] + w[6] + w[7];
+    a = total;
+    b = 32 * before + inside;
+}
+#endif
+
+inline bool delta_weak_simd() {
+#if defined(__x86_64__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+#else
+    return false;
+#endif
+}
+
+// a and b of a whole block
+inline void delta_weak(const uint8_t* p, size_t len, uint32_t& a, uint32_t& b) {
+#if defined(__x86_64__)
+    if (len % 32 == 0 && len <= 65536 && delta_weak_simd()) {
+        delta_weak_avx2(p, len, a, b);
+        return;
+    }
+#endif
+    delta_weak_sw(p, len, a, b);
+}
+
+// ============================================================================
+// STRONG HASH
+// ============================================================================
+//
+// XXH64 (seed 0): four independent multiply-rotate lanes over 32-byte
+// stripes, so it runs at several GB/s without vector instructions. It only
+// confirms a weak match; the whole-file CRC32C still has the last word.
+
+const uint64_t XXH_PRIME1 = 0x9E3779B185EBCA87ULL;
+const uint64_t XXH_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t XXH_PRIME3 = 0x165667B19E3779F9ULL;
+const uint64_t XXH_PRIME4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t XXH_PRIME5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+inline uint64_t delta_strong(const uint8_t* p, size_t len) {
+    const uint8_t* const end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2, v3 = 0, v4 = 0 - XXH_PRIME1;
+        const uint8_t* const limit = end - 32;
+        do {
+            uint64_t w[4];
+            memcpy(w, p, 32);                // little-endian hosts
+            v1 = xxh_round(v1, w[0]);
+            v2 = xxh_round(v2, w[1]);
+            v3 = xxh_round(v3, w[2]);
+            v4 = xxh_round(v4, w[3]);
+            p += 32;
+        } while (p <= limit);
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = XXH_PRIME5;
+    }
+    h += len;
+
+    while (p + 8 <= end) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        h ^= xxh_round(0, k);
+        h = xxh_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        uint32_t k;
+        memcpy(&k, p, 4);
+        h ^= (uint64_t)k * XXH_PRIME1;
+        h = xxh_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * XXH_PRIME5;
+        h = xxh_rotl(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+// ============================================================================
+// BASIS FILE
+// ============================================================================
+//
+// The receiver's older copy of a file and the signatures of its whole
+// blocks (a short tail is never matched). The signatures are computed in
+// the background on a pool of their own, so the handshake and the event
+// loop of --server are not held up; SIG_QUERY is answered once ready().
+
+class BasisFile {
+private:
+    std::string file_path;
+    FileSource source;
+    uint32_t block_size;
+    uint32_t blocks;
+    std::vector<BlockSignature> sigs;
+    std::atomic<size_t> pieces_left;
+    std::atomic<bool> built;
+    std::chrono::steady_clock::time_point build_start;
+    double build_seconds;
+    std::unique_ptr<WorkerPool> pool;        // last, so it stops before the rest goes
+
+public:
+    BasisFile() : block_size(0), blocks(0), pieces_left(0), built(false), build_seconds(0) {}
+
+    // Map the file at path; false if it cannot be or has no whole block
+    bool open(const std::string& path, uint16_t b_size) {
+        if (!source.open_file(path, b_size) || !source.is_mapped()) return false;
+        uint64_t whole = source.size() / b_size;
+        if (whole == 0 || whole >= DELTA_NOT_FOUND) return false;
+        file_path = path;
+        block_size = b_size;
+        blocks = (uint32_t)whole;
+        return true;
+    }
+
+    // Start signing the blocks on `threads` threads
+    void build(unsigned threads) {
+        sigs.resize(blocks);
+        size_t pieces = (blocks + SIGNATURE_PIECE_BLOCKS - 1) / SIGNATURE_PIECE_BLOCKS;
+        pieces_left = pieces;
+        build_start = std::chrono::steady_clock::now();
+        pool.reset(new WorkerPool(threads));
+        for (size_t i = 0; i < pieces; i++) {
+            pool->submit([this, i]() {
+                uint32_t first = i * SIGNATURE_PIECE_BLOCKS;
+                uint32_t last = std::min<uint64_t>(first + SIGNATURE_PIECE_BLOCKS, blocks);
+                for (uint32_t blk = first; blk < last; blk++) {
+                    const uint8_t* p = source.data() + (uint64_t)blk * block_size;
+                    uint32_t a, b;
+                    delta_weak(p, block_size, a, b);
+                    sigs[blk].weak = delta_weak_value(a, b);
+                    sigs[blk].strong = delta_strong(p, block_size);
+                }
+                if (--pieces_left == 0) {
+                    build_seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - build_start).count();
+                    built.store(true, std::memory_order_release);
+                }
+            });
+        }
+    }
+
+    bool ready() const { return built.load(std::memory_order_acquire); }
+    const std::string& path() const { return file_path; }
+    uint32_t num_blocks() const { return blocks; }
+    uint16_t get_block_size() const { return block_size; }
+    size_t threads() const { return pool ? pool->size() : 0; }
+    double seconds() const { return build_seconds; }
+    const BlockSignature& signature(uint32_t blk) const { return sigs[blk]; }
+
+    // Block blk and the count - 1 after it, NULL unless all of them exist
+    const uint8_t* blocks_at(uint32_t blk, uint32_t count) const {
+        if (count == 0 || blk >= blocks || count > blocks - blk) return NULL;
+        return source.data() + (uint64_t)blk * block_size;
+    }
+};
+
+// ============================================================================
+// BLOCK MATCHING
+// ============================================================================
+//
+// The sender's side: every offset of the new file whose block has the
+// weak checksum of one of the receiver's blocks is confirmed with the
+// strong hash. A bitset filter turns most offsets away before the hashed
+// (weak, block) buckets are searched, and after a match the block following
+// the matched one is tried first, which keeps runs of repeated blocks
+// (zeros) in order. Matches are merged into copy runs.
+
+class SignatureIndex {
+private:
+    const std::vector<BlockSignature>* sigs;
+    std::vector<uint64_t> filter;
+    std::vector<uint32_t> bucket_start;      // blocks of bucket k: [start[k], start[k + 1])
+    std::vector<uint32_t> bucket_blocks;
+    int filter_shift;
+    int bucket_shift;
+
+    uint32_t mix(uint32_t weak) const {
+        return weak * 2654435761u;
+    }
+
+public:
+    explicit SignatureIndex(const std::vector<BlockSignature>& signatures)
+        : sigs(&signatures), filter_shift(32), bucket_shift(32) {
+        int bits = 10;                       // about 32 filter bits per block
+        while (bits < 28 && ((size_t)1 << bits) < signatures.size() * 32) bits++;
+        filter_shift = 32 - bits;
+        filter.assign(((size_t)1 << bits) / 64, 0);
+        bits = 1;                            // about one block per bucket
+        while (bits < 26 && ((size_t)1 << bits) < signatures.size()) bits++;
+        bucket_shift = 32 - bits;
+
+        bucket_start.assign(((size_t)1 << bits) + 1, 0);
+        for (const BlockSignature& sig : signatures) {
+            uint32_t h = mix(sig.weak);
+            filter[(h >> filter_shift) / 64] |= 1ULL << ((h >> filter_shift) % 64);
+            bucket_start[(h >> bucket_shift) + 1]++;
+        }
+        for (size_t k = 1; k < bucket_start.size(); k++) {
+            bucket_start[k] += bucket_start[k - 1];
+        }
+        std::vector<uint32_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+        bucket_blocks.resize(signatures.size());
+        for (uint32_t blk = 0; blk < signatures.size(); blk++) {
+            bucket_blocks[fill[mix(signatures[blk].weak) >> bucket_shift]++] = blk;
+        }
+    }
+
+    // A block with this weak checksum whose strong hash is strong(), or
+    // DELTA_NOT_FOUND; strong() is only called if the weak one is known
+    template <typename Strong>
+    uint32_t find(uint32_t weak, Strong strong) const {
+        uint32_t h = mix(weak);
+        uint32_t f = h >> filter_shift;
+        if (!((filter[f / 64] >> (f % 64)) & 1)) return DELTA_NOT_FOUND;
+        uint32_t k = h >> bucket_shift;
+        bool hashed = false;
+        uint64_t want = 0;
+        for (uint32_t i = bucket_start[k]; i < bucket_start[k + 1]; i++) {
+            const BlockSignature& sig = (*sigs)[bucket_blocks[i]];
+            if (sig.weak != weak) continue;
+            if (!hashed) {
+                want = strong();
+                hashed = true;
+            }
+            if (sig.strong == want) return bucket_blocks[i];
+        }
+        return DELTA_NOT_FOUND;
+    }
+};
+
+// Extend the last run with a match at offset, or start a new one
+inline void add_match(std::vector<DeltaCopy>& runs, uint64_t offset, uint32_t blk,
+                      uint32_t block_size) {
+    if (!runs.empty()) {
+        DeltaCopy& last = runs.back();
+        if (last.offset + (uint64_t)last.count * block_size == offset &&
+            last.block + last.count == blk) {
+            last.count++;
+            return;
+        }
+    }
+    runs.push_back(DeltaCopy(offset, blk, 1));
+}
+
+// Matches of blocks starting at offsets [begin, end) of data
+inline void match_range(const uint8_t* data, uint64_t size, uint32_t block_size,
+                        const std::vector<BlockSignature>& sigs, const SignatureIndex& index,
+                        uint64_t begin, uint64_t end, std::vector<DeltaCopy>& runs) {
+    const uint64_t last_offset = size - block_size;
+    uint64_t pos = begin;
+    uint32_t a = 0, b = 0;
+    bool fresh = true;                       // a and b need summing from scratch
+    uint32_t expect = DELTA_NOT_FOUND;       // the block after the last match
+    while (pos < end) {
+        if (fresh) {
+            delta_weak(data + pos, block_size, a, b);
+            fresh = false;
+        }
+        uint32_t weak = delta_weak_value(a, b);
+        const uint8_t* block = data + pos;
+        auto strong = [block, block_size]() { return delta_strong(block, block_size); };
+
+        uint32_t found = DELTA_NOT_FOUND;
+        if (expect < sigs.size() && sigs[expect].weak == weak && sigs[expect].strong == strong()) {
+            found = expect;
+        } else {
+            found = index.find(weak, strong);
+        }
+        if (found != DELTA_NOT_FOUND) {
+            add_match(runs, pos, found, block_size);
+            expect = found + 1;
+            pos += block_size;
+            fresh = true;
+            continue;
+        }
+
+        if (pos >= last_offset) break;
+        uint32_t out = data[pos], in = data[pos + block_size];
+        a += in - out;
+        b += a - block_size * out;
+        pos++;
+    }
+}
+
+// Copy runs that rebuild as much of data (size bytes) as possible from the
+// blocks sigs describes, in file order and not overlapping. The file is
+// cut into pieces scanned in parallel on the pool; a match running over
+// the end of a piece wins over the next piece's first ones.
+inline std::vector<DeltaCopy> match_blocks(const uint8_t* data, uint64_t size, uint32_t block_size,
+                                           const std::vector<BlockSignature>& sigs,
+                                           WorkerPool& pool) {
+    std::vector<DeltaCopy> copies;
+    if (sigs.empty() || size < block_size) return copies;
+
+    SignatureIndex index(sigs);
+    uint64_t offsets = size - block_size + 1;
+    size_t pieces = std::max<uint64_t>(1, std::min<uint64_t>(pool.size() * 4,
+                                                             offsets / MATCH_PIECE_BYTES));
+    uint64_t piece_len = (offsets + pieces - 1) / pieces;
+    std::vector<std::vector<DeltaCopy>> found(pieces);
+    run_parallel(pool, pieces, [&](size_t i) {
+        uint64_t begin = i * piece_len;
+        uint64_t end = std::min(offsets, begin + piece_len);
+        if (begin < end) {
+            match_range(data, size, block_size, sigs, index, begin, end, found[i]);
+        }
+    });
+
+    uint64_t covered = 0;                    // end of the last run kept
+    for (auto& piece : found) {
+        for (DeltaCopy run : piece) {
+            if (run.offset < covered) {
+                uint64_t skip = (covered - run.offset + block_size - 1) / block_size;
+                if (skip >= run.count) continue;
+                run.offset += skip * block_size;
+                run.block += skip;
+                run.count -= skip;
+            }
+            if (!copies.empty() &&
+                copies.back().offset + (uint64_t)copies.back().count * block_size == run.offset &&
+                copies.back().block + copies.back().count == run.block) {
+                copies.back().count += run.count;
+            } else {
+                copies.push_back(run);
+            }
+            covered = run.offset + (uint64_t)run.count * block_size;
+        }
+    }
+    return copies;
+}
+
+#endif // DELTA_H
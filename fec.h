@@ -0,0 +1,249 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <set>
+
+// ============================================================================
+// XOR KERNEL
+// ============================================================================
+//
+// dst ^= src over len bytes. Picks AVX2 at runtime when the CPU has it,
+// otherwise SSE2 (always present on x86-64), otherwise 8 bytes at a time.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+inline void xor_into_avx2(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(a, b));
+    }
+    for (; i < len; i++) dst[i] ^= src[i];
+}
+
+__attribute__((target("sse2")))
+inline void xor_into_sse2(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(a, b));
+    }
+    for (; i < len; i++) dst[i] ^= src[i];
+}
+#endif
+
+inline void xor_into(uint8_t* dst, const uint8_t* src, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) {
+        xor_into_avx2(dst, src, len);
+    } else {
+        xor_into_sse2(dst, src, len);
+    }
+#else
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) dst[i] ^= src[i];
+#endif
+}
+
+// ============================================================================
+// FEC LAYOUT
+// ============================================================================
+//
+// With --fec K the sender follows every K DATA packets of a blast with one
+// FEC_PARITY packet. A parity group is the K * n records those packets
+// carry (n = records per packet), starting at the blast start, and its
+// parity is the XOR of the packets' payloads. Slot s of the parity payload
+// therefore covers records group_start + s, + s + n, + s + 2n, ..., so one
+// lost DATA packet leaves exactly one record missing per slot and every
+// one of them can be rebuilt. Blasts are aligned to blast_size, so both
+// ends derive the same groups from FILE_HDR alone.
+
+struct FecLayout {
+    uint32_t blast_size;
+    uint32_t group_packets;     // K, 0 = FEC off
+    uint32_t stride;            // n, records per DATA packet
+    uint32_t total_records;
+
+    FecLayout() : blast_size(0), group_packets(0), stride(0), total_records(0) {}
+
+    bool enabled() const { return group_packets > 0; }
+    uint32_t group_records() const { return group_packets * stride; }
+
+    uint32_t blast_start(uint32_t rec) const {
+        return (rec - 1) / blast_size * blast_size + 1;
+    }
+
+    uint32_t group_start(uint32_t rec) const {
+        uint32_t bs = blast_start(rec);
+        return bs + (rec - bs) / group_records() * group_records();
+    }
+
+    uint32_t group_end(uint32_t start) const {
+        uint64_t end = (uint64_t)start + group_records() - 1;
+        uint64_t blast_end = (uint64_t)blast_start(start) + blast_size - 1;
+        if (end > blast_end) end = blast_end;
+        if (end > total_records) end = total_records;
+        return (uint32_t)end;
+    }
+};
+
+// ============================================================================
+// FEC DECODER
+// ============================================================================
+//
+// Receiver side. Every accepted record is XORed into its group's slot as
+// it arrives and the parity is XORed in when its packet shows up, so when
+// a slot has seen all but one of its records the accumulator *is* the
+// missing record. Only groups with records still outstanding are kept, and
+// at most max_groups of them: a group that does not fit is skipped for
+// good (its records are simply retransmitted), since an accumulator that
+// missed a record can never be trusted again.
+
+class FecDecoder {
+private:
+    struct Group {
+        std::vector<uint8_t> acc;        // stride * record_size bytes
+        std::vector<uint16_t> have;      // records seen per slot
+        uint32_t received;               // records seen in the group
+        bool parity_received;
+    };
+
+    FecLayout layout;
+    uint16_t record_size;
+    size_t max_groups;                  // 0 = unlimited
+    std::map<uint32_t, Group> groups;   // by group start record
+    std::set<uint32_t> skipped;         // groups dropped for lack of room
+
+    // NULL if the group is skipped
+    Group* get_group(uint32_t start) {
+        std::map<uint32_t, Group>::iterator it = groups.find(start);
+        if (it != groups.end()) return &it->second;
+        if (skipped.count(start)) return NULL;
+        if (max_groups > 0 && groups.size() >= max_groups) {
+            skipped.insert(start);
+            return NULL;
+        }
+        Group& g = groups[start];
+        g.acc.assign((size_t)layout.stride * record_size, 0);
+        g.have.assign(layout.stride, 0);
+        g.received = 0;
+        g.parity_received = false;
+        return &g;
+    }
+
+    // Records of the group that fall in slot s
+    uint32_t slot_members(uint32_t start, uint32_t end, uint32_t s) const {
+        if (start + s > end) return 0;
+        return (end - start - s) / layout.stride + 1;
+    }
+
+public:
+    FecDecoder() : record_size(0), max_groups(0) {}
+
+    void configure(const FecLayout& l, uint16_t rec_size, size_t group_limit = 0) {
+        layout = l;
+        record_size = rec_size;
+        max_groups = group_limit;
+        groups.clear();
+        skipped.clear();
+    }
+
+    // Memory one pending group takes, for budgeting group_limit
+    static size_t group_bytes(const FecLayout& l, uint16_t rec_size) {
+        return (size_t)l.stride * (rec_size + sizeof(uint16_t)) + sizeof(Group) + 64;
+    }
+
+    bool enabled() const { return layout.enabled(); }
+    const FecLayout& get_layout() const { return layout; }
+    size_t groups_pending() const { return groups.size(); }
+
+    // XOR a newly accepted record into its group
+    void add_record(uint32_t rec, const uint8_t* data) {
+        uint32_t start = layout.group_start(rec);
+        uint32_t end = layout.group_end(start);
+        Group* g = get_group(start);
+        if (!g) return;
+        uint32_t slot = (rec - start) % layout.stride;
+
+        xor_into(g->acc.data() + (size_t)slot * record_size, data, record_size);
+        g->have[slot]++;
+        if (++g->received == end - start + 1) {
+            groups.erase(start);
+        }
+    }
+
+    // XOR in a parity payload. has(rec) tells whether a record is already
+    // in, so parity for a group that completed earlier is ignored.
+    template <typename HasRecord>
+    void add_parity(uint32_t start, const uint8_t* payload, size_t len, HasRecord has) {
+        if (start < 1 || start > layout.total_records || start != layout.group_start(start)) {
+            return;
+        }
+        if (len < (size_t)layout.stride * record_size) return;
+
+        if (groups.find(start) == groups.end()) {
+            uint32_t end = layout.group_end(start);
+            bool complete = true;
+            for (uint32_t rec = start; rec <= end && complete; rec++) {
+                complete = has(rec);
+            }
+            if (complete) return;
+        }
+
+        Group* g = get_group(start);
+        if (!g || g->parity_received) return;   // duplicate would cancel itself out
+        xor_into(g->acc.data(), payload, g->acc.size());
+        g->parity_received = true;
+    }
+
+    // Rebuild every record the group's parity can recover. deliver(rec, data)
+    // is called for each one; it returns true if the record was stored.
+    template <typename HasRecord, typename Deliver>
+    uint32_t recover(uint32_t rec_in_group, HasRecord has, Deliver deliver) {
+        uint32_t start = layout.group_start(rec_in_group);
+        std::map<uint32_t, Group>::iterator it = groups.find(start);
+        if (it == groups.end() || !it->second.parity_received) return 0;
+
+        Group& g = it->second;
+        uint32_t end = layout.group_end(start);
+        uint32_t recovered = 0;
+
+        for (uint32_t s = 0; s < layout.stride; s++) {
+            uint32_t members = slot_members(start, end, s);
+            if (members == 0 || (uint32_t)g.have[s] + 1 != members) continue;
+
+            for (uint32_t rec = start + s; rec <= end; rec += layout.stride) {
+                if (has(rec)) continue;
+                if (deliver(rec, g.acc.data() + (size_t)s * record_size)) {
+                    g.have[s]++;
+                    g.received++;
+                    recovered++;
+                }
+                break;
+            }
+        }
+
+        if (g.received == end - start + 1) {
+            groups.erase(it);
+        }
+        return recovered;
+    }
+};
+
+#endif // FEC_H
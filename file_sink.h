@@ -0,0 +1,155 @@
+#ifndef FILE_SINK_H
+#define FILE_SINK_H
+
+#include <cstdint>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+
+// ============================================================================
+// FILE SINK
+// ============================================================================
+//
+// Write side counterpart of FileSource. The output file is created at its
+// final size as soon as FILE_HDR arrives and every record is written to
+// (rec - 1) * record_size the moment it is accepted, so the receiver never
+// holds file data in memory and there is no serial write pass at the end.
+// The padding of the last record is cut off so the file ends up exactly
+// file_size bytes long.
+
+class FileSink {
+private:
+    int fd;
+    uint64_t file_size;
+    uint16_t record_size;
+
+public:
+    FileSink() : fd(-1), file_size(0), record_size(0) {}
+
+    ~FileSink() {
+        if (fd >= 0) close(fd);
+    }
+
+    // Create the output file, or with keep reopen one an earlier transfer
+    // of the same file left behind (it must already be size bytes long)
+    bool open_file(const std::string& path, uint64_t size, uint16_t rec_size, bool keep = false) {
+        if (fd >= 0) close(fd);
+
+        fd = open(path.c_str(), keep ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+
+        file_size = size;
+        record_size = rec_size;
+
+        if (keep) {
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != file_size) {
+                close(fd);
+                fd = -1;
+                return false;
+            }
+            return true;
+        }
+
+        // Reserve the blocks up front; fall back to a sparse file where
+        // the filesystem cannot preallocate
+        if (file_size > 0 && posix_fallocate(fd, 0, file_size) != 0) {
+            if (ftruncate(fd, file_size) != 0) {
+                close(fd);
+                fd = -1;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool is_open() const { return fd >= 0; }
+    int descriptor() const { return fd; }
+
+    // Where record `rec` goes in the file and how many of its bytes are
+    // real (the last one is cut at file_size); false if past the end
+    bool record_extent(uint32_t rec, uint64_t& offset, size_t& len) const {
+        offset = (uint64_t)(rec - 1) * record_size;
+        if (offset >= file_size) return false;
+        len = record_size;
+        if (offset + len > file_size) len = file_size - offset;
+        return true;
+    }
+
+    // Write one record at its final offset
+    bool write_record(uint32_t rec, const uint8_t* data) {
+        uint64_t offset;
+        size_t len;
+        if (!record_extent(rec, offset, len)) return false;
+        return write_at(offset, data, len);
+    }
+
+    // Write len bytes at offset, which must lie within the file
+    bool write_at(uint64_t offset, const uint8_t* data, size_t len) {
+        if (offset > file_size || len > file_size - offset) return false;
+
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pwrite(fd, data + done, len - done, offset + done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    // CRC32C of what is in the file now, read back from it
+    bool checksum(uint32_t& crc) const {
+        crc = 0;
+        std::vector<uint8_t> buf(1 << 20);
+        for (uint64_t offset = 0; offset < file_size; ) {
+            ssize_t n = pread(fd, buf.data(), std::min<uint64_t>(buf.size(), file_size - offset), offset);
+            if (n <= 0) return false;
+            crc = crc32c(buf.data(), n, crc);
+            offset += n;
+        }
+        return true;
+    }
+
+    // Flush to stable storage and close
+    bool finish() {
+        if (fd < 0) return false;
+        bool ok = (fdatasync(fd) == 0);
+        ok = (close(fd) == 0) && ok;
+        fd = -1;
+        return ok;
+    }
+};
+
+// ============================================================================
+// CHUNK WRITER
+// ============================================================================
+//
+// Where a receive loop sends records when they are not written one pwrite
+// each: runs of adjacent records are copied into chunks that go to disk
+// off the receive path (io_uring writes, or the disk thread of --io
+// pipeline).
+
+class ChunkWriter {
+public:
+    virtual ~ChunkWriter() {}
+
+    // Queue len bytes for offset; false once a write has failed
+    virtual bool write(uint64_t offset, const uint8_t* data, size_t len) = 0;
+
+    // Start writing the partly filled chunk, e.g. before waiting for the
+    // network, so the disk is not left idle
+    virtual void kick() = 0;
+
+    // Write out everything and wait for it; false if any write failed
+    virtual bool flush() = 0;
+};
+
+#endif // FILE_SINK_H
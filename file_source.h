@@ -0,0 +1,199 @@
+#ifndef FILE_SOURCE_H
+#define FILE_SOURCE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+
+// ============================================================================
+// FILE SOURCE
+// ============================================================================
+//
+// Read-only, record-addressed view of the file being sent. The file is
+// mapped once and records are copied straight from the page cache into the
+// outgoing packet, so nothing is read up front and the first blast can go
+// out immediately. If the file cannot be mapped every record is fetched
+// with pread instead. Only regular files can be sent: the size has to be
+// known up front, and a pipe's or device's st_size is not it.
+//
+// Records are 1-indexed to match the wire protocol. The last record is
+// zero-padded to record_size, like the old in-memory copy was.
+
+class FileSource {
+private:
+    int fd;
+    const uint8_t* map;
+    uint64_t file_size;
+    uint16_t record_size;
+    uint32_t total_records;
+    long page_size;
+
+public:
+    FileSource() : fd(-1), map(NULL), file_size(0), record_size(0),
+                   total_records(0), page_size(sysconf(_SC_PAGESIZE)) {}
+
+    ~FileSource() {
+        close_file();
+    }
+
+    bool open_file(const std::string& path, uint16_t rec_size) {
+        close_file();
+
+        // Non-blocking, so that opening a FIFO fails below rather than
+        // waiting for a writer; it changes nothing for a regular file
+        fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close_file();
+            return false;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            close_file();
+            errno = EINVAL;
+            return false;
+        }
+
+        file_size = st.st_size;
+        record_size = rec_size;
+        total_records = (file_size + record_size - 1) / record_size;
+
+        if (file_size > 0) {
+            void* p = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                map = (const uint8_t*)p;
+                madvise(p, file_size, MADV_SEQUENTIAL);
+            }
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return true;
+    }
+
+    // Take over a mapping laid out elsewhere (a directory tree, see
+    // file_tree.h); it is unmapped with the source and has no descriptor
+    void adopt_map(const uint8_t* image, uint64_t size, uint16_t rec_size) {
+        close_file();
+        map = size > 0 ? image : NULL;
+        file_size = size;
+        record_size = rec_size;
+        total_records = (file_size + record_size - 1) / record_size;
+        if (map) madvise((void*)map, file_size, MADV_SEQUENTIAL);
+    }
+
+    void close_file() {
+        if (map) munmap((void*)map, file_size);
+        if (fd >= 0) close(fd);
+        map = NULL;
+        fd = -1;
+    }
+
+    uint64_t size() const { return file_size; }
+    uint32_t num_records() const { return total_records; }
+    bool is_mapped() const { return map != NULL; }
+    const uint8_t* data() const { return map; }   // the whole file, NULL if not mapped
+    int descriptor() const { return fd; }
+
+    // Byte range of records [start_rec, end_rec], clamped to the file
+    void record_range(uint32_t start_rec, uint32_t end_rec,
+                      uint64_t& begin, uint64_t& end) const {
+        begin = (uint64_t)(start_rec - 1) * record_size;
+        end = (uint64_t)end_rec * record_size;
+        if (end > file_size) end = file_size;
+    }
+
+    // Number of real file bytes in a record (less than record_size only for
+    // the last record)
+    size_t record_length(uint32_t rec) const {
+        uint64_t begin = (uint64_t)(rec - 1) * record_size;
+        if (begin + record_size <= file_size) return record_size;
+        return file_size - begin;
+    }
+
+    // Copy record `rec` into dst, padding to record_size with zeros. False
+    // if the file has become shorter than it was when opened.
+    bool read_record(uint32_t rec, uint8_t* dst) const {
+        uint64_t offset = (uint64_t)(rec - 1) * record_size;
+        size_t len = record_length(rec);
+
+        if (map) {
+            memcpy(dst, map + offset, len);
+        } else {
+            size_t done = 0;
+            while (done < len) {
+                ssize_t n = pread(fd, dst + done, len - done, offset + done);
+                if (n <= 0) return false;
+                done += n;
+            }
+        }
+
+        if (len < record_size) {
+            memset(dst + len, 0, record_size - len);
+        }
+        return true;
+    }
+
+    // Fold the bytes of records [start_rec, end_rec] into crc (CRC32C).
+    // The sender builds the CRC of the whole file this way, blast by
+    // blast, from pages it is about to send anyway.
+    bool checksum(uint32_t start_rec, uint32_t end_rec, uint32_t& crc) const {
+        if (start_rec > end_rec) return true;
+        uint64_t begin, end;
+        record_range(start_rec, end_rec, begin, end);
+        if (map) {
+            crc = crc32c(map + begin, end - begin, crc);
+            return true;
+        }
+        std::vector<uint8_t> buf(std::min<uint64_t>(end - begin, 1 << 20));
+        for (uint64_t offset = begin; offset < end; ) {
+            ssize_t n = pread(fd, buf.data(), std::min<uint64_t>(buf.size(), end - offset), offset);
+            if (n <= 0) return false;
+            crc = crc32c(buf.data(), n, crc);
+            offset += n;
+        }
+        return true;
+    }
+
+    // Ask the kernel to start reading records ahead of the blast that needs them
+    void prefetch(uint32_t start_rec, uint32_t end_rec) const {
+        if (start_rec > end_rec || start_rec > total_records) return;
+        uint64_t begin, end;
+        record_range(start_rec, end_rec, begin, end);
+        if (map) {
+            uint64_t aligned = begin - (begin % page_size);
+            madvise((void*)(map + aligned), end - aligned, MADV_WILLNEED);
+        } else {
+            posix_fadvise(fd, begin, end - begin, POSIX_FADV_WILLNEED);
+        }
+    }
+
+    // Drop pages of fully acknowledged records so RSS stays bounded by the
+    // blasts still in flight rather than by the file size
+    void release(uint32_t start_rec, uint32_t end_rec) const {
+        if (start_rec > end_rec) return;
+        uint64_t begin, end;
+        record_range(start_rec, end_rec, begin, end);
+
+        // Only whole pages inside the range, so neighbouring blasts keep theirs
+        uint64_t first = (begin + page_size - 1) / page_size * page_size;
+        uint64_t last = (end == file_size) ? end : end / page_size * page_size;
+        if (first >= last) return;
+
+        if (map) {
+            madvise((void*)(map + first), last - first, MADV_DONTNEED);
+        }
+        if (fd >= 0) {
+            posix_fadvise(fd, first, last - first, POSIX_FADV_DONTNEED);
+        }
+    }
+};
+
+#endif // FILE_SOURCE_H
@@ -0,0 +1,466 @@
+#ifndef FILE_TREE_H
+#define FILE_TREE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "protocol.h"
+#include "compress.h"
+#include "crc32c.h"
+
+// ============================================================================
+// DIRECTORY TREES
+// ============================================================================
+//
+// A directory is sent as a single transfer: one handshake, one set of
+// blasts, one DISCONNECT and one linger for the whole tree. Its regular
+// files are laid end to end into one stream of records and the MANIFEST
+// tells the receiver which bytes of the stream belong to which file.
+//
+// Files under TREE_MAP_MIN are packed back to back, so one blast carries
+// hundreds of small files and a packet may end one file and start the
+// next. Larger files start on a page boundary (as does whatever follows
+// them) so the sender can map them straight into place instead of reading
+// them; the few bytes skipped are zeros that belong to no file.
+//
+// The sender reads the small files into an anonymous mapping of the whole
+// stream on a pool of threads and maps the large ones over their place,
+// and FileSource then serves records from it like from a single file. The
+// receiver writes every record straight into the files it covers from the
+// stream threads, and verifies the tree by reading the files back in
+// parallel and stitching their CRCs together.
+
+const uint64_t TREE_MAP_MIN = 64 * 1024;     // files this large are mapped, not read
+
+// ----------------------------------------------------------------------------
+// Sender
+// ----------------------------------------------------------------------------
+
+// Directories and regular files under root/rel, depth first in name order,
+// so every directory comes before what is in it. Symbolic links, devices,
+// sockets and FIFOs are left out.
+inline bool scan_tree(const std::string& root, const std::string& rel,
+                      std::vector<TreeEntry>& entries) {
+    std::string dir = rel.empty() ? root : root + "/" + rel;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return false;
+    std::vector<std::string> names;
+    while (struct dirent* ent = readdir(d)) {
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            names.push_back(ent->d_name);
+        }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+
+    for (const std::string& name : names) {
+        TreeEntry e;
+        e.path = rel.empty() ? name : rel + "/" + name;
+        if (e.path.size() > MAX_TREE_PATH) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        struct stat st;
+        if (lstat((root + "/" + e.path).c_str(), &st) != 0) return false;
+        e.mode = st.st_mode;
+        if (S_ISDIR(st.st_mode)) {
+            entries.push_back(e);
+            if (!scan_tree(root, e.path, entries)) return false;
+        } else if (S_ISREG(st.st_mode)) {
+            e.size = st.st_size;
+            entries.push_back(e);
+        }
+    }
+    return true;
+}
+
+// Give every file its offset in the stream; returns the stream's length
+inline uint64_t layout_tree(std::vector<TreeEntry>& entries, uint64_t page_size) {
+    uint64_t offset = 0;
+    bool align = false;                      // the last file was a mapped one
+    for (TreeEntry& e : entries) {
+        if (S_ISDIR(e.mode) || e.size == 0) continue;
+        bool mapped = e.size >= TREE_MAP_MIN;
+        if (mapped || align) {
+            offset = (offset + page_size - 1) / page_size * page_size;
+        }
+        e.offset = offset;
+        offset += e.size;
+        align = mapped;
+    }
+    return offset;
+}
+
+// Build the stream image: an anonymous mapping of `size` bytes with the
+// small files read into it on the pool and the large ones mapped over
+// their place. The caller owns the image (munmap(image, size)).
+inline bool map_tree(const std::string& root, const std::vector<TreeEntry>& entries,
+                     uint64_t size, WorkerPool& pool, uint8_t*& image) {
+    image = NULL;
+    if (size == 0) return true;
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return false;
+
+    uint8_t* base = (uint8_t*)p;
+    std::atomic<bool> ok(true);
+    run_parallel(pool, entries.size(), [&](size_t i) {
+        const TreeEntry& e = entries[i];
+        if (S_ISDIR(e.mode) || e.size == 0 || !ok) return;
+        int fd = open((root + "/" + e.path).c_str(), O_RDONLY);
+        if (fd < 0) {
+            ok = false;
+            return;
+        }
+        if (e.size >= TREE_MAP_MIN) {
+            if (mmap(base + e.offset, e.size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                ok = false;
+            }
+        } else {
+            for (uint64_t done = 0; done < e.size; ) {
+                ssize_t n = pread(fd, base + e.offset + done, e.size - done, done);
+                if (n <= 0) {
+                    ok = false;                  // unreadable, or shrank since the scan
+                    break;
+                }
+                done += n;
+            }
+        }
+        close(fd);
+    });
+    if (!ok) {
+        munmap(p, size);
+        return false;
+    }
+    image = base;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Receiver
+// ----------------------------------------------------------------------------
+
+// A relative path that stays under the tree's root: no leading '/', no
+// empty, "." or ".." components
+inline bool tree_path_safe(const std::string& path) {
+    if (path.empty() || path.size() > MAX_TREE_PATH || path[0] == '/' ||
+        path.find('\0') != std::string::npos) {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) end = path.size();
+        std::string part = path.substr(start, end - start);
+        if (part.empty() || part == "." || part == "..") return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+// The tree on the receiving side. Entries are created as the MANIFEST
+// comes in, before any DATA: directories in order, files on a pool of
+// threads (a large one preallocated), so the receive threads only open,
+// write and close. A file is closed as soon as all of its bytes are
+// written; files are created writable by their owner and given a mode
+// without that once complete. Only the permission bits of a sent mode are
+// kept: setuid, setgid and sticky bits from a sender are never applied.
+class TreeSink {
+private:
+    struct File {
+        int fd;
+        uint64_t written;
+
+        File() : fd(-1), written(0) {}
+    };
+
+    std::string root;
+    uint64_t stream_size;
+    uint16_t record_size;
+    std::vector<TreeEntry> entries;
+    std::vector<char> known;                 // per entry: named by a MANIFEST yet
+    uint32_t entries_known;
+    std::set<std::string> made_dirs;
+    std::vector<uint32_t> by_offset;         // files with data, in stream order
+    std::vector<File> files;                 // per entry
+    std::mutex lock;                         // fd and written of every file
+    std::atomic<bool> ready;                 // manifest complete and checked
+    bool opened;
+    WorkerPool pool;                         // creates the files, reads them back
+
+    static uint32_t final_mode(const TreeEntry& e) { return e.mode & 0777; }
+    static uint32_t create_mode(const TreeEntry& e) { return final_mode(e) | S_IRUSR | S_IWUSR; }
+
+    std::string full_path(const TreeEntry& e) const { return root + "/" + e.path; }
+
+    // mkdir -p of the directories above a path
+    bool make_parents(const std::string& path) {
+        for (size_t slash = path.find('/'); slash != std::string::npos;
+             slash = path.find('/', slash + 1)) {
+            std::string dir = path.substr(0, slash);
+            if (made_dirs.count(dir)) continue;
+            if (mkdir((root + "/" + dir).c_str(), 0755) != 0 && errno != EEXIST) return false;
+            made_dirs.insert(dir);
+        }
+        return true;
+    }
+
+    // Every entry is named: index the files by offset and check that they
+    // lie inside the stream without overlapping
+    bool index_files() {
+        by_offset.clear();
+        for (uint32_t i = 0; i < entries.size(); i++) {
+            if (S_ISREG(entries[i].mode) && entries[i].size > 0) by_offset.push_back(i);
+        }
+        std::sort(by_offset.begin(), by_offset.end(), [this](uint32_t a, uint32_t b) {
+            return entries[a].offset < entries[b].offset;
+        });
+        uint64_t end = 0;
+        for (uint32_t i : by_offset) {
+            const TreeEntry& e = entries[i];
+            if (e.offset < end || e.size > stream_size || e.offset > stream_size - e.size) {
+                return false;
+            }
+            end = e.offset + e.size;
+        }
+        return true;
+    }
+
+    // Write the part of [offset, offset + len) of the stream that falls in
+    // file `index`
+    bool write_file(uint32_t index, uint64_t offset, const uint8_t* data, size_t len) {
+        const TreeEntry& e = entries[index];
+        File& f = files[index];
+        uint64_t begin = std::max(offset, e.offset);
+        uint64_t end = std::min(offset + len, e.offset + e.size);
+        int fd;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (f.fd < 0) {
+                f.fd = ::open(full_path(e).c_str(), O_WRONLY);
+                if (f.fd < 0) return false;
+            }
+            fd = f.fd;
+        }
+
+        for (uint64_t done = begin; done < end; ) {
+            ssize_t n = pwrite(fd, data + (done - offset), end - done, done - e.offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            done += n;
+        }
+
+        // Records are written once each, so whoever writes the last bytes
+        // is the only one still using the descriptor
+        bool last;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            f.written += end - begin;
+            last = f.written >= e.size;
+        }
+        if (last) {
+            bool ok = create_mode(e) == final_mode(e) || fchmod(fd, final_mode(e)) == 0;
+            ok = (close(fd) == 0) && ok;
+            std::lock_guard<std::mutex> guard(lock);
+            f.fd = -1;
+            return ok;
+        }
+        return true;
+    }
+
+    // CRC32C of one file as it is on disk, which must be its size
+    bool file_checksum(const TreeEntry& e, uint32_t& crc) const {
+        crc = 0;
+        int fd = ::open(full_path(e).c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        std::vector<uint8_t> buf(std::min<uint64_t>(e.size, 1 << 20));
+        uint64_t offset = 0;
+        while (offset < e.size) {
+            ssize_t n = pread(fd, buf.data(), std::min<uint64_t>(buf.size(), e.size - offset), offset);
+            if (n <= 0) break;
+            crc = crc32c(buf.data(), n, crc);
+            offset += n;
+        }
+        close(fd);
+        return offset == e.size;
+    }
+
+public:
+    explicit TreeSink(unsigned threads)
+        : stream_size(0), record_size(0), entries_known(0), ready(false), opened(false),
+          pool(threads) {}
+
+    ~TreeSink() {
+        for (File& f : files) {
+            if (f.fd >= 0) close(f.fd);
+        }
+    }
+
+    // Bytes of memory one entry takes, besides its path
+    static size_t entry_bytes() { return sizeof(TreeEntry) + sizeof(File) + sizeof(uint32_t) + 1; }
+
+    // Create the root directory of a tree of `total` entries whose files
+    // take `size` bytes of stream
+    bool open_tree(const std::string& path, uint32_t total, uint64_t size, uint16_t rec_size) {
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        root = path;
+        stream_size = size;
+        record_size = rec_size;
+        entries.assign(total, TreeEntry());
+        known.assign(total, 0);
+        files.assign(total, File());
+        entries_known = 0;
+        opened = true;
+        return true;
+    }
+
+    bool is_open() const { return opened; }
+    bool is_ready() const { return ready; }
+    uint32_t num_entries() const { return entries.size(); }
+
+    // Take in the entries of one MANIFEST packet; a packet seen before is
+    // accepted again without doing anything, even once finished. False if
+    // an entry is unsafe or cannot be created.
+    bool add_entries(uint32_t first, const std::vector<TreeEntry>& batch) {
+        if (first > entries.size() || batch.size() > entries.size() - first) return false;
+        for (size_t i = 0; i < batch.size(); i++) {
+            const TreeEntry& e = batch[i];
+            if (!tree_path_safe(e.path) || !(S_ISDIR(e.mode) || S_ISREG(e.mode))) return false;
+        }
+        std::vector<uint32_t> fresh;         // files not created yet
+        for (size_t i = 0; i < batch.size(); i++) {
+            uint32_t index = first + i;
+            if (known[index]) continue;
+            if (!opened) return false;
+            const TreeEntry& e = batch[i];
+            if (!make_parents(e.path)) return false;
+            if (S_ISDIR(e.mode)) {
+                if (mkdir(full_path(e).c_str(), 0755) != 0 && errno != EEXIST) return false;
+                made_dirs.insert(e.path);
+            } else {
+                fresh.push_back(index);
+            }
+            entries[index] = e;
+        }
+
+        std::atomic<bool> ok(true);
+        run_parallel(pool, fresh.size(), [&](size_t i) {
+            const TreeEntry& e = entries[fresh[i]];
+            uint32_t mode = e.size == 0 ? final_mode(e) : create_mode(e);
+            int fd = ::open(full_path(e).c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+            if (fd < 0) {
+                ok = false;
+                return;
+            }
+            if (fchmod(fd, mode) != 0 ||
+                (e.size >= TREE_MAP_MIN && posix_fallocate(fd, 0, e.size) != 0 &&
+                 ftruncate(fd, e.size) != 0)) {
+                ok = false;
+            }
+            close(fd);
+        });
+        if (!ok) return false;
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (!known[first + i]) {
+                known[first + i] = 1;
+                entries_known++;
+            }
+        }
+        if (entries_known == entries.size() && !ready) {
+            if (!index_files()) return false;
+            ready = true;
+        }
+        return true;
+    }
+
+    // Write record `rec` (1-indexed) of the stream into its files
+    bool write_record(uint32_t rec, const uint8_t* data) {
+        uint64_t offset = (uint64_t)(rec - 1) * record_size;
+        if (offset >= stream_size) return false;
+        return write_at(offset, data, std::min<uint64_t>(record_size, stream_size - offset));
+    }
+
+    // Write [offset, offset + len) of the stream into the files it covers;
+    // the gaps between them are dropped
+    bool write_at(uint64_t offset, const uint8_t* data, size_t len) {
+        if (!ready || offset > stream_size || len > stream_size - offset) return false;
+        auto it = std::upper_bound(by_offset.begin(), by_offset.end(), offset,
+                                   [this](uint64_t o, uint32_t i) { return o < entries[i].offset; });
+        if (it != by_offset.begin()) --it;
+        for (; it != by_offset.end() && entries[*it].offset < offset + len; ++it) {
+            const TreeEntry& e = entries[*it];
+            if (e.offset + e.size <= offset) continue;
+            if (!write_file(*it, offset, data, len)) return false;
+        }
+        return true;
+    }
+
+    // CRC32C of the stream as the sender built it, from what is now on
+    // disk: every file is read back on the pool and the CRCs are joined in
+    // stream order, with zeros for the gaps
+    bool checksum(uint32_t& crc) {
+        std::vector<uint32_t> crcs(by_offset.size());
+        std::atomic<bool> ok(ready.load());
+        run_parallel(pool, by_offset.size(), [&](size_t i) {
+            if (ok && !file_checksum(entries[by_offset[i]], crcs[i])) ok = false;
+        });
+        if (!ok) return false;
+
+        static const uint8_t zeros[4096] = {0};
+        uint64_t at = 0;
+        crc = 0;
+        for (size_t i = 0; i <= by_offset.size(); i++) {
+            uint64_t next = i < by_offset.size() ? entries[by_offset[i]].offset : stream_size;
+            while (at < next) {
+                size_t n = std::min<uint64_t>(sizeof(zeros), next - at);
+                crc = crc32c(zeros, n, crc);
+                at += n;
+            }
+            if (i == by_offset.size()) break;
+            const TreeEntry& e = entries[by_offset[i]];
+            crc = crc32c_combine(crc, crcs[i], e.size);
+            at += e.size;
+        }
+        return true;
+    }
+
+    // Close whatever is still open, give directories their modes (deepest
+    // first, so a read-only one does not stop its children) and flush the
+    // filesystem
+    bool finish() {
+        if (!opened) return false;
+        bool ok = true;
+        for (File& f : files) {
+            if (f.fd >= 0) {
+                ok = (close(f.fd) == 0) && ok;
+                f.fd = -1;
+            }
+        }
+        for (size_t i = entries.size(); i-- > 0; ) {
+            if (known[i] && S_ISDIR(entries[i].mode)) {
+                chmod(full_path(entries[i]).c_str(), final_mode(entries[i]));
+            }
+        }
+        int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY);
+        ok = fd >= 0 && syncfs(fd) == 0 && ok;
+        if (fd >= 0) close(fd);
+        opened = false;
+        return ok;
+    }
+};
+
+#endif // FILE_TREE_H
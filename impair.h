@@ -0,0 +1,429 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+const double IMPAIR_QUEUE_MS = 100;          // bottleneck queue before tail drop
+const uint32_t IMPAIR_BUCKET_BYTES = 65536;  // token bucket depth, bytes
+const double IMPAIR_REORDER_MS = 1.0;        // least extra hold of a reordered packet
+const int IMPAIR_SEND_BATCH = 32;            // held datagrams per sendmmsg
+
+// ============================================================================
+// IMPAIRMENT SETTINGS
+// ============================================================================
+//
+// What a simulated link does to the datagrams one side sends, given as
+// comma-separated key=value pairs (--impair on either binary):
+//   loss=p          drop DATA with probability p (the good state, below)
+//   burst=P/R[/h]   Gilbert-Elliott: enter the bad state with probability P
+//                   per packet, leave it with R (mean burst 1/R packets),
+//                   drop DATA in it with probability h (default 1)
+//   ctrl-loss=p     drop control packets with probability p
+//   delay=ms        fixed one-way delay
+//   jitter=ms       plus a uniform +-ms, without reordering
+//   reorder=p       hold this share of packets back so later ones pass them
+//   dup=p           send this share of packets twice
+//   rate=mbps       token-bucket bandwidth cap, tail drop past queue=ms
+//   bucket=bytes    token bucket depth (burst allowed at line rate)
+//   queue=ms        bottleneck queue in front of the cap
+//   seed=n          random seed; the same seed drops the same packets
+
+struct ImpairmentConfig {
+    double loss;
+    double burst_enter;
+    double burst_exit;
+    double burst_loss;
+    double control_loss;
+    double delay_ms;
+    double jitter_ms;
+    double reorder;
+    double duplicate;
+    double rate_mbps;
+    uint32_t bucket_bytes;
+    double queue_ms;
+    uint64_t seed;
+    bool has_loss;                           // loss= given, not just defaulted
+    bool has_seed;
+
+    ImpairmentConfig() : loss(0), burst_enter(0), burst_exit(1), burst_loss(1), control_loss(0),
+                         delay_ms(0), jitter_ms(0), reorder(0), duplicate(0), rate_mbps(0),
+                         bucket_bytes(IMPAIR_BUCKET_BYTES), queue_ms(IMPAIR_QUEUE_MS), seed(1),
+                         has_loss(false), has_seed(false) {}
+
+    // Anything to do at all
+    bool active() const {
+        return loss > 0 || burst_enter > 0 || control_loss > 0 || delay_ms > 0 ||
+               jitter_ms > 0 || reorder > 0 || duplicate > 0 || rate_mbps > 0;
+    }
+};
+
+inline bool impair_probability(const char* text, double& p) {
+    char* end;
+    p = strtod(text, &end);
+    return end != text && *end == '\0' && p >= 0.0 && p <= 1.0;
+}
+
+inline bool impair_positive(const char* text, double& v) {
+    char* end;
+    v = strtod(text, &end);
+    return end != text && *end == '\0' && v >= 0.0;
+}
+
+// Parse a spec as above into cfg; false (with the offending item in
+// error) if any of it is not understood
+inline bool parse_impairment(const std::string& spec, ImpairmentConfig& cfg, std::string& error) {
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t comma = spec.find(',', start);
+        if (comma == std::string::npos) comma = spec.size();
+        std::string item = spec.substr(start, comma - start);
+        start = comma + 1;
+        if (item.empty()) continue;
+
+        size_t eq = item.find('=');
+        std::string key = item.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+        const char* v = value.c_str();
+        double bytes = 0;
+        bool ok;
+        if (eq == std::string::npos) {
+            ok = false;
+        } else if (key == "loss") {
+            ok = impair_probability(v, cfg.loss);
+            cfg.has_loss = true;
+        } else if (key == "burst") {
+            std::string parts[3] = {"", "", "1"};
+            size_t from = 0;
+            int n = 0;
+            for (; n < 3 && from <= value.size(); n++) {
+                size_t slash = value.find('/', from);
+                if (slash == std::string::npos) slash = value.size();
+                parts[n] = value.substr(from, slash - from);
+                from = slash + 1;
+            }
+            ok = n >= 2 && from > value.size() &&
+                 impair_probability(parts[0].c_str(), cfg.burst_enter) &&
+                 impair_probability(parts[1].c_str(), cfg.burst_exit) &&
+                 impair_probability(parts[2].c_str(), cfg.burst_loss) && cfg.burst_exit > 0;
+        } else if (key == "ctrl-loss") {
+            ok = impair_probability(v, cfg.control_loss);
+        } else if (key == "delay") {
+            ok = impair_positive(v, cfg.delay_ms);
+        } else if (key == "jitter") {
+            ok = impair_positive(v, cfg.jitter_ms);
+        } else if (key == "reorder") {
+            ok = impair_probability(v, cfg.reorder);
+        } else if (key == "dup") {
+            ok = impair_probability(v, cfg.duplicate);
+        } else if (key == "rate") {
+            ok = impair_positive(v, cfg.rate_mbps);
+        } else if (key == "bucket") {
+            ok = impair_positive(v, bytes) && bytes >= 1500 && bytes <= 1e9;
+            cfg.bucket_bytes = (uint32_t)bytes;
+        } else if (key == "queue") {
+            ok = impair_positive(v, cfg.queue_ms);
+        } else if (key == "seed") {
+            char* end;
+            cfg.seed = strtoull(v, &end, 10);
+            ok = end != v && *end == '\0';
+            cfg.has_seed = true;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            error = item;
+            return false;
+        }
+    }
+    return true;
+}
+
+// ============================================================================
+// IMPAIRED LINK
+// ============================================================================
+//
+// Every datagram a side sends on one socket passes through pass() first,
+// which decides its fate from a seeded xorshift generator, so one seed
+// gives the same drops on every run. Datagrams due now go back to the
+// caller to send the normal way, which keeps the common case (loss only)
+// at a few nanoseconds and leaves batching and GSO alone. Anything that
+// has to wait (delay, a full token bucket, a reordered or duplicated
+// packet) is copied to a delay line, and the link's own thread sends it
+// with sendmmsg when it is due.
+//
+// The bandwidth cap is a token bucket that may run into debt: a packet
+// that finds too few tokens waits until the debt is paid off at the line
+// rate, and one that would wait longer than the queue allows is dropped,
+// as a bottleneck router would. Jitter never reorders; only reorder= does.
+
+enum LinkVerdict {
+    LINK_SEND,                               // send it now
+    LINK_HELD,                               // the link sends it later
+    LINK_DROP                                // lost
+};
+
+struct LinkCounters {
+    uint64_t dropped;                        // DATA lost to loss= or burst=
+    uint64_t dropped_in_bursts;              // ... of which in the bad state
+    uint64_t control_dropped;
+    uint64_t queue_dropped;                  // tail drops at the bandwidth cap
+    uint64_t delayed;                        // sent later by the link
+    uint64_t reordered;
+    uint64_t duplicated;
+
+    LinkCounters() : dropped(0), dropped_in_bursts(0), control_dropped(0), queue_dropped(0),
+                     delayed(0), reordered(0), duplicated(0) {}
+
+    LinkCounters& operator+=(const LinkCounters& other) {
+        dropped += other.dropped;
+        dropped_in_bursts += other.dropped_in_bursts;
+        control_dropped += other.control_dropped;
+        queue_dropped += other.queue_dropped;
+        delayed += other.delayed;
+        reordered += other.reordered;
+        duplicated += other.duplicated;
+        return *this;
+    }
+};
+
+class ImpairedLink {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Held {
+        Clock::time_point release;
+        uint64_t order;                      // ties go out in the order sent
+        struct sockaddr_in dest;
+        std::vector<uint8_t> data;
+
+        bool operator<(const Held& other) const {   // for a min-heap
+            if (release != other.release) return release > other.release;
+            return order > other.order;
+        }
+    };
+
+    int sockfd;
+    ImpairmentConfig cfg;
+    uint64_t rng;
+    bool shaping;                            // anything beyond loss
+    bool bad_state;
+    double tokens;                           // bytes, negative = queued
+    Clock::time_point tokens_time;
+    Clock::time_point last_release;          // keeps jittered packets in order
+    LinkCounters counters;
+
+    std::mutex lock;                         // pass() from several threads
+    std::condition_variable wakeup;
+    std::priority_queue<Held> held;
+    uint64_t held_order;
+    bool stopping;
+    std::thread sender;                      // started on the first held packet
+
+    // xorshift64*, seeded through splitmix64 so nearby seeds differ
+    double uniform() {
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        return ((rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    static uint64_t mix_seed(uint64_t seed) {
+        uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        return z ? z : 1;
+    }
+
+    static Clock::duration ms(double v) {
+        return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double, std::milli>(v));
+    }
+
+    void hold(const uint8_t* data, size_t size, const struct sockaddr_in& dest,
+              Clock::time_point release) {
+        Held h;
+        h.release = release;
+        h.order = held_order++;
+        h.dest = dest;
+        h.data.assign(data, data + size);
+        bool earliest = held.empty() || release < held.top().release;
+        held.push(std::move(h));
+        counters.delayed++;
+        if (!sender.joinable()) {
+            sender = std::thread([this] { run(); });
+        } else if (earliest) {
+            wakeup.notify_one();
+        }
+    }
+
+    void run() {
+        std::vector<Held> due;
+        std::vector<struct mmsghdr> msgs(IMPAIR_SEND_BATCH);
+        std::vector<struct iovec> iov(IMPAIR_SEND_BATCH);
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping || !held.empty()) {
+            if (held.empty()) {
+                wakeup.wait(guard);
+                continue;
+            }
+            Clock::time_point next = held.top().release;
+            if (Clock::now() < next) {
+                wakeup.wait_until(guard, next);
+                continue;
+            }
+            due.clear();
+            Clock::time_point now = Clock::now();
+            while (!held.empty() && held.top().release <= now && due.size() < msgs.size()) {
+                due.push_back(std::move(const_cast<Held&>(held.top())));
+                held.pop();
+            }
+            guard.unlock();
+
+            memset(msgs.data(), 0, sizeof(struct mmsghdr) * due.size());
+            for (size_t i = 0; i < due.size(); i++) {
+                iov[i].iov_base = due[i].data.data();
+                iov[i].iov_len = due[i].data.size();
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = &due[i].dest;
+                msgs[i].msg_hdr.msg_namelen = sizeof(due[i].dest);
+            }
+            size_t sent = 0;
+            while (sent < due.size()) {
+                int n = sendmmsg(sockfd, msgs.data() + sent, due.size() - sent, 0);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    break;                   // lost, as on a real link
+                }
+                sent += n;
+            }
+            guard.lock();
+        }
+    }
+
+public:
+    ImpairedLink(int fd, const ImpairmentConfig& config, uint64_t stream_seed)
+        : sockfd(fd), cfg(config), rng(mix_seed(stream_seed)),
+          shaping(config.rate_mbps > 0 || config.delay_ms > 0 || config.jitter_ms > 0 ||
+                  config.reorder > 0 || config.duplicate > 0),
+          bad_state(false),
+          tokens(config.bucket_bytes), tokens_time(Clock::now()), last_release(Clock::now()),
+          held_order(0), stopping(false) {}
+
+    // Datagrams still held are sent when due before the link goes
+    ~ImpairedLink() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        if (sender.joinable()) sender.join();
+    }
+
+    // The fate of one datagram about to go to dest. LINK_SEND: send it
+    // yourself; LINK_HELD: the link has a copy and sends it when due.
+    LinkVerdict pass(const uint8_t* data, size_t size, bool control,
+                     const struct sockaddr_in& dest) {
+        std::lock_guard<std::mutex> guard(lock);
+
+        // Loss: the channel state moves on with every packet
+        if (cfg.burst_enter > 0) {
+            bad_state = bad_state ? uniform() >= cfg.burst_exit : uniform() < cfg.burst_enter;
+        }
+        if (control) {
+            if (cfg.control_loss > 0 && uniform() < cfg.control_loss) {
+                counters.control_dropped++;
+                return LINK_DROP;
+            }
+        } else {
+            double p = bad_state ? cfg.burst_loss : cfg.loss;
+            if (p > 0 && uniform() < p) {
+                counters.dropped++;
+                if (bad_state) counters.dropped_in_bursts++;
+                return LINK_DROP;
+            }
+        }
+
+        if (!shaping) return LINK_SEND;
+
+        // Bandwidth cap: departure once the bucket's debt is paid
+        Clock::time_point now = Clock::now();
+        Clock::time_point release = now;
+        if (cfg.rate_mbps > 0) {
+            double bytes_per_sec = cfg.rate_mbps * 125000.0;
+            tokens = std::min((double)cfg.bucket_bytes,
+                              tokens + std::chrono::duration<double>(now - tokens_time).count() *
+                                           bytes_per_sec);
+            tokens_time = now;
+            double wait_ms = tokens >= (double)size ? 0 : (size - tokens) / bytes_per_sec * 1000;
+            if (wait_ms > cfg.queue_ms) {
+                counters.queue_dropped++;
+                return LINK_DROP;
+            }
+            tokens -= size;
+            release += ms(wait_ms);
+        }
+
+        // Delay, jitter that keeps the order, and the odd packet held back
+        if (cfg.delay_ms > 0 || cfg.jitter_ms > 0) {
+            double d = cfg.delay_ms + cfg.jitter_ms * (2 * uniform() - 1);
+            release += ms(d > 0 ? d : 0);
+        }
+        bool reordered = cfg.reorder > 0 && uniform() < cfg.reorder;
+        if (reordered) {
+            release += ms(std::max(IMPAIR_REORDER_MS, cfg.jitter_ms));
+            counters.reordered++;
+        } else {
+            if (release < last_release) release = last_release;
+            last_release = release;
+        }
+
+        bool twice = cfg.duplicate > 0 && uniform() < cfg.duplicate;
+        if (twice) {
+            counters.duplicated++;
+        }
+        if (release <= now && !reordered) {
+            if (twice) hold(data, size, dest, now);
+            return LINK_SEND;
+        }
+        hold(data, size, dest, release);
+        if (twice) hold(data, size, dest, release);
+        return LINK_HELD;
+    }
+
+    LinkCounters get_counters() {
+        std::lock_guard<std::mutex> guard(lock);
+        return counters;
+    }
+};
+
+// One line about what a link did, for the end-of-transfer summaries
+inline void print_link_counters(const char* what, const LinkCounters& c) {
+    printf("Impairment (%s): %llu dropped (%llu in bursts), %llu control dropped, "
+           "%llu tail-dropped at the cap, %llu delayed, %llu reordered, %llu duplicated\n",
+           what, (unsigned long long)c.dropped, (unsigned long long)c.dropped_in_bursts,
+           (unsigned long long)c.control_dropped, (unsigned long long)c.queue_dropped,
+           (unsigned long long)c.delayed, (unsigned long long)c.reordered,
+           (unsigned long long)c.duplicated);
+}
+
+#endif // IMPAIR_H
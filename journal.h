@@ -0,0 +1,191 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "record_bitmap.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+const int DEFAULT_CHECKPOINT_MS = 1000;      // between checkpoints of a stream
+const uint32_t JOURNAL_MAGIC = 0x4c4e524a;   // "JRNL"
+const uint32_t JOURNAL_VERSION = 2;
+
+// ============================================================================
+// PROGRESS JOURNAL
+// ============================================================================
+//
+// Which records of a partial output file are safely on disk, kept next to
+// it so that a transfer cut short can be resumed: a header naming the file
+// (size, record size, the sender's mtime) followed by the completion
+// bitmap in RecordBitmap's layout. Bits only reach it in checkpoints. A
+// checkpoint fdatasyncs the output file first and then writes the bitmap
+// words that changed and fdatasyncs the journal, so after a crash the
+// journal may lag the file by one checkpoint but never claims a record
+// that is not there.
+// Streams checkpoint their own stripes from their own threads; the words
+// they share at stripe boundaries are merged under a lock.
+
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    uint32_t record_size;
+    uint32_t total_records;
+    uint64_t file_mtime;
+
+    JournalHeader() : magic(JOURNAL_MAGIC), version(JOURNAL_VERSION), file_size(0),
+                      record_size(0), total_records(0), file_mtime(0) {}
+
+    bool same_file(const JournalHeader& other) const {
+        return magic == other.magic && version == other.version &&
+               file_size == other.file_size && record_size == other.record_size &&
+               total_records == other.total_records && file_mtime == other.file_mtime;
+    }
+};
+
+class ProgressJournal {
+private:
+    int fd;
+    std::string path;
+    JournalHeader header;
+    std::vector<uint64_t> durable;           // the bitmap as the journal has it
+    std::mutex lock;                         // checkpoints of different streams
+    bool failed;                             // an I/O error, no more checkpoints
+
+    bool write_at(const void* data, size_t len, uint64_t offset) {
+        const uint8_t* p = (const uint8_t*)data;
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pwrite(fd, p + done, len - done, offset + done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    bool read_at(void* data, size_t len, uint64_t offset) {
+        uint8_t* p = (uint8_t*)data;
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(fd, p + done, len - done, offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += n;
+        }
+        return true;
+    }
+
+public:
+    ProgressJournal() : fd(-1), failed(false) {}
+
+    ~ProgressJournal() {
+        if (fd >= 0) close(fd);
+    }
+
+    bool is_open() const { return fd >= 0; }
+
+    // Open the journal at p for the file hdr describes, with room for a
+    // bitmap of `words` words. An existing journal of that file is taken
+    // over and its bits returned in saved; anything else there is
+    // replaced by an empty one. False if it cannot be opened or another
+    // transfer of the same file holds it.
+    bool open_journal(const std::string& p, const JournalHeader& hdr, size_t words,
+                      std::vector<uint64_t>& saved) {
+        saved.clear();
+        fd = open(p.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        path = p;
+        header = hdr;
+        durable.assign(words, 0);
+
+        JournalHeader existing;
+        struct stat st;
+        if (fstat(fd, &st) == 0 &&
+            (uint64_t)st.st_size == sizeof(JournalHeader) + words * sizeof(uint64_t) &&
+            read_at(&existing, sizeof(existing), 0) && existing.same_file(hdr) &&
+            read_at(durable.data(), words * sizeof(uint64_t), sizeof(JournalHeader))) {
+            saved = durable;
+            return true;
+        }
+        return reset();
+    }
+
+    // Forget every record: an empty bitmap, on disk before the file is
+    // written to
+    bool reset() {
+        durable.assign(durable.size(), 0);
+        if (ftruncate(fd, 0) != 0 ||
+            !write_at(&header, sizeof(header), 0) ||
+            !write_at(durable.data(), durable.size() * sizeof(uint64_t), sizeof(header)) ||
+            fdatasync(fd) != 0) {
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    // Journal the records of [first, last] that bitmap marks received,
+    // once data_fd has them on disk. The caller makes sure every record
+    // it has marked in that range has been written (not just queued).
+    bool checkpoint(int data_fd, const RecordBitmap& bitmap, uint32_t first, uint32_t last) {
+        if (fd < 0 || first > last) return true;
+
+        // Snapshot the bits before syncing: whatever they mark was written
+        // before the sync started, so the sync covers it
+        size_t w0 = first / 64, w1 = last / 64;
+        std::vector<uint64_t> snapshot(w1 - w0 + 1);
+        for (size_t w = w0; w <= w1; w++) {
+            uint64_t mask = ~0ULL;
+            if (w == w0) mask &= ~0ULL << (first % 64);
+            if (w == w1 && last % 64 != 63) mask &= (1ULL << (last % 64 + 1)) - 1;
+            snapshot[w - w0] = bitmap.word(w) & mask;
+        }
+        if (fdatasync(data_fd) != 0) {
+            std::lock_guard<std::mutex> guard(lock);
+            failed = true;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (failed) return false;
+        for (size_t w = w0; w <= w1; w++) {
+            durable[w] |= snapshot[w - w0];
+        }
+        if (!write_at(&durable[w0], (w1 - w0 + 1) * sizeof(uint64_t),
+                      sizeof(header) + w0 * sizeof(uint64_t)) ||
+            fdatasync(fd) != 0) {
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    // The file is complete (or worthless): drop the journal
+    void remove() {
+        if (fd < 0) return;
+        unlink(path.c_str());
+        close(fd);
+        fd = -1;
+    }
+};
+
+#endif // JOURNAL_H
@@ -0,0 +1,409 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "udp_batch.h"
+#include "file_sink.h"
+#include "telemetry.h"
+
+// ============================================================================
+// RECEIVE PIPELINE
+// ============================================================================
+//
+// --io pipeline splits the receive path of a stream into three threads,
+// joined by single-producer/single-consumer rings:
+//
+//   drain      recvmmsg into a pooled RecvBatch and pass it on, nothing
+//              else, so the socket buffer is emptied as fast as the
+//              kernel fills it and a slow disk or a long REC_MISS no
+//              longer turns into datagrams dropped by the kernel
+//   placement  the stream's own thread: checks each packet, tracks its
+//              records and copies them into coalesced write chunks
+//   disk       pwrite()s the chunks
+//
+// Buffers go round in a loop (a second ring takes them back to the
+// producer), so nothing is allocated per packet. Each hand-off records
+// how often the producer found the next stage behind (no free buffer to
+// fill), how long it waited for one and how many items were queued.
+
+const int PIPELINE_BATCHES = 4;          // RecvBatches per drain thread
+const int PIPELINE_WAIT_MS = 1000;       // longest park before rechecking
+
+// ============================================================================
+// SPSC RING
+// ============================================================================
+//
+// Bounded lock-free queue of one producer and one consumer thread: the
+// producer only writes tail, the consumer only head, each publishing
+// with a release store. A consumer with nothing to do parks on a
+// condition variable; the producer takes the lock only when someone is
+// parked, so a busy pipeline never touches it.
+
+template <typename T>
+class SpscRing {
+private:
+    std::vector<T> slots;
+    size_t mask;
+    std::atomic<size_t> head;            // next to pop, consumer owned
+    char head_line[64];                  // keep head and tail on separate cache lines
+    std::atomic<size_t> tail;            // next to push, producer owned
+    char tail_line[64];
+    std::atomic<int> sleepers;
+    std::atomic<bool> closed;
+    std::mutex park_lock;
+    std::condition_variable parked;
+
+    static size_t round_up(size_t n) {
+        size_t p = 1;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+public:
+    explicit SpscRing(size_t capacity)
+        : slots(round_up(capacity)), mask(round_up(capacity) - 1), head(0), tail(0),
+          sleepers(0), closed(false) {
+        (void)head_line;
+        (void)tail_line;
+    }
+
+    // Producer: false if the ring is full
+    bool push(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) return false;
+        slots[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(park_lock);
+            parked.notify_one();
+        }
+        return true;
+    }
+
+    // Consumer: false if the ring is empty
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        item = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: pop, parking up to timeout_ms for the producer; false on
+    // timeout or once the ring is closed and empty
+    bool pop_wait(T& item, int timeout_ms) {
+        bool got = pop(item);
+        if (got || timeout_ms <= 0) return got;
+        std::unique_lock<std::mutex> lock(park_lock);
+        sleepers.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        parked.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]() {
+            got = pop(item);
+            return got || closed.load();
+        });
+        sleepers.fetch_sub(1);
+        return got;
+    }
+
+    // Items queued, as seen from either side
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    // Wake a parked consumer for good; what is queued can still be popped
+    void close() {
+        closed = true;
+        std::lock_guard<std::mutex> lock(park_lock);
+        parked.notify_all();
+    }
+};
+
+// ============================================================================
+// STAGE METRICS
+// ============================================================================
+
+// Backpressure at one hand-off of the pipeline
+struct StageMetrics {
+    Counter& stalls;                     // the producer had to wait for a free buffer
+    Histogram& stall_ns;                 // ... for this long
+    Histogram& depth;                    // items queued after each hand-off
+};
+
+// ============================================================================
+// DRAIN STAGE
+// ============================================================================
+//
+// Owns a thread that does nothing but recvmmsg on one socket. Filled
+// batches go to the placement thread through `full` and come back through
+// `spare` once it is done with them; with all of them queued the drain
+// waits (a stall) and the kernel buffer takes up the slack. It also keeps
+// the SO_RXQ_OVFL count, so drops by this host are told apart from loss
+// on the path.
+
+class DrainStage {
+private:
+    int sockfd;
+    int wake_fd;                         // eventfd that ends the drain's poll
+    std::vector<std::unique_ptr<RecvBatch>> pool;
+    SpscRing<RecvBatch*> full;
+    SpscRing<RecvBatch*> spare;
+    std::atomic<bool> stopping;
+    std::atomic<bool> ended;             // the drain thread is gone, by stop() or an error
+    std::thread drainer;
+    StageMetrics& stage;
+    Histogram& recv_ns;
+    Counter& kernel_drops;
+    uint32_t& drops_seen;                // SO_RXQ_OVFL count of the socket so far
+
+    // Block until the socket (or wake_fd) is readable
+    bool wait_readable() {
+        struct pollfd pfd[2];
+        pfd[0].fd = sockfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = wake_fd;
+        pfd[1].events = POLLIN;
+        while (!stopping) {
+            int n = poll(pfd, 2, PIPELINE_WAIT_MS);
+            if (n < 0 && errno != EINTR) return false;
+            if (n > 0 && (pfd[0].revents & POLLIN)) return true;
+        }
+        return false;
+    }
+
+    void drain() {
+        RecvBatch* batch = NULL;
+        while (!stopping) {
+            if (!batch && !spare.pop(batch)) {
+                stage.stalls.add();
+                auto start = std::chrono::steady_clock::now();
+                while (!stopping && !spare.pop_wait(batch, PIPELINE_WAIT_MS)) {}
+                stage.stall_ns.record(elapsed_ns(start));
+                if (!batch) break;
+            }
+
+            // Take what is queued without blocking, so the syscall is
+            // timed without the wait
+            auto start = std::chrono::steady_clock::now();
+            int count = batch->receive(sockfd, MSG_DONTWAIT);
+            if (count == 0) {
+                if (!wait_readable()) break;
+                continue;
+            }
+            recv_ns.record(elapsed_ns(start) / count);
+            uint32_t dropped = batch->kernel_drops(drops_seen);
+            if (dropped > 0) kernel_drops.add(dropped);
+            full.push(batch);            // never full: there are only pool.size() batches
+            stage.depth.record(full.size());
+            batch = NULL;
+        }
+        ended = true;
+        full.close();
+    }
+
+public:
+    // seen is only touched by the drain thread until stop()
+    DrainStage(StageMetrics& s, Histogram& recv, Counter& dropped, uint32_t& seen)
+        : sockfd(-1), wake_fd(-1), full(PIPELINE_BATCHES), spare(PIPELINE_BATCHES),
+          stopping(false), ended(false), stage(s), recv_ns(recv), kernel_drops(dropped),
+          drops_seen(seen) {}
+
+    ~DrainStage() {
+        stop();
+        if (wake_fd >= 0) close(wake_fd);
+    }
+
+    // Start draining fd; false if the thread cannot be woken up
+    bool start(int fd) {
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd < 0) return false;
+        sockfd = fd;
+        for (int i = 0; i < PIPELINE_BATCHES; i++) {
+            pool.push_back(std::unique_ptr<RecvBatch>(new RecvBatch(RECV_BATCH_SIZE, GRO_BUFFER_SIZE)));
+            spare.push(pool.back().get());
+        }
+        drainer = std::thread([this]() { drain(); });
+        return true;
+    }
+
+    // End the drain thread; datagrams it has not taken stay on the socket
+    void stop() {
+        if (!drainer.joinable()) return;
+        stopping = true;
+        spare.close();
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {}
+        drainer.join();
+    }
+
+    // Placement side: the next filled batch, waiting up to timeout_ms;
+    // NULL on timeout or once the drain has ended and everything it
+    // received is handled. Hand it back with release() once it is done.
+    RecvBatch* next(int timeout_ms) {
+        RecvBatch* batch = NULL;
+        full.pop_wait(batch, timeout_ms);
+        return batch;
+    }
+
+    void release(RecvBatch* batch) {
+        spare.push(batch);
+    }
+
+    // The drain thread stopped receiving on its own (poll failed)
+    bool ended_early() const { return ended && !stopping; }
+};
+
+// ============================================================================
+// DISK STAGE
+// ============================================================================
+//
+// The ChunkWriter of --io pipeline: the placement thread copies records
+// into CHUNK-sized buffers (a new one whenever the next record is not
+// adjacent) and a thread of its own writes each full buffer with pwrite.
+// Placement only waits when every chunk is queued for the disk. As with
+// the io_uring writer, a failed write is reported by flush().
+
+class DiskWriter : public ChunkWriter {
+private:
+    struct Chunk {
+        std::vector<uint8_t> data;
+        uint64_t offset;                 // file offset of data[0]
+        size_t len;                      // bytes filled
+    };
+
+    int fd;
+    std::vector<Chunk> chunks;
+    SpscRing<int> queued;                // to the disk thread
+    SpscRing<int> written;               // back from it
+    std::vector<int> idle;               // chunks placement holds, none being written
+    int current;                         // chunk being filled, -1 = none
+    std::atomic<bool> failed;
+    std::atomic<bool> closing;           // the disk thread ends once queued is empty
+    std::thread writer;
+    StageMetrics& stage;
+    Histogram& write_ns;
+
+    bool write_chunk(const Chunk& c) {
+        auto start = std::chrono::steady_clock::now();
+        size_t done = 0;
+        while (done < c.len) {
+            ssize_t n = pwrite(fd, c.data.data() + done, c.len - done, c.offset + done);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                fprintf(stderr, "Disk write failed: %s\n", n < 0 ? strerror(errno) : "no progress");
+                return false;
+            }
+            done += n;
+        }
+        write_ns.record(elapsed_ns(start));
+        return true;
+    }
+
+    void run() {
+        int i;
+        while (true) {
+            if (!queued.pop_wait(i, PIPELINE_WAIT_MS)) {
+                if (queued.size() == 0 && closing) break;
+                continue;
+            }
+            if (!failed && !write_chunk(chunks[i])) {
+                failed = true;
+            }
+            written.push(i);
+        }
+    }
+
+    // Take back the chunks the disk thread is done with, waiting (a
+    // stall) if that leaves none to fill
+    void collect() {
+        int i;
+        while (written.pop(i)) idle.push_back(i);
+        if (!idle.empty()) return;
+        stage.stalls.add();
+        auto start = std::chrono::steady_clock::now();
+        while (!written.pop_wait(i, PIPELINE_WAIT_MS)) {}
+        idle.push_back(i);
+        stage.stall_ns.record(elapsed_ns(start));
+    }
+
+public:
+    static const size_t CHUNK = 256 * 1024;
+    static const unsigned CHUNKS = 8;
+
+    DiskWriter(StageMetrics& s, Histogram& ns)
+        : fd(-1), queued(CHUNKS), written(CHUNKS), current(-1), failed(false),
+          closing(false), stage(s), write_ns(ns) {}
+
+    ~DiskWriter() {
+        if (!writer.joinable()) return;
+        closing = true;
+        queued.close();
+        writer.join();
+    }
+
+    void start(int file_fd) {
+        fd = file_fd;
+        chunks.resize(CHUNKS);
+        for (unsigned i = 0; i < CHUNKS; i++) {
+            chunks[i].data.resize(CHUNK);
+            idle.push_back(i);
+        }
+        writer = std::thread([this]() { run(); });
+    }
+
+    bool write(uint64_t offset, const uint8_t* data, size_t len) {
+        if (failed || len > CHUNK) return false;
+        if (current >= 0) {
+            Chunk& c = chunks[current];
+            if (offset != c.offset + c.len || c.len + len > CHUNK) {
+                kick();
+            }
+        }
+        if (current < 0) {
+            collect();
+            current = idle.back();
+            idle.pop_back();
+            chunks[current].offset = offset;
+            chunks[current].len = 0;
+        }
+        Chunk& c = chunks[current];
+        memcpy(c.data.data() + c.len, data, len);
+        c.len += len;
+        return true;
+    }
+
+    void kick() {
+        if (current < 0) return;
+        if (chunks[current].len > 0) {
+            queued.push(current);        // never full: there are only CHUNKS chunks
+            stage.depth.record(queued.size());
+        } else {
+            idle.push_back(current);
+        }
+        current = -1;
+    }
+
+    bool flush() {
+        kick();
+        int i;
+        while (idle.size() < CHUNKS) {
+            if (written.pop_wait(i, PIPELINE_WAIT_MS)) idle.push_back(i);
+        }
+        return !failed;
+    }
+};
+
+#endif // PIPELINE_H
@@ -5,6 +5,7 @@
 #include <cstring>
 #include <vector>
 #include <bits/stdc++.h>
+#include "crc32c.h"
 
 // ============================================================================
 // CONSTANTS
@@ -12,13 +13,41 @@
 
 const int DEFAULT_RECORD_SIZE = 512;
 const int DEFAULT_BLAST_SIZE = 1000;
-const int MAX_RECORDS_PER_PACKET = 16;
-const int TIMEOUT_FILE_HDR = 2;          // seconds
-const int TIMEOUT_BLAST_OVER = 2;        // seconds
-const int LINGER_TIME = 5;               // seconds
+const int DEFAULT_BLAST_WINDOW = 4;      // blasts in flight at once
+const int MAX_RECORDS_PER_PACKET = 255;   // records in one DATA packet
+const int MAX_SEGMENTS_PER_PACKET = 64;   // descriptors in one DATA packet
+const int LINGER_TIME = 5;               // seconds of silence before a finished transfer goes
+const int LINGER_QUIET_MS = 250;         // after DISCONNECT_ACK, for a resent DISCONNECT
+const int DISCONNECT_ATTEMPTS = 5;       // unanswered DISCONNECTs before the sender stops
 const int MAX_FILENAME_LEN = 256;
-const int MAX_MISSING_SEGMENTS = 1000;
+const int MAX_STREAMS = 16;              // parallel sockets per transfer
+const int SESSION_IDLE_TIMEOUT = 30;     // seconds before a silent session is dropped
+const int DEFAULT_MAX_SESSIONS = 256;    // concurrent transfers in --server mode
+const int DEFAULT_SESSION_MEMORY_MB = 64;  // per-session tracking/FEC budget
+const int FINALIZE_THREADS = 4;          // --server: files checked and flushed at once
 const int MAX_UDP_PAYLOAD = 65000;       // safe UDP payload size
+const int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;  // room for blasts in flight
+const int EARLY_DATA_MAX = SOCKET_BUFFER_SIZE / 4;  // a first blast sent before FILE_HDR_ACK
+const int MAX_DATA_PACKET_SIZE = MAX_UDP_PAYLOAD;
+const int IP_UDP_HEADER_SIZE = 28;       // IPv4 + UDP headers
+const int DEFAULT_PATH_MTU = 1500;       // when the route's MTU is unknown
+
+// ============================================================================
+// STRIPES
+// ============================================================================
+
+// Records [first, last] carried by stream `index` of `streams`. Stripes are
+// made of whole blasts, so blast and FEC group boundaries do not depend on
+// the stream count. A stripe is empty (first > last) when there are more
+// streams than blasts.
+inline void stripe_range(uint32_t total_records, uint32_t blast_size, uint32_t streams,
+                         uint32_t index, uint32_t& first, uint32_t& last) {
+    uint64_t blasts = (total_records + (uint64_t)blast_size - 1) / blast_size;
+    uint64_t first_blast = blasts * index / streams;
+    uint64_t end_blast = blasts * (index + 1) / streams;
+    first = first_blast * blast_size + 1;
+    last = (uint32_t)std::min<uint64_t>(end_blast * blast_size, total_records);
+}
 
 // ============================================================================
 // PACKET TYPES
@@ -30,7 +59,19 @@ enum PacketType : uint8_t {
     DATA = 3,
     IS_BLAST_OVER = 4,
     REC_MISS = 5,
-    DISCONNECT = 6
+    DISCONNECT = 6,
+    FEC_PARITY = 7,
+    DATA_COMPRESSED = 8,
+    RESUME_QUERY = 9,
+    RESUME_MAP = 10,
+    SIG_QUERY = 11,
+    SIG_MAP = 12,
+    DELTA_COPY = 13,
+    DELTA_ACK = 14,
+    NACK = 15,
+    MANIFEST = 16,
+    MANIFEST_ACK = 17,
+    DISCONNECT_ACK = 18
 };
 
 // ============================================================================
@@ -54,9 +95,25 @@ struct FileHeaderPacket {
     uint64_t file_size;                 // total file size in bytes
     uint16_t record_size;               // 256, 512, or 1024
     uint32_t blast_size;                // M records per blast
+    uint16_t fec_group;                 // DATA packets per parity packet, 0 = no FEC
+    uint8_t num_streams;                // stripes, one socket each on port + i
+    uint32_t session_id;                // random per transfer, shared by its streams
+    uint8_t stream_index;               // 0 opens the session, i > 0 joins stream i
+    uint16_t records_per_packet;        // records per first-pass DATA packet
+    uint64_t file_mtime;                // sender's mtime (ns), 0 = none; with name and
+                                        // size it tells a partial copy is of this file
+    uint32_t timestamp;                 // sender clock (us), echoed in FILE_HDR_ACK
+    uint8_t codec;                      // compression offered, CODEC_NONE = raw only
+    uint8_t codec_level;
+    uint8_t delta;                      // 1 = send signatures of an older copy if there is one
+    uint8_t nack;                       // 1 = report gaps mid-blast with NACK
+    uint32_t tree_entries;              // > 0: filename is a directory of this many entries
     char filename[MAX_FILENAME_LEN];    // output filename
     
-    FileHeaderPacket() : type(FILE_HDR), file_size(0), record_size(0), blast_size(0) {
+    FileHeaderPacket() : type(FILE_HDR), file_size(0), record_size(0), blast_size(0),
+                         fec_group(0), num_streams(1), session_id(0), stream_index(0),
+                         records_per_packet(0), file_mtime(0), timestamp(0),
+                         codec(0), codec_level(0), delta(0), nack(0), tree_entries(0) {
         memset(filename, 0, MAX_FILENAME_LEN);
     }
     
@@ -69,6 +126,24 @@ struct FileHeaderPacket {
         offset += sizeof(record_size);
         memcpy(buffer + offset, &blast_size, sizeof(blast_size));
         offset += sizeof(blast_size);
+        memcpy(buffer + offset, &fec_group, sizeof(fec_group));
+        offset += sizeof(fec_group);
+        buffer[offset++] = num_streams;
+        memcpy(buffer + offset, &session_id, sizeof(session_id));
+        offset += sizeof(session_id);
+        buffer[offset++] = stream_index;
+        memcpy(buffer + offset, &records_per_packet, sizeof(records_per_packet));
+        offset += sizeof(records_per_packet);
+        memcpy(buffer + offset, &file_mtime, sizeof(file_mtime));
+        offset += sizeof(file_mtime);
+        memcpy(buffer + offset, &timestamp, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        buffer[offset++] = codec;
+        buffer[offset++] = codec_level;
+        buffer[offset++] = delta;
+        buffer[offset++] = nack;
+        memcpy(buffer + offset, &tree_entries, sizeof(tree_entries));
+        offset += sizeof(tree_entries);
         memcpy(buffer + offset, filename, MAX_FILENAME_LEN);
         offset += MAX_FILENAME_LEN;
         return offset;
@@ -83,6 +158,24 @@ struct FileHeaderPacket {
         offset += sizeof(record_size);
         memcpy(&blast_size, buffer + offset, sizeof(blast_size));
         offset += sizeof(blast_size);
+        memcpy(&fec_group, buffer + offset, sizeof(fec_group));
+        offset += sizeof(fec_group);
+        num_streams = buffer[offset++];
+        memcpy(&session_id, buffer + offset, sizeof(session_id));
+        offset += sizeof(session_id);
+        stream_index = buffer[offset++];
+        memcpy(&records_per_packet, buffer + offset, sizeof(records_per_packet));
+        offset += sizeof(records_per_packet);
+        memcpy(&file_mtime, buffer + offset, sizeof(file_mtime));
+        offset += sizeof(file_mtime);
+        memcpy(&timestamp, buffer + offset, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        codec = buffer[offset++];
+        codec_level = buffer[offset++];
+        delta = buffer[offset++];
+        nack = buffer[offset++];
+        memcpy(&tree_entries, buffer + offset, sizeof(tree_entries));
+        offset += sizeof(tree_entries);
         memcpy(filename, buffer + offset, MAX_FILENAME_LEN);
         offset += MAX_FILENAME_LEN;
         return offset;
@@ -94,29 +187,464 @@ struct FileHeaderPacket {
 // ============================================================================
 
 struct FileHeaderAckPacket {
-    uint8_t type;  // FILE_HDR_ACK
+    uint8_t type;             // FILE_HDR_ACK
+    uint32_t echo_timestamp;  // FILE_HDR timestamp this answers
+    uint8_t codec;            // compression accepted: the offered one or CODEC_NONE
+    uint32_t records_held;    // records of this file the receiver kept from an earlier try
+    uint32_t basis_blocks;    // delta: record-sized blocks of its older copy, 0 = none
     
-    FileHeaderAckPacket() : type(FILE_HDR_ACK) {}
+    FileHeaderAckPacket() : type(FILE_HDR_ACK), echo_timestamp(0), codec(0), records_held(0),
+                            basis_blocks(0) {}
     
     size_t serialize(uint8_t* buffer) const {
         buffer[0] = type;
-        return 1;
+        memcpy(buffer + 1, &echo_timestamp, sizeof(echo_timestamp));
+        buffer[5] = codec;
+        memcpy(buffer + 6, &records_held, sizeof(records_held));
+        memcpy(buffer + 10, &basis_blocks, sizeof(basis_blocks));
+        return 14;
     }
     
-    size_t deserialize(const uint8_t* buffer) {
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        if (buffer_size < 14) return 0;
         type = buffer[0];
-        return 1;
+        memcpy(&echo_timestamp, buffer + 1, sizeof(echo_timestamp));
+        codec = buffer[5];
+        memcpy(&records_held, buffer + 6, sizeof(records_held));
+        memcpy(&basis_blocks, buffer + 10, sizeof(basis_blocks));
+        return 14;
+    }
+};
+
+// ============================================================================
+// RESUME QUERY PACKET
+// ============================================================================
+
+// Sent after a FILE_HDR_ACK that reports records held: which records from
+// start_record on are still missing? The receiver answers with a RESUME_MAP,
+// laid out like REC_MISS, covering [start_record, last record] in as many
+// parts as it takes; if one is lost, the sender asks again from the first
+// record the parts it got do not cover.
+struct ResumeQueryPacket {
+    uint8_t type;            // RESUME_QUERY
+    uint32_t start_record;
+    uint32_t timestamp;      // sender clock (us), echoed in RESUME_MAP
+    
+    ResumeQueryPacket() : type(RESUME_QUERY), start_record(0), timestamp(0) {}
+    
+    size_t serialize(uint8_t* buffer) const {
+        size_t offset = 0;
+        buffer[offset++] = type;
+        memcpy(buffer + offset, &start_record, sizeof(start_record));
+        offset += sizeof(start_record);
+        memcpy(buffer + offset, &timestamp, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        return offset;
+    }
+    
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        size_t offset = 0;
+        if (buffer_size < 1 + 2 * sizeof(uint32_t)) return 0;
+        type = buffer[offset++];
+        memcpy(&start_record, buffer + offset, sizeof(start_record));
+        offset += sizeof(start_record);
+        memcpy(&timestamp, buffer + offset, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        return offset;
     }
 };
 
+// ============================================================================
+// DELTA PACKETS
+// ============================================================================
+//
+// --delta: the receiver has an older copy of the file. The sender pulls
+// the signatures of its record-sized blocks (SIG_QUERY -> SIG_MAP), looks
+// for those blocks anywhere in the new file and tells the receiver where
+// to copy them (DELTA_COPY -> DELTA_ACK). The records the copies fill are
+// then held like those of a resumed transfer, so RESUME_QUERY finds what
+// is left to send. Both exchanges keep DELTA_WINDOW requests in flight
+// and every request gets a reply of its own.
+
+const uint32_t SIG_MAP_BLOCKS = 1024;        // signatures per SIG_MAP
+const uint32_t DELTA_COPY_ENTRIES = 1024;    // copies per DELTA_COPY
+const int DELTA_WINDOW = 16;                 // requests in flight
+
+struct BlockSignature {
+    uint32_t weak;           // rolling checksum of the block
+    uint64_t strong;         // 64-bit hash, checked when the weak one matches
+    
+    BlockSignature() : weak(0), strong(0) {}
+};
+
+// Copy `count` blocks of the older copy, starting at block `block` (from
+// 0), to byte `offset` of the new file
+struct DeltaCopy {
+    uint64_t offset;
+    uint32_t block;
+    uint32_t count;
+    
+    DeltaCopy() : offset(0), block(0), count(0) {}
+    DeltaCopy(uint64_t o, uint32_t b, uint32_t c) : offset(o), block(b), count(c) {}
+};
+
+// Signatures of blocks [first_block, first_block + count)
+struct SigQueryPacket {
+    uint8_t type;            // SIG_QUERY
+    uint32_t first_block;
+    uint16_t count;
+    uint32_t timestamp;      // sender clock (us), echoed in SIG_MAP
+    
+    SigQueryPacket() : type(SIG_QUERY), first_block(0), count(0), timestamp(0) {}
+    
+    size_t serialize(uint8_t* buffer) const {
+        size_t offset = 0;
+        buffer[offset++] = type;
+        memcpy(buffer + offset, &first_block, sizeof(first_block));
+        offset += sizeof(first_block);
+        memcpy(buffer + offset, &count, sizeof(count));
+        offset += sizeof(count);
+        memcpy(buffer + offset, &timestamp, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        return offset;
+    }
+    
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        size_t offset = 0;
+        if (buffer_size < 1 + 2 * sizeof(uint32_t) + sizeof(uint16_t)) return 0;
+        type = buffer[offset++];
+        memcpy(&first_block, buffer + offset, sizeof(first_block));
+        offset += sizeof(first_block);
+        memcpy(&count, buffer + offset, sizeof(count));
+        offset += sizeof(count);
+        memcpy(&timestamp, buffer + offset, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        return offset;
+    }
+};
+
+// The answer to a SIG_QUERY; no signatures means they are still being
+// computed, ask again later
+struct SigMapPacket {
+    uint8_t type;                           // SIG_MAP
+    uint32_t first_block;
+    uint32_t echo_timestamp;                // SIG_QUERY timestamp this answers
+    std::vector<BlockSignature> sigs;
+    
+    SigMapPacket() : type(SIG_MAP), first_block(0), echo_timestamp(0) {}
+    
+    size_t serialize(uint8_t* buffer, size_t buffer_size) const {
+        size_t offset = 0;
+        uint16_t count = (uint16_t)sigs.size();
+        if (1 + 2 * sizeof(uint32_t) + sizeof(uint16_t) + count * 12 > buffer_size) return 0;
+        buffer[offset++] = type;
+        memcpy(buffer + offset, &first_block, sizeof(first_block));
+        offset += sizeof(first_block);
+        memcpy(buffer + offset, &echo_timestamp, sizeof(echo_timestamp));
+        offset += sizeof(echo_timestamp);
+        memcpy(buffer + offset, &count, sizeof(count));
+        offset += sizeof(count);
+        for (const BlockSignature& sig : sigs) {
+            memcpy(buffer + offset, &sig.weak, sizeof(sig.weak));
+            offset += sizeof(sig.weak);
+            memcpy(buffer + offset, &sig.strong, sizeof(sig.strong));
+            offset += sizeof(sig.strong);
+        }
+        return offset;
+    }
+    
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        size_t offset = 0;
+        uint16_t count;
+        if (buffer_size < 1 + 2 * sizeof(uint32_t) + sizeof(uint16_t)) return 0;
+        type = buffer[offset++];
+        memcpy(&first_block, buffer + offset, sizeof(first_block));
+        offset += sizeof(first_block);
+        memcpy(&echo_timestamp, buffer + offset, sizeof(echo_timestamp));
+        offset += sizeof(echo_timestamp);
+        memcpy(&count, buffer + offset, sizeof(count));
+        offset += sizeof(count);
+        if (offset + (size_t)count * 12 > buffer_size) return 0;
+        sigs.resize(count);
+        for (BlockSignature& sig : sigs) {
+            memcpy(&sig.weak, buffer + offset, sizeof(sig.weak));
+            offset += sizeof(sig.weak);
+            memcpy(&sig.strong, buffer + offset, sizeof(sig.strong));
+            offset += sizeof(sig.strong);
+        }
+        return offset;
+    }
+};
+
+// Copies [first_entry, first_entry + copies.size()) of total_entries;
+// DELTA_COPY_ENTRIES per packet, so first_entry names the packet
+struct DeltaCopyPacket {
+    uint8_t type;                           // DELTA_COPY
+    uint32_t first_entry;
+    uint32_t total_entries;
+    uint32_t timestamp;                     // sender clock (us), echoed in DELTA_ACK
+    std::vector<DeltaCopy> copies;
+    
+    DeltaCopyPacket() : type(DELTA_COPY), first_entry(0), total_entries(0), timestamp(0) {}
+    
+    size_t serialize(uint8_t* buffer, size_t buffer_size) const {
+        size_t offset = 0;
+        uint16_t count = (uint16_t)copies.size();
+        if (1 + 3 * sizeof(uint32_t) + sizeof(uint16_t) + count * 16 > buffer_size) return 0;
+        buffer[offset++] = type;
+        memcpy(buffer + offset, &first_entry, sizeof(first_entry));
+        offset += sizeof(first_entry);
+        memcpy(buffer + offset, &total_entries, sizeof(total_entries));
+        offset += sizeof(total_entries);
+        memcpy(buffer + offset, &timestamp, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        memcpy(buffer + offset, &count, sizeof(count));
+        offset += sizeof(count);
+        for (const DeltaCopy& copy : copies) {
+            memcpy(buffer + offset, &copy.offset, sizeof(copy.offset));
+            offset += sizeof(copy.offset);
+            memcpy(buffer + offset, &copy.block, sizeof(copy.block));
+            offset += sizeof(copy.block);
+            memcpy(buffer + offset, &copy.count, sizeof(copy.count));
+            offset += sizeof(copy.count);
+        }
+        return offset;
+    }
+    
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        size_t offset = 0;
+        uint16_t count;
+        if (buffer_size < 1 + 3 * sizeof(uint32_t) + sizeof(uint16_t)) return 0;
+        type = buffer[offset++];
+        memcpy(&first_entry, buffer + offset, sizeof(first_entry));
+        offset += sizeof(first_entry);
+        memcpy(&total_entries, buffer + offset, sizeof(total_entries));
+        offset += sizeof(total_entries);
+        memcpy(&timestamp, buffer + offset, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        memcpy(&count, buffer + offset, sizeof(count));
+        offset += sizeof(count);
+        if (offset + (size_t)count * 16 > buffer_size) return 0;
+        copies.resize(count);
+        for (DeltaCopy& copy : copies) {
+            memcpy(&copy.offset, buffer + offset, sizeof(copy.offset));
+            offset += sizeof(copy.offset);
+            memcpy(&copy.block, buffer + offset, sizeof(copy.block));
+            offset += sizeof(copy.block);
+            memcpy(&copy.count, buffer + offset, sizeof(copy.count));
+            offset += sizeof(copy.count);
+        }
+        return offset;
+    }
+};
+
+// The copies of the DELTA_COPY starting at first_entry are done
+struct DeltaAckPacket {
+    uint8_t type;            // DELTA_ACK
+    uint32_t first_entry;
+    uint32_t echo_timestamp;
+    
+    DeltaAckPacket() : type(DELTA_ACK), first_entry(0), echo_timestamp(0) {}
+    
+    size_t serialize(uint8_t* buffer) const {
+        size_t offset = 0;
+        buffer[offset++] = type;
+        memcpy(buffer + offset, &first_entry, sizeof(first_entry));
+        offset += sizeof(first_entry);
+        memcpy(buffer + offset, &echo_timestamp, sizeof(echo_timestamp));
+        offset += sizeof(echo_timestamp);
+        return offset;
+    }
+    
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        size_t offset = 0;
+        if (buffer_size < 1 + 2 * sizeof(uint32_t)) return 0;
+        type = buffer[offset++];
+        memcpy(&first_entry, buffer + offset, sizeof(first_entry));
+        offset += sizeof(first_entry);
+        memcpy(&echo_timestamp, buffer + offset, sizeof(echo_timestamp));
+        offset += sizeof(echo_timestamp);
+        return offset;
+    }
+};
+
+// ============================================================================
+// TREE MANIFEST
+// ============================================================================
+//
+// A directory is sent as one transfer whose "file" is every regular file
+// under it laid end to end (see file_tree.h). Before any DATA the sender
+// lists the tree in MANIFEST packets, each naming a run of entries with
+// their offsets into that stream, and the receiver creates the entries
+// and acknowledges each packet with a MANIFEST_ACK. Like DELTA_COPY, the
+// packets go out DELTA_WINDOW at a time; the entries of a packet are as
+// many as fit in MANIFEST_MAX_SIZE, so first_entry names the packet.
+
+const size_t MANIFEST_MAX_SIZE = 8192;
+const size_t MANIFEST_HEADER_SIZE = 1 + 3 * sizeof(uint32_t) + sizeof(uint16_t);
+const size_t MANIFEST_ENTRY_SIZE = 2 * sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t);
+const size_t MAX_TREE_PATH = 4096;           // bytes of one relative path
+
+// A directory (S_ISDIR(mode), no data) or a regular file at [offset,
+// offset + size) of the stream; path is relative to the tree's root
+struct TreeEntry {
+    std::string path;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t mode;                           // st_mode: type and permission bits
+    
+    TreeEntry() : offset(0), size(0), mode(0) {}
+    
+    size_t wire_size() const { return MANIFEST_ENTRY_SIZE + path.size(); }
+};
+
+// Entries [first_entry, first_entry + entries.size()) of total_entries
+struct ManifestPacket {
+    uint8_t type;                           // MANIFEST
+    uint32_t first_entry;
+    uint32_t total_entries;
+    uint32_t timestamp;                     // sender clock (us), echoed in MANIFEST_ACK
+    std::vector<TreeEntry> entries;
+    
+    ManifestPacket() : type(MANIFEST), first_entry(0), total_entries(0), timestamp(0) {}
+    
+    size_t serialize(uint8_t* buffer, size_t buffer_size) const {
+        size_t offset = 0;
+        uint16_t count = (uint16_t)entries.size();
+        size_t needed = MANIFEST_HEADER_SIZE;
+        for (const TreeEntry& e : entries) {
+            needed += e.wire_size();
+        }
+        if (needed > buffer_size) return 0;
+        buffer[offset++] = type;
+        memcpy(buffer + offset, &first_entry, sizeof(first_entry));
+        offset += sizeof(first_entry);
+        memcpy(buffer + offset, &total_entries, sizeof(total_entries));
+        offset += sizeof(total_entries);
+        memcpy(buffer + offset, &timestamp, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        memcpy(buffer + offset, &count, sizeof(count));
+        offset += sizeof(count);
+        for (const TreeEntry& e : entries) {
+            uint16_t len = (uint16_t)e.path.size();
+            memcpy(buffer + offset, &e.offset, sizeof(e.offset));
+            offset += sizeof(e.offset);
+            memcpy(buffer + offset, &e.size, sizeof(e.size));
+            offset += sizeof(e.size);
+            memcpy(buffer + offset, &e.mode, sizeof(e.mode));
+            offset += sizeof(e.mode);
+            memcpy(buffer + offset, &len, sizeof(len));
+            offset += sizeof(len);
+            memcpy(buffer + offset, e.path.data(), len);
+            offset += len;
+        }
+        return offset;
+    }
+    
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        size_t offset = 0;
+        uint16_t count;
+        if (buffer_size < MANIFEST_HEADER_SIZE) return 0;
+        type = buffer[offset++];
+        memcpy(&first_entry, buffer + offset, sizeof(first_entry));
+        offset += sizeof(first_entry);
+        memcpy(&total_entries, buffer + offset, sizeof(total_entries));
+        offset += sizeof(total_entries);
+        memcpy(&timestamp, buffer + offset, sizeof(timestamp));
+        offset += sizeof(timestamp);
+        memcpy(&count, buffer + offset, sizeof(count));
+        offset += sizeof(count);
+        entries.resize(count);
+        for (TreeEntry& e : entries) {
+            uint16_t len;
+            if (offset + MANIFEST_ENTRY_SIZE > buffer_size) return 0;
+            memcpy(&e.offset, buffer + offset, sizeof(e.offset));
+            offset += sizeof(e.offset);
+            memcpy(&e.size, buffer + offset, sizeof(e.size));
+            offset += sizeof(e.size);
+            memcpy(&e.mode, buffer + offset, sizeof(e.mode));
+            offset += sizeof(e.mode);
+            memcpy(&len, buffer + offset, sizeof(len));
+            offset += sizeof(len);
+            if (offset + len > buffer_size) return 0;
+            e.path.assign((const char*)buffer + offset, len);
+            offset += len;
+        }
+        return offset;
+    }
+};
+
+// The entries of the MANIFEST starting at first_entry exist
+struct ManifestAckPacket {
+    uint8_t type;            // MANIFEST_ACK
+    uint32_t first_entry;
+    uint32_t echo_timestamp;
+    
+    ManifestAckPacket() : type(MANIFEST_ACK), first_entry(0), echo_timestamp(0) {}
+    
+    size_t serialize(uint8_t* buffer) const {
+        size_t offset = 0;
+        buffer[offset++] = type;
+        memcpy(buffer + offset, &first_entry, sizeof(first_entry));
+        offset += sizeof(first_entry);
+        memcpy(buffer + offset, &echo_timestamp, sizeof(echo_timestamp));
+        offset += sizeof(echo_timestamp);
+        return offset;
+    }
+    
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        size_t offset = 0;
+        if (buffer_size < 1 + 2 * sizeof(uint32_t)) return 0;
+        type = buffer[offset++];
+        memcpy(&first_entry, buffer + offset, sizeof(first_entry));
+        offset += sizeof(first_entry);
+        memcpy(&echo_timestamp, buffer + offset, sizeof(echo_timestamp));
+        offset += sizeof(echo_timestamp);
+        return offset;
+    }
+};
+
+// Where each MANIFEST packet starts: as many entries as fit in max_size
+inline void split_manifest(const std::vector<TreeEntry>& entries, size_t max_size,
+                           std::vector<uint32_t>& starts) {
+    starts.clear();
+    size_t used = max_size;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (used + entries[i].wire_size() > max_size) {
+            starts.push_back((uint32_t)i);
+            used = MANIFEST_HEADER_SIZE;
+        }
+        used += entries[i].wire_size();
+    }
+}
+
 // ============================================================================
 // DATA PACKET
 // ============================================================================
 
+// DATA and FEC_PARITY packets carry a CRC32C of everything after it right
+// behind the type byte, so a payload damaged on the way (and missed by the
+// 16-bit UDP checksum) is dropped and re-requested like a lost packet.
+const size_t PACKET_CRC_OFFSET = 1;
+const size_t PACKET_CRC_END = PACKET_CRC_OFFSET + sizeof(uint32_t);
+
+// Fill in the CRC of a packet of len bytes once its payload is in place
+inline void seal_packet(uint8_t* buffer, size_t len) {
+    uint32_t crc = crc32c(buffer + PACKET_CRC_END, len - PACKET_CRC_END);
+    memcpy(buffer + PACKET_CRC_OFFSET, &crc, sizeof(crc));
+}
+
+inline bool packet_intact(const uint8_t* buffer, size_t len) {
+    if (len < PACKET_CRC_END) return false;
+    uint32_t crc;
+    memcpy(&crc, buffer + PACKET_CRC_OFFSET, sizeof(crc));
+    return crc == crc32c(buffer + PACKET_CRC_END, len - PACKET_CRC_END);
+}
+
 struct DataPacket {
     uint8_t type;                           // DATA
-    uint8_t num_segments;                   // number of segments (1-16)
-    Segment segments[MAX_RECORDS_PER_PACKET]; // segment descriptors
+    uint8_t num_segments;                   // number of segments (1-64)
+    Segment segments[MAX_SEGMENTS_PER_PACKET]; // segment descriptors
     std::vector<uint8_t> data;              // actual record data
     
     DataPacket() : type(DATA), num_segments(0) {}
@@ -124,10 +652,9 @@ struct DataPacket {
     size_t serialize(uint8_t* buffer, size_t buffer_size) const {
         size_t offset = 0;
         
-        if (offset + 1 > buffer_size) return 0;
+        if (offset + PACKET_CRC_END + 1 > buffer_size) return 0;
         buffer[offset++] = type;
-        
-        if (offset + 1 > buffer_size) return 0;
+        offset += sizeof(uint32_t);         // CRC, filled in last
         buffer[offset++] = num_segments;
         
         // Serialize segments
@@ -144,17 +671,19 @@ struct DataPacket {
         memcpy(buffer + offset, data.data(), data.size());
         offset += data.size();
         
+        seal_packet(buffer, offset);
         return offset;
     }
     
     size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
         size_t offset = 0;
         
-        if (offset + 1 > buffer_size) return 0;
+        if (offset + PACKET_CRC_END + 1 > buffer_size) return 0;
+        if (!packet_intact(buffer, buffer_size)) return 0;
         type = buffer[offset++];
-        
-        if (offset + 1 > buffer_size) return 0;
+        offset += sizeof(uint32_t);
         num_segments = buffer[offset++];
+        if (num_segments > MAX_SEGMENTS_PER_PACKET) return 0;
         
         // Deserialize segments
         for (int i = 0; i < num_segments; i++) {
@@ -176,6 +705,198 @@ struct DataPacket {
     }
 };
 
+// ============================================================================
+// FEC PARITY PACKET
+// ============================================================================
+
+struct FecParityPacket {
+    uint8_t type;                           // FEC_PARITY
+    uint32_t group_start;                   // first record of the parity group
+    uint32_t group_end;                     // last record of the parity group
+    std::vector<uint8_t> parity;            // XOR of the group's DATA payloads
+    
+    FecParityPacket() : type(FEC_PARITY), group_start(0), group_end(0) {}
+    
+    size_t serialize(uint8_t* buffer, size_t buffer_size) const {
+        size_t offset = 0;
+        
+        if (offset + PACKET_CRC_END + sizeof(uint32_t) * 2 + parity.size() > buffer_size) return 0;
+        buffer[offset++] = type;
+        offset += sizeof(uint32_t);         // CRC
+        memcpy(buffer + offset, &group_start, sizeof(group_start));
+        offset += sizeof(group_start);
+        memcpy(buffer + offset, &group_end, sizeof(group_end));
+        offset += sizeof(group_end);
+        memcpy(buffer + offset, parity.data(), parity.size());
+        offset += parity.size();
+        
+        seal_packet(buffer, offset);
+        return offset;
+    }
+    
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        size_t offset = 0;
+        
+        if (offset + PACKET_CRC_END + sizeof(uint32_t) * 2 > buffer_size) return 0;
+        if (!packet_intact(buffer, buffer_size)) return 0;
+        type = buffer[offset++];
+        offset += sizeof(uint32_t);
+        memcpy(&group_start, buffer + offset, sizeof(group_start));
+        offset += sizeof(group_start);
+        memcpy(&group_end, buffer + offset, sizeof(group_end));
+        offset += sizeof(group_end);
+        
+        parity.assign(buffer + offset, buffer + buffer_size);
+        offset = buffer_size;
+        
+        return offset;
+    }
+};
+
+// ============================================================================
+// IN-PLACE DATA CODEC
+// ============================================================================
+//
+// DataPacket and FecParityPacket own their payload, which costs a heap
+// allocation and an extra copy per packet. The data path uses these
+// instead: the sender writes the header straight into its send slot and
+// reads the records from the file in behind it, and the receiver parses
+// views that point into its receive buffer. The CRC is left blank by the
+// header writers; seal_packet() fills it in once the payload is there,
+// and views are only parsed from packets packet_intact() accepted.
+
+// DATA header bytes for n segment descriptors
+inline size_t data_header_size(int num_segments) {
+    return PACKET_CRC_END + 1 + (size_t)num_segments * 2 * sizeof(uint32_t);
+}
+
+// Write a DATA header; the records go at buffer + the returned size
+inline size_t write_data_header(uint8_t* buffer, const Segment* segments, int num_segments) {
+    size_t offset = 0;
+    buffer[offset++] = DATA;
+    offset += sizeof(uint32_t);             // CRC
+    buffer[offset++] = (uint8_t)num_segments;
+    for (int i = 0; i < num_segments; i++) {
+        memcpy(buffer + offset, &segments[i].start_record, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        memcpy(buffer + offset, &segments[i].end_record, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+    }
+    return offset;
+}
+
+// Records of a first-pass DATA packet (one segment) for the largest
+// datagram the path takes; at least one, even if that means fragmenting
+inline uint32_t records_per_packet(size_t max_datagram, uint16_t record_size) {
+    size_t fit = max_datagram > data_header_size(1) ?
+                 (max_datagram - data_header_size(1)) / record_size : 0;
+    return (uint32_t)std::max<size_t>(1, std::min<size_t>(fit, MAX_RECORDS_PER_PACKET));
+}
+
+// Write a FEC_PARITY header; the parity goes at buffer + the returned size
+inline size_t write_parity_header(uint8_t* buffer, uint32_t group_start, uint32_t group_end) {
+    size_t offset = 0;
+    buffer[offset++] = FEC_PARITY;
+    offset += sizeof(uint32_t);             // CRC
+    memcpy(buffer + offset, &group_start, sizeof(group_start));
+    offset += sizeof(group_start);
+    memcpy(buffer + offset, &group_end, sizeof(group_end));
+    offset += sizeof(group_end);
+    return offset;
+}
+
+// A received DATA packet, valid as long as the buffer it was parsed from
+struct DataPacketView {
+    uint8_t num_segments;
+    const uint8_t* descriptors;             // num_segments * 8 bytes
+    const uint8_t* data;                    // records, back to back
+    size_t data_len;
+    
+    DataPacketView() : num_segments(0), descriptors(NULL), data(NULL), data_len(0) {}
+    
+    bool parse(const uint8_t* buffer, size_t buffer_size) {
+        if (buffer_size < data_header_size(0) || buffer[0] != DATA) return false;
+        num_segments = buffer[PACKET_CRC_END];
+        size_t header = data_header_size(num_segments);
+        if (num_segments > MAX_SEGMENTS_PER_PACKET || header > buffer_size) return false;
+        descriptors = buffer + PACKET_CRC_END + 1;
+        data = buffer + header;
+        data_len = buffer_size - header;
+        return true;
+    }
+    
+    Segment segment(int i) const {
+        Segment seg;
+        memcpy(&seg.start_record, descriptors + i * 8, sizeof(uint32_t));
+        memcpy(&seg.end_record, descriptors + i * 8 + 4, sizeof(uint32_t));
+        return seg;
+    }
+};
+
+// DATA_COMPRESSED: a run of consecutive records compressed as one block,
+// [type][crc][codec][first record][record count][block]. It carries more
+// records than a DATA packet when they compress; it is only used for the
+// first pass of a blast, retransmissions go out as plain DATA.
+const size_t COMPRESSED_HEADER_SIZE = PACKET_CRC_END + 1 + sizeof(uint32_t) + sizeof(uint16_t);
+
+// Write a DATA_COMPRESSED header; the block goes at buffer + the returned size
+inline size_t write_compressed_header(uint8_t* buffer, uint8_t codec, uint32_t first_record,
+                                      uint16_t num_records) {
+    size_t offset = 0;
+    buffer[offset++] = DATA_COMPRESSED;
+    offset += sizeof(uint32_t);             // CRC
+    buffer[offset++] = codec;
+    memcpy(buffer + offset, &first_record, sizeof(first_record));
+    offset += sizeof(first_record);
+    memcpy(buffer + offset, &num_records, sizeof(num_records));
+    offset += sizeof(num_records);
+    return offset;
+}
+
+// A received DATA_COMPRESSED packet, valid as long as its buffer
+struct CompressedDataView {
+    uint8_t codec;
+    uint32_t first_record;
+    uint16_t num_records;
+    const uint8_t* block;
+    size_t block_len;
+    
+    CompressedDataView() : codec(0), first_record(0), num_records(0), block(NULL), block_len(0) {}
+    
+    bool parse(const uint8_t* buffer, size_t buffer_size) {
+        if (buffer_size < COMPRESSED_HEADER_SIZE || buffer[0] != DATA_COMPRESSED) return false;
+        size_t offset = PACKET_CRC_END;
+        codec = buffer[offset++];
+        memcpy(&first_record, buffer + offset, sizeof(first_record));
+        offset += sizeof(first_record);
+        memcpy(&num_records, buffer + offset, sizeof(num_records));
+        offset += sizeof(num_records);
+        block = buffer + offset;
+        block_len = buffer_size - offset;
+        return num_records > 0;
+    }
+};
+
+// A received FEC_PARITY packet, valid as long as its buffer
+struct FecParityView {
+    uint32_t group_start;
+    uint32_t group_end;
+    const uint8_t* parity;
+    size_t parity_len;
+    
+    FecParityView() : group_start(0), group_end(0), parity(NULL), parity_len(0) {}
+    
+    bool parse(const uint8_t* buffer, size_t buffer_size) {
+        const size_t header = PACKET_CRC_END + 2 * sizeof(uint32_t);
+        if (buffer_size < header || buffer[0] != FEC_PARITY) return false;
+        memcpy(&group_start, buffer + PACKET_CRC_END, sizeof(uint32_t));
+        memcpy(&group_end, buffer + PACKET_CRC_END + 4, sizeof(uint32_t));
+        parity = buffer + header;
+        parity_len = buffer_size - header;
+        return true;
+    }
+};
+
 // ============================================================================
 // IS_BLAST_OVER PACKET
 // ============================================================================
@@ -184,9 +905,11 @@ struct BlastOverPacket {
     uint8_t type;            // IS_BLAST_OVER
     uint32_t start_record;   // M_st
     uint32_t end_record;     // M_fin
+    uint32_t timestamp;      // sender clock (us), echoed in REC_MISS
     
-    BlastOverPacket() : type(IS_BLAST_OVER), start_record(0), end_record(0) {}
-    BlastOverPacket(uint32_t s, uint32_t e) : type(IS_BLAST_OVER), start_record(s), end_record(e) {}
+    BlastOverPacket() : type(IS_BLAST_OVER), start_record(0), end_record(0), timestamp(0) {}
+    BlastOverPacket(uint32_t s, uint32_t e, uint32_t ts)
+        : type(IS_BLAST_OVER), start_record(s), end_record(e), timestamp(ts) {}
     
     size_t serialize(uint8_t* buffer) const {
         size_t offset = 0;
@@ -195,6 +918,8 @@ struct BlastOverPacket {
         offset += sizeof(start_record);
         memcpy(buffer + offset, &end_record, sizeof(end_record));
         offset += sizeof(end_record);
+        memcpy(buffer + offset, &timestamp, sizeof(timestamp));
+        offset += sizeof(timestamp);
         return offset;
     }
     
@@ -205,6 +930,8 @@ struct BlastOverPacket {
         offset += sizeof(start_record);
         memcpy(&end_record, buffer + offset, sizeof(end_record));
         offset += sizeof(end_record);
+        memcpy(&timestamp, buffer + offset, sizeof(timestamp));
+        offset += sizeof(timestamp);
         return offset;
     }
 };
@@ -212,76 +939,312 @@ struct BlastOverPacket {
 // ============================================================================
 // REC_MISS PACKET
 // ============================================================================
+//
+// A REC_MISS lists every missing record of the blast it answers (a
+// RESUME_MAP, every one from the queried record to the end of the file),
+// over as many datagrams as that takes. Each part covers records
+// [part_start, part_end], the parts in order and back to back, and holds
+// them in whichever encoding is smaller:
+//
+//   NACK_RANGES  varint run count, then per run the varint gap from the
+//                end of the previous run (or part_start) and its length - 1
+//   NACK_BITMAP  one bit per record of the part, set = missing
+//
+// A run costs a few bytes and scattered loss at most a bit per record,
+// so the missing records of any blast (10000 records at most) fit in a
+// single unfragmented datagram. missing_records counts the whole reply,
+// so whichever part arrives first can start the retransmission round.
+//
+// A NACK is laid out the same way but is not asked for: while a blast
+// arrives the receiver notes the gaps in its records, and once records
+// NACK_REORDER_PACKETS packets past a gap are in and the gap is older
+// than the latest reordering seen (so a packet that is merely late is
+// not reported) it lists whatever of the gap is still missing, at most
+// once per NACK_INTERVAL_US. The sender retransmits
+// those records at once, a round trip after the loss rather than after
+// the end of the blast; gaps the IS_BLAST_OVER of a blast reaches first
+// are left to its REC_MISS.
+
+const size_t REC_MISS_MAX_SIZE = DEFAULT_PATH_MTU - IP_UDP_HEADER_SIZE;
+const size_t REC_MISS_HEADER_SIZE = 1 + 8 * sizeof(uint32_t) + 1;
+const uint32_t NACK_REORDER_PACKETS = 3;     // first-pass packets past a gap
+const int NACK_INTERVAL_US = 1000;           // between NACKs of one stream
+const int NACK_REORDER_MAX_US = 50000;       // longest a gap waits for a late packet
+
+enum NackEncoding : uint8_t {
+    NACK_RANGES = 0,
+    NACK_BITMAP = 1
+};
+
+inline size_t varint_size(uint32_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+inline size_t put_varint(uint8_t* buffer, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        buffer[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buffer[n++] = (uint8_t)v;
+    return n;
+}
+
+// False if the varint runs past end or is longer than five bytes
+inline bool get_varint(const uint8_t*& p, const uint8_t* end, uint32_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        v |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
 
 struct RecMissPacket {
-    uint8_t type;                               // REC_MISS
-    uint16_t num_missing;                       // count of missing segments
-    Segment missing[MAX_MISSING_SEGMENTS];      // missing segments
+    uint8_t type;                    // REC_MISS, RESUME_MAP or NACK
+    uint32_t start_record;           // range answered: the blast (M_st)
+    uint32_t end_record;             // (M_fin)
+    uint32_t echo_timestamp;         // IS_BLAST_OVER (RESUME_QUERY) timestamp this answers
+    uint32_t missing_records;        // in the whole range, every part
+    uint32_t part;                   // this datagram, from 0
+    uint32_t parts;
+    uint32_t part_start;             // records this part covers
+    uint32_t part_end;
+    std::vector<Segment> missing;    // missing runs of the part, in order
     
-    RecMissPacket() : type(REC_MISS), num_missing(0) {}
+    RecMissPacket() : type(REC_MISS), start_record(0), end_record(0), echo_timestamp(0),
+                      missing_records(0), part(0), parts(1), part_start(0), part_end(0) {}
     
+    // Payload bytes the part takes as NACK_RANGES
+    size_t ranges_size() const {
+        size_t size = varint_size((uint32_t)missing.size());
+        uint32_t next = part_start;
+        for (const Segment& run : missing) {
+            size += varint_size(run.start_record - next) +
+                    varint_size(run.end_record - run.start_record);
+            next = run.end_record + 1;
+        }
+        return size;
+    }
+    
+    // ... and as NACK_BITMAP
+    size_t bitmap_size() const {
+        return ((uint64_t)part_end - part_start + 1 + 7) / 8;
+    }
+    
+    // The part in its smaller encoding; 0 if it does not fit
     size_t serialize(uint8_t* buffer, size_t buffer_size) const {
-        size_t offset = 0;
+        size_t ranges = ranges_size();
+        size_t bitmap = bitmap_size();
+        uint8_t encoding = bitmap < ranges ? NACK_BITMAP : NACK_RANGES;
+        if (REC_MISS_HEADER_SIZE + std::min(ranges, bitmap) > buffer_size) return 0;
         
-        if (offset + 1 > buffer_size) return 0;
+        size_t offset = 0;
         buffer[offset++] = type;
+        const uint32_t fields[] = {start_record, end_record, echo_timestamp, missing_records,
+                                   part, parts, part_start, part_end};
+        memcpy(buffer + offset, fields, sizeof(fields));
+        offset += sizeof(fields);
+        buffer[offset++] = encoding;
         
-        if (offset + sizeof(uint16_t) > buffer_size) return 0;
-        memcpy(buffer + offset, &num_missing, sizeof(num_missing));
-        offset += sizeof(num_missing);
-        
-        // Serialize missing segments
-        for (int i = 0; i < num_missing; i++) {
-            if (offset + sizeof(uint32_t) * 2 > buffer_size) return 0;
-            memcpy(buffer + offset, &missing[i].start_record, sizeof(uint32_t));
-            offset += sizeof(uint32_t);
-            memcpy(buffer + offset, &missing[i].end_record, sizeof(uint32_t));
-            offset += sizeof(uint32_t);
+        if (encoding == NACK_RANGES) {
+            offset += put_varint(buffer + offset, (uint32_t)missing.size());
+            uint32_t next = part_start;
+            for (const Segment& run : missing) {
+                offset += put_varint(buffer + offset, run.start_record - next);
+                offset += put_varint(buffer + offset, run.end_record - run.start_record);
+                next = run.end_record + 1;
+            }
+            return offset;
         }
         
-        return offset;
+        uint8_t* bits = buffer + offset;
+        memset(bits, 0, bitmap);
+        for (const Segment& run : missing) {
+            for (uint32_t r = run.start_record - part_start; r <= run.end_record - part_start; r++) {
+                bits[r / 8] |= (uint8_t)(1 << (r % 8));
+            }
+        }
+        return offset + bitmap;
     }
     
+    // 0 if malformed: a part outside the range, or runs outside the part
     size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        if (buffer_size < REC_MISS_HEADER_SIZE) return 0;
         size_t offset = 0;
-        
-        if (offset + 1 > buffer_size) return 0;
         type = buffer[offset++];
+        uint32_t fields[8];
+        memcpy(fields, buffer + offset, sizeof(fields));
+        offset += sizeof(fields);
+        start_record = fields[0];
+        end_record = fields[1];
+        echo_timestamp = fields[2];
+        missing_records = fields[3];
+        part = fields[4];
+        parts = fields[5];
+        part_start = fields[6];
+        part_end = fields[7];
+        uint8_t encoding = buffer[offset++];
+        missing.clear();
+        if (start_record > part_start || part_start > part_end || part_end > end_record ||
+            part >= parts) {
+            return 0;
+        }
         
-        if (offset + sizeof(uint16_t) > buffer_size) return 0;
-        memcpy(&num_missing, buffer + offset, sizeof(num_missing));
-        offset += sizeof(num_missing);
-        
-        // Deserialize missing segments
-        for (int i = 0; i < num_missing && i < MAX_MISSING_SEGMENTS; i++) {
-            if (offset + sizeof(uint32_t) * 2 > buffer_size) return 0;
-            memcpy(&missing[i].start_record, buffer + offset, sizeof(uint32_t));
-            offset += sizeof(uint32_t);
-            memcpy(&missing[i].end_record, buffer + offset, sizeof(uint32_t));
-            offset += sizeof(uint32_t);
+        const uint8_t* p = buffer + offset;
+        const uint8_t* end = buffer + buffer_size;
+        if (encoding == NACK_RANGES) {
+            uint32_t count;
+            if (!get_varint(p, end, count)) return 0;
+            uint64_t next = part_start;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t gap, length;
+                if (!get_varint(p, end, gap) || !get_varint(p, end, length)) return 0;
+                uint64_t first = next + gap;
+                uint64_t last = first + length;
+                if (last > part_end) return 0;
+                missing.push_back(Segment((uint32_t)first, (uint32_t)last));
+                next = last + 1;
+            }
+            return p - buffer;
         }
+        if (encoding != NACK_BITMAP || (size_t)(end - p) < bitmap_size()) return 0;
         
-        return offset;
+        // Runs of set bits
+        uint32_t records = part_end - part_start + 1;
+        uint32_t r = find_bit(p, 0, records, true);
+        while (r < records) {
+            uint32_t clear = find_bit(p, r, records, false);
+            missing.push_back(Segment(part_start + r, part_start + clear - 1));
+            r = find_bit(p, clear, records, true);
+        }
+        return offset + bitmap_size();
+    }
+    
+private:
+    // The first bit from r on that is set (or clear), records if none;
+    // whole bytes of the other kind are skipped at once
+    static uint32_t find_bit(const uint8_t* bits, uint32_t r, uint32_t records, bool set) {
+        while (r < records) {
+            uint8_t byte = set ? bits[r / 8] : (uint8_t)~bits[r / 8];
+            byte &= (uint8_t)(0xff << (r % 8));
+            if (byte) return std::min(records, (r & ~7u) + __builtin_ctz(byte));
+            r = (r & ~7u) + 8;
+        }
+        return records;
     }
 };
 
+// Split a reply listing every missing run of [start_record, end_record]
+// into parts of at most max_size bytes, each covering as many records as
+// the better of its two encodings allows
+inline void split_rec_miss(const RecMissPacket& whole, size_t max_size,
+                           std::vector<RecMissPacket>& parts) {
+    const size_t budget = max_size - REC_MISS_HEADER_SIZE;
+    const std::vector<Segment>& runs = whole.missing;
+    parts.clear();
+    size_t i = 0;
+    uint64_t lo = whole.start_record;
+    do {
+        // As far as runs fit as NACK_RANGES...
+        uint64_t ranges_end = whole.end_record;
+        size_t size = 0;
+        uint64_t next = lo;
+        for (size_t j = i; j < runs.size(); j++) {
+            uint64_t first = std::max<uint64_t>(runs[j].start_record, lo);
+            size_t run = varint_size((uint32_t)(first - next)) +
+                         varint_size((uint32_t)(runs[j].end_record - first));
+            if (varint_size((uint32_t)(j - i + 1)) + size + run > budget) {
+                ranges_end = first - 1;
+                break;
+            }
+            size += run;
+            next = runs[j].end_record + 1;
+        }
+        // ... or as far as a full bitmap reaches
+        uint64_t bitmap_end = std::min<uint64_t>(whole.end_record, lo + budget * 8 - 1);
+        uint64_t hi = std::max(ranges_end, bitmap_end);
+        
+        RecMissPacket part;
+        part.type = whole.type;
+        part.start_record = whole.start_record;
+        part.end_record = whole.end_record;
+        part.echo_timestamp = whole.echo_timestamp;
+        part.missing_records = whole.missing_records;
+        part.part = (uint32_t)parts.size();
+        part.part_start = (uint32_t)lo;
+        part.part_end = (uint32_t)hi;
+        for (; i < runs.size() && runs[i].start_record <= hi; i++) {
+            part.missing.push_back(Segment((uint32_t)std::max<uint64_t>(runs[i].start_record, lo),
+                                           (uint32_t)std::min<uint64_t>(runs[i].end_record, hi)));
+            if (runs[i].end_record > hi) break;          // continues in the next part
+        }
+        parts.push_back(part);
+        lo = hi + 1;
+    } while (lo <= whole.end_record);
+    
+    for (RecMissPacket& part : parts) {
+        part.parts = (uint32_t)parts.size();
+    }
+}
+
 // ============================================================================
 // DISCONNECT PACKET
 // ============================================================================
 
+// Ends the session and carries the CRC32C of the whole file, which the
+// sender builds stripe by stripe while sending it
 struct DisconnectPacket {
     uint8_t type;  // DISCONNECT
+    uint32_t file_crc;
     
-    DisconnectPacket() : type(DISCONNECT) {}
+    DisconnectPacket() : type(DISCONNECT), file_crc(0) {}
     
     size_t serialize(uint8_t* buffer) const {
         buffer[0] = type;
-        return 1;
+        memcpy(buffer + 1, &file_crc, sizeof(file_crc));
+        return 5;
     }
     
-    size_t deserialize(const uint8_t* buffer) {
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        if (buffer_size < 5) return 0;
         type = buffer[0];
-        return 1;
+        memcpy(&file_crc, buffer + 1, sizeof(file_crc));
+        return 5;
+    }
+};
+
+// The receiver's answer to DISCONNECT: whether the file checked out, or
+// that it is still being verified (the sender keeps asking)
+enum DisconnectStatus : uint8_t {
+    DISCONNECT_PENDING = 0,
+    DISCONNECT_VERIFIED = 1,
+    DISCONNECT_FAILED = 2
+};
+
+struct DisconnectAckPacket {
+    uint8_t type;  // DISCONNECT_ACK
+    uint8_t status;
+    
+    DisconnectAckPacket() : type(DISCONNECT_ACK), status(DISCONNECT_PENDING) {}
+    
+    size_t serialize(uint8_t* buffer) const {
+        buffer[0] = type;
+        buffer[1] = status;
+        return 2;
+    }
+    
+    size_t deserialize(const uint8_t* buffer, size_t buffer_size) {
+        if (buffer_size < 2) return 0;
+        type = buffer[0];
+        status = buffer[1];
+        return 2;
     }
 };
 
@@ -290,26 +1253,128 @@ struct DisconnectPacket {
 // ============================================================================
 
 struct Statistics {
-    uint32_t total_packets_sent;
-    uint32_t total_data_packets_sent;
-    uint32_t total_packets_lost;
-    uint32_t retransmissions;
-    uint32_t total_blasts;
+    uint64_t total_packets_sent;
+    uint64_t total_data_packets_sent;
+    uint64_t total_packets_lost;
+    uint64_t retransmissions;
+    uint64_t total_blasts;
+    uint64_t fec_packets_sent;
+    uint64_t packets_corrupted;             // damaged on purpose by the garbler
+    uint64_t probes_dropped;                // IS_BLAST_OVER dropped by the garbler
+    uint64_t probe_timeouts;                // IS_BLAST_OVER resent for a late REC_MISS
+    uint64_t blasts_compressed;             // first pass sent from the compressor
+    uint64_t blasts_uncompressed;           // first pass sent raw while it backed off
+    uint64_t backoffs_slow;                 // compressor slower than the link
+    uint64_t backoffs_incompressible;       // a blast did not shrink
+    uint64_t bytes_before_compression;      // records of compressed blasts
+    uint64_t bytes_after_compression;       // what they went out as
+    uint64_t records_resumed;               // already at the receiver, not sent
+    uint64_t blasts_skipped;                // ... making up whole blasts
+    uint64_t records_copied;                // rebuilt from the receiver's older copy
+    uint64_t delta_copies;                  // DELTA_COPY entries that did it
+    uint64_t nacks_received;                // NACKs acted on mid-blast
+    uint64_t nack_records;                  // ... and the records they resent
+    uint64_t early_records;                 // first blast sent before FILE_HDR_ACK
+    std::vector<float> blast_ms;            // first DATA to empty REC_MISS, per blast
     double throughput_mbps;
     double total_time_sec;
     
     Statistics() : total_packets_sent(0), total_data_packets_sent(0), 
                    total_packets_lost(0), retransmissions(0), total_blasts(0),
-                   throughput_mbps(0.0), total_time_sec(0.0) {}
+                   fec_packets_sent(0), packets_corrupted(0), probes_dropped(0),
+                   probe_timeouts(0), blasts_compressed(0), blasts_uncompressed(0),
+                   backoffs_slow(0), backoffs_incompressible(0), bytes_before_compression(0),
+                   bytes_after_compression(0), records_resumed(0), blasts_skipped(0),
+                   records_copied(0), delta_copies(0), nacks_received(0),
+                   nack_records(0), early_records(0), throughput_mbps(0.0),
+                   total_time_sec(0.0) {}
+    
+    // Add the counters of another stream's statistics
+    void merge(const Statistics& other) {
+        total_packets_sent += other.total_packets_sent;
+        total_data_packets_sent += other.total_data_packets_sent;
+        total_packets_lost += other.total_packets_lost;
+        retransmissions += other.retransmissions;
+        total_blasts += other.total_blasts;
+        fec_packets_sent += other.fec_packets_sent;
+        packets_corrupted += other.packets_corrupted;
+        probes_dropped += other.probes_dropped;
+        probe_timeouts += other.probe_timeouts;
+        blasts_compressed += other.blasts_compressed;
+        blasts_uncompressed += other.blasts_uncompressed;
+        backoffs_slow += other.backoffs_slow;
+        backoffs_incompressible += other.backoffs_incompressible;
+        bytes_before_compression += other.bytes_before_compression;
+        bytes_after_compression += other.bytes_after_compression;
+        records_resumed += other.records_resumed;
+        blasts_skipped += other.blasts_skipped;
+        records_copied += other.records_copied;
+        delta_copies += other.delta_copies;
+        nacks_received += other.nacks_received;
+        nack_records += other.nack_records;
+        early_records += other.early_records;
+        blast_ms.insert(blast_ms.end(), other.blast_ms.begin(), other.blast_ms.end());
+    }
+    
+    // The p-th percentile (0..1) of the blast completion times, 0 if none
+    double blast_percentile(double p) const {
+        if (blast_ms.empty()) return 0.0;
+        std::vector<float> sorted(blast_ms);
+        size_t rank = (size_t)(p * (sorted.size() - 1) + 0.5);
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
     
     void print() const {
         printf("\n=== Transfer Statistics ===\n");
-        printf("Total packets sent: %u\n", total_packets_sent);
-        printf("Data packets sent: %u\n", total_data_packets_sent);
-        printf("Packets lost: %u (%.2f%%)\n", total_packets_lost, 
-               total_data_packets_sent > 0 ? (total_packets_lost * 100.0 / total_data_packets_sent) : 0.0);
-        printf("Retransmissions: %u\n", retransmissions);
-        printf("Total blasts: %u\n", total_blasts);
+        printf("Total packets sent: %llu\n", (unsigned long long)total_packets_sent);
+        printf("Data packets sent: %llu\n", (unsigned long long)total_data_packets_sent);
+        uint64_t attempted = total_data_packets_sent + total_packets_lost;
+        printf("Packets lost: %llu (%.2f%%)\n", (unsigned long long)total_packets_lost, 
+               attempted > 0 ? (total_packets_lost * 100.0 / attempted) : 0.0);
+        printf("Retransmissions: %llu\n", (unsigned long long)retransmissions);
+        printf("Total blasts: %llu\n", (unsigned long long)total_blasts);
+        if (fec_packets_sent > 0) {
+            printf("FEC parity packets: %llu\n", (unsigned long long)fec_packets_sent);
+        }
+        if (packets_corrupted > 0) {
+            printf("Packets corrupted: %llu\n", (unsigned long long)packets_corrupted);
+        }
+        if (probes_dropped > 0) {
+            printf("IS_BLAST_OVER dropped: %llu\n", (unsigned long long)probes_dropped);
+        }
+        printf("IS_BLAST_OVER timeouts: %llu\n", (unsigned long long)probe_timeouts);
+        if (nacks_received > 0) {
+            printf("Mid-blast NACKs: %llu, %llu record(s) resent on them\n",
+                   (unsigned long long)nacks_received, (unsigned long long)nack_records);
+        }
+        if (early_records > 0) {
+            printf("0-RTT: %llu record(s) sent before FILE_HDR_ACK\n",
+                   (unsigned long long)early_records);
+        }
+        if (!blast_ms.empty()) {
+            printf("Blast completion: p50 %.2f ms, p99 %.2f ms over %zu blast(s)\n",
+                   blast_percentile(0.5), blast_percentile(0.99), blast_ms.size());
+        }
+        if (blasts_compressed + blasts_uncompressed > 0) {
+            printf("Compression: %.2fx (%llu -> %llu bytes) over %llu blast(s), %llu raw\n",
+                   bytes_after_compression > 0 ?
+                       (double)bytes_before_compression / bytes_after_compression : 0.0,
+                   (unsigned long long)bytes_before_compression,
+                   (unsigned long long)bytes_after_compression,
+                   (unsigned long long)blasts_compressed, (unsigned long long)blasts_uncompressed);
+            printf("Compression backoffs: %llu (compressor too slow), %llu (incompressible)\n",
+                   (unsigned long long)backoffs_slow, (unsigned long long)backoffs_incompressible);
+        }
+        if (records_resumed > 0) {
+            printf("Resumed: %llu record(s) already at the receiver, %llu blast(s) skipped\n",
+                   (unsigned long long)records_resumed, (unsigned long long)blasts_skipped);
+        }
+        if (records_copied > 0) {
+            printf("Delta: %llu record(s) copied from the receiver's older copy (%llu copy run(s)), "
+                   "%llu blast(s) skipped\n", (unsigned long long)records_copied,
+                   (unsigned long long)delta_copies, (unsigned long long)blasts_skipped);
+        }
         printf("Total time: %.3f seconds\n", total_time_sec);
         printf("Throughput: %.2f Mbps\n", throughput_mbps);
         printf("===========================\n");
@@ -1,4 +1,16 @@
 #include "protocol.h"
+#include "file_sink.h"
+#include "file_tree.h"
+#include "udp_batch.h"
+#include "fec.h"
+#include "record_bitmap.h"
+#include "uring.h"
+#include "pipeline.h"
+#include "compress.h"
+#include "journal.h"
+#include "delta.h"
+#include "impair.h"
+#include "telemetry.h"
 #include <iostream>
 #include <fstream>
 #include <cstring>
@@ -7,193 +19,855 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <vector>
+#include <deque>
+#include <algorithm>
 #include <set>
+#include <map>
 #include <chrono>
 #include <iomanip>
 #include <sstream>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <mutex>
+#include <condition_variable>
+#include <poll.h>
+#include <dirent.h>
 
 using namespace std;
 
 // ============================================================================
-// RECEIVER CLASS
+// RECEIVER METRICS
 // ============================================================================
 
-class FileReceiver {
+// What the receive loops and sessions record for --telemetry and the
+// end-of-run summary. The loops add their datagram counts once per batch.
+struct ReceiverMetrics {
+    Counter& datagrams;
+    Counter& bytes;
+    Counter& corrupt_packets;
+    Counter& rec_miss_sent;
+    Counter& nacks_sent;
+    Counter& kernel_drops;               // SO_RXQ_OVFL: dropped by this host, not the path
+    Counter& records_repaired;           // received after a REC_MISS or NACK listed them
+    Histogram& recv_ns;                  // recvmmsg time per message
+    Histogram& write_ns;                 // one record's pwrite
+    Histogram& missing_segments;         // segments per non-empty REC_MISS
+    
+    // --io pipeline: the drain -> placement and placement -> disk hand-offs
+    StageMetrics drain;
+    StageMetrics disk;
+    Histogram& chunk_write_ns;           // one chunk's pwrite on the disk thread
+    
+    static ReceiverMetrics& get() {
+        static ReceiverMetrics metrics(Telemetry::instance());
+        return metrics;
+    }
+    
+    // Datagrams handled by one pass of a receive loop
+    void on_batch(uint64_t count, uint64_t size) {
+        if (count == 0) return;
+        datagrams.add(count);
+        bytes.add(size);
+    }
+    
+    void print() const {
+        if (recv_ns.count() > 0) {
+            printf("Receive syscall: p50 %llu ns, p99 %llu ns per message\n",
+                   (unsigned long long)recv_ns.quantile(0.5),
+                   (unsigned long long)recv_ns.quantile(0.99));
+        }
+        if (write_ns.count() > 0) {
+            printf("Record writes: p50 %llu ns, p99 %llu ns, max %llu ns over %llu write(s)\n",
+                   (unsigned long long)write_ns.quantile(0.5),
+                   (unsigned long long)write_ns.quantile(0.99),
+                   (unsigned long long)write_ns.max(), (unsigned long long)write_ns.count());
+        }
+        print_stage("Drain -> placement", drain, "batch(es)", PIPELINE_BATCHES);
+        print_stage("Placement -> disk", disk, "chunk(s)", DiskWriter::CHUNKS);
+        if (chunk_write_ns.count() > 0) {
+            printf("Chunk writes: p50 %llu ns, p99 %llu ns, max %llu ns over %llu write(s)\n",
+                   (unsigned long long)chunk_write_ns.quantile(0.5),
+                   (unsigned long long)chunk_write_ns.quantile(0.99),
+                   (unsigned long long)chunk_write_ns.max(),
+                   (unsigned long long)chunk_write_ns.count());
+        }
+    }
+    
+    static void print_stage(const char* name, const StageMetrics& stage, const char* items,
+                            unsigned capacity) {
+        if (stage.depth.count() == 0) return;
+        printf("%s: %llu hand-off(s), p99 %llu of %u %s queued, %llu stall(s)",
+               name, (unsigned long long)stage.depth.count(),
+               (unsigned long long)stage.depth.quantile(0.99), capacity, items,
+               (unsigned long long)stage.stalls.get());
+        if (stage.stall_ns.count() > 0) {
+            printf(", p99 %llu ns each", (unsigned long long)stage.stall_ns.quantile(0.99));
+        }
+        printf("\n");
+    }
+    
 private:
-    int sockfd;
-    struct sockaddr_in server_addr;
-    struct sockaddr_in sender_addr;
+    ReceiverMetrics(Telemetry& t)
+        : datagrams(t.counter("blast_receiver_datagrams_total", "Datagrams received")),
+          bytes(t.counter("blast_receiver_bytes_total", "Datagram bytes received")),
+          corrupt_packets(t.counter("blast_receiver_corrupt_packets_total",
+                                    "DATA and parity packets dropped for a bad CRC")),
+          rec_miss_sent(t.counter("blast_receiver_rec_miss_total",
+                                  "REC_MISS datagrams sent, every part")),
+          nacks_sent(t.counter("blast_receiver_nacks_total", "NACKs sent mid-blast")),
+          kernel_drops(t.counter("blast_receiver_kernel_drops_total",
+                                 "Packets dropped by the kernel for a full socket buffer (SO_RXQ_OVFL)")),
+          records_repaired(t.counter("blast_receiver_records_repaired_total",
+                                     "Records received after a REC_MISS or NACK listed them")),
+          recv_ns(t.histogram("blast_receiver_recv_ns_per_message",
+                              "recvmmsg time per message, nanoseconds")),
+          write_ns(t.histogram("blast_receiver_write_ns",
+                               "Blocking record write latency, nanoseconds")),
+          missing_segments(t.histogram("blast_receiver_rec_miss_segments",
+                                       "Missing segments listed per non-empty REC_MISS")),
+          drain{t.counter("blast_receiver_drain_stalls_total",
+                          "Times the drain thread found every receive batch queued for placement"),
+                t.histogram("blast_receiver_drain_stall_ns", "Drain waits for a free batch, nanoseconds"),
+                t.histogram("blast_receiver_drain_depth", "Batches queued for placement after each hand-off")},
+          disk{t.counter("blast_receiver_disk_stalls_total",
+                         "Times placement found every write chunk queued for the disk"),
+               t.histogram("blast_receiver_disk_stall_ns", "Placement waits for a free chunk, nanoseconds"),
+               t.histogram("blast_receiver_disk_depth", "Chunks queued for the disk after each hand-off")},
+          chunk_write_ns(t.histogram("blast_receiver_chunk_write_ns",
+                                     "Disk thread write latency per chunk, nanoseconds")) {}
+};
+
+// ============================================================================
+// RECEIVE STREAM
+// ============================================================================
+
+// A DATA_COMPRESSED packet handed to the worker pool, and what it holds
+struct InflateJob {
+    uint32_t first_record;
+    uint16_t num_records;
+    vector<uint8_t> block;               // compressed, copied out of the packet
+    vector<uint8_t> records;             // decompressed
+};
+
+// Records a DATA packet skipped over, and when
+struct Gap {
+    Segment run;
+    chrono::steady_clock::time_point seen;
+    
+    Gap(const Segment& r, chrono::steady_clock::time_point t) : run(r), seen(t) {}
+};
+
+// One stripe of a transfer and the socket/peer it is exchanged on. Stream 0
+// carries every record of a plain transfer; a --streams N transfer adds one
+// stream per extra stripe, received on port + i.
+struct ReceiveStream {
+    int sockfd;                          // socket replies for this stream go out on
+    struct sockaddr_in sender_addr;      // where replies for this stream go
     socklen_t sender_addr_len;
-    int port;
     
+    uint32_t first_record;               // stripe
+    uint32_t last_record;
+    uint32_t stripe_received;            // records of the stripe accepted
+    FecDecoder fec;                      // Parity groups still being filled
+    uint32_t fec_recovered;              // records rebuilt from parity
+    bool active;                         // still in the data phase
+    ChunkWriter* writer;                 // --io uring/pipeline: coalesced writes, NULL = pwrite
+    uint32_t drops_seen;                 // SO_RXQ_OVFL count of sockfd so far
+    unique_ptr<ImpairedLink> link;       // --impair: the simulated return path
+    
+    // Compressed packets being decompressed by the pool; the stream's own
+    // thread stores the records once they are done
+    mutex inflate_lock;                  // guards inflated and inflating
+    condition_variable inflate_done;
+    vector<shared_ptr<InflateJob>> inflated;
+    uint32_t inflating;
+    vector<uint8_t> inflate_buffer;      // decompressing inline, without a pool
+    
+    // Records stored since the last journal checkpoint
+    uint32_t dirty_first;
+    uint32_t dirty_last;                 // dirty_first > dirty_last: none
+    chrono::steady_clock::time_point last_checkpoint;
+    
+    // Mid-blast NACKs: gaps behind the highest record seen, reported once
+    // enough packets and time have gone past them to rule out reordering
+    uint32_t highest_seen;               // last record of the furthest DATA packet
+    deque<Gap> holes;                    // skipped over, not yet reported
+    int64_t reorder_us;                  // how long a gap waits for a late packet
+    vector<Segment> nack_runs;           // due, waiting for NACK_INTERVAL_US
+    chrono::steady_clock::time_point last_nack;
+    
+    ReceiveStream(int fd)
+        : sockfd(fd), sender_addr_len(sizeof(sender_addr)),
+          first_record(1), last_record(0), stripe_received(0), fec_recovered(0),
+          active(false), writer(NULL), drops_seen(0), inflating(0), dirty_first(UINT32_MAX), dirty_last(0),
+          last_checkpoint(chrono::steady_clock::now()), highest_seen(0),
+          reorder_us(0) {
+        memset(&sender_addr, 0, sizeof(sender_addr));
+    }
+    
+    bool stripe_complete() const {
+        return stripe_received >= last_record - first_record + 1 || first_record > last_record;
+    }
+};
+
+// ============================================================================
+// RECEIVE SESSION
+// ============================================================================
+
+// Everything one transfer needs once its FILE_HDR is in: record tracking,
+// the output file and the per-stream stripes. It owns no sockets and never
+// blocks, so it can be driven by the per-stream threads of a single
+// transfer or by the event loop of the --server daemon.
+class ReceiveSession {
+private:
+    uint32_t session_id;
     uint64_t file_size;
     uint16_t record_size;
     uint32_t blast_size;
     uint32_t total_records;
+    uint32_t tree_entries;               // > 0: a directory of this many entries
     string output_filename;
+    string output_path;                  // received_files/<timestamp>/<name>
+    string partial_path;                 // where it is written until complete, "" = output_path
+    
+    int checkpoint_ms;                   // between journal checkpoints, 0 = no journal
+    ProgressJournal journal;             // records of partial_path that are on disk
+    atomic<bool> journal_failed;         // stop checkpointing after an I/O error
+    uint32_t records_held;               // taken over from an earlier transfer
+    
+    // --delta: an older copy of the file the sender has blocks copied from
+    bool delta_allowed;                  // look for one at all (single-transfer mode)
+    unique_ptr<BasisFile> basis;
+    uint32_t copies_total;               // DELTA_COPY entries announced
+    vector<char> copies_done;            // per DELTA_COPY packet
+    size_t copy_packets_left;
+    vector<pair<uint64_t, uint64_t>> copied;   // byte ranges of the file filled so far
+    uint32_t records_copied;
+    bool signatures_logged;
     
-    vector<bool> received_records;       // Track which records received
-    vector<vector<uint8_t>> record_buffer;  // Store received records
+    RecordBitmap received_records;       // Track which records received
+    RecordBitmap requested_records;      // listed in a REC_MISS or NACK
+    atomic<uint32_t> num_received;       // records accepted so far
+    FileSink sink;                       // Records are written here on arrival
+    unique_ptr<TreeSink> tree;           // ... or into the files of a directory
+    atomic<bool> write_failed;           // an async write was lost after the fact
+    uint64_t file_mtime;                 // the sender's, from FILE_HDR; names the file for resuming
+    uint32_t file_crc;                   // CRC32C of the whole file, from DISCONNECT
+    atomic<uint32_t> corrupt_packets;    // DATA/FEC_PARITY dropped for a bad CRC
+    bool verified;                       // finalized and matching file_crc
+    uint8_t codec;                       // compression accepted in FILE_HDR_ACK
+    bool nack_enabled;                   // report gaps mid-blast (no FEC, no compression)
+    uint32_t nack_reorder;               // records past a gap before it is reported
+    WorkerPool* inflate_pool;            // decompresses off the receive threads, or NULL
+    atomic<uint32_t> packets_inflated;   // DATA_COMPRESSED packets decompressed
+    atomic<uint32_t> inflate_errors;     // ... that did not decompress
     
-    bool connection_active;
+    vector<unique_ptr<ReceiveStream>> streams;
+    atomic<bool> disconnected;
+    ReceiveStream* disconnect_from;      // the stream DISCONNECT came in on
+    mutex disconnect_lock;               // file_crc and disconnected, for wait_for_disconnect
+    condition_variable disconnect_seen;
+    atomic<bool> finalizing;             // finalize() is under way; nothing more is written
+    atomic<uint8_t> verdict;             // what finalize() found, DISCONNECT_PENDING before
+    bool verbose;                        // per-blast logging
+    ImpairmentConfig impair;             // --impair: what replies go through
+    chrono::steady_clock::time_point start_time;
+    ReceiverMetrics& metrics;
     
     // Send packet
-    bool send_packet(const uint8_t* buffer, size_t size) {
-        ssize_t sent = sendto(sockfd, buffer, size, 0, 
-                             (struct sockaddr*)&sender_addr, sender_addr_len);
+    bool send_packet(ReceiveStream& st, const uint8_t* buffer, size_t size) {
+        if (st.link && st.link->pass(buffer, size, true, st.sender_addr) != LINK_SEND) {
+            return true;                 // lost or sent later, as on a real link
+        }
+        ssize_t sent = sendto(st.sockfd, buffer, size, 0,
+                             (struct sockaddr*)&st.sender_addr, st.sender_addr_len);
         return (sent >= 0);
     }
     
-    // Receive packet
-    bool recv_packet(uint8_t* buffer, size_t& size) {
-        sender_addr_len = sizeof(sender_addr);
-        ssize_t n = recvfrom(sockfd, buffer, MAX_UDP_PAYLOAD, 0,
-                            (struct sockaddr*)&sender_addr, &sender_addr_len);
-        if (n < 0) {
+    // Process DATA packet
+    void process_data_packet(ReceiveStream& st, const uint8_t* buffer, size_t size) {
+        // Records are taken straight out of the receive buffer
+        DataPacketView pkt;
+        if (!pkt.parse(buffer, size)) return;
+        
+        // Extract records from packet
+        size_t data_offset = 0;
+        for (int i = 0; i < pkt.num_segments; i++) {
+            Segment seg = pkt.segment(i);
+            
+            for (uint32_t rec = seg.start_record; rec <= seg.end_record; rec++) {
+                if (data_offset + record_size > pkt.data_len) {
+                    return;  // Truncated packet
+                }
+                // Write to the final offset; a failed write stays missing
+                // and is requested again through REC_MISS
+                if (rec >= st.first_record && rec <= st.last_record &&
+                    !received_records.test(rec)) {
+                    accept_record(st, rec, pkt.data + data_offset);
+                }
+                data_offset += record_size;
+            }
+        }
+        if (nack_enabled && pkt.num_segments > 0) {
+            track_gaps(st, pkt.segment(0).start_record, pkt.segment(pkt.num_segments - 1).end_record);
+        }
+    }
+    
+    // Note the records a DATA packet of [first, last] skipped over, and
+    // queue the gaps it leaves nack_reorder records and reorder_us behind.
+    // Packets of a first pass arrive in record order; retransmissions and
+    // resumed blasts land behind highest_seen and leave no gaps of their
+    // own. A late packet that fills a gap not yet reported shows how far
+    // the path reorders, and gaps wait that long from then on.
+    void track_gaps(ReceiveStream& st, uint32_t first, uint32_t last) {
+        auto now = chrono::steady_clock::now();
+        if (last <= st.highest_seen) {
+            for (const Gap& gap : st.holes) {
+                if (first <= gap.run.end_record && last >= gap.run.start_record) {
+                    int64_t late = chrono::duration_cast<chrono::microseconds>(now - gap.seen).count();
+                    st.reorder_us = min<int64_t>(max<int64_t>(st.reorder_us, late + late / 4),
+                                                 NACK_REORDER_MAX_US);
+                    break;
+                }
+            }
+            return;
+        }
+        if (first > st.highest_seen + 1) {
+            st.holes.push_back(Gap(Segment(st.highest_seen + 1, first - 1), now));
+        }
+        st.highest_seen = last;
+        while (!st.holes.empty() && st.holes.front().run.end_record + nack_reorder <= st.highest_seen &&
+               now - st.holes.front().seen >= chrono::microseconds(st.reorder_us)) {
+            st.nack_runs.push_back(st.holes.front().run);
+            st.holes.pop_front();
+        }
+        if (!st.nack_runs.empty()) {
+            maybe_send_nack(st);
+        }
+    }
+    
+    // Send a NACK with what is still missing of the due holes, at most
+    // once per NACK_INTERVAL_US
+    void maybe_send_nack(ReceiveStream& st) {
+        auto now = chrono::steady_clock::now();
+        if (now - st.last_nack < chrono::microseconds(NACK_INTERVAL_US)) {
+            return;
+        }
+        RecMissPacket nack;
+        nack.type = NACK;
+        nack.start_record = st.nack_runs.front().start_record;
+        nack.end_record = st.nack_runs.back().end_record;
+        for (const Segment& hole : st.nack_runs) {
+            received_records.for_each_missing(hole.start_record, hole.end_record,
+                [&nack](uint32_t first, uint32_t last) {
+                    nack.missing.push_back(Segment(first, last));
+                    nack.missing_records += last - first + 1;
+                    return true;
+                });
+        }
+        st.nack_runs.clear();
+        if (nack.missing.empty()) {
+            return;
+        }
+        note_requested(nack);
+        send_missing(st, nack);
+        st.last_nack = now;
+        metrics.nacks_sent.add();
+    }
+    
+    // The REC_MISS for a blast covers its holes; forget them
+    void drop_holes(ReceiveStream& st, uint32_t end_record) {
+        auto covered = [end_record](Segment& hole) {
+            if (hole.start_record <= end_record && hole.end_record > end_record) {
+                hole.start_record = end_record + 1;
+            }
+            return hole.end_record <= end_record;
+        };
+        st.holes.erase(remove_if(st.holes.begin(), st.holes.end(),
+                                 [&covered](Gap& gap) { return covered(gap.run); }),
+                       st.holes.end());
+        st.nack_runs.erase(remove_if(st.nack_runs.begin(), st.nack_runs.end(), covered),
+                           st.nack_runs.end());
+    }
+    
+    // Process DATA_COMPRESSED packet: decompress it on the pool if there is
+    // one, otherwise right here
+    void process_compressed_packet(ReceiveStream& st, const uint8_t* buffer, size_t size) {
+        CompressedDataView pkt;
+        if (codec == CODEC_NONE || !pkt.parse(buffer, size) || pkt.codec != codec) return;
+        if (pkt.first_record < st.first_record ||
+            (uint64_t)pkt.first_record + pkt.num_records - 1 > st.last_record ||
+            (size_t)pkt.num_records * record_size > MAX_FRAME_BYTES) {
+            return;
+        }
+        size_t expected = (size_t)pkt.num_records * record_size;
+        
+        if (!inflate_pool) {
+            st.inflate_buffer.resize(expected);
+            if (codec_decompress(codec, pkt.block, pkt.block_len,
+                                 st.inflate_buffer.data(), expected) != expected) {
+                inflate_errors++;
+                return;
+            }
+            store_inflated(st, pkt.first_record, pkt.num_records, st.inflate_buffer.data());
+            return;
+        }
+        
+        shared_ptr<InflateJob> job(new InflateJob());
+        job->first_record = pkt.first_record;
+        job->num_records = pkt.num_records;
+        job->block.assign(pkt.block, pkt.block + pkt.block_len);
+        {
+            lock_guard<mutex> guard(st.inflate_lock);
+            st.inflating++;
+        }
+        uint8_t c = codec;
+        ReceiveStream* stream = &st;
+        inflate_pool->submit([this, stream, job, c, expected]() {
+            job->records.resize(expected);
+            bool ok = codec_decompress(c, job->block.data(), job->block.size(),
+                                       job->records.data(), expected) == expected;
+            lock_guard<mutex> guard(stream->inflate_lock);
+            if (ok) {
+                stream->inflated.push_back(job);
+            } else {
+                inflate_errors++;
+            }
+            stream->inflating--;
+            stream->inflate_done.notify_all();
+        });
+        drain_inflated(st, false);
+    }
+    
+    // Store the records of a decompressed packet that are still missing
+    void store_inflated(ReceiveStream& st, uint32_t first, uint16_t count, const uint8_t* data) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (!received_records.test(first + i)) {
+                accept_record(st, first + i, data + (size_t)i * record_size);
+            }
+        }
+        packets_inflated++;
+    }
+    
+    // Store what the pool has decompressed for this stream; with wait, once
+    // every packet handed to it is done
+    void drain_inflated(ReceiveStream& st, bool wait) {
+        if (!inflate_pool) return;
+        vector<shared_ptr<InflateJob>> ready;
+        {
+            unique_lock<mutex> guard(st.inflate_lock);
+            if (wait) {
+                st.inflate_done.wait(guard, [&st] { return st.inflating == 0; });
+            }
+            ready.swap(st.inflated);
+        }
+        for (auto& job : ready) {
+            store_inflated(st, job->first_record, job->num_records, job->records.data());
+        }
+    }
+    
+    // Store a new record and let FEC rebuild whatever it now can
+    void accept_record(ReceiveStream& st, uint32_t rec, const uint8_t* data) {
+        if (!store_record(st, rec, data)) {
+            return;
+        }
+        if (st.fec.enabled()) {
+            st.fec.add_record(rec, data);
+            recover_fec_group(st, rec);
+        }
+    }
+    
+    // Write a record to its final offset; a failed write stays missing and
+    // is requested again through REC_MISS
+    bool store_record(ReceiveStream& st, uint32_t rec, const uint8_t* data) {
+        if (st.writer) {
+            uint64_t offset;
+            size_t len;
+            if (!sink.record_extent(rec, offset, len) || !st.writer->write(offset, data, len)) {
+                return false;
+            }
+        } else {
+            auto start = chrono::steady_clock::now();
+            bool written = tree ? tree->write_record(rec, data) : sink.write_record(rec, data);
+            metrics.write_ns.record(elapsed_ns(start));
+            if (!written) return false;
+        }
+        if (!received_records.set(rec)) {
             return false;
         }
-        size = n;
+        if (requested_records.test(rec)) {
+            metrics.records_repaired.add();
+        }
+        st.stripe_received++;
+        num_received++;
+        st.dirty_first = min(st.dirty_first, rec);
+        st.dirty_last = max(st.dirty_last, rec);
         return true;
     }
     
-    // Receive packet with timeout
-    bool recv_packet_timeout(uint8_t* buffer, size_t& size, int timeout_sec) {
-        struct timeval tv;
-        tv.tv_sec = timeout_sec;
-        tv.tv_usec = 0;
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        
-        return recv_packet(buffer, size);
+    // Journal what the stream has stored since its last checkpoint. Its
+    // async writes are completed first so that the bits journaled are
+    // all backed by data the sync covers.
+    void checkpoint(ReceiveStream& st) {
+        st.last_checkpoint = chrono::steady_clock::now();
+        if (!journal.is_open() || journal_failed || st.dirty_first > st.dirty_last) {
+            return;
+        }
+        if (st.writer && !st.writer->flush()) {
+            write_failed = true;
+            return;
+        }
+        if (!journal.checkpoint(sink.descriptor(), received_records, st.dirty_first, st.dirty_last)) {
+            if (!journal_failed.exchange(true)) {
+                cerr << "Warning: Cannot update the journal of " << partial_path
+                     << ", this transfer will not be resumable" << endl;
+            }
+            return;
+        }
+        st.dirty_first = UINT32_MAX;
+        st.dirty_last = 0;
     }
     
-    // Send FILE_HDR_ACK
-    void send_file_hdr_ack() {
-        FileHeaderAckPacket ack;
-        uint8_t buffer[16];
-        size_t size = ack.serialize(buffer);
-        send_packet(buffer, size);
-        cout << "Sent FILE_HDR_ACK" << endl;
+    void maybe_checkpoint(ReceiveStream& st) {
+        if (checkpoint_ms > 0 &&
+            chrono::steady_clock::now() - st.last_checkpoint >= chrono::milliseconds(checkpoint_ms)) {
+            checkpoint(st);
+        }
     }
     
-    // Process FILE_HDR
-    bool process_file_hdr(const uint8_t* buffer, size_t size) {
-        FileHeaderPacket hdr;
-        hdr.deserialize(buffer);
-        
-        file_size = hdr.file_size;
-        record_size = hdr.record_size;
-        blast_size = hdr.blast_size;
-        output_filename = hdr.filename;
+    void recover_fec_group(ReceiveStream& st, uint32_t rec) {
+        st.fec_recovered += st.fec.recover(rec,
+            [this](uint32_t r) { return received_records.test(r); },
+            [this, &st](uint32_t r, const uint8_t* data) { return store_record(st, r, data); });
+    }
+    
+    // Process FEC_PARITY packet
+    void process_parity_packet(ReceiveStream& st, const uint8_t* buffer, size_t size) {
+        if (!st.fec.enabled()) return;
         
-        total_records = (file_size + record_size - 1) / record_size;
+        FecParityView pkt;
+        if (!pkt.parse(buffer, size)) return;
+        if (pkt.group_start < st.first_record || pkt.group_start > st.last_record) return;
         
-        cout << "\n=== File Header Received ===" << endl;
-        cout << "Filename: " << output_filename << endl;
-        cout << "File size: " << file_size << " bytes" << endl;
-        cout << "Record size: " << record_size << " bytes" << endl;
-        cout << "Blast size: " << blast_size << " records" << endl;
-        cout << "Total records: " << total_records << endl;
+        st.fec.add_parity(pkt.group_start, pkt.parity, pkt.parity_len,
+            [this](uint32_t r) { return received_records.test(r); });
+        recover_fec_group(st, pkt.group_start);
+    }
+    
+    // Fill in every missing run of the range
+    void find_missing_records(RecMissPacket& rec_miss) {
+        rec_miss.missing.clear();
+        rec_miss.missing_records = 0;
+        if (rec_miss.start_record < 1 || rec_miss.start_record > rec_miss.end_record ||
+            rec_miss.end_record > total_records) {
+            return;
+        }
+        received_records.for_each_missing(rec_miss.start_record, rec_miss.end_record,
+            [&rec_miss](uint32_t first, uint32_t last) {
+                rec_miss.missing.push_back(Segment(first, last));
+                rec_miss.missing_records += last - first + 1;
+                return true;
+            });
+    }
+    
+    // Remember the records a REC_MISS or NACK asks for again, so the ones
+    // that arrive afterwards are counted as lost and repaired
+    void note_requested(const RecMissPacket& reply) {
+        for (const Segment& seg : reply.missing) {
+            for (uint32_t rec = seg.start_record; rec <= seg.end_record; rec++) {
+                requested_records.set(rec);
+            }
+        }
+    }
+    
+    // Send a REC_MISS or RESUME_MAP, in as many parts as it takes;
+    // returns the number of parts
+    size_t send_missing(ReceiveStream& st, const RecMissPacket& reply) {
+        vector<RecMissPacket> parts;
+        split_rec_miss(reply, REC_MISS_MAX_SIZE, parts);
+        uint8_t buffer[REC_MISS_MAX_SIZE];
+        for (const RecMissPacket& part : parts) {
+            size_t size = part.serialize(buffer, sizeof(buffer));
+            if (size > 0) {
+                send_packet(st, buffer, size);
+            }
+        }
+        return parts.size();
+    }
+    
+    // Send RESUME_MAP: the missing runs from the queried record on
+    void send_resume_map(ReceiveStream& st, const ResumeQueryPacket& query) {
+        RecMissPacket map;
+        map.type = RESUME_MAP;
+        map.start_record = max(query.start_record, 1u);
+        map.end_record = total_records;
+        map.echo_timestamp = query.timestamp;
+        find_missing_records(map);
+        send_missing(st, map);
+    }
+    
+    // Send SIG_MAP: the signatures the query asks for, or none while they
+    // are still being computed
+    void send_sig_map(ReceiveStream& st, const SigQueryPacket& query) {
+        if (!basis || query.first_block >= basis->num_blocks()) return;
         
-        // Initialize buffers
-        received_records.resize(total_records + 1, false);  // 1-indexed
-        record_buffer.resize(total_records + 1);
+        SigMapPacket map;
+        map.first_block = query.first_block;
+        map.echo_timestamp = query.timestamp;
+        if (basis->ready()) {
+            uint32_t count = min(min((uint32_t)query.count, SIG_MAP_BLOCKS),
+                                 basis->num_blocks() - query.first_block);
+            for (uint32_t i = 0; i < count; i++) {
+                map.sigs.push_back(basis->signature(query.first_block + i));
+            }
+            if (verbose && !signatures_logged) {
+                signatures_logged = true;
+                uint64_t bytes = (uint64_t)basis->num_blocks() * basis->get_block_size();
+                printf("Signatures: %u block(s) in %.1f ms (%.2f GB/s, %zu thread(s), %s)\n",
+                       basis->num_blocks(), basis->seconds() * 1000.0,
+                       bytes / max(basis->seconds(), 1e-9) / 1e9, basis->threads(),
+                       delta_weak_simd() ? "AVX2" : "scalar");
+            }
+        }
         
-        send_file_hdr_ack();
-        return true;
+        uint8_t buffer[MAX_UDP_PAYLOAD];
+        size_t size = map.serialize(buffer, MAX_UDP_PAYLOAD);
+        send_packet(st, buffer, size);
     }
     
-    // Process DATA packet
-    void process_data_packet(const uint8_t* buffer, size_t size) {
-        DataPacket pkt;
-        pkt.deserialize(buffer, size);
+    // Apply a DELTA_COPY: copy the blocks it names from the older copy to
+    // their place in the new file, once per packet, and acknowledge it
+    void apply_delta_copies(ReceiveStream& st, const DeltaCopyPacket& pkt) {
+        if (pkt.total_entries == 0 || pkt.first_entry % DELTA_COPY_ENTRIES != 0 ||
+            pkt.first_entry >= pkt.total_entries) {
+            return;
+        }
+        if (copies_done.empty()) {
+            if (!basis) return;
+            copies_total = pkt.total_entries;
+            copies_done.assign((copies_total + DELTA_COPY_ENTRIES - 1) / DELTA_COPY_ENTRIES, 0);
+            copy_packets_left = copies_done.size();
+        }
+        if (pkt.total_entries != copies_total) return;
         
-        // Extract records from packet
-        size_t data_offset = 0;
-        for (int i = 0; i < pkt.num_segments; i++) {
-            uint32_t start = pkt.segments[i].start_record;
-            uint32_t end = pkt.segments[i].end_record;
-            
-            for (uint32_t rec = start; rec <= end; rec++) {
-                if (rec >= 1 && rec <= total_records) {
-                    record_buffer[rec].resize(record_size);
-                    memcpy(record_buffer[rec].data(), 
-                          pkt.data.data() + data_offset, 
-                          record_size);
-                    received_records[rec] = true;
-                    data_offset += record_size;
+        // A file being finalized has every record; late copies only get
+        // their acknowledgement
+        size_t index = pkt.first_entry / DELTA_COPY_ENTRIES;
+        if (!finalizing && !copies_done[index] && basis && sink.is_open()) {
+            for (const DeltaCopy& copy : pkt.copies) {
+                // A copy that cannot be made leaves its records to be sent
+                const uint8_t* src = basis->blocks_at(copy.block, copy.count);
+                uint64_t len = (uint64_t)copy.count * record_size;
+                if (src && sink.write_at(copy.offset, src, len)) {
+                    copied.push_back(make_pair(copy.offset, copy.offset + len));
                 }
             }
+            copies_done[index] = 1;
+            if (--copy_packets_left == 0) {
+                hold_copied_records();
+            }
         }
+        
+        DeltaAckPacket ack;
+        ack.first_entry = pkt.first_entry;
+        ack.echo_timestamp = pkt.timestamp;
+        uint8_t buffer[16];
+        size_t size = ack.serialize(buffer);
+        send_packet(st, buffer, size);
     }
     
-    // Find missing records in range
-    vector<Segment> find_missing_records(uint32_t start_rec, uint32_t end_rec) {
-        vector<Segment> missing;
-        
-        uint32_t segment_start = 0;
-        bool in_segment = false;
-        
-        for (uint32_t rec = start_rec; rec <= end_rec; rec++) {
-            if (!received_records[rec]) {
-                if (!in_segment) {
-                    segment_start = rec;
-                    in_segment = true;
-                }
-            } else {
-                if (in_segment) {
-                    missing.push_back(Segment(segment_start, rec - 1));
-                    in_segment = false;
+    // Every copy is made: mark the records they filled completely as
+    // received, journal them, and let go of the older copy
+    void hold_copied_records() {
+        sort(copied.begin(), copied.end());
+        uint64_t start = 0, end = 0;
+        auto hold = [this](uint64_t begin, uint64_t finish) {
+            // Records lying wholly inside [begin, finish)
+            uint64_t first = (begin + record_size - 1) / record_size + 1;
+            uint64_t last = finish >= file_size ? total_records : finish / record_size;
+            for (uint64_t rec = first; rec <= last; rec++) {
+                if (received_records.set((uint32_t)rec)) {
+                    num_received++;
+                    records_copied++;
                 }
             }
+        };
+        for (const auto& range : copied) {
+            if (range.first > end) {
+                if (end > start) hold(start, end);
+                start = range.first;
+            }
+            end = max(end, range.second);
         }
+        if (end > start) hold(start, end);
         
-        // Close last segment if needed
-        if (in_segment) {
-            missing.push_back(Segment(segment_start, end_rec));
+        for (auto& st : streams) {
+            st->stripe_received = received_records.count(st->first_record, st->last_record);
+            st->active = !st->stripe_complete();
+        }
+        if (journal.is_open() && !journal_failed &&
+            !journal.checkpoint(sink.descriptor(), received_records, 1, total_records)) {
+            journal_failed = true;
+            cerr << "Warning: Cannot update the journal of " << partial_path
+                 << ", this transfer will not be resumable" << endl;
+        }
+        if (verbose) {
+            cout << "Delta: " << records_copied << " of " << total_records << " records copied from "
+                 << basis->path() << " (" << copies_total << " copy run(s))" << endl;
+        }
+        basis.reset();
+        copied.clear();
+    }
+    
+    // Create the entries of a MANIFEST packet and acknowledge it; a packet
+    // that cannot be taken is left unanswered, and the sender gives up
+    void add_manifest(ReceiveStream& st, const ManifestPacket& pkt) {
+        if (!tree || pkt.total_entries != tree->num_entries()) {
+            return;
+        }
+        // A tree being finalized has every entry; a late part is only
+        // acknowledged
+        bool was_ready = tree->is_ready();
+        if (!finalizing && !tree->add_entries(pkt.first_entry, pkt.entries)) {
+            cerr << "Error: Cannot create the entries of " << output_path << " from "
+                 << pkt.first_entry << " on" << endl;
+            return;
+        }
+        if (verbose && !was_ready && tree->is_ready()) {
+            cout << "Manifest: " << tree->num_entries() << " entries created" << endl;
         }
         
-        return missing;
+        ManifestAckPacket ack;
+        ack.first_entry = pkt.first_entry;
+        ack.echo_timestamp = pkt.timestamp;
+        uint8_t buffer[16];
+        size_t size = ack.serialize(buffer);
+        send_packet(st, buffer, size);
     }
     
     // Send REC_MISS
-    void send_rec_miss(uint32_t start_rec, uint32_t end_rec) {
-        vector<Segment> missing = find_missing_records(start_rec, end_rec);
-        
+    void send_rec_miss(ReceiveStream& st, const BlastOverPacket& blast_over) {
         RecMissPacket rec_miss;
-        rec_miss.num_missing = min((int)missing.size(), MAX_MISSING_SEGMENTS);
-        for (int i = 0; i < rec_miss.num_missing; i++) {
-            rec_miss.missing[i] = missing[i];
-        }
+        rec_miss.start_record = blast_over.start_record;
+        rec_miss.end_record = blast_over.end_record;
+        rec_miss.echo_timestamp = blast_over.timestamp;
+        find_missing_records(rec_miss);
+        note_requested(rec_miss);
         
-        uint8_t buffer[MAX_UDP_PAYLOAD];
-        size_t size = rec_miss.serialize(buffer, MAX_UDP_PAYLOAD);
-        send_packet(buffer, size);
+        size_t parts = send_missing(st, rec_miss);
+        metrics.rec_miss_sent.add(parts);
+        if (!rec_miss.missing.empty()) {
+            metrics.missing_segments.record(rec_miss.missing.size());
+        }
         
-        if (rec_miss.num_missing == 0) {
+        if (!verbose) {
+            return;
+        }
+        if (rec_miss.missing.empty()) {
             cout << "Sent REC_MISS: empty (all received)" << endl;
         } else {
-            cout << "Sent REC_MISS: " << rec_miss.num_missing << " missing segment(s)" << endl;
+            cout << "Sent REC_MISS: " << rec_miss.missing.size() << " missing segment(s), "
+                 << rec_miss.missing_records << " record(s) in " << parts << " part(s)" << endl;
+        }
+    }
+    
+    // The newest file of this name an earlier single transfer left
+    // directly under a received_files/<timestamp>/ directory; "" if there
+    // is none. What --server sessions received (in their subdirectories)
+    // belongs to whoever sent it and is never offered.
+    string find_basis() const {
+        string best;
+        struct timespec newest = {0, 0};
+        auto consider = [&](const string& path) {
+            struct stat info;
+            if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode) &&
+                (info.st_mtim.tv_sec > newest.tv_sec ||
+                 (info.st_mtim.tv_sec == newest.tv_sec && info.st_mtim.tv_nsec > newest.tv_nsec))) {
+                best = path;
+                newest = info.st_mtim;
+            }
+        };
+        
+        DIR* top = opendir("received_files");
+        if (!top) return best;
+        while (struct dirent* entry = readdir(top)) {
+            string name = entry->d_name;
+            if (name == "." || name == ".." || name == "partial") continue;
+            consider("received_files/" + name + "/" + output_filename);
+        }
+        closedir(top);
+        return best;
+    }
+    
+    // Take over the partial file and journal an earlier transfer of this
+    // file left in received_files/partial/, or start both afresh. The file
+    // is named after its identity: name, size, record size and the
+    // sender's mtime.
+    bool open_partial_file() {
+        uint32_t id = crc32c((const uint8_t*)output_filename.data(), output_filename.size());
+        id = crc32c((const uint8_t*)&file_size, sizeof(file_size), id);
+        id = crc32c((const uint8_t*)&record_size, sizeof(record_size), id);
+        id = crc32c((const uint8_t*)&file_mtime, sizeof(file_mtime), id);
+        char tag[16];
+        snprintf(tag, sizeof(tag), "%08x", id);
+        
+        mkdir("received_files", 0755);
+        if (mkdir("received_files/partial", 0755) != 0 && errno != EEXIST) {
+            return false;
         }
+        partial_path = "received_files/partial/" + string(tag) + "-" + output_filename;
+        
+        JournalHeader identity;
+        identity.file_size = file_size;
+        identity.record_size = record_size;
+        identity.total_records = total_records;
+        identity.file_mtime = file_mtime;
+        vector<uint64_t> saved;
+        if (!journal.open_journal(partial_path + ".journal", identity,
+                                  received_records.num_words(), saved)) {
+            partial_path.clear();            // e.g. the same file arriving twice at once
+            return false;
+        }
+        
+        if (!saved.empty() && sink.open_file(partial_path, file_size, record_size, true)) {
+            records_held = received_records.restore(saved);
+            num_received = records_held;
+            return true;
+        }
+        if (!journal.reset() || !sink.open_file(partial_path, file_size, record_size)) {
+            journal.remove();
+            partial_path.clear();
+            return false;
+        }
+        return true;
     }
     
-    // Write received file to disk
-    bool write_file_to_disk() {
+    // Create received_files/<timestamp>/[<dir_tag>/] and the preallocated
+    // output file; with a journal the records go to a partial file first
+    // and it is moved there once complete
+    bool open_output_file(const string& dir_tag) {
         // Create timestamp string in IST (UTC+5:30)
         auto now = chrono::system_clock::now();
         auto now_time_t = chrono::system_clock::to_time_t(now);
         
         // Convert to IST by adding 5 hours 30 minutes (19800 seconds)
         now_time_t += 19800;
-        struct tm* timeinfo = gmtime(&now_time_t);  // Use gmtime since we already adjusted
+        struct tm timeinfo;
+        gmtime_r(&now_time_t, &timeinfo);  // Use gmtime since we already adjusted
         
         // Format: YYYYMMDD-H:MM-AM/PM (e.g., 20251029-9:50-PM)
         stringstream timestamp_ss;
-        timestamp_ss << put_time(timeinfo, "%Y%m%d-")
-                    << (timeinfo->tm_hour % 12 == 0 ? 12 : timeinfo->tm_hour % 12)
-                    << put_time(timeinfo, ":%M-%p");
+        timestamp_ss << put_time(&timeinfo, "%Y%m%d-")
+                    << (timeinfo.tm_hour % 12 == 0 ? 12 : timeinfo.tm_hour % 12)
+                    << put_time(&timeinfo, ":%M-%p");
         string timestamp = timestamp_ss.str();
         
         // Create directory structure: received_files/YYYYMMDD-H:MM-AM/PM/
@@ -206,161 +880,986 @@ private:
             return false;
         }
         
-        // Full output path
-        string full_output_path = dir_path + "/" + output_filename;
-        
-        cout << "\nWriting file to disk: " << full_output_path << endl;
-        
-        ofstream output(full_output_path, ios::binary);
-        if (!output.is_open()) {
-            cerr << "Error: Cannot create output file" << endl;
-            return false;
+        // Concurrent sessions may well send files of the same name
+        if (!dir_tag.empty()) {
+            dir_path += "/" + dir_tag;
+            if (mkdir(dir_path.c_str(), 0755) != 0 && errno != EEXIST) {
+                cerr << "Error: Cannot create directory " << dir_path << endl;
+                return false;
+            }
         }
         
-        for (uint32_t rec = 1; rec <= total_records; rec++) {
-            if (!received_records[rec]) {
-                cerr << "Error: Missing record " << rec << endl;
-                output.close();
+        // Full output path
+        output_path = dir_path + "/" + output_filename;
+        
+        // A directory is written in place, file by file, without a journal
+        if (tree_entries > 0) {
+            tree.reset(new TreeSink(worker_count(streams.size())));
+            if (!tree->open_tree(output_path, tree_entries, file_size, record_size)) {
+                cerr << "Error: Cannot create directory " << output_path << endl;
                 return false;
             }
-            
-            size_t bytes_to_write = record_size;
-            if (rec == total_records) {
-                // Last record - only write actual file bytes
-                size_t remaining = file_size % record_size;
-                if (remaining != 0) {
-                    bytes_to_write = remaining;
-                }
+            if (verbose) {
+                cout << "Writing files directly under: " << output_path << "/" << endl;
             }
-            
-            output.write((char*)record_buffer[rec].data(), bytes_to_write);
+            return true;
+        }
+        
+        if (checkpoint_ms > 0 && open_partial_file()) {
+            if (verbose && records_held > 0) {
+                cout << "Resuming: " << records_held << " of " << total_records
+                     << " records already in " << partial_path << endl;
+            } else if (verbose) {
+                cout << "Writing records to: " << partial_path << " (journaled)" << endl;
+            }
+            return true;
+        }
+        if (checkpoint_ms > 0) {
+            cerr << "Warning: No journal for " << output_filename
+                 << ", writing it without one (not resumable)" << endl;
+        }
+        
+        // Do not truncate the older copy under the blocks about to be
+        // copied out of it; the mapping keeps it alive
+        if (basis && basis->path() == output_path) {
+            unlink(output_path.c_str());
+        }
+        if (!sink.open_file(output_path, file_size, record_size)) {
+            cerr << "Error: Cannot create output file " << output_path << endl;
+            return false;
         }
         
-        output.close();
-        cout << "File written successfully to: " << full_output_path << endl;
+        if (verbose) {
+            cout << "Writing records directly to: " << output_path << endl;
+        }
         return true;
     }
 
 public:
-    FileReceiver(int p) : port(p), connection_active(false) {
-        // Create UDP socket
-        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-        if (sockfd < 0) {
-            perror("Socket creation failed");
-            exit(1);
-        }
+    ReceiveSession(bool verbose_log, int checkpoint_interval_ms, const ImpairmentConfig& link)
+        : session_id(0), file_size(0), record_size(0), blast_size(0), total_records(0), tree_entries(0),
+          checkpoint_ms(checkpoint_interval_ms), journal_failed(false), records_held(0),
+          delta_allowed(false), copies_total(0), copy_packets_left(0), records_copied(0), signatures_logged(false),
+          num_received(0), write_failed(false), file_mtime(0), file_crc(0), corrupt_packets(0), verified(false),
+          codec(CODEC_NONE), nack_enabled(false), nack_reorder(0), inflate_pool(NULL),
+          packets_inflated(0), inflate_errors(0), disconnected(false), disconnect_from(NULL),
+          finalizing(false), verdict(DISCONNECT_PENDING), verbose(verbose_log), impair(link),
+          metrics(ReceiverMetrics::get()) {}
+    
+    // Set the transfer up from its FILE_HDR. Stream i replies on sockets[i];
+    // there must be one socket per stream. memory_limit (bytes, 0 = none)
+    // caps record tracking plus pending FEC groups; a transfer whose
+    // tracking alone does not fit is refused, FEC is trimmed to what is left.
+    bool start(const FileHeaderPacket& hdr, const vector<int>& sockets,
+               size_t memory_limit, const string& dir_tag) {
+        session_id = hdr.session_id;
+        file_size = hdr.file_size;
+        file_mtime = hdr.file_mtime;
+        codec = codec_available(hdr.codec) ? hdr.codec : (uint8_t)CODEC_NONE;
+        record_size = hdr.record_size;
+        blast_size = hdr.blast_size;
+        start_time = chrono::steady_clock::now();
         
-        memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_addr.s_addr = INADDR_ANY;
-        server_addr.sin_port = htons(port);
+        if (record_size != 256 && record_size != 512 && record_size != 1024) {
+            cerr << "Error: Unsupported record size " << record_size << endl;
+            return false;
+        }
+        if (blast_size == 0) {
+            cerr << "Error: Blast size must be positive" << endl;
+            return false;
+        }
+        if ((file_size + record_size - 1) / record_size > UINT32_MAX - 1) {
+            cerr << "Error: File too large" << endl;
+            return false;
+        }
+        total_records = (file_size + record_size - 1) / record_size;
+        tree_entries = hdr.tree_entries;
         
-        if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            perror("Bind failed");
-            exit(1);
+        // Keep only the last path component of whatever the sender named it
+        char name[MAX_FILENAME_LEN];
+        memcpy(name, hdr.filename, MAX_FILENAME_LEN);
+        name[MAX_FILENAME_LEN - 1] = '\0';
+        output_filename = name;
+        size_t last_slash = output_filename.find_last_of("/\\");
+        if (last_slash != string::npos) {
+            output_filename = output_filename.substr(last_slash + 1);
+        }
+        if (output_filename.empty() || output_filename == "." || output_filename == "..") {
+            cerr << "Error: Invalid filename" << endl;
+            return false;
         }
         
-        cout << "Receiver listening on port " << port << endl;
-    }
-    
-    ~FileReceiver() {
-        close(sockfd);
-    }
-    
-    bool run() {
-        uint8_t buffer[MAX_UDP_PAYLOAD];
-        size_t size;
+        if (hdr.records_per_packet < 1 || hdr.records_per_packet > MAX_RECORDS_PER_PACKET ||
+            data_header_size(1) + (size_t)hdr.records_per_packet * record_size > MAX_UDP_PAYLOAD) {
+            cerr << "Error: Invalid records per packet " << hdr.records_per_packet << endl;
+            return false;
+        }
         
-        // Phase 1: Wait for FILE_HDR
-        while (true) {
-            if (recv_packet(buffer, size)) {
-                if (buffer[0] == FILE_HDR) {
-                    process_file_hdr(buffer, size);
-                    connection_active = true;
-                    break;
-                }
-            }
+        uint32_t num_streams = max(1, (int)hdr.num_streams);
+        if (num_streams != sockets.size()) {
+            cerr << "Error: " << num_streams << " streams but " << sockets.size()
+                 << " sockets" << endl;
+            return false;
         }
         
-        // Phase 2: Receive data
-        uint32_t expected_blast_start = 1;
+        FecLayout layout;
+        layout.blast_size = blast_size;
+        layout.group_packets = hdr.fec_group;
+        layout.stride = hdr.records_per_packet;
+        layout.total_records = total_records;
         
-        while (connection_active) {
-            // Receive packets until IS_BLAST_OVER or DISCONNECT
-            while (true) {
-                if (!recv_packet_timeout(buffer, size, 10)) {
-                    continue;  // Timeout, keep waiting
-                }
-                
-                PacketType type = (PacketType)buffer[0];
-                
-                if (type == DATA) {
-                    process_data_packet(buffer, size);
-                }
-                else if (type == IS_BLAST_OVER) {
-                    BlastOverPacket blast_over;
-                    blast_over.deserialize(buffer);
-                    
-                    cout << "\nReceived IS_BLAST_OVER(" << blast_over.start_record 
-                         << ", " << blast_over.end_record << ")" << endl;
-                    
-                    // Send REC_MISS
-                    send_rec_miss(blast_over.start_record, blast_over.end_record);
-                    
-                    // Check if this blast is complete
-                    vector<Segment> missing = find_missing_records(
-                        blast_over.start_record, blast_over.end_record);
-                    
-                    if (missing.empty()) {
-                        expected_blast_start = blast_over.end_record + 1;
-                        
-                        // Check if all records received
-                        if (blast_over.end_record >= total_records) {
-                            cout << "\nAll data received!" << endl;
-                            break;  // Exit inner loop
-                        }
-                    }
-                }
-                else if (type == DISCONNECT) {
-                    cout << "\nReceived DISCONNECT" << endl;
-                    connection_active = false;
-                    break;
+        // Parity repairs gaps without a round trip, and compressed records
+        // are stored as the pool finishes them, out of order
+        nack_enabled = hdr.nack && hdr.fec_group == 0 && codec == CODEC_NONE;
+        nack_reorder = NACK_REORDER_PACKETS * hdr.records_per_packet;
+        
+        size_t tracking = (size_t)total_records / 8 + 8 +
+                          ((size_t)total_records / blast_size + 1) * sizeof(uint32_t) +
+                          (size_t)tree_entries * TreeSink::entry_bytes();
+        size_t group_limit = 0;
+        if (memory_limit > 0) {
+            if (tracking > memory_limit) {
+                cerr << "Error: Tracking " << total_records << " records needs "
+                     << tracking << " bytes, session limit is " << memory_limit << endl;
+                return false;
+            }
+            group_limit = (memory_limit - tracking) / num_streams /
+                          FecDecoder::group_bytes(layout, record_size);
+            if (group_limit == 0) {
+                layout.group_packets = 0;  // not even one group fits, go without
+            }
+        }
+        
+        if (verbose) {
+            cout << "\n=== File Header Received ===" << endl;
+            cout << "Filename: " << output_filename << endl;
+            if (tree_entries > 0) {
+                cout << "Directory: " << tree_entries << " entries" << endl;
+            }
+            cout << "File size: " << file_size << " bytes" << endl;
+            cout << "Record size: " << record_size << " bytes" << endl;
+            cout << "Blast size: " << blast_size << " records" << endl;
+            cout << "Total records: " << total_records << endl;
+            if (layout.enabled()) {
+                cout << "FEC: 1 parity packet per " << layout.group_packets << " DATA packets" << endl;
+            }
+            if (codec != CODEC_NONE) {
+                cout << "Compression: " << codec_name(codec) << " (level "
+                     << (int)hdr.codec_level << ")" << endl;
+            } else if (hdr.codec != CODEC_NONE) {
+                cout << "Compression: " << codec_name(hdr.codec)
+                     << " offered but not supported here, asking for raw" << endl;
+            }
+            if (num_streams > 1) {
+                cout << "Streams: " << num_streams << endl;
+            }
+        }
+        
+        streams.clear();
+        for (uint32_t i = 0; i < num_streams; i++) {
+            streams.push_back(unique_ptr<ReceiveStream>(new ReceiveStream(sockets[i])));
+            ReceiveStream& st = *streams[i];
+            if (impair.active()) {
+                st.link.reset(new ImpairedLink(sockets[i], impair, impair.seed + i));
+            }
+            stripe_range(total_records, blast_size, num_streams, i,
+                         st.first_record, st.last_record);
+            st.highest_seen = st.first_record - 1;
+            st.fec.configure(layout, record_size, group_limit);
+        }
+        
+        // --delta: an older copy to offer the sender, found before the
+        // output file is created in case that is where it lives
+        if (hdr.delta && delta_allowed && tree_entries == 0) {
+            string path = find_basis();
+            basis.reset(new BasisFile());
+            if (path.empty() || !basis->open(path, record_size)) {
+                basis.reset();
+            }
+        }
+        
+        // Initialize tracking and the preallocated output file
+        received_records.reset(total_records, blast_size);
+        requested_records.reset(total_records, blast_size);
+        if (!open_output_file(dir_tag)) {
+            return false;
+        }
+        
+        // Resuming beats delta: the records held are the new file's own
+        if (basis && records_held > 0) {
+            basis.reset();
+        }
+        if (basis) {
+            basis->build(worker_count(num_streams));
+            if (verbose) {
+                cout << "Delta: signing " << basis->num_blocks() << " block(s) of "
+                     << basis->path() << " on " << basis->threads() << " thread(s)" << endl;
+            }
+        } else if (hdr.delta && verbose) {
+            cout << "Delta: no older copy of " << output_filename << ", receiving it whole" << endl;
+        }
+        
+        // A resumed transfer may have whole stripes in already
+        for (auto& st : streams) {
+            st->stripe_received = received_records.count(st->first_record, st->last_record);
+            st->active = !st->stripe_complete();
+        }
+        return true;
+    }
+    
+    uint32_t id() const { return session_id; }
+    uint64_t get_file_size() const { return file_size; }
+    const string& get_output_filename() const { return output_filename; }
+    const string& get_output_path() const { return output_path; }
+    size_t num_streams() const { return streams.size(); }
+    ReceiveStream& stream(size_t i) { return *streams[i]; }
+    bool is_complete() const {
+        return num_received == total_records && (!tree || tree->is_ready());
+    }
+    bool is_disconnected() const { return disconnected; }
+    bool is_finalized() const { return verdict != DISCONNECT_PENDING; }
+    uint8_t disconnect_status() const { return verdict; }
+    int output_fd() const { return sink.descriptor(); }
+    uint8_t compression() const { return codec; }
+    void set_inflate_pool(WorkerPool* pool) { inflate_pool = pool; }
+    void allow_delta() { delta_allowed = true; }   // before start()
+    void report_write_error() { write_failed = true; }
+    
+    double elapsed_sec() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    }
+    
+    uint32_t corrupt_dropped() const { return corrupt_packets; }
+    bool impaired() const { return impair.active(); }
+    
+    LinkCounters link_counters() const {
+        LinkCounters total;
+        for (const auto& st : streams) {
+            if (st->link) total += st->link->get_counters();
+        }
+        return total;
+    }
+    uint32_t compressed_packets() const { return packets_inflated; }
+    uint32_t compressed_errors() const { return inflate_errors; }
+    uint32_t copied_records() const { return records_copied; }
+    
+    uint32_t fec_recovered() const {
+        uint32_t total = 0;
+        for (const auto& st : streams) {
+            total += st->fec_recovered;
+        }
+        return total;
+    }
+    
+    // Tell the sender what became of the file, or that it is still being
+    // checked
+    void send_disconnect_ack(ReceiveStream& st) {
+        DisconnectAckPacket ack;
+        ack.status = verdict;
+        uint8_t buffer[16];
+        size_t size = ack.serialize(buffer);
+        send_packet(st, buffer, size);
+        if (verbose) {
+            cout << "Sent DISCONNECT_ACK (" << (ack.status == DISCONNECT_VERIFIED ? "verified" :
+                    ack.status == DISCONNECT_FAILED ? "failed" : "pending") << ")" << endl;
+        }
+    }
+    
+    // Answer a DISCONNECT that came in before the file was finalized
+    void answer_disconnect() {
+        if (disconnected) {
+            send_disconnect_ack(*disconnect_from);
+        }
+    }
+    
+    // Send FILE_HDR_ACK, echoing the timestamp of the FILE_HDR it answers
+    void send_file_hdr_ack(ReceiveStream& st, const FileHeaderPacket& hdr) {
+        FileHeaderAckPacket ack;
+        ack.echo_timestamp = hdr.timestamp;
+        ack.codec = codec;
+        ack.records_held = records_held;
+        ack.basis_blocks = basis ? basis->num_blocks() : 0;
+        uint8_t buffer[16];
+        size_t size = ack.serialize(buffer);
+        send_packet(st, buffer, size);
+        if (verbose) {
+            cout << "Sent FILE_HDR_ACK" << endl;
+        }
+    }
+    
+    // Handle one packet during the data transfer phase; ends the stream's
+    // data phase once its stripe is complete, and the session on DISCONNECT
+    void handle_packet(ReceiveStream& st, const uint8_t* buffer, size_t size) {
+        PacketType type = (PacketType)buffer[0];
+        
+        // A damaged DATA or parity packet counts as lost: its records are
+        // simply reported missing again
+        if ((type == DATA || type == DATA_COMPRESSED || type == FEC_PARITY) &&
+            !packet_intact(buffer, size)) {
+            corrupt_packets++;
+            metrics.corrupt_packets.add();
+            return;
+        }
+        // Once finalize() is under way the file is not written any more;
+        // from then on packets are only answered
+        if (finalizing && (type == DATA || type == DATA_COMPRESSED || type == FEC_PARITY)) {
+            return;
+        }
+        
+        if (type == DATA) {
+            process_data_packet(st, buffer, size);
+        }
+        else if (type == DATA_COMPRESSED) {
+            process_compressed_packet(st, buffer, size);
+        }
+        else if (type == FEC_PARITY) {
+            process_parity_packet(st, buffer, size);
+        }
+        else if (type == IS_BLAST_OVER) {
+            BlastOverPacket blast_over;
+            blast_over.deserialize(buffer);
+            
+            if (verbose) {
+                cout << "\nReceived IS_BLAST_OVER(" << blast_over.start_record
+                     << ", " << blast_over.end_record << ")" << endl;
+            }
+            
+            // Send REC_MISS, counting whatever is still being decompressed
+            // unless finalize() has the file (and the journal) by now
+            if (!finalizing) {
+                drain_inflated(st, true);
+            }
+            drop_holes(st, blast_over.end_record);
+            send_rec_miss(st, blast_over);
+            if (!finalizing) {
+                maybe_checkpoint(st);
+            }
+            
+            // Blasts may complete out of order when the sender pipelines
+            // them, so finish once every record of the stripe is in
+            if (st.stripe_complete()) {
+                st.active = false;
+            }
+        }
+        else if (type == RESUME_QUERY) {
+            ResumeQueryPacket query;
+            if (query.deserialize(buffer, size) > 0) {
+                send_resume_map(st, query);
+            }
+        }
+        else if (type == SIG_QUERY) {
+            SigQueryPacket query;
+            if (query.deserialize(buffer, size) > 0) {
+                send_sig_map(st, query);
+            }
+        }
+        else if (type == DELTA_COPY) {
+            DeltaCopyPacket pkt;
+            if (pkt.deserialize(buffer, size) > 0) {
+                apply_delta_copies(st, pkt);
+            }
+        }
+        else if (type == MANIFEST) {
+            ManifestPacket pkt;
+            if (pkt.deserialize(buffer, size) > 0) {
+                add_manifest(st, pkt);
+            }
+        }
+        else if (type == DISCONNECT) {
+            DisconnectPacket disc;
+            if (disc.deserialize(buffer, size) == 0) {
+                return;
+            }
+            if (verbose) {
+                cout << "\nReceived DISCONNECT" << endl;
+            }
+            {
+                lock_guard<mutex> guard(disconnect_lock);
+                if (!disconnected) {
+                    file_crc = disc.file_crc;
                 }
-                else if (type == FILE_HDR) {
-                    // Sender retransmitting FILE_HDR, resend ACK
-                    send_file_hdr_ack();
+                disconnect_from = &st;
+                disconnected = true;
+            }
+            disconnect_seen.notify_all();
+            // Before finalize() it is answered once the file is checked
+            if (finalizing) {
+                send_disconnect_ack(st);
+            }
+        }
+        else if (type == FILE_HDR) {
+            // Sender retransmitting FILE_HDR, or a stream joining: resend ACK
+            FileHeaderPacket hdr;
+            hdr.deserialize(buffer);
+            if (hdr.session_id == session_id) {
+                send_file_hdr_ack(st, hdr);
+            }
+        }
+    }
+    
+    // The same for a directory: every file is read back for the CRC of the
+    // whole stream, then the filesystem is flushed
+    bool finalize_tree() {
+        if (!tree->is_open()) {
+            return verified;  // Already finalized
+        }
+        if (!is_complete()) {
+            cerr << "Error: " << output_path << " is incomplete (" << num_received << " of "
+                 << total_records << " records" << (tree->is_ready() ? "" : ", manifest partial")
+                 << ")" << endl;
+            tree->finish();
+            return false;
+        }
+        if (write_failed) {
+            cerr << "Error: Records of " << output_path << " were lost writing them" << endl;
+            tree->finish();
+            return false;
+        }
+        if (!disconnected) {
+            cerr << "Error: " << output_path << " cannot be checked, no DISCONNECT with its CRC32C"
+                 << endl;
+            tree->finish();
+            return false;
+        }
+        
+        uint32_t crc;
+        if (!tree->checksum(crc) || crc != file_crc) {
+            fprintf(stderr, "Error: %s fails its checksum (CRC32C %08x, expected %08x)\n",
+                    output_path.c_str(), crc, file_crc);
+            tree->finish();
+            return false;
+        }
+        if (!tree->finish()) {
+            cerr << "Error: Failed to flush " << output_path << endl;
+            return false;
+        }
+        verified = true;
+        
+        if (verbose) {
+            cout << "Directory written successfully to: " << output_path << " ("
+                 << tree_entries << " entries)" << endl;
+        }
+        return true;
+    }
+    
+    // Check that every record made it to disk and flush the output file
+    bool finalize_file() {
+        if (!sink.is_open()) {
+            return verified;  // Already finalized
+        }
+        
+        bool complete = true;
+        received_records.for_each_missing(1, total_records, [this, &complete](uint32_t rec, uint32_t) {
+            cerr << "Error: Missing record " << rec << " of " << output_path << endl;
+            complete = false;
+            return false;
+        });
+        // Whole, but with nothing to check it against it is kept to resume
+        if (complete && !disconnected) {
+            cerr << "Error: " << output_path << " cannot be checked, no DISCONNECT with its CRC32C"
+                 << endl;
+            complete = false;
+        }
+        if (!complete) {
+            // Keep what arrived for the next try; records lost writing
+            // them must not make it into the journal
+            if (!write_failed) {
+                for (auto& st : streams) {
+                    checkpoint(*st);
                 }
             }
+            if (journal.is_open() && !journal_failed) {
+                cerr << "Kept " << num_received << " of " << total_records << " records in "
+                     << partial_path << " to resume from" << endl;
+            }
+            sink.finish();
+            return false;
+        }
+        if (write_failed) {
+            cerr << "Error: Records of " << output_path << " were lost writing them" << endl;
+            sink.finish();
+            return false;
+        }
+        
+        // End to end: what is on disk must hash to what the sender hashed
+        uint32_t crc;
+        if (!sink.checksum(crc) || crc != file_crc) {
+            fprintf(stderr, "Error: %s fails its checksum (CRC32C %08x, expected %08x)\n",
+                    output_path.c_str(), crc, file_crc);
+            sink.finish();
+            if (!partial_path.empty()) {
+                unlink(partial_path.c_str());    // nothing in it can be trusted
+                journal.remove();
+                rmdir("received_files/partial");  // fails unless it is now empty
+            }
+            return false;
+        }
+        
+        if (!sink.finish()) {
+            cerr << "Error: Failed to flush " << output_path << endl;
+            return false;
+        }
+        if (!partial_path.empty()) {
+            if (rename(partial_path.c_str(), output_path.c_str()) != 0) {
+                cerr << "Error: Cannot move " << partial_path << " to " << output_path << endl;
+                return false;
+            }
+            journal.remove();
+            rmdir("received_files/partial");  // fails unless it is now empty
+        }
+        verified = true;
+        
+        if (verbose) {
+            cout << "File written successfully to: " << output_path << endl;
+        }
+        return true;
+    }
+    
+    // Wait up to seconds for DISCONNECT, which brings the CRC32C the file
+    // is checked against; false if it did not come
+    bool wait_for_disconnect(int seconds) {
+        unique_lock<mutex> guard(disconnect_lock);
+        return disconnect_seen.wait_for(guard, chrono::seconds(seconds),
+                                        [this] { return (bool)disconnected; });
+    }
+    
+    // No more writes: from here on handle_packet only answers. Called
+    // before finalize() is started on another thread, so that no packet
+    // handler can be halfway through writing when it begins.
+    void stop_writing() {
+        finalizing = true;
+    }
+    
+    // Finalize the file or directory; the outcome is what a DISCONNECT is
+    // answered with from then on. Other threads may still be answering
+    // late packets meanwhile, provided stop_writing() came first.
+    bool finalize() {
+        finalizing = true;
+        bool ok = tree ? finalize_tree() : finalize_file();
+        verdict = ok ? DISCONNECT_VERIFIED : DISCONNECT_FAILED;
+        return ok;
+    }
+};
+
+// ============================================================================
+// RECEIVER CLASS
+// ============================================================================
+
+// One transfer, then exit: stream 0 on the listening port, stream i on
+// port + i with a thread of its own.
+class FileReceiver {
+private:
+    int sockfd;
+    struct sockaddr_in server_addr;
+    int port;
+    
+    vector<int> sockets;                 // one per stream, sockets[0] == sockfd
+    ReceiveSession session;
+    string io;                           // --io: sync, uring or pipeline
+    unique_ptr<WorkerPool> inflate_pool; // compressed transfers; stopped before the session goes
+    
+    // Receive packet
+    bool recv_packet(ReceiveStream& st, uint8_t* buffer, size_t& size) {
+        st.sender_addr_len = sizeof(st.sender_addr);
+        ssize_t n = recvfrom(st.sockfd, buffer, MAX_UDP_PAYLOAD, 0,
+                            (struct sockaddr*)&st.sender_addr, &st.sender_addr_len);
+        if (n < 0) {
+            return false;
+        }
+        size = n;
+        return true;
+    }
+    
+    // Bind the sockets for streams 1..n-1 on the ports after ours
+    bool open_streams(uint32_t count) {
+        for (uint32_t i = 1; i < count; i++) {
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd < 0) {
+                perror("Socket creation failed");
+                return false;
+            }
+            
+            int rcvbuf = SOCKET_BUFFER_SIZE;
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+            enable_udp_gro(fd);
+            enable_rxq_ovfl(fd);
             
-            if (!connection_active || expected_blast_start > total_records) {
-                break;
+            struct sockaddr_in addr = server_addr;
+            addr.sin_port = htons(port + i);
+            if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+                perror("Bind failed for stream socket");
+                close(fd);
+                return false;
+            }
+            sockets.push_back(fd);
+        }
+        return true;
+    }
+    
+    // Every stream stays up until the whole file is in, even once its own
+    // stripe is (or when it is empty): stream 0 answers the sender's
+    // RESUME_QUERYs and the others the FILE_HDR their sender socket joins with
+    bool keep_receiving(const ReceiveStream& st) {
+        if (session.is_disconnected()) return false;
+        return st.active || !session.is_complete();
+    }
+    
+    // How long a stream waits for its socket before checking again; one
+    // whose stripe is done checks often, so it ends soon after the file
+    int receive_wait_ms(const ReceiveStream& st) const {
+        return st.active ? 1000 : 10;
+    }
+    
+    // Hand every datagram of a batch to the session
+    void place_batch(ReceiveStream& st, RecvBatch& batch) {
+        uint64_t datagrams = 0, bytes = 0;
+        batch.for_each_datagram([&](const uint8_t* data, size_t len,
+                                    const struct sockaddr_in& addr, socklen_t addr_len) {
+            st.sender_addr = addr;
+            st.sender_addr_len = addr_len;
+            session.handle_packet(st, data, len);
+            datagrams++;
+            bytes += len;
+        });
+        ReceiverMetrics::get().on_batch(datagrams, bytes);
+    }
+    
+    // Data phase of one stream, RECV_BATCH_SIZE datagrams per syscall. The
+    // short timeout lets stripe threads notice a DISCONNECT seen on stream 0.
+    void run_stream(ReceiveStream& st) {
+        if (io == "uring" && run_stream_uring(st)) {
+            return;
+        }
+        if (io == "pipeline" && run_stream_pipeline(st)) {
+            return;
+        }
+        
+        RecvBatch recv_batch(RECV_BATCH_SIZE, GRO_BUFFER_SIZE);
+        int recv_timeout_sec = -1;
+        set_recv_timeout(st.sockfd, 1, recv_timeout_sec);
+        struct pollfd pfd;
+        pfd.fd = st.sockfd;
+        pfd.events = POLLIN;
+        
+        ReceiverMetrics& metrics = ReceiverMetrics::get();
+        while (keep_receiving(st)) {
+            // Take whatever is queued without blocking, so the syscall is
+            // timed without the wait; an empty socket is waited on apart
+            auto start = chrono::steady_clock::now();
+            int count = recv_batch.receive(st.sockfd, MSG_DONTWAIT);
+            if (count == 0) {
+                poll(&pfd, 1, receive_wait_ms(st));   // timeout: keep waiting
+                continue;
+            }
+            metrics.recv_ns.record(elapsed_ns(start) / count);
+            uint32_t dropped = recv_batch.kernel_drops(st.drops_seen);
+            if (dropped > 0) metrics.kernel_drops.add(dropped);
+            place_batch(st, recv_batch);
+        }
+    }
+    
+    // The data phase as a pipeline: a drain thread takes the datagrams off the
+    // socket and a disk thread writes the records, this thread only places
+    // them. False if the drain thread cannot run (or fails), so the caller
+    // runs the blocking loop for whatever is left.
+    bool run_stream_pipeline(ReceiveStream& st) {
+        ReceiverMetrics& metrics = ReceiverMetrics::get();
+        DrainStage drain(metrics.drain, metrics.recv_ns, metrics.kernel_drops, st.drops_seen);
+        DiskWriter writer(metrics.disk, metrics.chunk_write_ns);
+        if (!drain.start(st.sockfd)) {
+            cerr << "Warning: Cannot start the receive pipeline (" << strerror(errno)
+                 << "), using blocking I/O" << endl;
+            return false;
+        }
+        
+        bool file_writes = session.output_fd() >= 0;   // a directory is written file by file
+        if (file_writes) {
+            writer.start(session.output_fd());
+            st.writer = &writer;
+        }
+        if (&st == &session.stream(0)) {
+            cout << "I/O: pipeline (drain, placement and disk threads per stream)" << endl;
+        }
+        while (keep_receiving(st) && !drain.ended_early()) {
+            RecvBatch* batch = drain.next(0);
+            if (!batch) {
+                writer.kick();               // let the disk work while we wait
+                batch = drain.next(receive_wait_ms(st));
+                if (!batch) continue;
+            }
+            place_batch(st, *batch);
+            drain.release(batch);
+        }
+        
+        // Whatever the drain took off the socket is handled as the blocking
+        // loop would have, had it come in just before the end
+        bool failed = drain.ended_early();
+        drain.stop();
+        while (RecvBatch* batch = drain.next(0)) {
+            place_batch(st, *batch);
+            drain.release(batch);
+        }
+        if (file_writes && !writer.flush()) {
+            session.report_write_error();
+        }
+        st.writer = NULL;
+        if (failed) {
+            cerr << "Warning: Receive pipeline failed, using blocking I/O" << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // The same through io_uring: a multishot receive feeds datagrams in as
+    // they land and records go to disk through async writes, all driven
+    // from this thread. False if io_uring cannot be used (or stops
+    // working), so the caller runs the blocking loop for whatever is left.
+    bool run_stream_uring(ReceiveStream& st) {
+        IoUring ring;
+        vector<uint8_t> ops(1, IORING_OP_RECVMSG);
+        MultishotReceiver receiver;
+        UringFileWriter writer;
+        bool file_writes = session.output_fd() >= 0;   // a directory is written file by file
+        if (!ring.init(256, ops) ||
+            !receiver.init(ring, st.sockfd, 1, URING_RECV_BUFFERS, GRO_BUFFER_SIZE) ||
+            (file_writes && !writer.init(session.output_fd()))) {
+            string why = !ring.error().empty() ? ring.error() :
+                         !writer.error().empty() ? writer.error() : "no provided buffer rings";
+            cerr << "Warning: io_uring unavailable (" << why << "), using blocking I/O" << endl;
+            return false;
+        }
+        
+        if (&st == &session.stream(0)) {
+            cout << "I/O: io_uring" << endl;
+        }
+        st.writer = file_writes ? &writer : NULL;
+        int error = 0;
+        while (keep_receiving(st) && error == 0) {
+            if (!receiver.is_armed()) receiver.arm();
+            if (ring.ready() == 0) {
+                writer.kick();               // let the disk work while we wait
+                ring.submit_and_wait(1, receive_wait_ms(st));
             }
+            uint64_t datagrams = 0, bytes = 0;
+            ring.reap([&](const struct io_uring_cqe& cqe) {
+                int r = receiver.complete(cqe, [&](const uint8_t* data, size_t len,
+                                                   const struct sockaddr_in& addr, socklen_t addr_len) {
+                    st.sender_addr = addr;
+                    st.sender_addr_len = addr_len;
+                    session.handle_packet(st, data, len);
+                    datagrams++;
+                    bytes += len;
+                });
+                if (r < 0 && error == 0) error = r;
+            });
+            ReceiverMetrics::get().on_batch(datagrams, bytes);
         }
         
-        // Phase 3: Linger
-        cout << "\nEntering linger state for " << LINGER_TIME << " seconds..." << endl;
+        if (!writer.flush()) {
+            session.report_write_error();
+        }
+        st.writer = NULL;
+        if (error != 0) {
+            cerr << "Warning: io_uring receive failed (" << strerror(-error)
+                 << "), using blocking I/O" << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // Answer late IS_BLAST_OVERs (and the FILE_HDRs, RESUME_QUERYs,
+    // DELTA_COPYs and MANIFESTs of a transfer that had every record before
+    // the sender heard back) on every stream while finalize() runs, and the
+    // DISCONNECT once it is done. The session no longer writes anything by
+    // then, so none of these touch the file finalize() is checking. The
+    // linger ends LINGER_QUIET_MS after that answer unless the sender asks
+    // again, or once finalize() is done and the sender has been silent for
+    // LINGER_TIME seconds.
+    void linger() {
+        cout << "\nLingering until DISCONNECT is answered..." << endl;
         
-        auto linger_start = chrono::steady_clock::now();
+        vector<struct pollfd> fds(sockets.size());
+        for (size_t i = 0; i < sockets.size(); i++) {
+            fds[i].fd = sockets[i];
+            fds[i].events = POLLIN;
+        }
+        
+        uint8_t buffer[MAX_UDP_PAYLOAD];
+        size_t size;
+        bool answered = false;
+        bool finalized = false;
+        auto finalized_at = chrono::steady_clock::now();
+        auto last_packet = finalized_at;
         while (true) {
             auto now = chrono::steady_clock::now();
-            auto elapsed = chrono::duration_cast<chrono::seconds>(now - linger_start).count();
-            if (elapsed >= LINGER_TIME) {
-                break;
+            if (!finalized && session.is_finalized()) {
+                finalized = true;
+                finalized_at = now;
+            }
+            if (finalized) {
+                if (!answered && session.is_disconnected()) {
+                    session.answer_disconnect();
+                    answered = true;
+                    last_packet = now;
+                }
+                if ((answered && now - last_packet >= chrono::milliseconds(LINGER_QUIET_MS)) ||
+                    now - max(finalized_at, last_packet) >= chrono::seconds(LINGER_TIME)) {
+                    break;
+                }
             }
             
-            // Still respond to IS_BLAST_OVER during linger
-            if (recv_packet_timeout(buffer, size, 1)) {
-                PacketType type = (PacketType)buffer[0];
-                if (type == IS_BLAST_OVER) {
-                    BlastOverPacket blast_over;
-                    blast_over.deserialize(buffer);
-                    send_rec_miss(blast_over.start_record, blast_over.end_record);
+            // A DISCONNECT waiting on finalize() is answered the moment
+            // it is done
+            int timeout_ms = !finalized && session.is_disconnected() ? 1 : 50;
+            if (poll(fds.data(), fds.size(), timeout_ms) <= 0) {
+                continue;
+            }
+            for (size_t i = 0; i < session.num_streams(); i++) {
+                if (!(fds[i].revents & POLLIN)) continue;
+                ReceiveStream& st = session.stream(i);
+                if (!recv_packet(st, buffer, size)) continue;
+                if (buffer[0] == IS_BLAST_OVER || buffer[0] == FILE_HDR || buffer[0] == RESUME_QUERY ||
+                    buffer[0] == DELTA_COPY || buffer[0] == MANIFEST || buffer[0] == DISCONNECT) {
+                    last_packet = chrono::steady_clock::now();
+                    // Answered in handle_packet once finalized
+                    if (buffer[0] == DISCONNECT && session.is_finalized()) answered = true;
+                    session.handle_packet(st, buffer, size);
                 }
             }
         }
+    }
+
+public:
+    FileReceiver(int p, const string& engine, int checkpoint_ms, const ImpairmentConfig& impair)
+        : port(p), session(true, checkpoint_ms, impair), io(engine) {
+        // Create UDP socket
+        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd < 0) {
+            perror("Socket creation failed");
+            exit(1);
+        }
+        
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
+        
+        // The only sender this receiver serves may have its files as a basis
+        session.allow_delta();
+        
+        // Several blasts can be in flight; give the kernel room to queue them
+        int rcvbuf = SOCKET_BUFFER_SIZE;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        enable_udp_gro(sockfd);
+        enable_rxq_ovfl(sockfd);
+        
+        if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            exit(1);
+        }
+        sockets.push_back(sockfd);
+        
+        cout << "Receiver listening on port " << port << endl;
+    }
+    
+    ~FileReceiver() {
+        for (int fd : sockets) {
+            close(fd);
+        }
+    }
+    
+    bool run() {
+        uint8_t buffer[MAX_UDP_PAYLOAD];
+        ssize_t n;
+        struct sockaddr_in sender_addr;
+        socklen_t sender_addr_len;
+        
+        // Phase 1: Wait for FILE_HDR
+        FileHeaderPacket hdr;
+        while (true) {
+            sender_addr_len = sizeof(sender_addr);
+            n = recvfrom(sockfd, buffer, MAX_UDP_PAYLOAD, 0,
+                         (struct sockaddr*)&sender_addr, &sender_addr_len);
+            if (n > 0 && buffer[0] == FILE_HDR) {
+                hdr.deserialize(buffer);
+                if (hdr.stream_index == 0) {
+                    break;
+                }
+            }
+        }
+        
+        uint32_t num_streams = max(1, min((int)hdr.num_streams, MAX_STREAMS));
+        if (num_streams > 1) {
+            cout << "Stream ports: " << port << "-" << port + num_streams - 1 << endl;
+        }
+        if (!open_streams(num_streams) || !session.start(hdr, sockets, 0, "")) {
+            return false;
+        }
+        
+        ReceiveStream& first = session.stream(0);
+        first.sender_addr = sender_addr;
+        first.sender_addr_len = sender_addr_len;
+        session.send_file_hdr_ack(first, hdr);
+        
+        // Decompress on every core the stream threads leave free
+        if (session.compression() != CODEC_NONE) {
+            inflate_pool.reset(new WorkerPool(worker_count(session.num_streams())));
+            session.set_inflate_pool(inflate_pool.get());
+        }
+        
+        // Phase 2: Receive data, one thread per extra stream
+        vector<thread> workers;
+        for (size_t i = 1; i < session.num_streams(); i++) {
+            ReceiveStream* st = &session.stream(i);
+            workers.push_back(thread([this, st]() { run_stream(*st); }));
+        }
+        run_stream(first);
+        for (auto& w : workers) {
+            w.join();
+        }
+        
+        if (session.is_complete()) {
+            cout << "\nAll data received!" << endl;
+        }
+        if (session.fec_recovered() > 0) {
+            cout << "Records recovered by FEC: " << session.fec_recovered() << endl;
+        }
+        if (session.corrupt_dropped() > 0) {
+            cout << "Corrupt packets dropped: " << session.corrupt_dropped() << endl;
+        }
+        if (session.compressed_packets() > 0) {
+            cout << "Compressed packets: " << session.compressed_packets() << " ("
+                 << codec_name(session.compression()) << ", "
+                 << (inflate_pool ? inflate_pool->size() : 0) << " decompression thread(s))" << endl;
+        }
+        if (session.copied_records() > 0) {
+            cout << "Records copied from the older copy: " << session.copied_records() << endl;
+        }
+        if (session.compressed_errors() > 0) {
+            cout << "Compressed packets that failed to decompress: "
+                 << session.compressed_errors() << endl;
+        }
+        ReceiverMetrics& metrics = ReceiverMetrics::get();
+        if (metrics.records_repaired.get() > 0 || metrics.kernel_drops.get() > 0) {
+            cout << "Records lost and repaired: " << metrics.records_repaired.get() << endl;
+            cout << "Kernel drops (SO_RXQ_OVFL): " << metrics.kernel_drops.get()
+                 << " packet(s) dropped by this host for a full socket buffer,"
+                 << " the rest of the loss was on the path" << endl;
+        }
+        if (session.impaired()) {
+            print_link_counters("replies", session.link_counters());
+        }
+        metrics.print();
         
-        // Write file to disk
-        if (!write_file_to_disk()) {
+        // Phase 3: Every record is already at its offset; check and flush
+        // the file while the linger answers the sender
+        session.stop_writing();
+        thread lingering([this]() { linger(); });
+        session.wait_for_disconnect(LINGER_TIME);   // with the CRC to check against
+        bool written = session.finalize();
+        lingering.join();
+        
+        if (!written) {
             return false;
         }
         
@@ -369,25 +1868,551 @@ public:
     }
 };
 
+// ============================================================================
+// RECEIVER SERVER
+// ============================================================================
+//
+// --server: one long-running process serving many senders at once. A
+// single thread waits on every socket with epoll and hands each datagram
+// to the session its source address belongs to; sessions never block, so
+// hundreds of transfers share the loop. FILE_HDR with stream index 0 opens
+// a session (keyed by the sender's random session id), FILE_HDR with index
+// i on port + i binds that sender socket to stream i. Sessions end on
+// DISCONNECT, which carries the file's CRC32C: the file is checked against
+// it and flushed on a pool of FINALIZE_THREADS, off the loop, which answers
+// DISCONNECT with DISCONNECT_PENDING meanwhile and with DISCONNECT_ACK
+// once the file is checked. For LINGER_TIME after that only the sender's
+// address and the answer are kept, should the DISCONNECT come again. A
+// session without one is finalized after SESSION_IDLE_TIMEOUT seconds of
+// silence, which fails for want of a CRC and keeps what it has to resume.
+
+class ReceiverServer {
+private:
+    struct Session {
+        unique_ptr<ReceiveSession> transfer;
+        string peer;                               // ip:port of stream 0
+        vector<uint64_t> routes;                   // sender addresses bound to it
+        chrono::steady_clock::time_point last_activity;
+        bool finished;
+        bool finalizing;                           // on the pool; kept until it is done
+        
+        Session() : finished(false), finalizing(false) {}
+    };
+    
+    // A session ended by DISCONNECT, as far as a resent DISCONNECT needs
+    struct ClosedRoute {
+        uint8_t status;                            // what DISCONNECT_ACK said
+        chrono::steady_clock::time_point closed_at;
+    };
+    
+    int port;
+    struct sockaddr_in server_addr;
+    vector<int> sockets;                           // port + i, bound on demand
+    vector<uint32_t> drops_seen;                   // SO_RXQ_OVFL count of each socket
+    uint64_t drops_reported;                       // kernel drops already logged
+    int epfd;
+    int finalized_fd;                              // eventfd: a finalize job is done
+    RecvBatch recv_batch;
+    
+    size_t max_sessions;
+    size_t session_memory;                         // bytes
+    int checkpoint_ms;                             // journal checkpoints, 0 = none
+    ImpairmentConfig impair;                       // --impair: every session's replies
+    
+    map<uint32_t, unique_ptr<Session>> sessions;   // by session id
+    map<uint64_t, pair<Session*, uint32_t>> routes;  // sender address -> session, stream
+    map<uint64_t, ClosedRoute> closed;             // stream 0 address -> how it ended
+    uint64_t completed;
+    uint64_t failed;
+    WorkerPool finalizers;                         // destroyed before the sessions it finalizes
+    
+    static const uint32_t FINALIZED_EVENT = UINT32_MAX;  // epoll tag of finalized_fd
+    
+    static uint64_t addr_key(const struct sockaddr_in& addr) {
+        return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+    }
+    
+    static string addr_string(const struct sockaddr_in& addr) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        return string(ip) + ":" + to_string(ntohs(addr.sin_port));
+    }
+    
+    static string session_tag(uint32_t id) {
+        char tag[16];
+        snprintf(tag, sizeof(tag), "%08x", id);
+        return tag;
+    }
+    
+    // Bind port + 0..count-1 that are not bound yet and watch them
+    bool open_sockets(uint32_t count) {
+        while (sockets.size() < count) {
+            uint32_t index = sockets.size();
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd < 0) {
+                perror("Socket creation failed");
+                return false;
+            }
+            
+            int rcvbuf = SOCKET_BUFFER_SIZE;
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+            enable_udp_gro(fd);
+            enable_rxq_ovfl(fd);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            
+            struct sockaddr_in addr = server_addr;
+            addr.sin_port = htons(port + index);
+            if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+                perror("Bind failed");
+                close(fd);
+                return false;
+            }
+            
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u32 = index;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                perror("epoll_ctl failed");
+                close(fd);
+                return false;
+            }
+            sockets.push_back(fd);
+            drops_seen.push_back(0);
+        }
+        return true;
+    }
+    
+    // Open a session (stream index 0) or bind a sender socket to one of its
+    // streams, then acknowledge
+    void handle_file_hdr(const uint8_t* buffer, const struct sockaddr_in& from) {
+        FileHeaderPacket hdr;
+        hdr.deserialize(buffer);
+        auto now = chrono::steady_clock::now();
+        
+        auto it = sessions.find(hdr.session_id);
+        if (it == sessions.end()) {
+            if (hdr.stream_index != 0) {
+                return;  // Join for a session that was refused or is gone
+            }
+            if (active_sessions() >= max_sessions) {
+                cerr << "Refusing " << addr_string(from) << ": " << max_sessions
+                     << " sessions already active" << endl;
+                return;
+            }
+            
+            uint32_t num_streams = max(1, min((int)hdr.num_streams, MAX_STREAMS));
+            if (!open_sockets(num_streams)) {
+                return;
+            }
+            
+            unique_ptr<Session> s(new Session());
+            s->peer = addr_string(from);
+            s->last_activity = now;
+            s->transfer.reset(new ReceiveSession(false, checkpoint_ms, impair));
+            vector<int> stream_sockets(sockets.begin(), sockets.begin() + num_streams);
+            if (!s->transfer->start(hdr, stream_sockets, session_memory,
+                                    session_tag(hdr.session_id))) {
+                cerr << "[" << session_tag(hdr.session_id) << "] refused " << s->peer << endl;
+                return;
+            }
+            
+            cout << "[" << session_tag(hdr.session_id) << "] " << s->peer << " -> "
+                 << s->transfer->get_output_path() << " (" << hdr.file_size << " bytes, "
+                 << num_streams << " stream(s)); " << active_sessions() + 1 << " active" << endl;
+            it = sessions.insert(make_pair(hdr.session_id, move(s))).first;
+        }
+        
+        Session& s = *it->second;
+        if (hdr.stream_index >= s.transfer->num_streams()) {
+            return;
+        }
+        
+        ReceiveStream& st = s.transfer->stream(hdr.stream_index);
+        st.sender_addr = from;
+        st.sender_addr_len = sizeof(from);
+        
+        uint64_t key = addr_key(from);
+        if (routes.find(key) == routes.end()) {
+            s.routes.push_back(key);
+        }
+        routes[key] = make_pair(&s, (uint32_t)hdr.stream_index);
+        s.last_activity = now;
+        s.transfer->send_file_hdr_ack(st, hdr);
+    }
+    
+    void handle_packet(const uint8_t* buffer, size_t size, const struct sockaddr_in& from) {
+        if (size == 0) return;
+        if (buffer[0] == FILE_HDR) {
+            handle_file_hdr(buffer, from);
+            return;
+        }
+        
+        auto r = routes.find(addr_key(from));
+        if (r == routes.end()) {
+            // The DISCONNECT_ACK of a closed session was lost: answer again
+            auto c = closed.find(addr_key(from));
+            if (buffer[0] == DISCONNECT && c != closed.end()) {
+                DisconnectAckPacket ack;
+                ack.status = c->second.status;
+                uint8_t reply[16];
+                size_t len = ack.serialize(reply);
+                sendto(sockets[0], reply, len, 0, (const struct sockaddr*)&from, sizeof(from));
+            }
+            return;  // Not part of any session
+        }
+        
+        Session& s = *r->second.first;
+        ReceiveStream& st = s.transfer->stream(r->second.second);
+        s.last_activity = chrono::steady_clock::now();
+        s.transfer->handle_packet(st, buffer, size);
+        
+        // DISCONNECT brings the CRC the file is checked against
+        if (s.transfer->is_disconnected()) {
+            if (!s.finished) {
+                finish_session(s);
+                s.transfer->answer_disconnect();   // pending, most likely
+            }
+            if (!s.finalizing) {
+                close_session(s);
+            }
+        }
+    }
+    
+    // DISCONNECT has been answered with the verdict: keep only that
+    void close_session(Session& s) {
+        ClosedRoute c;
+        c.status = s.transfer->disconnect_status();
+        c.closed_at = chrono::steady_clock::now();
+        closed[addr_key(s.transfer->stream(0).sender_addr)] = c;
+        remove_session(s.transfer->id());
+    }
+    
+    // Sessions still receiving; lingering ones make room for new senders
+    size_t active_sessions() const {
+        size_t active = 0;
+        for (const auto& entry : sessions) {
+            if (!entry.second->finished) active++;
+        }
+        return active;
+    }
+    
+    // Hand the output file to the pool to be checked and flushed; the
+    // session keeps answering IS_BLAST_OVER (and DISCONNECT, with
+    // DISCONNECT_PENDING) meanwhile
+    void finish_session(Session& s) {
+        s.finished = true;
+        s.finalizing = true;
+        
+        ReceiveSession* t = s.transfer.get();
+        t->stop_writing();
+        int fd = finalized_fd;
+        finalizers.submit([t, fd]() {
+            t->finalize();
+            uint64_t one = 1;
+            if (write(fd, &one, sizeof(one)) < 0) {
+                perror("eventfd write failed");
+            }
+        });
+    }
+    
+    // Report the sessions the pool is done with and give a waiting
+    // DISCONNECT its answer
+    void reap_finalized() {
+        uint64_t count;
+        while (read(finalized_fd, &count, sizeof(count)) > 0) {}
+        
+        vector<Session*> closing;
+        for (auto& entry : sessions) {
+            Session& s = *entry.second;
+            if (!s.finalizing || !s.transfer->is_finalized()) continue;
+            s.finalizing = false;
+            report_session(s);
+            if (s.transfer->is_disconnected()) {
+                s.transfer->answer_disconnect();
+                closing.push_back(&s);
+            }
+        }
+        for (Session* s : closing) {
+            close_session(*s);
+        }
+    }
+    
+    // Log how a finalized session came out
+    void report_session(Session& s) {
+        ReceiveSession& t = *s.transfer;
+        string tag = "[" + session_tag(t.id()) + "] ";
+        if (t.disconnect_status() == DISCONNECT_VERIFIED) {
+            completed++;
+            double secs = t.elapsed_sec();
+            printf("%scomplete: %s, %.3f s, %.2f Mbps\n", tag.c_str(),
+                   t.get_output_path().c_str(), secs,
+                   t.get_file_size() * 8.0 / (max(secs, 1e-6) * 1000000.0));
+        } else {
+            failed++;
+            cerr << tag << "failed: " << t.get_output_path() << endl;
+        }
+        fflush(stdout);
+    }
+    
+    void remove_session(uint32_t id) {
+        auto it = sessions.find(id);
+        if (it == sessions.end()) return;
+        
+        Session* s = it->second.get();
+        for (uint64_t key : s->routes) {
+            auto r = routes.find(key);
+            if (r != routes.end() && r->second.first == s) {
+                routes.erase(r);
+            }
+        }
+        sessions.erase(it);
+    }
+    
+    // Retire lingering sessions and drop silent ones; a session being
+    // finalized stays until the pool is done with it
+    void sweep() {
+        auto now = chrono::steady_clock::now();
+        vector<uint32_t> done;
+        for (auto& entry : sessions) {
+            Session& s = *entry.second;
+            if (s.finalizing) {
+                continue;
+            }
+            if (s.finished) {
+                if (now - s.last_activity >= chrono::seconds(LINGER_TIME)) {
+                    done.push_back(entry.first);
+                }
+            } else if (now - s.last_activity >= chrono::seconds(SESSION_IDLE_TIMEOUT)) {
+                cerr << "[" << session_tag(entry.first) << "] " << s.peer << " timed out" << endl;
+                finish_session(s);             // removed once finalized and silent for LINGER_TIME
+            }
+        }
+        for (uint32_t id : done) {
+            remove_session(id);
+        }
+        for (auto c = closed.begin(); c != closed.end(); ) {
+            if (now - c->second.closed_at >= chrono::seconds(LINGER_TIME)) {
+                c = closed.erase(c);
+            } else {
+                ++c;
+            }
+        }
+    }
+
+public:
+    ReceiverServer(int p, size_t sessions_limit, size_t memory_mb, int checkpoint,
+                   const ImpairmentConfig& link)
+        : port(p), drops_reported(0), epfd(-1), finalized_fd(-1),
+          recv_batch(RECV_BATCH_SIZE, GRO_BUFFER_SIZE),
+          max_sessions(sessions_limit), session_memory(memory_mb * 1024 * 1024),
+          checkpoint_ms(checkpoint), impair(link), completed(0), failed(0),
+          finalizers(FINALIZE_THREADS) {
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
+        
+        epfd = epoll_create1(0);
+        if (epfd < 0) {
+            perror("epoll_create1 failed");
+            exit(1);
+        }
+        if (!open_sockets(1)) {
+            exit(1);
+        }
+        
+        finalized_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = FINALIZED_EVENT;
+        if (finalized_fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, finalized_fd, &ev) < 0) {
+            perror("eventfd failed");
+            exit(1);
+        }
+        
+        cout << "Receiver server listening on port " << port << " (max " << max_sessions
+             << " sessions, " << memory_mb << " MB each)" << endl;
+    }
+    
+    ~ReceiverServer() {
+        for (int fd : sockets) {
+            close(fd);
+        }
+        if (finalized_fd >= 0) close(finalized_fd);
+        if (epfd >= 0) close(epfd);
+    }
+    
+    bool run() {
+        const int MAX_EVENTS = 64;
+        const int BATCHES_PER_EVENT = 4;   // then let other sockets have a turn
+        struct epoll_event events[MAX_EVENTS];
+        ReceiverMetrics& metrics = ReceiverMetrics::get();
+        auto last_sweep = chrono::steady_clock::now();
+        
+        while (true) {
+            int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+            if (n < 0 && errno != EINTR) {
+                perror("epoll_wait failed");
+                return false;
+            }
+            
+            for (int e = 0; e < n; e++) {
+                uint32_t index = events[e].data.u32;
+                if (index == FINALIZED_EVENT) {
+                    reap_finalized();
+                    continue;
+                }
+                for (int b = 0; b < BATCHES_PER_EVENT; b++) {
+                    auto start = chrono::steady_clock::now();
+                    int count = recv_batch.receive(sockets[index]);  // non-blocking
+                    if (count > 0) {
+                        metrics.recv_ns.record(elapsed_ns(start) / count);
+                    }
+                    uint32_t dropped = recv_batch.kernel_drops(drops_seen[index]);
+                    if (dropped > 0) metrics.kernel_drops.add(dropped);
+                    uint64_t datagrams = 0, bytes = 0;
+                    recv_batch.for_each_datagram([&](const uint8_t* data, size_t len,
+                                                     const struct sockaddr_in& addr, socklen_t) {
+                        handle_packet(data, len, addr);
+                        datagrams++;
+                        bytes += len;
+                    });
+                    metrics.on_batch(datagrams, bytes);
+                    if (count < RECV_BATCH_SIZE) break;
+                }
+            }
+            
+            auto now = chrono::steady_clock::now();
+            if (now - last_sweep >= chrono::seconds(1)) {
+                sweep();
+                last_sweep = now;
+                
+                // Loss the senders see that is this host's doing
+                uint64_t drops = metrics.kernel_drops.get();
+                if (drops > drops_reported) {
+                    printf("Kernel drops (SO_RXQ_OVFL): %llu packet(s) in the last second, "
+                           "socket buffers full\n", (unsigned long long)(drops - drops_reported));
+                    fflush(stdout);
+                    drops_reported = drops;
+                }
+            }
+        }
+    }
+};
+
 // ============================================================================
 // MAIN
 // ============================================================================
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        cerr << "Usage: " << argv[0] << " <port>" << endl;
+    // Split --options from the positional arguments
+    vector<string> args;
+    bool server = false;
+    int max_sessions = DEFAULT_MAX_SESSIONS;
+    int session_memory_mb = DEFAULT_SESSION_MEMORY_MB;
+    string io = "sync";
+    int checkpoint_ms = DEFAULT_CHECKPOINT_MS;
+    ImpairmentConfig impair;
+    TelemetryConfig telemetry;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            args.push_back(arg);
+        } else if (arg == "--server") {
+            server = true;
+        } else if (arg == "--max-sessions" && i + 1 < argc) {
+            max_sessions = atoi(argv[++i]);
+        } else if (arg == "--session-memory" && i + 1 < argc) {
+            session_memory_mb = atoi(argv[++i]);
+        } else if (arg == "--io" && i + 1 < argc) {
+            io = argv[++i];
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpoint_ms = atoi(argv[++i]);
+        } else if (arg == "--impair" && i + 1 < argc) {
+            string bad;
+            if (!parse_impairment(argv[++i], impair, bad)) {
+                cerr << "Error: Cannot parse impairment '" << bad << "'" << endl;
+                return 1;
+            }
+        } else if (arg == "--telemetry" && i + 1 < argc) {
+            if (!parse_telemetry(argv[++i], telemetry)) {
+                cerr << "Error: Cannot parse telemetry '" << argv[i] << "'" << endl;
+                return 1;
+            }
+        } else {
+            cerr << "Error: Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    
+    if (args.size() < 1) {
+        cerr << "Usage: " << argv[0] << " <port> [options]" << endl;
+        cerr << "Options:" << endl;
+        cerr << "  --server              keep running and serve many senders at once" << endl;
+        cerr << "  --max-sessions <n>    concurrent transfers in server mode (default "
+             << DEFAULT_MAX_SESSIONS << ")" << endl;
+        cerr << "  --session-memory <mb> tracking/FEC memory per transfer (default "
+             << DEFAULT_SESSION_MEMORY_MB << ")" << endl;
+        cerr << "  --io <engine>         sync (blocking syscalls), uring (io_uring, falls" << endl;
+        cerr << "                        back to sync) or pipeline (a drain and a disk thread" << endl;
+        cerr << "                        per stream); single-transfer mode only" << endl;
+        cerr << "  --checkpoint <ms>     journal progress this often so an interrupted" << endl;
+        cerr << "                        transfer can resume (default "
+             << DEFAULT_CHECKPOINT_MS << ", 0 = off)" << endl;
+        cerr << "  --impair <spec>       simulate the return path, as the sender's --impair" << endl;
+        cerr << "                        (control packets: ctrl-loss, delay, jitter, reorder," << endl;
+        cerr << "                        dup, rate; seed=n for the same drops every run)" << endl;
+        cerr << "  --telemetry <spec>    live counters and latency histograms to <path>[,json|prom]" << endl;
+        cerr << "                        [,ms] every ms (default " << DEFAULT_TELEMETRY_MS
+             << "), or to each client of unix:<path>" << endl;
         cerr << "Example: " << argv[0] << " 8080" << endl;
         return 1;
     }
     
-    int port = atoi(argv[1]);
+    int port = atoi(args[0].c_str());
+    
+    if (max_sessions < 1 || session_memory_mb < 1) {
+        cerr << "Error: --max-sessions and --session-memory must be positive" << endl;
+        return 1;
+    }
+    
+    if (checkpoint_ms < 0) {
+        cerr << "Error: --checkpoint must not be negative" << endl;
+        return 1;
+    }
+    
+    if (!impair.has_seed) {
+        impair.seed = random_device()();
+    }
+    
+    if (io != "sync" && io != "uring" && io != "pipeline") {
+        cerr << "Error: I/O engine must be sync, uring or pipeline" << endl;
+        return 1;
+    }
+    
+    ReceiverMetrics::get();                // registered before the first dump
+    if (!telemetry.path.empty() && !Telemetry::instance().start(telemetry)) {
+        cerr << "Error: Cannot publish telemetry at " << telemetry.path << ": "
+             << telemetry_error(errno) << endl;
+        return 1;
+    }
+    
+    if (server) {
+        if (io != "sync") {
+            cerr << "Warning: --io " << io << " is not used in server mode" << endl;
+        }
+        ReceiverServer receiver(port, max_sessions, session_memory_mb, checkpoint_ms, impair);
+        return receiver.run() ? 0 : 1;
+    }
     
-    FileReceiver receiver(port);
+    FileReceiver receiver(port, io, checkpoint_ms, impair);
     
-    if (!receiver.run()) {
+    bool ok = receiver.run();
+    Telemetry::instance().stop();
+    if (!ok) {
         cerr << "Transfer failed!" << endl;
         return 1;
     }
     
     return 0;
-}   
\ No newline at end of file
+}
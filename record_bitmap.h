@@ -0,0 +1,155 @@
+#ifndef RECORD_BITMAP_H
+#define RECORD_BITMAP_H
+
+#include <cstdint>
+#include <vector>
+
+// ============================================================================
+// RECORD BITMAP
+// ============================================================================
+//
+// Which records have arrived, one bit per record, plus a received counter
+// per blast. A complete blast is recognised from its counter alone, and the
+// missing runs of an incomplete one come from scanning 64 records per word:
+// full words are skipped, ctz finds where a run of zeros starts and where
+// it ends. Bits are set with an atomic OR because stripes of different
+// streams can share a word; each blast belongs to a single stream, so its
+// counter is only ever written by one thread.
+
+class RecordBitmap {
+private:
+    std::vector<uint64_t> words;
+    std::vector<uint32_t> blast_received;   // records received per blast
+    uint32_t total_records;
+    uint32_t blast_size;
+
+    // Bits [lo, hi] of a word (0 <= lo <= hi <= 63)
+    static uint64_t bit_range(uint32_t lo, uint32_t hi) {
+        uint64_t upper = (hi == 63) ? ~0ULL : ((1ULL << (hi + 1)) - 1);
+        return upper & ~((1ULL << lo) - 1);
+    }
+
+    uint32_t blast_end(uint32_t blast) const {
+        uint64_t end = (uint64_t)(blast + 1) * blast_size;
+        return end < total_records ? (uint32_t)end : total_records;
+    }
+
+    // Bits set in [start, end], counted word by word
+    uint32_t popcount(uint32_t start, uint32_t end) const {
+        uint32_t first = start / 64, last = end / 64;
+        uint32_t n = 0;
+        for (uint32_t w = first; w <= last; w++) {
+            uint64_t bits = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+            uint32_t lo = (w == first) ? start % 64 : 0;
+            uint32_t hi = (w == last) ? end % 64 : 63;
+            n += __builtin_popcountll(bits & bit_range(lo, hi));
+        }
+        return n;
+    }
+
+public:
+    RecordBitmap() : total_records(0), blast_size(1) {}
+
+    // Records are numbered 1..records
+    void reset(uint32_t records, uint32_t b_size) {
+        total_records = records;
+        blast_size = b_size > 0 ? b_size : 1;
+        words.assign(((uint64_t)records + 64) / 64, 0);
+        blast_received.assign(((uint64_t)records + blast_size - 1) / blast_size, 0);
+    }
+
+    uint32_t size() const { return total_records; }
+
+    bool test(uint32_t rec) const {
+        return (__atomic_load_n(&words[rec / 64], __ATOMIC_RELAXED) >> (rec % 64)) & 1;
+    }
+
+    // Mark a record received; false if it already was
+    bool set(uint32_t rec) {
+        uint64_t bit = 1ULL << (rec % 64);
+        if (__atomic_fetch_or(&words[rec / 64], bit, __ATOMIC_RELAXED) & bit) {
+            return false;
+        }
+        blast_received[(rec - 1) / blast_size]++;
+        return true;
+    }
+
+    // Records received in [start, end]
+    uint32_t count(uint32_t start, uint32_t end) const {
+        if (start > end) return 0;
+
+        // Whole blasts are answered from their counters
+        if ((start - 1) % blast_size == 0 && end == blast_end((start - 1) / blast_size)) {
+            return blast_received[(start - 1) / blast_size];
+        }
+        return popcount(start, end);
+    }
+
+    // The raw words, bit rec % 64 of word rec / 64 for record rec; this is
+    // also the layout ProgressJournal keeps on disk
+    size_t num_words() const { return words.size(); }
+
+    uint64_t word(size_t w) const {
+        return __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+    }
+
+    // Take over words saved earlier (num_words() of them) and recount the
+    // blasts; returns how many records they mark received
+    uint32_t restore(const std::vector<uint64_t>& saved) {
+        for (size_t w = 0; w < words.size(); w++) {
+            words[w] = w < saved.size() ? saved[w] : 0;
+        }
+        words[0] &= ~1ULL;                               // there is no record 0
+        if (total_records % 64 != 63) {
+            words.back() &= bit_range(0, total_records % 64);
+        }
+        uint32_t n = 0;
+        for (uint32_t b = 0; b < blast_received.size(); b++) {
+            blast_received[b] = popcount(b * blast_size + 1, blast_end(b));
+            n += blast_received[b];
+        }
+        return n;
+    }
+
+    bool complete(uint32_t start, uint32_t end) const {
+        return start > end || count(start, end) == end - start + 1;
+    }
+
+    // Call missing(first, last) for each run of missing records in
+    // [start, end], in order, until it returns false
+    template <typename Missing>
+    void for_each_missing(uint32_t start, uint32_t end, Missing missing) const {
+        if (complete(start, end)) return;
+
+        uint32_t rec = start;
+        while (rec <= end) {
+            // Find the next missing record: skip words that are all ones
+            uint32_t w = rec / 64;
+            uint64_t holes = ~__atomic_load_n(&words[w], __ATOMIC_RELAXED) & bit_range(rec % 64, 63);
+            while (holes == 0) {
+                if ((uint64_t)(w + 1) * 64 > end) return;
+                w++;
+                holes = ~__atomic_load_n(&words[w], __ATOMIC_RELAXED);
+            }
+            uint32_t run_start = w * 64 + __builtin_ctzll(holes);
+            if (run_start > end) return;
+
+            // Find where the run ends: the next record that is present
+            uint64_t present = __atomic_load_n(&words[w], __ATOMIC_RELAXED) &
+                               bit_range(run_start % 64, 63);
+            while (present == 0) {
+                if ((uint64_t)(w + 1) * 64 > end) break;
+                w++;
+                present = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+            }
+            uint64_t run_end = present ? (uint64_t)w * 64 + __builtin_ctzll(present) - 1 : end;
+            if (run_end > end) run_end = end;
+
+            if (!missing(run_start, (uint32_t)run_end)) return;
+            rec = (uint32_t)run_end + 1;
+            if (run_end >= end) return;
+        }
+    }
+};
+
+#endif // RECORD_BITMAP_H
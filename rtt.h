@@ -0,0 +1,100 @@
+#ifndef RTT_H
+#define RTT_H
+
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+const int RTO_INITIAL_MS = 250;          // before the first RTT sample
+const int RTO_MIN_MS = 10;               // floor, covers receiver scheduling jitter
+const int RTO_MAX_MS = 2000;             // ceiling for backed-off timeouts
+const int RTO_GRANULARITY_US = 1000;     // smallest variance term (RFC 6298 G)
+const int CONTROL_GIVE_UP_MS = 10000;    // unanswered control packets before failing
+
+// ============================================================================
+// TIMESTAMPS
+// ============================================================================
+
+// The sender's clock in microseconds, stamped on FILE_HDR and IS_BLAST_OVER
+// and echoed back unchanged in FILE_HDR_ACK and REC_MISS. Only the sender
+// reads it, so the two hosts need no common clock; it wraps every 71
+// minutes, which unsigned subtraction absorbs.
+inline uint32_t timestamp_us() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Microseconds since an echoed timestamp was stamped
+inline uint32_t timestamp_age_us(uint32_t echoed) {
+    return timestamp_us() - echoed;
+}
+
+// Whether timestamp a was stamped before b
+inline bool timestamp_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+// ============================================================================
+// RTT ESTIMATOR
+// ============================================================================
+//
+// SRTT/RTTVAR as in RFC 6298. Every reply echoes the timestamp of the
+// probe it answers, so each one is a clean sample even when the probe was
+// sent several times (no need for Karn's rule).
+//   RTO = SRTT + max(G, 4 * RTTVAR), doubled per unanswered attempt
+//   PTO = 2 * SRTT, the earlier first re-probe of a reply that is overdue
+
+class RttEstimator {
+private:
+    double srtt;                // microseconds
+    double rttvar;
+    double latest;
+    bool has_sample;
+
+    static int clamp_ms(double us) {
+        return (int)std::max((double)RTO_MIN_MS, std::min((double)RTO_MAX_MS, us / 1000.0));
+    }
+
+public:
+    RttEstimator() : srtt(0), rttvar(0), latest(0), has_sample(false) {}
+
+    void on_sample(uint32_t rtt_us) {
+        double r = rtt_us;
+        if (!has_sample) {
+            srtt = r;
+            rttvar = r / 2;
+            has_sample = true;
+        } else {
+            rttvar = 0.75 * rttvar + 0.25 * std::abs(srtt - r);
+            srtt = 0.875 * srtt + 0.125 * r;
+        }
+        latest = r;
+    }
+
+    bool valid() const { return has_sample; }
+    double srtt_sec() const { return srtt / 1e6; }
+    double latest_sec() const { return latest / 1e6; }
+
+    // Timeout for a control packet already sent `attempts` times
+    int rto_ms(int attempts = 1) const {
+        if (!has_sample) {
+            return std::min(RTO_INITIAL_MS << std::min(std::max(attempts - 1, 0), 8), RTO_MAX_MS);
+        }
+        double rto = srtt + std::max((double)RTO_GRANULARITY_US, 4 * rttvar);
+        return clamp_ms(rto * (1 << std::min(std::max(attempts - 1, 0), 8)));
+    }
+
+    // Timeout before the first re-probe: a reply later than two RTTs is
+    // most likely lost, so do not wait out the full variance term for it
+    int probe_timeout_ms() const {
+        if (!has_sample) return RTO_INITIAL_MS;
+        return std::min(clamp_ms(2 * srtt), rto_ms());
+    }
+};
+
+#endif // RTT_H
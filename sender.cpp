@@ -1,4 +1,15 @@
 #include "protocol.h"
+#include "file_source.h"
+#include "file_tree.h"
+#include "udp_batch.h"
+#include "congestion.h"
+#include "fec.h"
+#include "uring.h"
+#include "rtt.h"
+#include "compress.h"
+#include "delta.h"
+#include "impair.h"
+#include "telemetry.h"
 #include <iostream>
 #include <fstream>
 #include <cstring>
@@ -9,12 +20,1245 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <vector>
 #include <map>
 #include <chrono>
+#include <memory>
+#include <thread>
+#include <random>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 
+// ============================================================================
+// SENDER OPTIONS
+// ============================================================================
+
+// Tunables given as --flags after the positional arguments
+struct SenderOptions {
+    uint32_t window;                       // --window: blasts in flight
+    string cc;                             // --cc: none, aimd or bbr
+    uint16_t fec_group;                    // --fec: DATA packets per parity, 0 = off
+    uint32_t streams;                      // --streams: parallel sockets/threads
+    uint32_t mtu;                          // --mtu: path MTU, 0 = ask the route
+    bool gso;                              // --no-gso turns UDP GSO off
+    string io;                             // --io: sync or uring
+    double corrupt_rate;                   // --corrupt: DATA packets damaged in flight
+    double probe_loss;                     // --probe-loss: IS_BLAST_OVER dropped
+    uint8_t codec;                         // --compress: codec offered to the receiver
+    int codec_level;
+    double rate_mbps;                      // --rate: fixed pacing per stream, 0 = off
+    bool delta;                            // --delta: reuse the receiver's older copy
+    bool nack;                             // --no-nack: only retransmit after IS_BLAST_OVER
+    bool early;                            // --no-0rtt: no DATA before FILE_HDR_ACK
+    unsigned int seed;                     // --seed: garbler seed, 0 = per session
+    ImpairmentConfig impair;               // --impair and loss_rate: the simulated link
+    string impair_spec;
+    TelemetryConfig telemetry;             // --telemetry: live metrics, path "" = off
+    
+    SenderOptions() : window(DEFAULT_BLAST_WINDOW), cc("none"), fec_group(0), streams(1),
+                      mtu(0), gso(true), io("sync"), corrupt_rate(0.0), probe_loss(0.0),
+                      codec(CODEC_NONE), codec_level(0), rate_mbps(0), delta(false),
+                      nack(true), early(true), seed(0) {}
+};
+
+// ============================================================================
+// SENDER METRICS
+// ============================================================================
+
+// What the streams record for --telemetry and the end-of-run summary,
+// shared by all of them. Counters are bumped once per batch rather than
+// per packet so the stream threads do not fight over the cache lines.
+struct SenderMetrics {
+    Counter& data_packets;
+    Counter& retransmitted_packets;
+    Counter& blasts_completed;
+    Counter& rec_miss_received;
+    Counter& nacks_received;
+    Histogram& blast_rtt_us;               // IS_BLAST_OVER to its REC_MISS
+    Histogram& blast_rounds;               // retransmission rounds per blast
+    Histogram& blast_completion_us;        // first DATA to empty REC_MISS
+    Histogram& repair_us;                  // first pass of a record to its retransmission
+    Histogram& send_ns;                    // sendmmsg time per datagram
+    
+    static SenderMetrics& get() {
+        static SenderMetrics metrics(Telemetry::instance());
+        return metrics;
+    }
+    
+    // The latency side of the run, next to Statistics::print
+    void print() const {
+        if (blast_rtt_us.count() > 0) {
+            printf("Blast RTT: p50 %llu us, p99 %llu us, max %llu us\n",
+                   (unsigned long long)blast_rtt_us.quantile(0.5),
+                   (unsigned long long)blast_rtt_us.quantile(0.99),
+                   (unsigned long long)blast_rtt_us.max());
+        }
+        if (blast_rounds.count() > 0) {
+            printf("Retransmission rounds per blast: p50 %llu, p99 %llu, max %llu\n",
+                   (unsigned long long)blast_rounds.quantile(0.5),
+                   (unsigned long long)blast_rounds.quantile(0.99),
+                   (unsigned long long)blast_rounds.max());
+        }
+        if (repair_us.count() > 0) {
+            printf("Loss repair: p50 %llu us, p99 %llu us over %llu retransmitted record(s)\n",
+                   (unsigned long long)repair_us.quantile(0.5),
+                   (unsigned long long)repair_us.quantile(0.99),
+                   (unsigned long long)repair_us.count());
+        }
+        if (send_ns.count() > 0) {
+            printf("Send syscall: p50 %llu ns, p99 %llu ns per packet\n",
+                   (unsigned long long)send_ns.quantile(0.5),
+                   (unsigned long long)send_ns.quantile(0.99));
+        }
+    }
+    
+private:
+    SenderMetrics(Telemetry& t)
+        : data_packets(t.counter("blast_sender_data_packets_total",
+                                 "DATA and parity packets handed to the kernel")),
+          retransmitted_packets(t.counter("blast_sender_retransmitted_packets_total",
+                                          "DATA packets carrying retransmitted records")),
+          blasts_completed(t.counter("blast_sender_blasts_completed_total",
+                                     "Blasts acknowledged by an empty REC_MISS")),
+          rec_miss_received(t.counter("blast_sender_rec_miss_total", "REC_MISS packets received")),
+          nacks_received(t.counter("blast_sender_nacks_total", "NACKs acted on mid-blast")),
+          blast_rtt_us(t.histogram("blast_sender_blast_rtt_us",
+                                   "IS_BLAST_OVER to REC_MISS round trip, microseconds")),
+          blast_rounds(t.histogram("blast_sender_retransmit_rounds",
+                                   "Retransmission rounds a blast needed")),
+          blast_completion_us(t.histogram("blast_sender_blast_completion_us",
+                                          "First DATA to empty REC_MISS, microseconds")),
+          repair_us(t.histogram("blast_sender_repair_us",
+                                "First send of a record to its retransmission, microseconds")),
+          send_ns(t.histogram("blast_sender_send_ns_per_packet",
+                              "sendmmsg time per datagram, nanoseconds")) {}
+};
+
+// ============================================================================
+// BLAST COMPRESSOR
+// ============================================================================
+
+// Compresses the first pass of upcoming blasts on the worker pool while the
+// send thread is busy with earlier ones. Each blast is cut into one slice
+// per worker; a slice becomes DATA_COMPRESSED packets, each packing as
+// many records as compress into one datagram, sized from the ratio the
+// previous packet got. Records that do not shrink below
+// MAX_COMPRESSED_RATIO are left for the send thread to send as DATA.
+//
+// Compression has to pay for itself, so the compressor stands aside for
+// COMPRESS_BACKOFF_BLASTS blasts when a whole blast did not shrink, or
+// when waiting for it plus sending it took longer than sending the blast
+// raw would have at the rate the link has been taking packets.
+class BlastCompressor {
+public:
+    // A packet ready to go, or (no packet) records to send as plain DATA
+    struct Frame {
+        uint32_t first_record;
+        uint32_t last_record;
+        vector<uint8_t> packet;
+    };
+    
+    // One blast on its way through the pool
+    struct Job {
+        uint32_t start_record;
+        uint32_t end_record;
+        vector<vector<Frame>> slices;        // in record order
+        mutex lock;
+        condition_variable done;
+        size_t pending;                      // slices still being compressed
+    };
+    
+    // What the workers need, copied so that jobs outlive nothing they use
+    struct Settings {
+        const FileSource* source;
+        uint8_t codec;
+        int level;
+        uint16_t record_size;
+        size_t max_block;                    // compressed bytes per datagram
+        uint32_t packet_records;             // records of a plain DATA packet
+    };
+    
+private:
+    WorkerPool& pool;
+    Settings settings;
+    uint32_t blast_size;
+    uint32_t last_record;                    // of the stripe
+    uint32_t next_scheduled;                 // first record not yet handed to the pool
+    deque<shared_ptr<Job>> ahead;            // handed to the pool, in blast order
+    uint32_t backoff;                        // blasts left to send raw
+    double link_rate;                        // bytes/sec the send thread achieves, 0 = unknown
+    function<bool(uint32_t, uint32_t)> wanted;  // blasts worth compressing, empty = all
+    
+    static void compress_slice(const Settings& cfg, Job& job, size_t slice,
+                               uint32_t first, uint32_t last) {
+        vector<Frame>& frames = job.slices[slice];
+        uint32_t max_records = min<size_t>(MAX_FRAME_BYTES / cfg.record_size, UINT16_MAX);
+        vector<uint8_t> raw((size_t)max_records * cfg.record_size);
+        double ratio = 0.5;                  // guess for the first packet
+        
+        uint32_t rec = first;
+        while (rec <= last) {
+            uint32_t remaining = last - rec + 1;
+            double fit = cfg.max_block * 0.9 / (ratio * cfg.record_size);
+            uint32_t count = (uint32_t)max<double>(cfg.packet_records, min<double>(fit, max_records));
+            count = min(count, remaining);
+            
+            Frame frame;
+            frame.first_record = rec;
+            frame.packet.resize(COMPRESSED_HEADER_SIZE + cfg.max_block);
+            while (true) {
+                size_t bytes = (size_t)count * cfg.record_size;
+                bool readable = true;
+                for (uint32_t i = 0; i < count && readable; i++) {
+                    readable = cfg.source->read_record(rec + i, raw.data() + (size_t)i * cfg.record_size);
+                }
+                // Left to the send thread, which reports the failed read
+                if (!readable) {
+                    frame.packet.clear();
+                    ratio = 1.0;
+                    break;
+                }
+                size_t compressed = codec_compress(cfg.codec, cfg.level, raw.data(), bytes,
+                                                   frame.packet.data() + COMPRESSED_HEADER_SIZE,
+                                                   cfg.max_block);
+                if (compressed > 0 && compressed <= bytes * MAX_COMPRESSED_RATIO) {
+                    write_compressed_header(frame.packet.data(), cfg.codec, rec, count);
+                    frame.packet.resize(COMPRESSED_HEADER_SIZE + compressed);
+                    ratio = (double)compressed / bytes;
+                    break;
+                }
+                // Did not shrink, or there is no shrinking it into one
+                // datagram even at a plain packet's worth: send it raw
+                if (compressed > 0 || count <= cfg.packet_records) {
+                    frame.packet.clear();
+                    ratio = 1.0;
+                    break;
+                }
+                count = max(cfg.packet_records, count * 2 / 3);
+            }
+            frame.last_record = rec + count - 1;
+            rec += count;
+            
+            // Neighbouring raw runs go out as one
+            if (frame.packet.empty() && !frames.empty() && frames.back().packet.empty()) {
+                frames.back().last_record = frame.last_record;
+            } else {
+                frames.push_back(move(frame));
+            }
+        }
+    }
+    
+    void schedule(uint32_t start, uint32_t end) {
+        shared_ptr<Job> job(new Job());
+        job->start_record = start;
+        job->end_record = end;
+        
+        size_t slices = min<size_t>(pool.size(), (end - start) / (settings.packet_records * 4) + 1);
+        job->slices.resize(slices);
+        job->pending = slices;
+        for (size_t i = 0; i < slices; i++) {
+            uint32_t first = start + (uint32_t)((uint64_t)(end - start + 1) * i / slices);
+            uint32_t last = start + (uint32_t)((uint64_t)(end - start + 1) * (i + 1) / slices) - 1;
+            Settings cfg = settings;
+            pool.submit([cfg, job, i, first, last]() {
+                compress_slice(cfg, *job, i, first, last);
+                lock_guard<mutex> guard(job->lock);
+                if (--job->pending == 0) {
+                    job->done.notify_all();
+                }
+            });
+        }
+        ahead.push_back(job);
+    }
+    
+public:
+    BlastCompressor(WorkerPool& workers, const Settings& cfg, uint32_t b_size,
+                    uint32_t first, uint32_t last)
+        : pool(workers), settings(cfg), blast_size(b_size), last_record(last),
+          next_scheduled(first), backoff(0), link_rate(0) {}
+    
+    // Only compress blasts for which filter(start, end) holds
+    void set_filter(function<bool(uint32_t, uint32_t)> filter) {
+        wanted = filter;
+    }
+    
+    // Keep COMPRESS_LOOKAHEAD blasts in the pool unless backing off
+    void fill() {
+        while (backoff == 0 && ahead.size() < COMPRESS_LOOKAHEAD && next_scheduled <= last_record) {
+            uint32_t end = min(next_scheduled + blast_size - 1, last_record);
+            if (!wanted || wanted(next_scheduled, end)) {
+                schedule(next_scheduled, end);
+            }
+            next_scheduled = end + 1;
+        }
+    }
+    
+    // The compressed blast [start, end], waiting for the pool if it is not
+    // done yet; NULL if the blast is to go out raw
+    shared_ptr<Job> take(uint32_t start, uint32_t end, Statistics& stats) {
+        if (ahead.empty() || ahead.front()->start_record != start) {
+            if (next_scheduled <= end) next_scheduled = end + 1;
+            if (backoff > 0) backoff--;
+            stats.blasts_uncompressed++;
+            return NULL;
+        }
+        shared_ptr<Job> job = ahead.front();
+        ahead.pop_front();
+        
+        auto wait_start = chrono::steady_clock::now();
+        {
+            unique_lock<mutex> guard(job->lock);
+            job->done.wait(guard, [&job] { return job->pending == 0; });
+        }
+        double waited = chrono::duration<double>(chrono::steady_clock::now() - wait_start).count();
+        
+        uint64_t raw = (uint64_t)(end - start + 1) * settings.record_size, sent = 0;
+        for (auto& slice : job->slices) {
+            for (auto& frame : slice) {
+                sent += frame.packet.empty() ?
+                        (uint64_t)(frame.last_record - frame.first_record + 1) * settings.record_size :
+                        frame.packet.size();
+            }
+        }
+        stats.blasts_compressed++;
+        stats.bytes_before_compression += raw;
+        stats.bytes_after_compression += sent;
+        
+        // Blasts already in the pool when backing off still count, once
+        bool backing_off = backoff > 0;
+        if (sent > raw * MAX_COMPRESSED_RATIO) {
+            backoff = COMPRESS_BACKOFF_BLASTS;
+            if (!backing_off) stats.backoffs_incompressible++;
+        } else if (link_rate > 0 && waited + sent / link_rate > raw / link_rate) {
+            backoff = COMPRESS_BACKOFF_BLASTS;
+            if (!backing_off) stats.backoffs_slow++;
+        }
+        return job;
+    }
+    
+    // The send thread put bytes on the wire in seconds
+    void on_sent(uint64_t bytes, double seconds) {
+        if (seconds <= 0 || bytes == 0) return;
+        double rate = bytes / seconds;
+        link_rate = link_rate > 0 ? 0.75 * link_rate + 0.25 * rate : rate;
+    }
+};
+
+// ============================================================================
+// BLAST STREAM
+// ============================================================================
+
+// Sends one stripe of the record space over one UDP socket: blasts,
+// IS_BLAST_OVER/REC_MISS, retransmissions, pacing and FEC. A plain
+// transfer has a single stream covering every record; --streams N runs N
+// of them on their own sockets and threads, sharing the read-only source.
+class BlastStream {
+private:
+    int sockfd;
+    bool owns_socket;                      // stream 0 borrows the handshake socket
+    struct sockaddr_in receiver_addr;
+    const FileSource& source;
+    uint16_t record_size;
+    uint32_t blast_size;
+    unique_ptr<ImpairedLink> link;         // the simulated link, NULL = none
+    double corrupt_rate;
+    double probe_loss;
+    unsigned int rand_seed;                // garbler state, per thread
+    uint32_t first_record;                 // stripe carried by this stream
+    uint32_t last_record;
+    uint32_t next_record;                  // first record of the next new blast
+    uint32_t stripe_crc;                   // CRC32C of the stripe up to crc_next
+    uint32_t crc_next;                     // first record not folded into it yet
+    
+    SendBatch send_batch;                  // DATA packets queued for sendmmsg
+    uint32_t packet_records;               // records per first-pass DATA packet
+    size_t max_packet;                     // largest DATA datagram, bytes
+    bool gso;                              // full packets go out as GSO messages
+    unique_ptr<IoUring> uring;             // --io uring: sends and readahead, NULL = syscalls
+    unique_ptr<BlastCompressor> compressor; // --compress: first passes, NULL = raw
+    uint64_t wire_bytes;                   // DATA bytes handed to the batch
+    bool read_failed;                      // a record could not be read, stop sending
+    
+    // A resumed transfer: the runs of the stripe the receiver still lacks
+    bool resuming;
+    vector<Segment> resume_missing;        // in order, clipped to the stripe
+    vector<Segment> resume_runs;           // those of the blast being sent
+    
+    // A blast that has been sent but not yet fully acknowledged
+    struct BlastState {
+        uint32_t start_record;
+        uint32_t end_record;
+        int attempts;                                // IS_BLAST_OVER without reply
+        chrono::steady_clock::time_point probe_time; // last IS_BLAST_OVER sent
+        chrono::steady_clock::time_point round_probe_time;  // first one this round
+        uint32_t round_timestamp;                    // and its timestamp
+        chrono::steady_clock::time_point start_time; // first DATA of the blast
+        uint32_t rounds;                             // start_round calls so far
+        uint32_t reply_timestamp;                    // REC_MISS being acted on
+        uint32_t reply_parts;                        // and its parts seen, 0 = none
+        vector<uint32_t> first_sent_us;              // timestamp_us() per record, 0 = not sent
+        
+        // Current round (initial blast or one retransmission), for rate samples
+        uint32_t round_records;                      // records sent in the round
+        uint32_t round_nacked;                       // ... resent on a NACK, so lost
+        uint64_t round_delivered;                    // delivered_records at round start
+        chrono::steady_clock::time_point round_delivered_time;
+    };
+    uint32_t window;                       // max blasts in flight
+    uint16_t fec_group;                    // DATA packets per parity packet
+    vector<uint8_t> parity;                // parity of the group being sent
+    vector<BlastState> in_flight;
+    RecMissPacket rec_miss;                // reused for every REC_MISS
+    
+    // Mid-blast NACKs: the first pass being sent, and the replies read
+    // while looking for NACKs, left for the main loop
+    bool nack;                             // act on NACKs
+    bool polling;                          // in poll_nacks, not to be reentered
+    uint32_t sent_through;                 // last record queued of the blast being
+                                           // sent (in_flight.back()), 0 = none
+    RecMissPacket nack_packet;
+    vector<uint8_t> poll_buffer;
+    deque<vector<uint8_t>> held_replies;
+    RttEstimator rtt;                      // from timestamps echoed in REC_MISS
+    
+    unique_ptr<RateController> controller; // NULL: unpaced blasts
+    Pacer pacer;
+    uint64_t delivered_records;            // records confirmed by REC_MISS
+    chrono::steady_clock::time_point delivered_time;
+    
+    Statistics stats;
+    SenderMetrics& metrics;
+    uint32_t batch_retransmissions;        // since the last flush, for metrics
+    
+    // Garbler: flip one bit past the type byte, as a link might
+    void maybe_corrupt(uint8_t* packet, size_t size) {
+        if (corrupt_rate <= 0.0 || (rand_r(&rand_seed) / (double)RAND_MAX) >= corrupt_rate) {
+            return;
+        }
+        size_t bit = 8 + rand_r(&rand_seed) % ((size - 1) * 8);
+        packet[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+        stats.packets_corrupted++;
+    }
+    
+    // Send a control packet
+    bool send_packet(const uint8_t* buffer, size_t size) {
+        if (link) {
+            LinkVerdict verdict = link->pass(buffer, size, true, receiver_addr);
+            if (verdict != LINK_SEND) {
+                if (verdict == LINK_HELD) stats.total_packets_sent++;
+                return true;               // lost or sent later, as on a real link
+            }
+        }
+        ssize_t sent = sendto(sockfd, buffer, size, 0, 
+                             (struct sockaddr*)&receiver_addr, sizeof(receiver_addr));
+        if (sent < 0) {
+            perror("sendto failed");
+            return false;
+        }
+        stats.total_packets_sent++;
+        return true;
+    }
+    
+    // Copy a record into the packet being built. One that cannot be read
+    // (the file shrank while being sent) must not go out as whatever the
+    // buffer held, so the stream fails instead.
+    bool fetch_record(uint32_t rec, uint8_t* dst) {
+        if (source.read_record(rec, dst)) return true;
+        if (!read_failed) {
+            cerr << "Error: Cannot read record " << rec << " (file truncated while sending?)" << endl;
+            read_failed = true;
+        }
+        return false;
+    }
+    
+    // Fold the stripe up to record end into stripe_crc. Every blast is
+    // folded in record order as it is opened, held ones included, so the
+    // CRC of the file is built on the first pass and never read up front.
+    bool fold_crc(uint32_t end) {
+        if (end < crc_next) return true;
+        if (!source.checksum(crc_next, end, stripe_crc)) {
+            if (!read_failed) {
+                cerr << "Error: Cannot read records " << crc_next << "-" << end
+                     << " (file truncated while sending?)" << endl;
+                read_failed = true;
+            }
+            return false;
+        }
+        crc_next = end + 1;
+        return true;
+    }
+    
+    // Send a blast of records
+    void send_blast(uint32_t start_rec, uint32_t end_rec) {
+        cout << "Sending blast: records " << start_rec << "-" << end_rec << endl;
+        send_records(start_rec, end_rec, fec_group > 0);
+        flush_send_batch();
+        sent_through = 0;
+    }
+    
+    // Send the runs of a resumed blast the receiver does not have yet. The
+    // FEC groups of the blast are not there to protect, so there is no
+    // parity; whatever is lost is retransmitted.
+    void send_resumed_blast(uint32_t start_rec, uint32_t end_rec, uint32_t records) {
+        cout << "Sending blast: records " << start_rec << "-" << end_rec << " (resumed, "
+             << records << " missing)" << endl;
+        for (const Segment& run : resume_runs) {
+            send_records(run.start_record, run.end_record, false);
+        }
+        flush_send_batch();
+        sent_through = 0;
+    }
+    
+    // Send a blast the compressor prepared: its packets as they are, the
+    // records that did not compress as plain DATA
+    void send_compressed_blast(const BlastCompressor::Job& job) {
+        cout << "Sending blast: records " << job.start_record << "-" << job.end_record
+             << " (compressed)" << endl;
+        for (const auto& slice : job.slices) {
+            for (const auto& frame : slice) {
+                if (frame.packet.empty()) {
+                    send_records(frame.first_record, frame.last_record, false);
+                    continue;
+                }
+                pace(frame.packet.size());
+                memcpy(send_batch.next_slot(), frame.packet.data(), frame.packet.size());
+                queued_first_pass(frame.first_record, frame.last_record);
+                commit_packet(frame.packet.size(), false);
+            }
+        }
+        flush_send_batch();
+        sent_through = 0;
+    }
+    
+    // Queue records as first-pass DATA packets. Each packet is built in
+    // place in the send batch: header first, records read from the file
+    // source straight behind it, so nothing is allocated or copied twice.
+    void send_records(uint32_t start_rec, uint32_t end_rec, bool with_fec) {
+        // Parity only protects the first pass of a blast
+        uint32_t group_start = start_rec;
+        
+        uint32_t packet_index = 0;
+        uint32_t current_rec = start_rec;
+        while (current_rec <= end_rec && !read_failed) {
+            uint32_t count = min(end_rec - current_rec + 1, packet_records);
+            size_t payload = (size_t)count * record_size;
+            pace(payload);
+            
+            uint8_t* slot = send_batch.next_slot();
+            Segment segment(current_rec, current_rec + count - 1);
+            size_t header = write_data_header(slot, &segment, 1);
+            for (uint32_t i = 0; i < count; i++) {
+                if (!fetch_record(current_rec + i, slot + header + (size_t)i * record_size)) return;
+            }
+            
+            // Fold the packet into its group's parity (dropped or not);
+            // close the group after K packets or at the end of the blast
+            if (with_fec) {
+                if (packet_index % fec_group == 0) {
+                    group_start = current_rec;
+                    memset(parity.data(), 0, parity.size());
+                }
+                xor_into(parity.data(), slot + header, payload);
+            }
+            
+            queued_first_pass(current_rec, current_rec + count - 1);
+            commit_packet(header + payload, false);
+            current_rec += count;
+            packet_index++;
+            
+            if (with_fec && (packet_index % fec_group == 0 || current_rec > end_rec)) {
+                queue_parity(group_start, current_rec - 1);
+                stats.fec_packets_sent++;
+            }
+        }
+    }
+    
+    // Retransmit what a REC_MISS lists for a blast
+    void retransmit(const RecMissPacket& rec_miss, const BlastState& blast) {
+        uint32_t packets = 0;
+        uint32_t records_sent = resend(rec_miss, blast, blast.end_record, packets);
+        flush_send_batch();
+        
+        cout << "Retransmitted " << records_sent << " record(s) of blast " << blast.start_record
+             << "-" << blast.end_record << " in " << packets << " packet(s)" << endl;
+    }
+    
+    // Queue the records of a blast, up to last, that a REC_MISS or NACK
+    // lists. Missing records are scattered, so each packet takes as many
+    // segments as fit: up to MAX_SEGMENTS_PER_PACKET descriptors and
+    // max_packet bytes in all. Returns the records queued; packets counts
+    // the packets.
+    uint32_t resend(const RecMissPacket& rec_miss, const BlastState& blast, uint32_t last,
+                    uint32_t& packets) {
+        uint32_t first = blast.start_record;
+        Segment segments[MAX_SEGMENTS_PER_PACKET];
+        uint32_t records_sent = 0;
+        
+        size_t seg = 0;
+        uint32_t next_rec = 0;
+        while (seg < rec_miss.missing.size()) {
+            // Plan the packet: which runs go in and how many records
+            int num_segments = 0;
+            uint32_t records = 0;
+            while (seg < rec_miss.missing.size() && num_segments < MAX_SEGMENTS_PER_PACKET) {
+                uint32_t seg_start = max(rec_miss.missing[seg].start_record, first);
+                uint32_t seg_end = min(rec_miss.missing[seg].end_record, last);
+                if (seg_start > seg_end || next_rec > seg_end) {
+                    seg++;  // nothing (left) of this blast
+                    next_rec = 0;
+                    continue;
+                }
+                if (next_rec < seg_start) next_rec = seg_start;
+                
+                size_t header = data_header_size(num_segments + 1);
+                if (header + (size_t)(records + 1) * record_size > max_packet) break;
+                
+                uint32_t room = (max_packet - header) / record_size - records;
+                uint32_t take = min(room, seg_end - next_rec + 1);
+                segments[num_segments++] = Segment(next_rec, next_rec + take - 1);
+                records += take;
+                next_rec += take;
+                if (next_rec > seg_end) {
+                    seg++;
+                    next_rec = 0;
+                }
+            }
+            if (records == 0) break;
+            
+            size_t payload = (size_t)records * record_size;
+            pace(payload);
+            
+            uint8_t* slot = send_batch.next_slot();
+            size_t header = write_data_header(slot, segments, num_segments);
+            uint8_t* dst = slot + header;
+            for (int i = 0; i < num_segments; i++) {
+                for (uint32_t rec = segments[i].start_record; rec <= segments[i].end_record; rec++) {
+                    if (!fetch_record(rec, dst)) return records_sent;
+                    dst += record_size;
+                    uint32_t sent_us = blast.first_sent_us[rec - first];
+                    if (sent_us != 0) {
+                        metrics.repair_us.record(timestamp_age_us(sent_us));
+                    }
+                }
+            }
+            commit_packet(header + payload, true);
+            packets++;
+            records_sent += records;
+        }
+        return records_sent;
+    }
+    
+    // Between batches of a first pass, act on the NACKs that have come in.
+    // Anything else read here waits in held_replies for the main loop.
+    void poll_nacks() {
+        polling = true;
+        while (true) {
+            ssize_t n = recvfrom(sockfd, poll_buffer.data(), poll_buffer.size(), MSG_DONTWAIT, NULL, NULL);
+            if (n <= 0) break;
+            if (poll_buffer[0] != NACK) {
+                held_replies.push_back(vector<uint8_t>(poll_buffer.begin(), poll_buffer.begin() + n));
+            } else if (nack_packet.deserialize(poll_buffer.data(), n) > 0) {
+                handle_nack(nack_packet);
+            }
+        }
+        flush_send_batch();
+        polling = false;
+    }
+    
+    // Retransmit what a NACK lists at once instead of a round trip after
+    // IS_BLAST_OVER. Records of the blast being sent go out with it, up to
+    // what has been queued. For a blast already probed, the retransmission
+    // starts a round: the REC_MISS to the old probe lists the same records
+    // and is ignored, and a new IS_BLAST_OVER follows them.
+    void handle_nack(const RecMissPacket& nack_rec) {
+        stats.nacks_received++;
+        metrics.nacks_received.add();
+        for (auto& blast : in_flight) {
+            if (blast.end_record < nack_rec.start_record || blast.start_record > nack_rec.end_record) {
+                continue;
+            }
+            bool sending = sent_through > 0 && &blast == &in_flight.back();
+            uint32_t packets = 0;
+            uint32_t records = resend(nack_rec, blast, sending ? sent_through : blast.end_record,
+                                      packets);
+            if (records == 0) continue;
+            stats.nack_records += records;
+            if (sending) {
+                blast.round_nacked += records;
+                continue;
+            }
+            if (controller) {
+                report_rate_sample(blast, records);
+            }
+            start_round(blast, records);
+            flush_send_batch();
+            send_blast_over(blast);
+        }
+    }
+    
+    // The next reply for the main loop: one poll_nacks held back, or
+    // whatever arrives within timeout_ms
+    bool next_reply(uint8_t* buffer, size_t& size, int timeout_ms) {
+        if (held_replies.empty()) {
+            return wait_for_packet(buffer, size, timeout_ms);
+        }
+        const vector<uint8_t>& reply = held_replies.front();
+        size = min(reply.size(), (size_t)MAX_UDP_PAYLOAD);
+        memcpy(buffer, reply.data(), size);
+        held_replies.pop_front();
+        return true;
+    }
+    
+    // Records [first, last] of the blast being sent are queued: NACKs may
+    // name them from now on, and how long their repair takes is counted
+    // from here
+    void queued_first_pass(uint32_t first, uint32_t last) {
+        sent_through = last;
+        BlastState& blast = in_flight.back();
+        uint32_t now = timestamp_us();
+        for (uint32_t rec = first; rec <= last; rec++) {
+            blast.first_sent_us[rec - blast.start_record] = now;
+        }
+    }
+    
+    // With a rate controller, packets leave at its pacing rate: the batch
+    // is flushed whenever the next departure is not yet due. Call before
+    // building a packet in the batch, since a flush moves the next slot.
+    void pace(size_t payload_bytes) {
+        if (!controller) return;
+        if (!pacer.ready()) {
+            flush_send_batch();
+            pacer.wait();
+        }
+        pacer.on_send(payload_bytes, controller->pacing_rate());
+    }
+    
+    // Seal the packet built in the batch's next slot with its CRC and
+    // queue it, unless the garbler drops it; flushes the batch when it
+    // fills up
+    void commit_packet(size_t size, bool is_retransmission) {
+        uint8_t* packet = send_batch.next_slot();
+        seal_packet(packet, size);
+        maybe_corrupt(packet, size);
+        wire_bytes += size;
+        
+        if (is_retransmission) {
+            stats.retransmissions++;
+            batch_retransmissions++;
+        }
+        if (link) {
+            LinkVerdict verdict = link->pass(packet, size, false, receiver_addr);
+            if (verdict == LINK_DROP) {
+                stats.total_packets_lost++;
+                return;
+            }
+            if (verdict == LINK_HELD) {
+                stats.total_packets_sent++;
+                stats.total_data_packets_sent++;
+                metrics.data_packets.add();
+                return;
+            }
+        }
+        
+        send_batch.commit(size);
+        if (send_batch.full()) {
+            flush_send_batch();
+        }
+    }
+    
+    // Queue a FEC_PARITY packet for [group_start, group_end]
+    void queue_parity(uint32_t group_start, uint32_t group_end) {
+        pace(parity.size());
+        uint8_t* slot = send_batch.next_slot();
+        size_t header = write_parity_header(slot, group_start, group_end);
+        memcpy(slot + header, parity.data(), parity.size());
+        commit_packet(header + parity.size(), false);
+    }
+    
+    // Hand queued DATA packets to the kernel in one sendmmsg (or one
+    // io_uring_enter). During a first pass, the NACKs in so far are then
+    // acted on.
+    void flush_send_batch() {
+        if (!send_batch.empty()) {
+            auto start = chrono::steady_clock::now();
+            int sent = uring ? uring_send_batch(*uring, sockfd, send_batch, receiver_addr)
+                             : send_batch.flush(sockfd, receiver_addr);
+            if (sent > 0) {
+                metrics.send_ns.record(elapsed_ns(start) / sent);
+                metrics.data_packets.add(sent);
+            }
+            if (batch_retransmissions > 0) {
+                metrics.retransmitted_packets.add(batch_retransmissions);
+                batch_retransmissions = 0;
+            }
+            stats.total_packets_sent += sent;
+            stats.total_data_packets_sent += sent;
+        }
+        if (nack && sent_through > 0 && !polling) {
+            poll_nacks();
+        }
+    }
+    
+    // Send IS_BLAST_OVER for a blast in flight, stamped with the time so
+    // the REC_MISS answering it gives an RTT sample
+    void send_blast_over(BlastState& blast) {
+        BlastOverPacket blast_over(blast.start_record, blast.end_record, timestamp_us());
+        uint8_t send_buffer[64];
+        size_t size = blast_over.serialize(send_buffer);
+        if (probe_loss > 0.0 && (rand_r(&rand_seed) / (double)RAND_MAX) < probe_loss) {
+            stats.probes_dropped++;
+        } else {
+            send_packet(send_buffer, size);
+        }
+        
+        blast.probe_time = chrono::steady_clock::now();
+        if (blast.attempts == 0) {
+            blast.round_probe_time = blast.probe_time;
+            blast.round_timestamp = blast_over.timestamp;
+        }
+        blast.attempts++;
+    }
+    
+    // When the REC_MISS for a blast is overdue: two RTTs after the first
+    // IS_BLAST_OVER of a round, then the RTO, doubled for every retry
+    chrono::steady_clock::time_point probe_deadline(const BlastState& blast) const {
+        int timeout_ms = blast.attempts <= 1 ? rtt.probe_timeout_ms()
+                                             : rtt.rto_ms(blast.attempts - 1);
+        return blast.probe_time + chrono::milliseconds(timeout_ms);
+    }
+    
+    // Wait up to timeout_ms for a packet without blocking past the deadline
+    bool wait_for_packet(uint8_t* buffer, size_t& size, int timeout_ms) {
+        return wait_for_datagram(sockfd, buffer, MAX_UDP_PAYLOAD, size, timeout_ms);
+    }
+    
+    // Act on a REC_MISS: retire the blast or retransmit what it lacks
+    void handle_rec_miss(const RecMissPacket& rec_miss) {
+        uint32_t age_us = timestamp_age_us(rec_miss.echo_timestamp);
+        rtt.on_sample(age_us);
+        metrics.rec_miss_received.add();
+        metrics.blast_rtt_us.record(age_us);
+        
+        size_t idx = 0;
+        while (idx < in_flight.size() &&
+               (in_flight[idx].start_record != rec_miss.start_record ||
+                in_flight[idx].end_record != rec_miss.end_record)) {
+            idx++;
+        }
+        if (idx == in_flight.size()) {
+            return;  // Late reply for a blast that is already complete
+        }
+        
+        BlastState& blast = in_flight[idx];
+        
+        // A reply to a probe from before the last retransmission still
+        // lists what that retransmission carries; acting on it would send
+        // the same records twice
+        if (rec_miss.missing_records > 0 &&
+            timestamp_before(rec_miss.echo_timestamp, blast.round_timestamp)) {
+            return;
+        }
+        
+        // Later parts of a reply already acted on only add records to
+        // the round it started
+        bool next_part = rec_miss.missing_records > 0 && blast.reply_parts > 0 &&
+                         rec_miss.echo_timestamp == blast.reply_timestamp;
+        if (next_part) {
+            retransmit(rec_miss, blast);
+            if (++blast.reply_parts == rec_miss.parts) {
+                send_blast_over(blast);
+            }
+            return;
+        }
+        
+        if (controller) {
+            report_rate_sample(blast, rec_miss.missing_records);
+        }
+        
+        if (rec_miss.missing_records == 0) {
+            cout << "Blast " << blast.start_record << "-" << blast.end_record
+                 << " complete - all records received!" << endl;
+            
+            uint64_t completion_ns = elapsed_ns(blast.start_time);
+            stats.blast_ms.push_back((float)(completion_ns / 1e6));
+            metrics.blasts_completed.add();
+            metrics.blast_completion_us.record(completion_ns / 1000);
+            metrics.blast_rounds.record(blast.rounds - 1);
+            
+            // Blast fully acknowledged, its pages are no longer needed
+            source.release(blast.start_record, blast.end_record);
+            in_flight.erase(in_flight.begin() + idx);
+            return;
+        }
+        
+        cout << "Missing " << rec_miss.missing_records << " record(s), retransmitting..." << endl;
+        
+        // Retransmit missing segments, then ask again once every part of
+        // the reply is in. Should a part be lost, the probe timer (run
+        // from now) asks again.
+        start_round(blast, rec_miss.missing_records);
+        blast.reply_timestamp = rec_miss.echo_timestamp;
+        blast.reply_parts = 1;
+        blast.probe_time = chrono::steady_clock::now();
+        retransmit(rec_miss, blast);
+        if (rec_miss.parts == 1) {
+            send_blast_over(blast);
+        }
+    }
+    
+    // Put a new blast in flight, its first round of `records` about to go out
+    void open_blast(uint32_t start_rec, uint32_t end_rec, uint32_t records) {
+        stats.total_blasts++;
+        
+        BlastState blast;
+        blast.start_record = start_rec;
+        blast.end_record = end_rec;
+        blast.start_time = chrono::steady_clock::now();
+        blast.rounds = 0;
+        blast.first_sent_us.assign(end_rec - start_rec + 1, 0);
+        start_round(blast, records);
+        in_flight.push_back(move(blast));
+    }
+    
+    // Begin a round of DATA for a blast
+    void start_round(BlastState& blast, uint32_t records) {
+        blast.rounds++;
+        blast.reply_parts = 0;
+        blast.attempts = 0;
+        blast.round_records = records;
+        blast.round_nacked = 0;
+        blast.round_delivered = delivered_records;
+        blast.round_delivered_time = delivered_time;
+    }
+    
+    // Feed the rate controller what one REC_MISS says about its round
+    void report_rate_sample(const BlastState& blast, uint32_t missing_records) {
+        auto now = chrono::steady_clock::now();
+        uint32_t lost = min(missing_records + blast.round_nacked, blast.round_records);
+        
+        delivered_records += blast.round_records - lost;
+        delivered_time = now;
+        
+        RateSample rs;
+        rs.sent_bytes = (double)blast.round_records * record_size;
+        rs.lost_bytes = (double)lost * record_size;
+        
+        double interval = chrono::duration<double>(now - blast.round_delivered_time).count();
+        if (interval > 0) {
+            rs.delivery_rate = (delivered_records - blast.round_delivered) * record_size / interval;
+        }
+        
+        // The echoed timestamp identifies the probe answered, so every
+        // reply is a clean RTT sample
+        rs.rtt = rtt.latest_sec();
+        
+        controller->on_feedback(rs);
+    }
+    
+public:
+    BlastStream(int fd, bool owns, const struct sockaddr_in& addr, const FileSource& src,
+                uint16_t rec_size, uint32_t b_size, const SenderOptions& opts,
+                uint32_t first, uint32_t last, uint32_t rec_per_packet, const RttEstimator& rtt0,
+                unsigned int seed, uint64_t link_seed)
+        : sockfd(fd), owns_socket(owns), receiver_addr(addr), source(src),
+          record_size(rec_size), blast_size(b_size),
+          link(opts.impair.active() ? new ImpairedLink(fd, opts.impair, link_seed) : NULL),
+          corrupt_rate(opts.corrupt_rate), probe_loss(opts.probe_loss), rand_seed(seed),
+          first_record(first), last_record(last), next_record(first),
+          stripe_crc(0), crc_next(first),
+          send_batch(SEND_BATCH_SIZE, MAX_DATA_PACKET_SIZE), packet_records(rec_per_packet),
+          max_packet(data_header_size(1) + (size_t)rec_per_packet * rec_size),
+          gso(opts.gso && udp_gso_supported(fd)), wire_bytes(0), read_failed(false),
+          resuming(false),
+          window(opts.window),
+          fec_group(opts.fec_group), nack(opts.nack && opts.fec_group == 0), polling(false),
+          sent_through(0), poll_buffer(MAX_UDP_PAYLOAD), rtt(rtt0),
+          controller(opts.rate_mbps > 0 ? new FixedRateController(opts.rate_mbps * 125000.0)
+                                        : make_rate_controller(opts.cc)),
+          delivered_records(0),
+          delivered_time(chrono::steady_clock::now()),
+          metrics(SenderMetrics::get()), batch_retransmissions(0) {
+        if (fec_group > 0) {
+            parity.resize((size_t)packet_records * record_size);
+        }
+        // Full first-pass packets are all max_packet bytes long, and no
+        // packet is longer, so they can share GSO messages
+        if (gso) {
+            send_batch.set_segment_size(max_packet);
+        }
+        if (opts.io == "uring") {
+            uring.reset(new IoUring());
+            vector<uint8_t> ops;
+            ops.push_back(IORING_OP_SENDMSG);
+            ops.push_back(IORING_OP_FADVISE);
+            if (!uring->init(64, ops)) {
+                cerr << "Warning: io_uring unavailable (" << uring->error()
+                     << "), using blocking I/O" << endl;
+                uring.reset();
+            }
+        }
+    }
+    
+    ~BlastStream() {
+        link.reset();                      // sends what it still holds
+        if (owns_socket) close(sockfd);
+    }
+    
+    const Statistics& get_stats() const { return stats; }
+    uint32_t stripe_checksum() const { return stripe_crc; }
+    
+    // Bytes of the file in the stripe, to combine stripe CRCs by
+    uint64_t stripe_bytes() const {
+        if (first_record > last_record) return 0;
+        uint64_t begin, end;
+        source.record_range(first_record, last_record, begin, end);
+        return end - begin;
+    }
+    const RateController* get_controller() const { return controller.get(); }
+    const RttEstimator& get_rtt() const { return rtt; }
+    LinkCounters link_counters() const { return link ? link->get_counters() : LinkCounters(); }
+    
+    // Send only what the receiver lacks of this stripe: missing holds the
+    // runs of the whole file, in order
+    void resume_from(const vector<Segment>& missing) {
+        resuming = true;
+        resume_missing.clear();
+        for (const Segment& run : missing) {
+            uint32_t start = max(run.start_record, first_record);
+            uint32_t end = min(run.end_record, last_record);
+            if (start <= end) {
+                resume_missing.push_back(Segment(start, end));
+            }
+        }
+    }
+    
+    // Records of [start, end] the receiver lacks; their runs go to runs
+    // unless it is NULL
+    uint32_t resume_missing_in(uint32_t start, uint32_t end, vector<Segment>* runs) const {
+        if (runs) runs->clear();
+        auto it = lower_bound(resume_missing.begin(), resume_missing.end(), start,
+            [](const Segment& run, uint32_t rec) { return run.end_record < rec; });
+        uint32_t records = 0;
+        for (; it != resume_missing.end() && it->start_record <= end; ++it) {
+            Segment run(max(it->start_record, start), min(it->end_record, end));
+            if (runs) runs->push_back(run);
+            records += run.end_record - run.start_record + 1;
+        }
+        return records;
+    }
+    
+    // The receiver has the whole stripe already: nothing to send or join
+    bool idle() const { return resuming && resume_missing.empty(); }
+    
+    // 0-RTT: the stripe's first blast and its IS_BLAST_OVER, sent right
+    // behind FILE_HDR before the receiver has answered. NACKs are not
+    // looked for meanwhile, so that FILE_HDR_ACK is left on the socket for
+    // the handshake; replies it reads for the blast come back through
+    // hold_reply. Returns the records sent.
+    uint32_t send_early_blast() {
+        if (next_record > last_record) return 0;
+        uint32_t blast_end = min(next_record + blast_size - 1, last_record);
+        uint32_t records = blast_end - next_record + 1;
+        
+        fold_crc(blast_end);
+        bool nack_enabled = nack;
+        nack = false;
+        open_blast(next_record, blast_end, records);
+        send_blast(next_record, blast_end);
+        nack = nack_enabled;
+        send_blast_over(in_flight.back());
+        
+        stats.early_records += records;
+        next_record = blast_end + 1;
+        return records;
+    }
+    
+    // A reply read by someone else, for the main loop
+    void hold_reply(const uint8_t* buffer, size_t size) {
+        held_replies.push_back(vector<uint8_t>(buffer, buffer + size));
+    }
+    
+    // The handshake's RTT sample, taken after the stream was made
+    void set_rtt(const RttEstimator& estimate) { rtt = estimate; }
+    
+    // Compress first passes with codec on pool. DATA_COMPRESSED packets
+    // are no longer than a full DATA packet, so they fit the GSO segment.
+    void enable_compression(WorkerPool& pool, uint8_t codec, int level) {
+        BlastCompressor::Settings cfg;
+        cfg.source = &source;
+        cfg.codec = codec;
+        cfg.level = level;
+        cfg.record_size = record_size;
+        cfg.max_block = max_packet - COMPRESSED_HEADER_SIZE;
+        cfg.packet_records = packet_records;
+        compressor.reset(new BlastCompressor(pool, cfg, blast_size, next_record, last_record));
+        
+        // Of a resumed transfer only blasts the receiver has nothing of
+        if (resuming) {
+            compressor->set_filter([this](uint32_t start, uint32_t end) {
+                return resume_missing_in(start, end, NULL) == end - start + 1;
+            });
+        }
+    }
+    bool uses_uring() const { return uring != NULL; }
+    
+    // Join the session: FILE_HDR with this stream's index until FILE_HDR_ACK
+    bool join(const FileHeaderPacket& session_hdr, uint8_t index) {
+        FileHeaderPacket hdr = session_hdr;
+        hdr.stream_index = index;
+        
+        uint8_t send_buffer[1024];
+        uint8_t recv_buffer[MAX_UDP_PAYLOAD];
+        auto give_up = chrono::steady_clock::now() + chrono::milliseconds(CONTROL_GIVE_UP_MS);
+        for (int attempt = 1; chrono::steady_clock::now() < give_up; attempt++) {
+            hdr.timestamp = timestamp_us();
+            size_t size = hdr.serialize(send_buffer);
+            send_packet(send_buffer, size);
+            
+            size_t recv_size;
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(rtt.rto_ms(attempt));
+            while (true) {
+                auto left = chrono::duration_cast<chrono::milliseconds>(
+                    deadline - chrono::steady_clock::now()).count();
+                if (left <= 0 || !wait_for_packet(recv_buffer, recv_size, left)) {
+                    break;
+                }
+                FileHeaderAckPacket ack;
+                if (recv_buffer[0] == FILE_HDR_ACK && ack.deserialize(recv_buffer, recv_size) > 0) {
+                    rtt.on_sample(timestamp_age_us(ack.echo_timestamp));
+                    return true;
+                }
+            }
+        }
+        
+        cerr << "Error: Stream " << (int)index << " could not join the session" << endl;
+        return false;
+    }
+    
+    // Transfer the stripe, keeping up to `window` blasts in flight. New
+    // blasts go out while earlier ones are still waiting for REC_MISS, and
+    // retransmissions are sent as soon as a REC_MISS names them.
+    bool transfer_records() {
+        if (read_failed) {
+            return false;                  // in the early blast
+        }
+        uint8_t recv_buffer[MAX_UDP_PAYLOAD];
+        if (compressor) {
+            compressor->fill();
+        }
+        
+        while (next_record <= last_record || !in_flight.empty()) {
+            // Fill the window with new blasts
+            while (in_flight.size() < window && next_record <= last_record) {
+                uint32_t blast_end = min(next_record + blast_size - 1, last_record);
+                if (!fold_crc(blast_end)) {
+                    return false;
+                }
+                
+                // A resumed transfer skips blasts the receiver already has
+                // and sends only the missing runs of partly held ones
+                uint32_t records = blast_end - next_record + 1;
+                if (resuming) {
+                    records = resume_missing_in(next_record, blast_end, &resume_runs);
+                    if (records == 0) {
+                        stats.blasts_skipped++;
+                        next_record = blast_end + 1;
+                        continue;
+                    }
+                }
+                
+                // Start reading the next blast while this one is in flight;
+                // through io_uring the readahead goes out with the blast
+                uint32_t ahead_end = min(blast_end + blast_size, last_record);
+                if (uring && source.descriptor() >= 0 && blast_end < ahead_end) {
+                    uint64_t begin, end;
+                    source.record_range(blast_end + 1, ahead_end, begin, end);
+                    uring_prefetch(*uring, source.descriptor(), begin, end - begin);
+                } else {
+                    source.prefetch(blast_end + 1, ahead_end);
+                }
+                
+                open_blast(next_record, blast_end, records);
+                
+                // Compressed if the compressor has it, raw otherwise; how
+                // fast it went tells the compressor what the link takes
+                shared_ptr<BlastCompressor::Job> job;
+                if (compressor) {
+                    job = compressor->take(next_record, blast_end, stats);
+                }
+                auto send_start = chrono::steady_clock::now();
+                uint64_t bytes_before = wire_bytes;
+                if (job) {
+                    send_compressed_blast(*job);
+                } else if (records < blast_end - next_record + 1) {
+                    send_resumed_blast(next_record, blast_end, records);
+                } else {
+                    send_blast(next_record, blast_end);
+                }
+                if (compressor) {
+                    compressor->on_sent(wire_bytes - bytes_before, chrono::duration<double>(
+                        chrono::steady_clock::now() - send_start).count());
+                    compressor->fill();
+                }
+                if (read_failed) {
+                    return false;
+                }
+                send_blast_over(in_flight.back());
+                
+                next_record = blast_end + 1;
+            }
+            if (in_flight.empty()) {
+                break;                     // the blasts left were all held already
+            }
+            
+            // Wait for REC_MISS until the earliest IS_BLAST_OVER is overdue
+            auto now = chrono::steady_clock::now();
+            auto deadline = now + chrono::milliseconds(RTO_MAX_MS);
+            for (auto& blast : in_flight) {
+                deadline = min(deadline, probe_deadline(blast));
+            }
+            // Round up so the wait does not end just short of the deadline
+            int wait_ms = (chrono::duration_cast<chrono::microseconds>(deadline - now).count() + 999) / 1000;
+            
+            size_t recv_size;
+            if (next_reply(recv_buffer, recv_size, wait_ms)) {
+                if (recv_buffer[0] == REC_MISS && rec_miss.deserialize(recv_buffer, recv_size) > 0) {
+                    handle_rec_miss(rec_miss);
+                } else if (recv_buffer[0] == NACK && nack &&
+                           nack_packet.deserialize(recv_buffer, recv_size) > 0) {
+                    handle_nack(nack_packet);
+                }
+                if (read_failed) {
+                    return false;
+                }
+            }
+            
+            // Ask again for every blast whose IS_BLAST_OVER went unanswered
+            now = chrono::steady_clock::now();
+            for (auto& blast : in_flight) {
+                if (now < probe_deadline(blast)) {
+                    continue;
+                }
+                if (now - blast.round_probe_time >= chrono::milliseconds(CONTROL_GIVE_UP_MS)) {
+                    cerr << "Error: Failed to receive REC_MISS" << endl;
+                    return false;
+                }
+                cout << "Timeout waiting for REC_MISS, retrying (attempt "
+                     << blast.attempts + 1 << ")..." << endl;
+                stats.probe_timeouts++;
+                send_blast_over(blast);
+            }
+        }
+        
+        return true;
+    }
+    
+};
+
 // ============================================================================
 // SENDER CLASS
 // ============================================================================
@@ -27,27 +1271,37 @@ private:
     string output_filename;
     uint16_t record_size;
     uint32_t blast_size;
-    double loss_rate;
+    unique_ptr<ImpairedLink> link;         // its control packets, NULL = no simulated link
+    uint64_t link_seed;                    // streams use the ones after it
+    LinkCounters link_totals;              // what the streams' links did
     
     uint64_t file_size;
     uint32_t total_records;
-    vector<vector<uint8_t>> file_records;  // all file records in memory
+    uint64_t file_mtime;                   // ns; names the file for resuming
+    uint32_t file_crc;                     // CRC32C of the file, sent in DISCONNECT
+    FileSource source;                     // mmap'd view of the input file
+    vector<TreeEntry> tree;                // a directory: its entries, in MANIFEST order
+    unique_ptr<WorkerPool> compress_pool;  // --compress: shared by the streams
     
-    Statistics stats;
+    SenderOptions opts;
+    FileHeaderPacket header;               // as acknowledged; streams join with it
+    vector<unique_ptr<BlastStream>> streams;  // one per stripe, made before the handshake
+    RttEstimator rtt;                      // first sample from FILE_HDR_ACK
+    uint32_t records_held;                 // at the receiver from an earlier try
+    vector<Segment> resume_missing;        // what it lacks, when records_held > 0
+    uint32_t basis_blocks;                 // --delta: blocks of its older copy
     
-    // Garbler: simulate packet loss
-    bool should_drop_packet() {
-        if (loss_rate <= 0.0) return false;
-        return (rand() / (double)RAND_MAX) < loss_rate;
-    }
+    Statistics stats;
     
-    // Send packet with garbler
-    bool send_packet(const uint8_t* buffer, size_t size, bool is_data_packet = false) {
-        if (is_data_packet && should_drop_packet()) {
-            stats.total_packets_lost++;
-            return false;  // Simulate packet loss
+    // Send a control packet on the handshake socket
+    bool send_packet(const uint8_t* buffer, size_t size) {
+        if (link) {
+            LinkVerdict verdict = link->pass(buffer, size, true, receiver_addr);
+            if (verdict != LINK_SEND) {
+                if (verdict == LINK_HELD) stats.total_packets_sent++;
+                return true;
+            }
         }
-        
         ssize_t sent = sendto(sockfd, buffer, size, 0, 
                              (struct sockaddr*)&receiver_addr, sizeof(receiver_addr));
         if (sent < 0) {
@@ -55,231 +1309,591 @@ private:
             return false;
         }
         stats.total_packets_sent++;
-        if (is_data_packet) {
-            stats.total_data_packets_sent++;
-        }
         return true;
     }
     
-    // Receive packet with timeout
-    bool recv_packet_timeout(uint8_t* buffer, size_t& size, int timeout_sec) {
-        struct timeval tv;
-        tv.tv_sec = timeout_sec;
-        tv.tv_usec = 0;
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // A directory: list it and lay its files out as one stream, read and
+    // mapped on every core
+    bool load_tree() {
+        auto start = chrono::steady_clock::now();
+        if (!scan_tree(filename, "", tree)) {
+            cerr << "Error: Cannot read directory " << filename << ": " << strerror(errno) << endl;
+            return false;
+        }
+        if (tree.empty()) {
+            cerr << "Error: " << filename << " is empty, nothing to send" << endl;
+            return false;
+        }
         
-        ssize_t n = recvfrom(sockfd, buffer, MAX_UDP_PAYLOAD, 0, NULL, NULL);
-        if (n < 0) {
-            return false;  // Timeout or error
+        uint64_t size = layout_tree(tree, sysconf(_SC_PAGESIZE));
+        WorkerPool pool(worker_count(0));
+        uint8_t* image;
+        if (!map_tree(filename, tree, size, pool, image)) {
+            cerr << "Error: Cannot read the files of " << filename << endl;
+            return false;
         }
-        size = n;
+        source.adopt_map(image, size, record_size);
+        
+        size_t files = 0, mapped = 0;
+        uint64_t bytes = 0;
+        for (const TreeEntry& e : tree) {
+            if (S_ISDIR(e.mode)) continue;
+            files++;
+            bytes += e.size;
+            if (e.size >= TREE_MAP_MIN) mapped++;
+        }
+        printf("Directory: %zu file(s) (%zu mapped) and %zu director(ies), %llu bytes "
+               "(loaded in %.1f ms, %zu thread(s))\n", files, mapped, tree.size() - files,
+               (unsigned long long)bytes,
+               chrono::duration<double, milli>(chrono::steady_clock::now() - start).count(),
+               pool.size());
         return true;
     }
     
-    // Load file into memory
+    // Open file and map it for reading; records are pulled on demand
     bool load_file() {
-        ifstream input(filename, ios::binary);
-        if (!input.is_open()) {
-            cerr << "Error: Cannot open file " << filename << endl;
+        struct stat st;
+        if (stat(filename.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (!load_tree()) return false;
+        } else if (!source.open_file(filename, record_size)) {
+            cerr << "Error: Cannot open file " << filename << ": "
+                 << (errno == EINVAL ? "not a regular file" : strerror(errno)) << endl;
             return false;
+        } else {
+            file_mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
         }
         
-        // Get file size
-        input.seekg(0, ios::end);
-        file_size = input.tellg();
-        input.seekg(0, ios::beg);
-        
-        // Calculate total records
-        total_records = (file_size + record_size - 1) / record_size;
+        file_size = source.size();
+        total_records = source.num_records();
         
         cout << "File size: " << file_size << " bytes" << endl;
         cout << "Record size: " << record_size << " bytes" << endl;
         cout << "Total records: " << total_records << endl;
-        
-        // Read all records
-        file_records.resize(total_records);
-        for (uint32_t i = 0; i < total_records; i++) {
-            file_records[i].resize(record_size, 0);  // Pad with zeros
-            
-            size_t bytes_to_read = record_size;
-            if (i == total_records - 1) {
-                // Last record might be partial
-                size_t remaining = file_size % record_size;
-                if (remaining != 0) {
-                    bytes_to_read = remaining;
+        if (tree.empty() && !source.is_mapped()) {
+            cout << "Note: file not mappable, reading records with pread" << endl;
+        }
+        return true;
+    }
+    
+    // Largest datagram the path to the receiver carries unfragmented: from
+    // --mtu, or the MTU of the route (IP_MTU on a connected socket)
+    size_t path_datagram_limit() {
+        int mtu = opts.mtu;
+        if (mtu == 0) {
+            mtu = DEFAULT_PATH_MTU;
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd >= 0 && connect(fd, (struct sockaddr*)&receiver_addr, sizeof(receiver_addr)) == 0) {
+                int route_mtu;
+                socklen_t len = sizeof(route_mtu);
+                if (getsockopt(fd, IPPROTO_IP, IP_MTU, &route_mtu, &len) == 0) {
+                    mtu = route_mtu;
                 }
             }
-            
-            input.read((char*)file_records[i].data(), bytes_to_read);
+            if (fd >= 0) close(fd);
         }
-        
-        input.close();
-        return true;
+        return min((size_t)(mtu - IP_UDP_HEADER_SIZE), (size_t)MAX_DATA_PACKET_SIZE);
     }
     
-    // Send FILE_HDR and wait for ACK
-    bool send_file_header() {
-        FileHeaderPacket hdr;
+    // Fill in FILE_HDR for the file and the path
+    void prepare_header() {
+        FileHeaderPacket& hdr = header;
+        hdr.session_id = random_device()();
         hdr.file_size = file_size;
         hdr.record_size = record_size;
         hdr.blast_size = blast_size;
+        hdr.fec_group = opts.fec_group;
+        hdr.num_streams = opts.streams;
+        hdr.file_mtime = file_mtime;
+        hdr.codec = opts.codec;
+        hdr.codec_level = (uint8_t)opts.codec_level;
+        hdr.nack = opts.nack;
+        hdr.tree_entries = tree.size();
+        hdr.delta = opts.delta && source.is_mapped() && tree.empty();
+        if (opts.delta && !hdr.delta) {
+            cout << "Note: --delta needs a mappable file, sending it whole" << endl;
+        }
+        
+        size_t datagram = path_datagram_limit();
+        hdr.records_per_packet = records_per_packet(datagram, record_size);
+        cout << "Records per packet: " << hdr.records_per_packet << " (datagrams up to "
+             << datagram << " bytes, GSO " << (opts.gso && udp_gso_supported(sockfd) ? "on" : "off")
+             << ")" << endl;
         
         // Ensure null termination
         memset(hdr.filename, 0, MAX_FILENAME_LEN);
         strncpy(hdr.filename, output_filename.c_str(), MAX_FILENAME_LEN - 1);
         hdr.filename[MAX_FILENAME_LEN - 1] = '\0';
-        
+    }
+    
+    // Send FILE_HDR and wait for ACK. With 0-RTT the first blast follows
+    // the first FILE_HDR at once, so a small file is on its way a round
+    // trip sooner; should that FILE_HDR be lost, so is the blast, and its
+    // IS_BLAST_OVER has it resent. Only where the receiver's answer cannot
+    // change what is sent first: not for a directory (the MANIFEST comes
+    // first) or a delta sync, and only a blast its socket buffer takes.
+    bool send_file_header() {
+        FileHeaderPacket& hdr = header;
         uint8_t send_buffer[1024];
-        size_t size = hdr.serialize(send_buffer);
+        bool early = opts.early && tree.empty() && !hdr.delta &&
+                     (uint64_t)min(blast_size, total_records) * record_size <= (uint64_t)EARLY_DATA_MAX;
         
         cout << "Sending FILE_HDR..." << endl;
         
-        // Retry loop with timeout
+        // Retry with a backed-off timeout until CONTROL_GIVE_UP_MS; every
+        // attempt is stamped, so whichever one is answered gives the RTT
         uint8_t recv_buffer[MAX_UDP_PAYLOAD];
-        for (int attempt = 0; attempt < 5; attempt++) {
-            send_packet(send_buffer, size, false);
+        auto give_up = chrono::steady_clock::now() + chrono::milliseconds(CONTROL_GIVE_UP_MS);
+        for (int attempt = 1; chrono::steady_clock::now() < give_up; attempt++) {
+            hdr.timestamp = timestamp_us();
+            size_t size = hdr.serialize(send_buffer);
+            send_packet(send_buffer, size);
+            if (early && attempt == 1) {
+                uint32_t records = streams[0]->send_early_blast();
+                cout << "0-RTT: " << records << " record(s) sent before FILE_HDR_ACK" << endl;
+            }
             
-            // Wait for FILE_HDR_ACK
-            size_t recv_size;
-            if (recv_packet_timeout(recv_buffer, recv_size, TIMEOUT_FILE_HDR)) {
-                if (recv_buffer[0] == FILE_HDR_ACK) {
-                    cout << "Received FILE_HDR_ACK - Connection established!" << endl;
+            // Wait for FILE_HDR_ACK; replies to an early blast are kept
+            // for its stream, anything else is ignored. A REC_MISS for the
+            // blast means the receiver has the session and its
+            // FILE_HDR_ACK went missing, so FILE_HDR goes again at once.
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(rtt.rto_ms(attempt));
+            bool ack_lost = false;
+            while (true) {
+                size_t recv_size;
+                auto left = chrono::duration_cast<chrono::milliseconds>(
+                    deadline - chrono::steady_clock::now()).count();
+                if (left <= 0 ||
+                    !wait_for_datagram(sockfd, recv_buffer, MAX_UDP_PAYLOAD, recv_size, left)) {
+                    break;
+                }
+                if (early && (recv_buffer[0] == REC_MISS || recv_buffer[0] == NACK)) {
+                    streams[0]->hold_reply(recv_buffer, recv_size);
+                    if (recv_buffer[0] == REC_MISS) {
+                        ack_lost = true;
+                        break;
+                    }
+                    continue;
+                }
+                FileHeaderAckPacket ack;
+                if (recv_buffer[0] == FILE_HDR_ACK && ack.deserialize(recv_buffer, recv_size) > 0) {
+                    rtt.on_sample(timestamp_age_us(ack.echo_timestamp));
+                    printf("Received FILE_HDR_ACK - Connection established! (RTT %.3f ms)\n",
+                           rtt.latest_sec() * 1000.0);
+                    records_held = ack.records_held;
+                    basis_blocks = hdr.delta ? ack.basis_blocks : 0;
+                    if (hdr.codec != CODEC_NONE && ack.codec != hdr.codec) {
+                        cout << "Receiver cannot decompress " << codec_name(hdr.codec)
+                             << ", sending uncompressed" << endl;
+                        hdr.codec = CODEC_NONE;
+                    }
                     return true;
                 }
             }
-            cout << "Timeout waiting for FILE_HDR_ACK, retrying..." << endl;
+            cout << (ack_lost ? "FILE_HDR_ACK lost, retrying..." :
+                                "Timeout waiting for FILE_HDR_ACK, retrying...") << endl;
         }
         
         cerr << "Error: Failed to establish connection" << endl;
         return false;
     }
     
-    // Create data packets from records
-    vector<DataPacket> create_data_packets(uint32_t start_rec, uint32_t end_rec) {
-        vector<DataPacket> packets;
+    // Requests of a windowed exchange, replies as accept_reply sees them
+    enum ReplyKind {
+        REPLY_IGNORED,                     // not an answer to this exchange
+        REPLY_DONE,                        // request `index` answered
+        REPLY_BUSY                         // receiver alive but not ready, ask again
+    };
+    
+    // Get requests 0..n-1 answered with up to DELTA_WINDOW of them in
+    // flight. make_request writes request i and returns its size; each
+    // request has its own timer, backed off like any control packet. Fails
+    // once nothing has come back for CONTROL_GIVE_UP_MS.
+    bool windowed_exchange(const char* what, size_t n,
+                           const function<size_t(size_t, uint8_t*)>& make_request,
+                           const function<ReplyKind(const uint8_t*, size_t, size_t&)>& accept_reply) {
+        struct Pending {
+            size_t index;
+            int attempts;
+            chrono::steady_clock::time_point deadline;
+        };
+        vector<Pending> pending;
+        vector<char> answered(n, 0);
+        size_t next = 0, left = n;
+        vector<uint8_t> send_buffer(MAX_UDP_PAYLOAD);
+        vector<uint8_t> recv_buffer(MAX_UDP_PAYLOAD);
+        auto give_up = chrono::steady_clock::now() + chrono::milliseconds(CONTROL_GIVE_UP_MS);
         
-        uint32_t current_rec = start_rec;
-        while (current_rec <= end_rec) {
-            DataPacket pkt;
-            pkt.num_segments = 0;
-            
-            uint32_t records_in_packet = 0;
-            uint32_t segment_start = current_rec;
-            
-            // Pack up to MAX_RECORDS_PER_PACKET records
-            while (current_rec <= end_rec && records_in_packet < MAX_RECORDS_PER_PACKET) {
-                // Add record data
-                pkt.data.insert(pkt.data.end(), 
-                               file_records[current_rec - 1].begin(), 
-                               file_records[current_rec - 1].end());
-                records_in_packet++;
-                current_rec++;
+        while (left > 0) {
+            auto now = chrono::steady_clock::now();
+            while (pending.size() < (size_t)DELTA_WINDOW && next < n) {
+                send_packet(send_buffer.data(), make_request(next, send_buffer.data()));
+                Pending p = {next++, 1, now + chrono::milliseconds(rtt.rto_ms(1))};
+                pending.push_back(p);
             }
             
-            // Create segment descriptor
-            pkt.segments[pkt.num_segments++] = Segment(segment_start, current_rec - 1);
+            // Resend what is overdue and wait for the earliest timer
+            auto wake = now + chrono::milliseconds(RTO_MAX_MS);
+            for (Pending& p : pending) {
+                if (p.deadline <= now) {
+                    if (now >= give_up) {
+                        cerr << "Error: No answer to " << what << endl;
+                        return false;
+                    }
+                    send_packet(send_buffer.data(), make_request(p.index, send_buffer.data()));
+                    p.attempts++;
+                    p.deadline = now + chrono::milliseconds(rtt.rto_ms(p.attempts));
+                }
+                wake = min(wake, p.deadline);
+            }
+            int wait_ms = (chrono::duration_cast<chrono::microseconds>(wake - now).count() + 999) / 1000;
             
-            packets.push_back(pkt);
+            size_t recv_size, index;
+            if (!wait_for_datagram(sockfd, recv_buffer.data(), MAX_UDP_PAYLOAD, recv_size, wait_ms)) {
+                continue;
+            }
+            ReplyKind kind = accept_reply(recv_buffer.data(), recv_size, index);
+            if (kind == REPLY_IGNORED) {
+                continue;
+            }
+            give_up = chrono::steady_clock::now() + chrono::milliseconds(CONTROL_GIVE_UP_MS);
+            if (kind == REPLY_DONE && index < n && !answered[index]) {
+                answered[index] = 1;
+                left--;
+                for (size_t i = 0; i < pending.size(); i++) {
+                    if (pending[i].index == index) {
+                        pending.erase(pending.begin() + i);
+                        break;
+                    }
+                }
+            }
         }
-        
-        return packets;
+        return true;
     }
     
-    // Send a blast of records
-    bool send_blast(uint32_t start_rec, uint32_t end_rec, bool is_retransmission = false) {
-        cout << "Sending blast: records " << start_rec << "-" << end_rec;
-        if (is_retransmission) cout << " (retransmission)";
-        cout << endl;
+    // A directory: list its entries before any DATA; the receiver creates
+    // them and acknowledges each MANIFEST packet
+    bool send_manifest() {
+        auto start = chrono::steady_clock::now();
+        vector<uint32_t> starts;
+        split_manifest(tree, MANIFEST_MAX_SIZE, starts);
+        bool sent = windowed_exchange("MANIFEST", starts.size(),
+            [this, &starts](size_t i, uint8_t* buffer) {
+                ManifestPacket pkt;
+                pkt.first_entry = starts[i];
+                pkt.total_entries = tree.size();
+                pkt.timestamp = timestamp_us();
+                size_t end = i + 1 < starts.size() ? starts[i + 1] : tree.size();
+                pkt.entries.assign(tree.begin() + pkt.first_entry, tree.begin() + end);
+                return pkt.serialize(buffer, MAX_UDP_PAYLOAD);
+            },
+            [this, &starts](const uint8_t* buffer, size_t size, size_t& index) {
+                ManifestAckPacket ack;
+                if (buffer[0] != MANIFEST_ACK || ack.deserialize(buffer, size) == 0) {
+                    return REPLY_IGNORED;
+                }
+                auto it = lower_bound(starts.begin(), starts.end(), ack.first_entry);
+                if (it == starts.end() || *it != ack.first_entry) {
+                    return REPLY_IGNORED;
+                }
+                rtt.on_sample(timestamp_age_us(ack.echo_timestamp));
+                index = it - starts.begin();
+                return REPLY_DONE;
+            });
+        if (sent) {
+            printf("Manifest: %zu entries in %zu packet(s) (%.1f ms)\n", tree.size(), starts.size(),
+                   chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+        return sent;
+    }
+    
+    // --delta: the receiver has an older copy of the file. Fetch the
+    // signatures of its blocks, find those blocks in our file and have it
+    // copy them into place; query_missing_records() then tells what is
+    // left to send.
+    bool sync_delta() {
+        auto start = chrono::steady_clock::now();
+        vector<BlockSignature> sigs(basis_blocks);
+        size_t sig_requests = (basis_blocks + SIG_MAP_BLOCKS - 1) / SIG_MAP_BLOCKS;
+        bool fetched = windowed_exchange("SIG_QUERY", sig_requests,
+            [this](size_t i, uint8_t* buffer) {
+                SigQueryPacket query;
+                query.first_block = i * SIG_MAP_BLOCKS;
+                query.count = min(SIG_MAP_BLOCKS, basis_blocks - query.first_block);
+                query.timestamp = timestamp_us();
+                return query.serialize(buffer);
+            },
+            [this, &sigs](const uint8_t* buffer, size_t size, size_t& index) {
+                SigMapPacket map;
+                if (buffer[0] != SIG_MAP || map.deserialize(buffer, size) == 0 ||
+                    map.first_block % SIG_MAP_BLOCKS != 0 || map.first_block >= basis_blocks) {
+                    return REPLY_IGNORED;
+                }
+                rtt.on_sample(timestamp_age_us(map.echo_timestamp));
+                if (map.sigs.empty()) {
+                    return REPLY_BUSY;
+                }
+                if (map.sigs.size() != min(SIG_MAP_BLOCKS, basis_blocks - map.first_block)) {
+                    return REPLY_IGNORED;
+                }
+                copy(map.sigs.begin(), map.sigs.end(), sigs.begin() + map.first_block);
+                index = map.first_block / SIG_MAP_BLOCKS;
+                return REPLY_DONE;
+            });
+        if (!fetched) return false;
+        double fetch_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
         
-        // Create packets
-        vector<DataPacket> packets = create_data_packets(start_rec, end_rec);
+        start = chrono::steady_clock::now();
+        WorkerPool pool(worker_count(0));
+        vector<DeltaCopy> copies = match_blocks(source.data(), file_size, record_size, sigs, pool);
+        uint64_t matched = 0;
+        for (const DeltaCopy& c : copies) {
+            matched += (uint64_t)c.count * record_size;
+        }
+        printf("Delta: %u signature(s) in %.1f ms, %zu copy run(s) covering %llu bytes "
+               "(matched in %.1f ms, %zu thread(s), %s)\n", basis_blocks, fetch_ms, copies.size(),
+               (unsigned long long)matched,
+               chrono::duration<double, milli>(chrono::steady_clock::now() - start).count(),
+               pool.size(), delta_weak_simd() ? "AVX2" : "scalar");
+        stats.delta_copies = copies.size();
+        if (copies.empty()) {
+            return true;
+        }
         
-        // Send all packets
-        uint8_t buffer[MAX_UDP_PAYLOAD];
-        for (auto& pkt : packets) {
-            size_t size = pkt.serialize(buffer, MAX_UDP_PAYLOAD);
-            if (size > 0) {
-                bool sent = send_packet(buffer, size, true);
-                if (!sent && is_retransmission) {
-                    stats.retransmissions++;
+        size_t copy_requests = (copies.size() + DELTA_COPY_ENTRIES - 1) / DELTA_COPY_ENTRIES;
+        return windowed_exchange("DELTA_COPY", copy_requests,
+            [&copies](size_t i, uint8_t* buffer) {
+                DeltaCopyPacket pkt;
+                pkt.first_entry = i * DELTA_COPY_ENTRIES;
+                pkt.total_entries = copies.size();
+                pkt.timestamp = timestamp_us();
+                size_t end = min(copies.size(), (size_t)pkt.first_entry + DELTA_COPY_ENTRIES);
+                pkt.copies.assign(copies.begin() + pkt.first_entry, copies.begin() + end);
+                return pkt.serialize(buffer, MAX_UDP_PAYLOAD);
+            },
+            [this, &copies](const uint8_t* buffer, size_t size, size_t& index) {
+                DeltaAckPacket ack;
+                if (buffer[0] != DELTA_ACK || ack.deserialize(buffer, size) == 0 ||
+                    ack.first_entry % DELTA_COPY_ENTRIES != 0 || ack.first_entry >= copies.size()) {
+                    return REPLY_IGNORED;
+                }
+                rtt.on_sample(timestamp_age_us(ack.echo_timestamp));
+                index = ack.first_entry / DELTA_COPY_ENTRIES;
+                return REPLY_DONE;
+            });
+    }
+    
+    // The receiver kept records of an earlier transfer of this file (or
+    // rebuilt them with --delta): ask it for the runs it still lacks. The
+    // RESUME_MAP parts are taken in order; if one goes missing, ask again
+    // from the first record not yet covered.
+    bool query_missing_records() {
+        resume_missing.clear();
+        uint8_t send_buffer[64];
+        uint8_t recv_buffer[MAX_UDP_PAYLOAD];
+        RecMissPacket map;
+        int round_trips = 0;
+        
+        ResumeQueryPacket query;
+        uint32_t next = 1;                 // first record no part has covered
+        auto give_up = chrono::steady_clock::now() + chrono::milliseconds(CONTROL_GIVE_UP_MS);
+        for (int attempt = 1; next <= total_records; attempt++) {
+            if (chrono::steady_clock::now() >= give_up) {
+                cerr << "Error: No answer to RESUME_QUERY" << endl;
+                return false;
+            }
+            query.start_record = next;
+            query.timestamp = timestamp_us();
+            send_packet(send_buffer, query.serialize(send_buffer));
+            round_trips++;
+            
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(rtt.rto_ms(attempt));
+            while (next <= total_records) {
+                size_t recv_size;
+                auto left = chrono::duration_cast<chrono::milliseconds>(
+                    deadline - chrono::steady_clock::now()).count();
+                if (left <= 0 ||
+                    !wait_for_datagram(sockfd, recv_buffer, MAX_UDP_PAYLOAD, recv_size, left)) {
+                    break;
+                }
+                if (recv_buffer[0] != RESUME_MAP || map.deserialize(recv_buffer, recv_size) == 0 ||
+                    map.part_start != next || map.end_record != total_records) {
+                    continue;
+                }
+                if (map.part == 0) {
+                    rtt.on_sample(timestamp_age_us(map.echo_timestamp));
                 }
+                for (const Segment& run : map.missing) {
+                    if (!resume_missing.empty() &&
+                        resume_missing.back().end_record + 1 == run.start_record) {
+                        resume_missing.back().end_record = run.end_record;  // split across parts
+                    } else {
+                        resume_missing.push_back(run);
+                    }
+                }
+                next = map.part_end + 1;
+                
+                // More parts are on their way; progress restarts the clock
+                attempt = 0;
+                give_up = chrono::steady_clock::now() + chrono::milliseconds(CONTROL_GIVE_UP_MS);
+                deadline = chrono::steady_clock::now() + chrono::milliseconds(rtt.rto_ms(1));
             }
         }
         
+        uint32_t missing = 0;
+        for (const Segment& run : resume_missing) {
+            missing += run.end_record - run.start_record + 1;
+        }
+        records_held = total_records - missing;
+        cout << "Receiver holds " << records_held << " of " << total_records
+             << " records, " << resume_missing.size() << " missing run(s) ("
+             << round_trips << " round trip(s))" << endl;
         return true;
     }
     
-    // Send IS_BLAST_OVER and wait for REC_MISS
-    bool send_blast_over_and_wait(uint32_t start_rec, uint32_t end_rec, RecMissPacket& rec_miss) {
-        BlastOverPacket blast_over(start_rec, end_rec);
-        uint8_t send_buffer[1024];
-        size_t size = blast_over.serialize(send_buffer);
-        
-        // Retry loop
-        for (int attempt = 0; attempt < 5; attempt++) {
-            send_packet(send_buffer, size, false);
+    // One BlastStream per stripe, each on its own socket (stream 0 reuses
+    // the handshake socket)
+    bool open_streams() {
+        for (uint32_t i = 0; i < opts.streams; i++) {
+            uint32_t first, last;
+            stripe_range(total_records, blast_size, opts.streams, i, first, last);
             
-            // Wait for REC_MISS
-            uint8_t recv_buffer[MAX_UDP_PAYLOAD];
-            size_t recv_size;
-            if (recv_packet_timeout(recv_buffer, recv_size, TIMEOUT_BLAST_OVER)) {
-                if (recv_buffer[0] == REC_MISS) {
-                    rec_miss.deserialize(recv_buffer, recv_size);
-                    return true;
+            int fd = sockfd;
+            if (i > 0) {
+                fd = socket(AF_INET, SOCK_DGRAM, 0);
+                if (fd < 0) {
+                    perror("Socket creation failed");
+                    return false;
                 }
             }
-            cout << "Timeout waiting for REC_MISS, retrying..." << endl;
+            
+            struct sockaddr_in addr = receiver_addr;
+            addr.sin_port = htons(ntohs(receiver_addr.sin_port) + i);
+            
+            streams.push_back(unique_ptr<BlastStream>(new BlastStream(
+                fd, i > 0, addr, source, record_size, blast_size, opts,
+                first, last, header.records_per_packet, rtt,
+                (opts.seed ? opts.seed : header.session_id) + i, link_seed + 1 + i)));
         }
-        
-        cerr << "Error: Failed to receive REC_MISS" << endl;
-        return false;
+        return true;
     }
     
-    // Process one blast cycle
-    bool process_blast_cycle(uint32_t start_rec, uint32_t end_rec) {
-        stats.total_blasts++;
-        
-        // Send initial blast
-        send_blast(start_rec, end_rec, false);
-        
-        // Loop until all records received
-        while (true) {
-            RecMissPacket rec_miss;
-            if (!send_blast_over_and_wait(start_rec, end_rec, rec_miss)) {
-                return false;
+    // Run the streams, each on its own thread (stream 0 on this one), once
+    // the others have joined
+    bool transfer_stripes() {
+        for (uint32_t i = 0; i < streams.size(); i++) {
+            streams[i]->set_rtt(rtt);
+            if (records_held > 0) {
+                streams[i]->resume_from(resume_missing);
             }
             
-            if (rec_miss.num_missing == 0) {
-                cout << "Blast complete - all records received!" << endl;
-                break;
+            if (i > 0 && !streams[i]->idle() && !streams[i]->join(header, i)) {
+                return false;
             }
-            
-            cout << "Missing " << rec_miss.num_missing << " segment(s), retransmitting..." << endl;
-            
-            // Retransmit missing segments
-            for (int i = 0; i < rec_miss.num_missing; i++) {
-                send_blast(rec_miss.missing[i].start_record, 
-                          rec_miss.missing[i].end_record, true);
+        }
+        cout << "I/O: " << (streams[0]->uses_uring() ? "io_uring" : "blocking syscalls") << endl;
+        
+        if (header.codec != CODEC_NONE) {
+            compress_pool.reset(new WorkerPool(worker_count(opts.streams)));
+            for (auto& stream : streams) {
+                stream->enable_compression(*compress_pool, header.codec, header.codec_level);
             }
+            cout << "Compression: " << codec_name(header.codec) << " level " << (int)header.codec_level
+                 << " (" << compress_pool->size() << " compression thread(s))" << endl;
         }
         
+        vector<char> ok(streams.size(), 0);
+        vector<thread> workers;
+        for (size_t i = 1; i < streams.size(); i++) {
+            workers.push_back(thread([this, &ok, i]() {
+                ok[i] = streams[i]->transfer_records();
+            }));
+        }
+        ok[0] = streams[0]->transfer_records();
+        for (auto& w : workers) {
+            w.join();
+        }
+        
+        for (size_t i = 0; i < streams.size(); i++) {
+            stats.merge(streams[i]->get_stats());
+            link_totals += streams[i]->link_counters();
+            const RttEstimator& r = streams[i]->get_rtt();
+            printf("Smoothed RTT: %.3f ms, RTO %d ms (stream %zu)\n",
+                   r.srtt_sec() * 1000.0, r.rto_ms(), i);
+            const RateController* cc = streams[i]->get_controller();
+            if (cc) {
+                printf("Final pacing rate: %.2f Mbps (%s, stream %zu)\n",
+                       cc->pacing_rate() * 8.0 / 1000000.0, cc->name(), i);
+            }
+        }
+        
+        // What the receiver checks the file against: the stripes' CRCs
+        // put together in order
+        file_crc = 0;
+        for (auto& stream : streams) {
+            file_crc = crc32c_combine(file_crc, stream->stripe_checksum(), stream->stripe_bytes());
+        }
+        streams.clear();                   // their links let go of what they hold
+        
+        for (size_t i = 0; i < ok.size(); i++) {
+            if (!ok[i]) return false;
+        }
+        printf("File CRC32C: %08x (built while sending, %s)\n", file_crc,
+               crc32c_hardware() ? "SSE4.2" : "software");
         return true;
     }
     
-    // Send disconnect
-    void send_disconnect() {
+    // End the session: DISCONNECT, with the file's CRC32C, until the
+    // receiver answers with what it made of the file. DISCONNECT_PENDING
+    // means it is still checking, so the wait goes on as long as it keeps
+    // saying so. False only if the receiver found the file bad; one that
+    // stays silent has had every record already, and the transfer stands.
+    bool send_disconnect() {
         DisconnectPacket disc;
+        disc.file_crc = file_crc;
         uint8_t buffer[16];
         size_t size = disc.serialize(buffer);
-        send_packet(buffer, size, false);
-        cout << "Sent DISCONNECT" << endl;
+        uint8_t recv_buffer[MAX_UDP_PAYLOAD];
+        
+        int unanswered = 0;
+        for (int attempt = 1; unanswered < DISCONNECT_ATTEMPTS; attempt++) {
+            send_packet(buffer, size);
+            unanswered++;
+            
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(rtt.rto_ms(attempt));
+            while (true) {
+                size_t recv_size;
+                auto left = chrono::duration_cast<chrono::milliseconds>(
+                    deadline - chrono::steady_clock::now()).count();
+                if (left <= 0 ||
+                    !wait_for_datagram(sockfd, recv_buffer, MAX_UDP_PAYLOAD, recv_size, left)) {
+                    break;
+                }
+                DisconnectAckPacket ack;
+                if (recv_buffer[0] != DISCONNECT_ACK || ack.deserialize(recv_buffer, recv_size) == 0) {
+                    continue;
+                }
+                if (ack.status == DISCONNECT_VERIFIED) {
+                    cout << "DISCONNECT acknowledged - receiver verified the file" << endl;
+                    return true;
+                }
+                if (ack.status == DISCONNECT_FAILED) {
+                    cerr << "Error: Receiver could not verify the file" << endl;
+                    return false;
+                }
+                unanswered = 0;            // still verifying
+            }
+        }
+        
+        cout << "Warning: DISCONNECT not acknowledged, receiver's check unknown" << endl;
+        return true;
     }
 
 public:
     FileSender(const string& ip, int port, const string& fname, const string& output_fname,
-               uint16_t rec_size, uint32_t b_size, double loss) 
+               uint16_t rec_size, uint32_t b_size, const SenderOptions& options) 
         : filename(fname), output_filename(output_fname), record_size(rec_size), 
-          blast_size(b_size), loss_rate(loss) {
+          blast_size(b_size), link_seed(0), file_mtime(0), file_crc(0), opts(options),
+          records_held(0), basis_blocks(0) {
         
         // Create UDP socket
         sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -296,10 +1910,17 @@ public:
             exit(1);
         }
         
-        srand(time(NULL));
+        // The same --seed (or seed=) simulates the same link every run
+        link_seed = opts.impair.has_seed ? opts.impair.seed :
+                    opts.seed ? opts.seed : random_device()();
+        if (opts.impair.active()) {
+            link.reset(new ImpairedLink(sockfd, opts.impair, link_seed));
+        }
     }
     
     ~FileSender() {
+        streams.clear();
+        link.reset();
         close(sockfd);
     }
     
@@ -307,26 +1928,39 @@ public:
         auto start_time = chrono::high_resolution_clock::now();
         
         cout << "\n=== File Sender Started ===" << endl;
-        cout << "Loss rate: " << (loss_rate * 100) << "%" << endl;
+        cout << "Loss rate: " << (opts.impair.loss * 100) << "%" << endl;
+        if (!opts.impair_spec.empty()) {
+            cout << "Impairment: " << opts.impair_spec << endl;
+        }
+        cout << "Blast window: " << opts.window << endl;
+        cout << "Congestion control: " << opts.cc << endl;
+        if (opts.fec_group > 0) {
+            cout << "FEC: 1 parity packet per " << opts.fec_group << " DATA packets" << endl;
+        }
+        if (opts.streams > 1) {
+            cout << "Streams: " << opts.streams << endl;
+        }
         
         // Phase 1: Connection Setup
         if (!load_file()) return false;
+        prepare_header();
+        if (!open_streams()) return false;
         if (!send_file_header()) return false;
+        if (!tree.empty() && !send_manifest()) return false;
+        if (records_held > 0) {
+            if (!query_missing_records()) return false;
+            stats.records_resumed = records_held;
+        } else if (basis_blocks > 0) {
+            if (!sync_delta()) return false;
+            if (stats.delta_copies > 0 && !query_missing_records()) return false;
+            stats.records_copied = records_held;
+        }
         
         // Phase 2: Data Transfer
-        uint32_t current_rec = 1;
-        while (current_rec <= total_records) {
-            uint32_t blast_end = min(current_rec + blast_size - 1, total_records);
-            
-            if (!process_blast_cycle(current_rec, blast_end)) {
-                return false;
-            }
-            
-            current_rec = blast_end + 1;
-        }
+        if (!transfer_stripes()) return false;
         
         // Phase 3: Disconnect
-        send_disconnect();
+        if (!send_disconnect()) return false;
         
         auto end_time = chrono::high_resolution_clock::now();
         chrono::duration<double> elapsed = end_time - start_time;
@@ -335,6 +1969,11 @@ public:
         
         cout << "\n=== Transfer Complete ===" << endl;
         stats.print();
+        SenderMetrics::get().print();
+        if (link) {
+            link_totals += link->get_counters();
+            print_link_counters("sender", link_totals);
+        }
         
         return true;
     }
@@ -345,20 +1984,101 @@ public:
 // ============================================================================
 
 int main(int argc, char* argv[]) {
-    if (argc < 4) {
-        cerr << "Usage: " << argv[0] << " <receiver_ip> <receiver_port> <filename> [record_size] [blast_size] [loss_rate]" << endl;
+    // Split --options from the positional arguments
+    vector<string> args;
+    SenderOptions opts;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            args.push_back(arg);
+        } else if (arg == "--window" && i + 1 < argc) {
+            opts.window = atoi(argv[++i]);
+        } else if (arg == "--cc" && i + 1 < argc) {
+            opts.cc = argv[++i];
+        } else if (arg == "--fec" && i + 1 < argc) {
+            opts.fec_group = atoi(argv[++i]);
+        } else if (arg == "--streams" && i + 1 < argc) {
+            opts.streams = atoi(argv[++i]);
+        } else if (arg == "--mtu" && i + 1 < argc) {
+            opts.mtu = atoi(argv[++i]);
+        } else if (arg == "--no-gso") {
+            opts.gso = false;
+        } else if (arg == "--io" && i + 1 < argc) {
+            opts.io = argv[++i];
+        } else if (arg == "--corrupt" && i + 1 < argc) {
+            opts.corrupt_rate = atof(argv[++i]);
+        } else if (arg == "--probe-loss" && i + 1 < argc) {
+            opts.probe_loss = atof(argv[++i]);
+        } else if (arg == "--compress" && i + 1 < argc) {
+            if (!parse_codec(argv[++i], opts.codec, opts.codec_level)) {
+                cerr << "Error: Compression must be lz4[:level], zstd[:level] or none" << endl;
+                return 1;
+            }
+        } else if (arg == "--rate" && i + 1 < argc) {
+            opts.rate_mbps = atof(argv[++i]);
+        } else if (arg == "--delta") {
+            opts.delta = true;
+        } else if (arg == "--no-nack") {
+            opts.nack = false;
+        } else if (arg == "--no-0rtt") {
+            opts.early = false;
+        } else if (arg == "--impair" && i + 1 < argc) {
+            opts.impair_spec = argv[++i];
+            string bad;
+            if (!parse_impairment(opts.impair_spec, opts.impair, bad)) {
+                cerr << "Error: Cannot parse impairment '" << bad << "'" << endl;
+                return 1;
+            }
+        } else if (arg == "--seed" && i + 1 < argc) {
+            opts.seed = strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--telemetry" && i + 1 < argc) {
+            if (!parse_telemetry(argv[++i], opts.telemetry)) {
+                cerr << "Error: Cannot parse telemetry '" << argv[i] << "'" << endl;
+                return 1;
+            }
+        } else {
+            cerr << "Error: Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    
+    if (args.size() < 3) {
+        cerr << "Usage: " << argv[0] << " <receiver_ip> <receiver_port> <file|directory> [record_size] [blast_size] [loss_rate] [options]" << endl;
+        cerr << "Options:" << endl;
+        cerr << "  --window <n>   blasts in flight at once (default " << DEFAULT_BLAST_WINDOW << ")" << endl;
+        cerr << "  --cc <alg>     rate control and pacing: none, aimd, bbr (default none)" << endl;
+        cerr << "  --fec <k>      one XOR parity packet per k DATA packets (default 0, off)" << endl;
+        cerr << "  --streams <n>  stripe the file over n sockets/threads on ports port..port+n-1" << endl;
+        cerr << "  --mtu <bytes>  path MTU to size DATA packets for (default: the route's)" << endl;
+        cerr << "  --no-gso       one syscall slot per datagram even if UDP GSO is available" << endl;
+        cerr << "  --io <engine>  sync (blocking syscalls) or uring (io_uring, falls back to sync)" << endl;
+        cerr << "  --corrupt <p>  flip a bit in this fraction of DATA packets (tests the CRCs)" << endl;
+        cerr << "  --probe-loss <p> drop this fraction of IS_BLAST_OVER packets (tests the timers)" << endl;
+        cerr << "  --compress <c[:level]> compress first passes: lz4 or zstd (default none)" << endl;
+        cerr << "  --rate <mbps>  pace each stream at a fixed rate (with --cc none)" << endl;
+        cerr << "  --delta        send only what differs from the receiver's older copy of the file" << endl;
+        cerr << "  --no-nack      ignore mid-blast NACKs, retransmit only after IS_BLAST_OVER" << endl;
+        cerr << "  --no-0rtt      wait for FILE_HDR_ACK before sending the first blast" << endl;
+        cerr << "  --seed <n>     seed the simulated loss, for runs that drop the same packets" << endl;
+        cerr << "  --impair <spec> simulate a link: loss=p,burst=P/R[/h],ctrl-loss=p,delay=ms," << endl;
+        cerr << "                 jitter=ms,reorder=p,dup=p,rate=mbps,bucket=bytes,queue=ms,seed=n" << endl;
+        cerr << "  --telemetry <spec> live counters and latency histograms to <path>[,json|prom][,ms]" << endl;
+        cerr << "                 every ms (default " << DEFAULT_TELEMETRY_MS
+             << "), or to each client of unix:<path>" << endl;
         cerr << "Example: " << argv[0] << " 127.0.0.1 8080 test.txt 512 1000 0.1" << endl;
         return 1;
     }
     
-    string receiver_ip = argv[1];
-    int receiver_port = atoi(argv[2]);
-    string filename = argv[3];
-    uint16_t record_size = (argc > 4) ? atoi(argv[4]) : DEFAULT_RECORD_SIZE;
-    uint32_t blast_size = (argc > 5) ? atoi(argv[5]) : DEFAULT_BLAST_SIZE;
-    double loss_rate = (argc > 6) ? atof(argv[6]) : 0.0;
-    
-    // Extract output filename from path
+    string receiver_ip = args[0];
+    int receiver_port = atoi(args[1].c_str());
+    string filename = args[2];
+    uint16_t record_size = (args.size() > 3) ? atoi(args[3].c_str()) : DEFAULT_RECORD_SIZE;
+    uint32_t blast_size = (args.size() > 4) ? atoi(args[4].c_str()) : DEFAULT_BLAST_SIZE;
+    double loss_rate = (args.size() > 5) ? atof(args[5].c_str()) : 0.0;
+    // Extract output filename from path (a directory may end in '/')
+    while (filename.size() > 1 && filename[filename.size() - 1] == '/') {
+        filename.erase(filename.size() - 1);
+    }
     string output_filename = filename;
     size_t last_slash = filename.find_last_of("/\\");
     if (last_slash != string::npos) {
@@ -380,11 +2100,78 @@ int main(int argc, char* argv[]) {
         cerr << "Error: Loss rate must be between 0.0 and 1.0" << endl;
         return 1;
     }
+    if (!opts.impair.has_loss) {
+        opts.impair.loss = loss_rate;
+    }
+    
+    if (opts.cc != "none" && opts.cc != "aimd" && opts.cc != "bbr") {
+        cerr << "Error: Congestion control must be none, aimd or bbr" << endl;
+        return 1;
+    }
+    
+    if (opts.corrupt_rate < 0.0 || opts.corrupt_rate > 1.0) {
+        cerr << "Error: Corruption rate must be between 0.0 and 1.0" << endl;
+        return 1;
+    }
+    
+    if (opts.probe_loss < 0.0 || opts.probe_loss > 1.0) {
+        cerr << "Error: Probe loss rate must be between 0.0 and 1.0" << endl;
+        return 1;
+    }
+    
+    if (!codec_available(opts.codec)) {
+        cerr << "Error: " << codec_name(opts.codec) << " support is not built in (make ZSTD=1)" << endl;
+        return 1;
+    }
+    
+    if (opts.codec != CODEC_NONE && opts.fec_group > 0) {
+        cerr << "Error: --compress and --fec cannot be combined" << endl;
+        return 1;
+    }
+    
+    if (opts.rate_mbps < 0 || (opts.rate_mbps > 0 && opts.cc != "none")) {
+        cerr << "Error: --rate takes a positive rate and --cc none" << endl;
+        return 1;
+    }
+    
+    if (opts.io != "sync" && opts.io != "uring") {
+        cerr << "Error: I/O engine must be sync or uring" << endl;
+        return 1;
+    }
+    
+    if (opts.fec_group > 255) {
+        cerr << "Error: FEC group must be between 0 and 255 packets" << endl;
+        return 1;
+    }
+    
+    if (opts.streams < 1 || opts.streams > MAX_STREAMS) {
+        cerr << "Error: Streams must be between 1 and " << MAX_STREAMS << endl;
+        return 1;
+    }
+    
+    if (opts.mtu != 0 && (opts.mtu < 576 || opts.mtu > 65535)) {
+        cerr << "Error: MTU must be between 576 and 65535 bytes" << endl;
+        return 1;
+    }
+    
+    if (opts.window < 1 || opts.window > 64) {
+        cerr << "Error: Window must be between 1 and 64 blasts" << endl;
+        return 1;
+    }
+    
+    SenderMetrics::get();                  // registered before the first dump
+    if (!opts.telemetry.path.empty() && !Telemetry::instance().start(opts.telemetry)) {
+        cerr << "Error: Cannot publish telemetry at " << opts.telemetry.path << ": "
+             << telemetry_error(errno) << endl;
+        return 1;
+    }
     
     FileSender sender(receiver_ip, receiver_port, filename, output_filename,
-                     record_size, blast_size, loss_rate);
+                     record_size, blast_size, opts);
     
-    if (!sender.run()) {
+    bool ok = sender.run();
+    Telemetry::instance().stop();
+    if (!ok) {
         cerr << "Transfer failed!" << endl;
         return 1;
     }
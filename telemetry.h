@@ -0,0 +1,393 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdarg>
+#include <cerrno>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+const int DEFAULT_TELEMETRY_MS = 1000;       // between dumps to a file
+const int HISTOGRAM_SUB_BITS = 5;            // 32 sub-buckets per power of two, ~3%
+const int HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS;
+
+// ============================================================================
+// COUNTERS AND HISTOGRAMS
+// ============================================================================
+//
+// Both are updated from the hot paths with relaxed atomic adds and only
+// ever read by the dump, so recording costs a few nanoseconds and never
+// takes a lock. Counters are 64-bit and do not wrap.
+//
+// The histogram is HDR-style log-linear: values below 32 have a bucket
+// each, above that every power of two is split into 32 buckets, so any
+// value from 1 to 2^64 is kept to within about 3% in 1920 buckets.
+
+class Counter {
+private:
+    std::atomic<uint64_t> value;
+
+public:
+    Counter() : value(0) {}
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+class Histogram {
+private:
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> largest;
+
+    static int index_of(uint64_t v) {
+        if (v < (1u << HISTOGRAM_SUB_BITS)) return (int)v;
+        int magnitude = 63 - __builtin_clzll(v);
+        int shift = magnitude - HISTOGRAM_SUB_BITS;
+        int sub = (int)((v >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+        return ((shift + 1) << HISTOGRAM_SUB_BITS) + sub;
+    }
+
+    // The middle of a bucket's range
+    static uint64_t value_at(int index) {
+        if (index < (1 << HISTOGRAM_SUB_BITS)) return index;
+        int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+        uint64_t sub = index & ((1 << HISTOGRAM_SUB_BITS) - 1);
+        uint64_t low = ((1ULL << HISTOGRAM_SUB_BITS) + sub) << shift;
+        return low + ((1ULL << shift) >> 1);
+    }
+
+public:
+    Histogram() : total(0), sum(0), largest(0) {
+        for (auto& b : buckets) b.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t v) {
+        buckets[index_of(v)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t seen = largest.load(std::memory_order_relaxed);
+        while (v > seen && !largest.compare_exchange_weak(seen, v, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t total_sum() const { return sum.load(std::memory_order_relaxed); }
+    uint64_t max() const { return largest.load(std::memory_order_relaxed); }
+
+    // The value at quantile q (0..1), 0 if nothing was recorded
+    uint64_t quantile(double q) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = std::max((uint64_t)1, (uint64_t)std::ceil(q * n));  // nearest rank
+        uint64_t seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return std::min(value_at(i), max());
+        }
+        return max();
+    }
+};
+
+// Nanoseconds since `start`, for histograms of elapsed time
+inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// ============================================================================
+// REGISTRY AND DUMPS
+// ============================================================================
+//
+// One registry per process holds every metric by name, in the order they
+// were registered; the returned references stay valid for the life of
+// the process. The dump renders all of them as Prometheus text or as
+// JSON, and with --telemetry a background thread either rewrites a file
+// with it every interval (written aside and renamed, so readers never
+// see half a dump) or answers each connection to a Unix socket with one.
+// Either way the hot paths only touch their atomics.
+
+enum TelemetryFormat {
+    TELEMETRY_PROMETHEUS,
+    TELEMETRY_JSON
+};
+
+struct TelemetryConfig {
+    std::string path;                        // file, or the socket with unix:
+    bool unix_socket;
+    TelemetryFormat format;
+    int interval_ms;
+
+    TelemetryConfig() : unix_socket(false), format(TELEMETRY_PROMETHEUS),
+                        interval_ms(DEFAULT_TELEMETRY_MS) {}
+};
+
+// "<path>[,json|prom][,<ms>]" or "unix:<path>[,json|prom]"; JSON by
+// default for a path ending in .json. False if not understood.
+inline bool parse_telemetry(const std::string& spec, TelemetryConfig& cfg) {
+    size_t comma = spec.find(',');
+    cfg.path = spec.substr(0, comma);
+    if (cfg.path.compare(0, 5, "unix:") == 0) {
+        cfg.unix_socket = true;
+        cfg.path = cfg.path.substr(5);
+    }
+    if (cfg.path.empty()) return false;
+    if (cfg.path.size() > 5 && cfg.path.compare(cfg.path.size() - 5, 5, ".json") == 0) {
+        cfg.format = TELEMETRY_JSON;
+    }
+    while (comma != std::string::npos) {
+        size_t next = spec.find(',', comma + 1);
+        std::string item = spec.substr(comma + 1, next == std::string::npos ? std::string::npos
+                                                                               : next - comma - 1);
+        comma = next;
+        if (item == "json") {
+            cfg.format = TELEMETRY_JSON;
+        } else if (item == "prom") {
+            cfg.format = TELEMETRY_PROMETHEUS;
+        } else {
+            char* end;
+            long ms = strtol(item.c_str(), &end, 10);
+            if (item.empty() || *end != '\0' || ms < 10 || ms > 3600000) return false;
+            cfg.interval_ms = (int)ms;
+        }
+    }
+    return true;
+}
+
+// Why Telemetry::start() failed, for the error message
+inline std::string telemetry_error(int err) {
+    if (err == ENOTSOCK) return "the path exists and is not a socket";
+    return strerror(err);
+}
+
+class Telemetry {
+private:
+    struct Metric {
+        std::string name;
+        std::string help;
+        Counter* counter;                    // one of the two
+        Histogram* histogram;
+    };
+
+    std::mutex lock;                         // registration and dumping
+    std::deque<Counter> counters;            // deques: references stay put
+    std::deque<Histogram> histograms;
+    std::vector<Metric> metrics;
+    std::chrono::steady_clock::time_point started;
+
+    TelemetryConfig cfg;
+    int listen_fd;
+    std::thread worker;
+    std::mutex stop_lock;
+    std::condition_variable stop_signal;
+    bool stopping;
+
+    Telemetry() : started(std::chrono::steady_clock::now()), listen_fd(-1), stopping(false) {}
+
+    __attribute__((format(printf, 2, 3)))
+    static void append(std::string& out, const char* fmt, ...) {
+        char buf[512];
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        if (n > 0) out.append(buf, std::min((size_t)n, sizeof(buf) - 1));
+    }
+
+    bool write_file(const std::string& text) {
+        std::string tmp = cfg.path + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = write_all(fd, text);
+        close(fd);
+        return ok && rename(tmp.c_str(), cfg.path.c_str()) == 0;
+    }
+
+    static bool write_all(int fd, const std::string& text) {
+        size_t done = 0;
+        while (done < text.size()) {
+            ssize_t n = write(fd, text.data() + done, text.size() - done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    bool open_socket() {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (cfg.path.size() >= sizeof(addr.sun_path)) return false;
+        strcpy(addr.sun_path, cfg.path.c_str());
+
+        // A socket left by an earlier run is replaced, anything else kept
+        struct stat st;
+        if (lstat(cfg.path.c_str(), &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                errno = ENOTSOCK;
+                return false;
+            }
+            unlink(cfg.path.c_str());
+        }
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0) return false;
+        if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, 8) != 0) {
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> guard(stop_lock);
+        while (!stopping) {
+            if (listen_fd >= 0) {
+                guard.unlock();
+                struct pollfd pfd;
+                pfd.fd = listen_fd;
+                pfd.events = POLLIN;
+                if (poll(&pfd, 1, 200) > 0) {
+                    int client = accept(listen_fd, NULL, NULL);
+                    if (client >= 0) {
+                        write_all(client, render(cfg.format));
+                        close(client);
+                    }
+                }
+                guard.lock();
+            } else {
+                stop_signal.wait_for(guard, std::chrono::milliseconds(cfg.interval_ms));
+                guard.unlock();
+                write_file(render(cfg.format));
+                guard.lock();
+            }
+        }
+    }
+
+public:
+    static Telemetry& instance() {
+        static Telemetry telemetry;
+        return telemetry;
+    }
+
+    ~Telemetry() {
+        stop();
+    }
+
+    Counter& counter(const std::string& name, const std::string& help) {
+        std::lock_guard<std::mutex> guard(lock);
+        counters.emplace_back();
+        Metric m = {name, help, &counters.back(), NULL};
+        metrics.push_back(m);
+        return counters.back();
+    }
+
+    Histogram& histogram(const std::string& name, const std::string& help) {
+        std::lock_guard<std::mutex> guard(lock);
+        histograms.emplace_back();
+        Metric m = {name, help, NULL, &histograms.back()};
+        metrics.push_back(m);
+        return histograms.back();
+    }
+
+    // Every metric as Prometheus text (histograms as summaries) or JSON
+    std::string render(TelemetryFormat format) {
+        static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+        std::lock_guard<std::mutex> guard(lock);
+        double uptime = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - started).count();
+        std::string out;
+        if (format == TELEMETRY_JSON) {
+            append(out, "{\"uptime_seconds\": %.3f", uptime);
+        } else {
+            append(out, "# TYPE uptime_seconds gauge\nuptime_seconds %.3f\n", uptime);
+        }
+        for (const Metric& m : metrics) {
+            const char* name = m.name.c_str();
+            if (format == TELEMETRY_JSON) {
+                if (m.counter) {
+                    append(out, ", \"%s\": %llu", name, (unsigned long long)m.counter->get());
+                    continue;
+                }
+                const Histogram& h = *m.histogram;
+                append(out, ", \"%s\": {\"count\": %llu, \"sum\": %llu, \"max\": %llu", name,
+                       (unsigned long long)h.count(), (unsigned long long)h.total_sum(),
+                       (unsigned long long)h.max());
+                for (double q : QUANTILES) {
+                    append(out, ", \"p%g\": %llu", q * 100, (unsigned long long)h.quantile(q));
+                }
+                out += "}";
+            } else if (m.counter) {
+                append(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, m.help.c_str(),
+                       name, name, (unsigned long long)m.counter->get());
+            } else {
+                const Histogram& h = *m.histogram;
+                append(out, "# HELP %s %s\n# TYPE %s summary\n", name, m.help.c_str(), name);
+                for (double q : QUANTILES) {
+                    append(out, "%s{quantile=\"%g\"} %llu\n", name, q,
+                           (unsigned long long)h.quantile(q));
+                }
+                append(out, "%s_sum %llu\n%s_count %llu\n", name,
+                       (unsigned long long)h.total_sum(), name, (unsigned long long)h.count());
+            }
+        }
+        if (format == TELEMETRY_JSON) out += "}\n";
+        return out;
+    }
+
+    // Start dumping as cfg says; false (with errno set) if the file or
+    // socket cannot be set up. ENOTSOCK: something other than a socket is
+    // at the socket's path, and it is left alone.
+    bool start(const TelemetryConfig& config) {
+        cfg = config;
+        if (cfg.unix_socket ? !open_socket() : !write_file(render(cfg.format))) {
+            return false;
+        }
+        worker = std::thread([this] { run(); });
+        return true;
+    }
+
+    // Stop the thread, leaving a last complete dump in the file
+    void stop() {
+        if (!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> guard(stop_lock);
+            stopping = true;
+        }
+        stop_signal.notify_all();
+        worker.join();
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            unlink(cfg.path.c_str());
+            listen_fd = -1;
+        } else {
+            write_file(render(cfg.format));
+        }
+    }
+};
+
+#endif // TELEMETRY_H
@@ -137,6 +137,39 @@ run_test() {
     fi
 }
 
+# Start a receiver in a directory of its own, with any extra options;
+# sets RECEIVER_PID and RX_DIR
+start_receiver() {
+    RX_DIR=$(mktemp -d)
+    restart_receiver "$@"
+}
+
+# Start a receiver again in RX_DIR, as after a crash or for a later
+# transfer that finds what the earlier one left
+restart_receiver() {
+    local port=$1
+    shift
+    (cd "$RX_DIR" && exec "$ROOT/receiver" $port "$@" > receiver_output.log 2>&1) &
+    RECEIVER_PID=$!
+    sleep 0.5
+}
+
+# Give a single-transfer receiver up to 10 s to exit on its own; false
+# (and killed) if it does not
+stop_receiver() {
+    for i in $(seq 100); do
+        ps -p $RECEIVER_PID > /dev/null || break
+        sleep 0.1
+    done
+    if ps -p $RECEIVER_PID > /dev/null; then
+        kill $RECEIVER_PID 2>/dev/null || true
+        wait $RECEIVER_PID 2>/dev/null || true
+        return 1
+    fi
+    wait $RECEIVER_PID 2>/dev/null || true
+    return 0
+}
+
 # Clean up function
 cleanup() {
     echo -e "\n${YELLOW}Cleaning up...${NC}"
@@ -155,6 +188,7 @@ trap cleanup EXIT
 TESTS_PASSED=0
 TESTS_FAILED=0
 PORT=8080
+ROOT=$(pwd)
 
 # Test 1: Small file, no loss
 echo -e "\n${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}"
@@ -162,9 +196,9 @@ echo -e "${BLUE}Test 1: Small File (10 KB), No Loss${NC}"
 echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
 generate_file "test_10kb.txt" 10
 if run_test "Small File - No Loss" "test_10kb.txt" 512 100 0.0 $PORT; then
-    ((TESTS_PASSED++))
+    TESTS_PASSED=$((TESTS_PASSED + 1))
 else
-    ((TESTS_FAILED++))
+    TESTS_FAILED=$((TESTS_FAILED + 1))
 fi
 sleep 2
 
@@ -174,9 +208,9 @@ echo -e "${BLUE}Test 2: Medium File (100 KB), 5% Loss${NC}"
 echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
 generate_file "test_100kb.txt" 100
 if run_test "Medium File - 5% Loss" "test_100kb.txt" 512 1000 0.05 $PORT; then
-    ((TESTS_PASSED++))
+    TESTS_PASSED=$((TESTS_PASSED + 1))
 else
-    ((TESTS_FAILED++))
+    TESTS_FAILED=$((TESTS_FAILED + 1))
 fi
 sleep 2
 
@@ -186,9 +220,9 @@ echo -e "${BLUE}Test 3: Large File (1 MB), 10% Loss${NC}"
 echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
 generate_file "test_1mb.txt" 1024
 if run_test "Large File - 10% Loss" "test_1mb.txt" 512 1000 0.10 $PORT; then
-    ((TESTS_PASSED++))
+    TESTS_PASSED=$((TESTS_PASSED + 1))
 else
-    ((TESTS_FAILED++))
+    TESTS_FAILED=$((TESTS_FAILED + 1))
 fi
 sleep 2
 
@@ -197,9 +231,9 @@ echo -e "\n${BLUE}━━━━━━━━━━━━━━━━━━━━
 echo -e "${BLUE}Test 4: 100 KB, 256-byte records, 10% Loss${NC}"
 echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
 if run_test "256-byte Records" "test_100kb.txt" 256 2000 0.10 $PORT; then
-    ((TESTS_PASSED++))
+    TESTS_PASSED=$((TESTS_PASSED + 1))
 else
-    ((TESTS_FAILED++))
+    TESTS_FAILED=$((TESTS_FAILED + 1))
 fi
 sleep 2
 
@@ -208,9 +242,9 @@ echo -e "\n${BLUE}━━━━━━━━━━━━━━━━━━━━
 echo -e "${BLUE}Test 5: 100 KB, 1024-byte records, 10% Loss${NC}"
 echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
 if run_test "1024-byte Records" "test_100kb.txt" 1024 500 0.10 $PORT; then
-    ((TESTS_PASSED++))
+    TESTS_PASSED=$((TESTS_PASSED + 1))
 else
-    ((TESTS_FAILED++))
+    TESTS_FAILED=$((TESTS_FAILED + 1))
 fi
 sleep 2
 
@@ -219,9 +253,231 @@ echo -e "\n${BLUE}━━━━━━━━━━━━━━━━━━━━
 echo -e "${BLUE}Test 6: 100 KB, High Loss Rate (20%)${NC}"
 echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
 if run_test "High Loss Rate" "test_100kb.txt" 512 1000 0.20 $PORT; then
-    ((TESTS_PASSED++))
+    TESTS_PASSED=$((TESTS_PASSED + 1))
+else
+    TESTS_FAILED=$((TESTS_FAILED + 1))
+fi
+
+# ============================================================================
+# REGRESSION TESTS
+# ============================================================================
+
+# Test 7: a directory whose entries carry setuid, setgid and sticky bits is
+# received with the permission bits only
+test_tree_modes() {
+    local port=$1
+    local src=$(mktemp -d)
+    mkdir -p "$src/tree/sub"
+    echo "#!/bin/sh" > "$src/tree/tool"
+    head -c 100000 /dev/urandom > "$src/tree/sub/data"
+    chmod 4755 "$src/tree/tool"
+    chmod 2755 "$src/tree/sub/data"
+    chmod 3755 "$src/tree/sub"
+
+    start_receiver $port
+    ./sender 127.0.0.1 $port "$src/tree" 1024 1000 0 > sender_output.log 2>&1
+    local rc=$?
+    stop_receiver
+    local out=$(ls -d "$RX_DIR"/received_files/*/tree 2>/dev/null | head -1)
+
+    local ok=0
+    if [ $rc -ne 0 ] || [ -z "$out" ] || ! diff -r "$src/tree" "$out" > /dev/null; then
+        echo -e "${RED}✗ Tree not received intact${NC}"
+        ok=1
+    else
+        for f in tool sub sub/data; do
+            local mode=$(stat -c %a "$out/$f")
+            if [ "$mode" != "755" ]; then
+                echo -e "${RED}✗ $f received with mode $mode, expected 755${NC}"
+                ok=1
+            fi
+        done
+    fi
+    [ $ok -eq 0 ] && echo -e "${GREEN}✓ setuid/setgid/sticky bits dropped${NC}"
+    rm -rf "$src" "$RX_DIR"
+    return $ok
+}
+
+echo -e "\n${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}"
+echo -e "${BLUE}Test 7: Directory with setuid/setgid modes${NC}"
+echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
+if test_tree_modes $((PORT + 100)); then
+    TESTS_PASSED=$((TESTS_PASSED + 1))
+else
+    TESTS_FAILED=$((TESTS_FAILED + 1))
+fi
+
+# Test 8: more streams than the file has records (or blasts), so some
+# streams have an empty stripe and must still let their sender socket join
+test_empty_stripes() {
+    local port=$1
+    local ok=0
+    for size in 3000 100000; do
+        head -c $size /dev/urandom > test_stripes.bin
+        start_receiver $port
+        timeout 30 ./sender 127.0.0.1 $port test_stripes.bin 1024 200 0 --streams 8 \
+            > sender_output.log 2>&1
+        local rc=$?
+        if ! stop_receiver; then
+            echo -e "${RED}✗ $size bytes: receiver still running after the transfer${NC}"
+            ok=1
+        fi
+        local out=$(ls "$RX_DIR"/received_files/*/test_stripes.bin 2>/dev/null | head -1)
+        if [ $rc -ne 0 ] || [ -z "$out" ] || ! cmp -s test_stripes.bin "$out"; then
+            echo -e "${RED}✗ $size bytes over 8 streams failed (sender rc=$rc)${NC}"
+            tail -3 sender_output.log
+            ok=1
+        fi
+        rm -rf "$RX_DIR" test_stripes.bin
+    done
+    [ $ok -eq 0 ] && echo -e "${GREEN}✓ Streams with empty stripes joined${NC}"
+    return $ok
+}
+
+echo -e "\n${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}"
+echo -e "${BLUE}Test 8: 8 streams, fewer records than streams${NC}"
+echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
+if test_empty_stripes $((PORT + 110)); then
+    TESTS_PASSED=$((TESTS_PASSED + 1))
+else
+    TESTS_FAILED=$((TESTS_FAILED + 1))
+fi
+
+# Test 9: a journaled transfer killed halfway, together with its receiver,
+# picks up where the journal left off once both are started again
+test_resume() {
+    local port=$1
+    local ok=0
+    head -c 20000000 /dev/urandom > test_resume.bin
+
+    start_receiver $port --checkpoint 50
+    ./sender 127.0.0.1 $port test_resume.bin 1024 1000 0 --rate 40 > sender_output.log 2>&1 &
+    local sender_pid=$!
+    sleep 1.5
+    kill -9 $sender_pid $RECEIVER_PID 2>/dev/null || true
+    wait $sender_pid $RECEIVER_PID 2>/dev/null || true
+
+    restart_receiver $port --checkpoint 50
+    timeout 60 ./sender 127.0.0.1 $port test_resume.bin 1024 1000 0 > sender_output.log 2>&1
+    local rc=$?
+    stop_receiver || ok=1
+    local out=$(ls "$RX_DIR"/received_files/*/test_resume.bin 2>/dev/null | head -1)
+
+    if [ $rc -ne 0 ] || [ -z "$out" ] || ! cmp -s test_resume.bin "$out"; then
+        echo -e "${RED}✗ Resumed transfer not received intact (sender rc=$rc)${NC}"
+        tail -3 sender_output.log
+        ok=1
+    elif ! grep -q "^Resumed: [1-9]" sender_output.log; then
+        echo -e "${RED}✗ Transfer started over instead of resuming${NC}"
+        ok=1
+    fi
+    [ $ok -eq 0 ] && echo -e "${GREEN}✓ $(grep "^Resumed:" sender_output.log)${NC}"
+    rm -rf "$RX_DIR" test_resume.bin
+    return $ok
+}
+
+echo -e "\n${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}"
+echo -e "${BLUE}Test 9: Interrupted transfer resumed from its journal${NC}"
+echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
+if test_resume $((PORT + 120)); then
+    TESTS_PASSED=$((TESTS_PASSED + 1))
+else
+    TESTS_FAILED=$((TESTS_FAILED + 1))
+fi
+
+# Test 10: --delta against an older copy of the same name, the new one
+# with bytes inserted, so the matching blocks sit at shifted offsets
+test_delta_insert() {
+    local port=$1
+    local ok=0
+    head -c 2000000 /dev/urandom > test_delta_old.bin
+    { head -c 1000000 test_delta_old.bin; head -c 3000 /dev/urandom;
+      tail -c +1000001 test_delta_old.bin; } > test_delta.bin
+
+    # The older copy goes first, under the same name
+    local old=$(mktemp -d)
+    cp test_delta_old.bin "$old/test_delta.bin"
+    start_receiver $port
+    ./sender 127.0.0.1 $port "$old/test_delta.bin" 1024 1000 0 > /dev/null 2>&1
+    stop_receiver || ok=1
+    rm -rf "$old"
+    sleep 1
+
+    restart_receiver $port
+    timeout 60 ./sender 127.0.0.1 $port test_delta.bin 1024 1000 0 --delta > sender_output.log 2>&1
+    local rc=$?
+    stop_receiver || ok=1
+    local out=$(ls -t "$RX_DIR"/received_files/*/test_delta.bin 2>/dev/null | head -1)
+
+    if [ $rc -ne 0 ] || [ -z "$out" ] || ! cmp -s test_delta.bin "$out"; then
+        echo -e "${RED}✗ Delta transfer not received intact (sender rc=$rc)${NC}"
+        tail -3 sender_output.log
+        ok=1
+    elif ! grep -q "Records copied from the older copy: [1-9]" "$RX_DIR/receiver_output.log"; then
+        echo -e "${RED}✗ Nothing was copied from the older copy${NC}"
+        ok=1
+    fi
+    [ $ok -eq 0 ] && echo -e "${GREEN}✓ $(grep "^Delta:" sender_output.log | head -1)${NC}"
+    rm -rf "$RX_DIR" test_delta.bin test_delta_old.bin
+    return $ok
+}
+
+echo -e "\n${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}"
+echo -e "${BLUE}Test 10: Delta sync with bytes inserted${NC}"
+echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
+if test_delta_insert $((PORT + 130)); then
+    TESTS_PASSED=$((TESTS_PASSED + 1))
+else
+    TESTS_FAILED=$((TESTS_FAILED + 1))
+fi
+
+# Test 11: several senders at once to one --server receiver, one of them
+# striped over streams, each file kept apart and intact
+test_server_sessions() {
+    local port=$1
+    local ok=0
+    start_receiver $port --server
+
+    local pids=""
+    for i in 1 2 3 4; do
+        head -c $((i * 700000)) /dev/urandom > test_server_$i.bin
+        local streams=1
+        [ $i -eq 4 ] && streams=3
+        ./sender 127.0.0.1 $port test_server_$i.bin 1024 1000 0 --streams $streams \
+            > sender_output_$i.log 2>&1 &
+        pids="$pids $!"
+    done
+    local i=1
+    for pid in $pids; do
+        if ! wait $pid; then
+            echo -e "${RED}✗ Sender $i failed${NC}"
+            tail -3 sender_output_$i.log
+            ok=1
+        fi
+        i=$((i + 1))
+    done
+    kill $RECEIVER_PID 2>/dev/null || true
+    wait $RECEIVER_PID 2>/dev/null || true
+
+    for i in 1 2 3 4; do
+        local out=$(ls "$RX_DIR"/received_files/*/*/test_server_$i.bin 2>/dev/null | head -1)
+        if [ -z "$out" ] || ! cmp -s test_server_$i.bin "$out"; then
+            echo -e "${RED}✗ test_server_$i.bin not received intact${NC}"
+            ok=1
+        fi
+    done
+    [ $ok -eq 0 ] && echo -e "${GREEN}✓ $(grep -c "complete:" "$RX_DIR/receiver_output.log") sessions complete${NC}"
+    rm -rf "$RX_DIR" test_server_*.bin sender_output_*.log
+    return $ok
+}
+
+echo -e "\n${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}"
+echo -e "${BLUE}Test 11: Server mode, four senders at once${NC}"
+echo -e "${BLUE}━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━${NC}\n"
+if test_server_sessions $((PORT + 140)); then
+    TESTS_PASSED=$((TESTS_PASSED + 1))
 else
-    ((TESTS_FAILED++))
+    TESTS_FAILED=$((TESTS_FAILED + 1))
 fi
 
 # ============================================================================
@@ -0,0 +1,313 @@
+#ifndef UDP_BATCH_H
+#define UDP_BATCH_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+
+// ============================================================================
+// BATCHED UDP I/O
+// ============================================================================
+//
+// Thin wrappers around sendmmsg/recvmmsg so a blast moves tens of
+// datagrams per syscall. Both keep their buffers and message headers for
+// their whole lifetime, so batching does not allocate per packet.
+//
+// Where the kernel supports it they go further: with UDP GSO one message
+// carries up to GSO_MAX_SEGMENTS equal-sized datagrams that the kernel (or
+// the NIC) cuts apart, and with UDP GRO the receive side gets runs of
+// datagrams of one flow coalesced back into a single buffer.
+
+const int SEND_BATCH_SIZE = 32;          // messages per sendmmsg
+const int RECV_BATCH_SIZE = 32;          // messages per recvmmsg
+const int GSO_MAX_SEGMENTS = 64;         // UDP_MAX_SEGMENTS on older kernels
+const size_t GSO_MAX_BYTES = 65000;      // payload of one GSO message
+const size_t GRO_BUFFER_SIZE = 65536;    // a coalesced GRO message fits
+
+// Whether the kernel does UDP GSO on this socket. The segment size itself
+// goes with each message (a UDP_SEGMENT cmsg), not on the socket, so
+// control packets sent on the same socket are never cut up.
+inline bool udp_gso_supported(int sockfd) {
+    int off = 0;
+    return setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+}
+
+// Ask for GRO-coalesced receives; false if unsupported
+inline bool enable_udp_gro(int sockfd) {
+    int on = 1;
+    return setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+}
+
+// Have every datagram carry the socket's running count of datagrams the
+// kernel dropped for want of buffer space (SO_RXQ_OVFL); false if
+// unsupported
+inline bool enable_rxq_ovfl(int sockfd) {
+    int on = 1;
+    return setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == 0;
+}
+
+// Set SO_RCVTIMEO, skipping the syscall when the value has not changed
+inline void set_recv_timeout(int sockfd, int timeout_sec, int& current_sec) {
+    if (timeout_sec == current_sec) return;
+    struct timeval tv;
+    tv.tv_sec = timeout_sec;
+    tv.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    current_sec = timeout_sec;
+}
+
+// Wait up to timeout_ms for one datagram; false on timeout or error
+inline bool wait_for_datagram(int sockfd, uint8_t* buffer, size_t capacity, size_t& size,
+                              int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, std::max(timeout_ms, 0)) <= 0) {
+        return false;
+    }
+    ssize_t n = recvfrom(sockfd, buffer, capacity, MSG_DONTWAIT, NULL, NULL);
+    if (n < 0) {
+        return false;
+    }
+    size = n;
+    return true;
+}
+
+// ============================================================================
+// SEND BATCH
+// ============================================================================
+
+// With a segment size set, datagrams of exactly that size are appended to
+// the open message until it holds GSO_MAX_SEGMENTS of them or GSO_MAX_BYTES;
+// any other size is still allowed but closes the message, since only the
+// last GSO segment may be short. Datagrams must not exceed the segment size.
+
+class SendBatch {
+private:
+    size_t slot_size;
+    std::vector<uint8_t> storage;
+    std::vector<struct iovec> iov;
+    std::vector<struct mmsghdr> msgs;
+    std::vector<int> segments;           // datagrams in each message
+    std::vector<uint8_t> control;        // UDP_SEGMENT cmsg per message
+    int count;                           // closed messages
+    size_t segment_size;                 // 0 = one datagram per message
+
+    static size_t control_space() { return CMSG_SPACE(sizeof(uint16_t)); }
+
+    bool open_message() const {
+        return count < (int)msgs.size() && segments[count] > 0;
+    }
+
+    void close_message() {
+        if (open_message()) count++;
+    }
+
+public:
+    SendBatch(int capacity, size_t slot)
+        : slot_size(slot), storage(capacity * slot), iov(capacity),
+          msgs(capacity), segments(capacity, 0), control(capacity * control_space(), 0),
+          count(0), segment_size(0) {
+        memset(msgs.data(), 0, sizeof(struct mmsghdr) * capacity);
+        for (int i = 0; i < capacity; i++) {
+            iov[i].iov_base = storage.data() + i * slot_size;
+            iov[i].iov_len = 0;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    // Pack datagrams of `size` bytes into GSO messages (0 turns it off)
+    void set_segment_size(size_t size) {
+        segment_size = size;
+    }
+
+    int size() const { return count + (open_message() ? 1 : 0); }
+    bool empty() const { return size() == 0; }
+    bool full() const { return count == (int)msgs.size(); }
+    size_t slot_capacity() const { return slot_size; }
+
+    // Buffer for the next datagram; call commit() once it is filled in
+    uint8_t* next_slot() {
+        return storage.data() + count * slot_size + iov[count].iov_len;
+    }
+
+    // Room left for the next datagram
+    size_t next_capacity() const {
+        return slot_size - iov[count].iov_len;
+    }
+
+    void commit(size_t len) {
+        iov[count].iov_len += len;
+        segments[count]++;
+
+        bool more = segment_size > 0 && len == segment_size &&
+                    segments[count] < GSO_MAX_SEGMENTS &&
+                    iov[count].iov_len + segment_size <= std::min(slot_size, GSO_MAX_BYTES);
+        if (!more) close_message();
+    }
+
+    // Drop everything queued without sending it
+    void clear() {
+        for (int i = 0; i <= count && i < (int)msgs.size(); i++) {
+            iov[i].iov_len = 0;
+            segments[i] = 0;
+        }
+        count = 0;
+    }
+
+    // Close the open message and address every queued one to dest, with
+    // its UDP_SEGMENT cmsg where it holds several datagrams. Returns the
+    // number of messages; message(i) is then ready for sendmsg.
+    int prepare(const struct sockaddr_in& dest) {
+        close_message();
+        for (int i = 0; i < count; i++) {
+            struct msghdr& hdr = msgs[i].msg_hdr;
+            hdr.msg_name = (void*)&dest;
+            hdr.msg_namelen = sizeof(dest);
+            hdr.msg_control = NULL;
+            hdr.msg_controllen = 0;
+            if (segments[i] > 1) {
+                hdr.msg_control = control.data() + i * control_space();
+                hdr.msg_controllen = control_space();
+                struct cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gso_size = (uint16_t)segment_size;
+                memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+            }
+        }
+        return count;
+    }
+
+    struct msghdr* message(int i) { return &msgs[i].msg_hdr; }
+    int datagrams(int i) const { return segments[i]; }
+
+    // Send everything queued. Returns the number of datagrams handed to
+    // the kernel; a hard error drops the rest of the batch.
+    int flush(int sockfd, const struct sockaddr_in& dest) {
+        prepare(dest);
+
+        int sent = 0;
+        int datagrams = 0;
+        while (sent < count) {
+            int n = sendmmsg(sockfd, msgs.data() + sent, count - sent, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("sendmmsg failed");
+                break;
+            }
+            for (int i = sent; i < sent + n; i++) datagrams += segments[i];
+            sent += n;
+        }
+        clear();
+        return datagrams;
+    }
+};
+
+// ============================================================================
+// RECEIVE BATCH
+// ============================================================================
+
+class RecvBatch {
+private:
+    size_t slot_size;
+    std::vector<uint8_t> storage;
+    std::vector<struct iovec> iov;
+    std::vector<struct mmsghdr> msgs;
+    std::vector<struct sockaddr_in> addrs;
+    std::vector<uint8_t> control;        // room for UDP_GRO and SO_RXQ_OVFL cmsgs per message
+    std::vector<size_t> gro_size;        // segment size of a coalesced message
+    int count;
+    bool overflow_seen;                  // a message carried SO_RXQ_OVFL
+    uint32_t overflow;                   // ... the latest count it held
+
+    static size_t control_space() { return CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t)); }
+
+public:
+    RecvBatch(int capacity, size_t slot)
+        : slot_size(slot), storage(capacity * slot), iov(capacity),
+          msgs(capacity), addrs(capacity), control(capacity * control_space()),
+          gro_size(capacity, 0), count(0), overflow_seen(false), overflow(0) {
+        memset(msgs.data(), 0, sizeof(struct mmsghdr) * capacity);
+        for (int i = 0; i < capacity; i++) {
+            iov[i].iov_base = storage.data() + i * slot_size;
+            iov[i].iov_len = slot_size;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    // Block (subject to SO_RCVTIMEO) until at least one datagram arrives,
+    // then take whatever else is already queued. Returns the count, or 0
+    // on timeout/error. MSG_DONTWAIT as flags only takes what is queued.
+    int receive(int sockfd, int flags = MSG_WAITFORONE) {
+        for (size_t i = 0; i < msgs.size(); i++) {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_control = control.data() + i * control_space();
+            msgs[i].msg_hdr.msg_controllen = control_space();
+        }
+        int n = recvmmsg(sockfd, msgs.data(), msgs.size(), flags, NULL);
+        count = (n < 0) ? 0 : n;
+
+        overflow_seen = false;
+        for (int i = 0; i < count; i++) {
+            gro_size[i] = 0;
+            struct msghdr* hdr = &msgs[i].msg_hdr;
+            for (struct cmsghdr* cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm)) {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    int size;
+                    memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                    gro_size[i] = size > 0 ? size : 0;
+                } else if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+                    memcpy(&overflow, CMSG_DATA(cm), sizeof(overflow));
+                    overflow_seen = true;
+                }
+            }
+        }
+        return count;
+    }
+
+    int size() const { return count; }
+    const uint8_t* data(int i) const { return storage.data() + i * slot_size; }
+    uint8_t* data(int i) { return storage.data() + i * slot_size; }
+    size_t length(int i) const { return msgs[i].msg_len; }
+    const struct sockaddr_in& addr(int i) const { return addrs[i]; }
+    socklen_t addr_len(int i) const { return msgs[i].msg_hdr.msg_namelen; }
+
+    // With enable_rxq_ovfl: packets the kernel has dropped on the socket
+    // since `seen` (the count as of an earlier batch), which is brought up
+    // to date. A dropped GRO packet counts once however many datagrams it
+    // held, and the count only comes with packets queued after a drop.
+    uint32_t kernel_drops(uint32_t& seen) const {
+        if (!overflow_seen || overflow == seen) return 0;
+        uint32_t dropped = overflow - seen;      // the kernel's counter wraps too
+        seen = overflow;
+        return dropped;
+    }
+
+    // Call f(data, length, addr, addr_len) for every datagram received,
+    // splitting GRO-coalesced messages back into the original datagrams
+    template <typename Datagram>
+    void for_each_datagram(Datagram f) {
+        for (int i = 0; i < count; i++) {
+            size_t len = length(i);
+            size_t seg = gro_size[i] > 0 ? gro_size[i] : len;
+            for (size_t off = 0; off < len; off += seg) {
+                f(data(i) + off, std::min(seg, len - off), addr(i), addr_len(i));
+            }
+        }
+    }
+};
+
+#endif // UDP_BATCH_H
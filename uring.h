@@ -0,0 +1,600 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include "udp_batch.h"
+#include "file_sink.h"
+
+// ============================================================================
+// IO_URING RING
+// ============================================================================
+//
+// --io uring moves socket and file I/O onto one io_uring per thread
+// instead of blocking syscalls, so the thread that receives a blast also
+// keeps the disk busy. liburing is not a dependency: the three syscalls
+// are made directly and the rings mapped here. init() fails, and callers
+// fall back to the blocking path, when the kernel has no io_uring, has it
+// disabled, or lacks an opcode or feature this code uses.
+
+inline int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+inline int sys_io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                              const void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, arg_size);
+}
+
+inline int sys_io_uring_register(int fd, unsigned op, const void* arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+class IoUring {
+private:
+    int ring_fd;
+    void* ring_mem;                      // SQ and CQ rings (one mapping)
+    size_t ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;                   // SQEs handed out so far
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    std::string failure;
+
+    bool fail(const std::string& why) {
+        failure = why;
+        close_ring();
+        return false;
+    }
+
+    void close_ring() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (ring_mem) munmap(ring_mem, ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+        sqes = NULL;
+        ring_mem = NULL;
+        ring_fd = -1;
+    }
+
+public:
+    IoUring() : ring_fd(-1), ring_mem(NULL), ring_size(0), sqes(NULL), sqes_size(0),
+                sq_head(NULL), sq_tail(NULL), sq_array(NULL), sq_mask(0), sq_entries(0),
+                sqe_tail(0), cq_head(NULL), cq_tail(NULL), cq_mask(0), cqes(NULL) {}
+
+    ~IoUring() {
+        close_ring();
+    }
+
+    // Set up a ring of `entries` SQEs and check that every opcode in ops
+    // is supported. On failure error() says why.
+    bool init(unsigned entries, const std::vector<uint8_t>& ops) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = sys_io_uring_setup(entries, &params);
+        if (ring_fd < 0) {
+            return fail(std::string("io_uring_setup: ") + strerror(errno));
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(params.features & IORING_FEAT_EXT_ARG)) {
+            return fail("kernel io_uring too old");
+        }
+
+        ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                             params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+        ring_mem = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd, IORING_OFF_SQ_RING);
+        if (ring_mem == MAP_FAILED) {
+            ring_mem = NULL;
+            return fail(std::string("mmap rings: ") + strerror(errno));
+        }
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* s = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) {
+            return fail(std::string("mmap sqes: ") + strerror(errno));
+        }
+        sqes = (struct io_uring_sqe*)s;
+
+        uint8_t* base = (uint8_t*)ring_mem;
+        sq_head = (unsigned*)(base + params.sq_off.head);
+        sq_tail = (unsigned*)(base + params.sq_off.tail);
+        sq_array = (unsigned*)(base + params.sq_off.array);
+        sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sqe_tail = *sq_tail;
+        cq_head = (unsigned*)(base + params.cq_off.head);
+        cq_tail = (unsigned*)(base + params.cq_off.tail);
+        cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+        // Ask which opcodes this kernel has
+        const unsigned max_ops = 256;
+        std::vector<uint8_t> probe_buf(sizeof(struct io_uring_probe) +
+                                       max_ops * sizeof(struct io_uring_probe_op), 0);
+        struct io_uring_probe* probe = (struct io_uring_probe*)probe_buf.data();
+        if (sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, max_ops) < 0) {
+            return fail(std::string("opcode probe: ") + strerror(errno));
+        }
+        for (size_t i = 0; i < ops.size(); i++) {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                return fail("opcode " + std::to_string(ops[i]) + " not supported");
+            }
+        }
+        return true;
+    }
+
+    int fd() const { return ring_fd; }
+    const std::string& error() const { return failure; }
+
+    // Next free SQE, zeroed; it goes to the kernel with the next submit.
+    // Submits what is queued first if the ring is full.
+    struct io_uring_sqe* get_sqe() {
+        if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submit_and_wait(0, -1);
+            if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                return NULL;
+            }
+        }
+        unsigned index = sqe_tail & sq_mask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        sq_array[index] = index;
+        sqe_tail++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Submit the queued SQEs and wait for at least wait_nr completions,
+    // for at most timeout_ms (-1 = no limit). Returns a negative errno on
+    // failure; a timeout or signal is not one.
+    int submit_and_wait(unsigned wait_nr, int timeout_ms) {
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (to_submit == 0 && wait_nr == 0) return 0;
+
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int r;
+        if (wait_nr > 0 && timeout_ms >= 0) {
+            struct __kernel_timespec ts;
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            struct io_uring_getevents_arg arg;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            r = sys_io_uring_enter(ring_fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG,
+                                   &arg, sizeof(arg));
+        } else {
+            r = sys_io_uring_enter(ring_fd, to_submit, wait_nr, flags, NULL, 0);
+        }
+        if (r < 0 && errno != ETIME && errno != EINTR) {
+            return -errno;
+        }
+        return 0;
+    }
+
+    int submit() {
+        return submit_and_wait(0, -1);
+    }
+
+    // Completions waiting to be reaped
+    unsigned ready() const {
+        return __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head;
+    }
+
+    // Call f(cqe) for every completion available now; returns how many
+    template <typename Completion>
+    unsigned reap(Completion f) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        while (head != tail) {
+            f(cqes[head & cq_mask]);
+            head++;
+            n++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return n;
+    }
+};
+
+// ============================================================================
+// PROVIDED BUFFER RING
+// ============================================================================
+//
+// Receive buffers handed to the kernel up front (IORING_REGISTER_PBUF_RING)
+// so a multishot receive picks one per datagram as it lands, instead of
+// the application committing a buffer to each receive in advance. A buffer
+// goes back into the ring as soon as its datagram has been handled.
+
+class BufferRing {
+private:
+    int ring_fd;
+    uint16_t group;
+    struct io_uring_buf* bufs;           // ring entries; the tail overlays bufs[0].resv
+    size_t bufs_size;
+    unsigned entries;
+    uint16_t tail;
+    size_t buf_size;
+    std::vector<uint8_t> storage;
+
+public:
+    BufferRing() : ring_fd(-1), group(0), bufs(NULL), bufs_size(0), entries(0), tail(0),
+                   buf_size(0) {}
+
+    ~BufferRing() {
+        if (ring_fd >= 0) {
+            struct io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.bgid = group;
+            sys_io_uring_register(ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        }
+        if (bufs) munmap(bufs, bufs_size);
+    }
+
+    // count must be a power of two
+    bool init(const IoUring& ring, uint16_t bgid, unsigned count, size_t size) {
+        bufs_size = (count * sizeof(struct io_uring_buf) + 4095) / 4096 * 4096;
+        void* p = mmap(NULL, bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return false;
+        bufs = (struct io_uring_buf*)p;
+
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)bufs;
+        reg.ring_entries = count;
+        reg.bgid = bgid;
+        if (sys_io_uring_register(ring.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            return false;
+        }
+        ring_fd = ring.fd();
+        group = bgid;
+        entries = count;
+        buf_size = size;
+        storage.assign(count * size, 0);
+        for (unsigned i = 0; i < count; i++) {
+            recycle(i);
+        }
+        return true;
+    }
+
+    uint16_t group_id() const { return group; }
+    size_t size() const { return buf_size; }
+    uint8_t* buffer(uint16_t bid) { return storage.data() + (size_t)bid * buf_size; }
+
+    // Give buffer bid back to the kernel
+    void recycle(uint16_t bid) {
+        struct io_uring_buf* b = &bufs[tail & (entries - 1)];
+        b->addr = (uint64_t)(uintptr_t)buffer(bid);
+        b->len = buf_size;
+        b->bid = bid;
+        tail++;
+        __atomic_store_n(&bufs[0].resv, tail, __ATOMIC_RELEASE);
+    }
+};
+
+// ============================================================================
+// MULTISHOT RECEIVE
+// ============================================================================
+//
+// One IORING_OP_RECVMSG armed with IORING_RECV_MULTISHOT keeps producing a
+// completion per datagram until it runs out of buffers; each buffer holds
+// an io_uring_recvmsg_out header, the sender address, the control data
+// (the UDP_GRO segment size) and the payload. complete() turns that back
+// into the same f(data, len, addr, addr_len) calls RecvBatch makes.
+
+const unsigned URING_RECV_BUFFERS = 64;  // provided buffers per socket (power of two)
+
+class MultishotReceiver {
+private:
+    IoUring* ring;
+    BufferRing buffers;
+    int sockfd;
+    struct msghdr layout;                // name/control room reserved per buffer
+    bool armed;
+    uint64_t tag;
+
+public:
+    MultishotReceiver() : ring(NULL), sockfd(-1), armed(false), tag(0) {
+        memset(&layout, 0, sizeof(layout));
+    }
+
+    bool init(IoUring& r, int fd, uint64_t user_data, unsigned count, size_t payload) {
+        ring = &r;
+        sockfd = fd;
+        tag = user_data;
+        layout.msg_namelen = sizeof(struct sockaddr_in);
+        layout.msg_controllen = CMSG_SPACE(sizeof(int));
+        size_t size = sizeof(struct io_uring_recvmsg_out) + layout.msg_namelen +
+                      layout.msg_controllen + payload;
+        return buffers.init(r, 0, count, size);
+    }
+
+    bool is_armed() const { return armed; }
+
+    // (Re)start the multishot receive; it stops when buffers run out
+    bool arm() {
+        struct io_uring_sqe* sqe = ring->get_sqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = sockfd;
+        sqe->addr = (uint64_t)(uintptr_t)&layout;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffers.group_id();
+        sqe->user_data = tag;
+        armed = true;
+        return true;
+    }
+
+    // Handle one of our completions. Returns 0, or the negative errno that
+    // ended the receive for good (-EINVAL: no multishot in this kernel).
+    template <typename Datagram>
+    int complete(const struct io_uring_cqe& cqe, Datagram f) {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            armed = false;
+        }
+        if (cqe.res < 0) {
+            return (cqe.res == -ENOBUFS || cqe.res == -EINTR) ? 0 : cqe.res;
+        }
+        if (!(cqe.flags & IORING_CQE_F_BUFFER)) return 0;
+
+        uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        uint8_t* buf = buffers.buffer(bid);
+        struct io_uring_recvmsg_out out;
+        memcpy(&out, buf, sizeof(out));
+
+        uint8_t* name = buf + sizeof(out);
+        uint8_t* control = name + layout.msg_namelen;
+        uint8_t* payload = control + layout.msg_controllen;
+        size_t available = (size_t)cqe.res - (payload - buf);
+        size_t len = std::min((size_t)out.payloadlen, available);
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        memcpy(&addr, name, std::min((size_t)out.namelen, sizeof(addr)));
+
+        size_t seg = 0;
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_control = control;
+        hdr.msg_controllen = out.controllen;
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int size;
+                memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                seg = size > 0 ? size : 0;
+            }
+        }
+        if (seg == 0) seg = len;
+
+        for (size_t off = 0; off < len; off += seg) {
+            f(payload + off, std::min(seg, len - off), addr, (socklen_t)sizeof(addr));
+        }
+        buffers.recycle(bid);
+        return 0;
+    }
+};
+
+// ============================================================================
+// ASYNC FILE WRITER
+// ============================================================================
+//
+// Records are copied into CHUNK-sized buffers as they are accepted and a
+// buffer goes to the kernel as one IORING_OP_WRITE once it is full or the
+// next record is not adjacent, so a blast received in order turns into a
+// handful of large writes that proceed while the next datagrams come in.
+// The writer has a ring of its own, so its completions never have to be
+// sorted out from socket ones. A failed write cannot be undone (the record
+// is already counted as received), so it is reported by flush().
+
+class UringFileWriter : public ChunkWriter {
+private:
+    struct Chunk {
+        std::vector<uint8_t> data;
+        uint64_t offset;                 // file offset of data[0]
+        size_t len;                      // bytes filled
+        size_t written;                  // bytes the kernel has written
+    };
+
+    IoUring ring;
+    int fd;
+    std::vector<Chunk> chunks;
+    std::vector<int> idle;
+    int current;                         // chunk being filled, -1 = none
+    unsigned in_flight;
+    bool failed;
+
+    bool queue_write(int i) {
+        Chunk& c = chunks[i];
+        struct io_uring_sqe* sqe = ring.get_sqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)(c.data.data() + c.written);
+        sqe->len = c.len - c.written;
+        sqe->off = c.offset + c.written;
+        sqe->user_data = i;
+        in_flight++;
+        return ring.submit() == 0;
+    }
+
+    void reap() {
+        ring.reap([this](const struct io_uring_cqe& cqe) {
+            int i = (int)cqe.user_data;
+            Chunk& c = chunks[i];
+            in_flight--;
+            if (cqe.res <= 0) {
+                if (!failed) {
+                    fprintf(stderr, "Async write failed: %s\n",
+                            cqe.res < 0 ? strerror(-cqe.res) : "no progress");
+                }
+                failed = true;
+                idle.push_back(i);
+                return;
+            }
+            c.written += cqe.res;
+            if (c.written < c.len) {
+                queue_write(i);          // short write, finish it
+            } else {
+                idle.push_back(i);
+            }
+        });
+    }
+
+public:
+    static const size_t CHUNK = 256 * 1024;
+    static const unsigned CHUNKS = 16;
+
+    UringFileWriter() : fd(-1), current(-1), in_flight(0), failed(false) {}
+
+    bool init(int file_fd) {
+        std::vector<uint8_t> ops(1, IORING_OP_WRITE);
+        if (!ring.init(CHUNKS * 2, ops)) return false;
+        fd = file_fd;
+        chunks.resize(CHUNKS);
+        for (unsigned i = 0; i < CHUNKS; i++) {
+            chunks[i].data.resize(CHUNK);
+            idle.push_back(i);
+        }
+        return true;
+    }
+
+    const std::string& error() const { return ring.error(); }
+
+    // Queue len bytes (at most CHUNK) for offset. Blocks only when every
+    // chunk is in flight.
+    bool write(uint64_t offset, const uint8_t* data, size_t len) {
+        if (failed || len > CHUNK) return false;
+        if (current >= 0) {
+            Chunk& c = chunks[current];
+            if (offset != c.offset + c.len || c.len + len > CHUNK) {
+                kick();
+            }
+        }
+        if (current < 0) {
+            reap();
+            while (idle.empty() && !failed) {
+                ring.submit_and_wait(1, -1);
+                reap();
+            }
+            if (failed) return false;
+            current = idle.back();
+            idle.pop_back();
+            chunks[current].offset = offset;
+            chunks[current].len = 0;
+            chunks[current].written = 0;
+        }
+        Chunk& c = chunks[current];
+        memcpy(c.data.data() + c.len, data, len);
+        c.len += len;
+        return true;
+    }
+
+    // Start writing the partly filled chunk, e.g. before waiting for the
+    // network, so the disk is not left idle
+    void kick() {
+        if (current < 0) return;
+        if (chunks[current].len > 0) {
+            if (!queue_write(current)) failed = true;
+        } else {
+            idle.push_back(current);
+        }
+        current = -1;
+    }
+
+    // Write out everything and wait for it; false if any write failed
+    bool flush() {
+        kick();
+        while (in_flight > 0) {
+            if (ring.submit_and_wait(1, -1) < 0) {
+                failed = true;
+                break;
+            }
+            reap();
+        }
+        return !failed;
+    }
+};
+
+// ============================================================================
+// SENDER HELPERS
+// ============================================================================
+
+// user_data of completions the sender does not wait for
+const uint64_t URING_PREFETCH_TAG = ~0ULL;
+
+// Send what a SendBatch holds: one IORING_OP_SENDMSG per message, all in
+// one io_uring_enter together with whatever else is queued (prefetches).
+// Waits for the sends so the batch can be refilled. Returns the number of
+// datagrams sent.
+inline int uring_send_batch(IoUring& ring, int sockfd, SendBatch& batch,
+                            const struct sockaddr_in& dest) {
+    int messages = batch.prepare(dest);
+    int queued = 0;
+    for (int i = 0; i < messages; i++) {
+        struct io_uring_sqe* sqe = ring.get_sqe();
+        if (!sqe) break;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sockfd;
+        sqe->addr = (uint64_t)(uintptr_t)batch.message(i);
+        sqe->len = 1;
+        sqe->user_data = i;
+        queued++;
+    }
+
+    int datagrams = 0;
+    int done = 0;
+    bool reported = false;
+    while (done < queued) {
+        if (ring.submit_and_wait(1, -1) < 0) break;
+        ring.reap([&](const struct io_uring_cqe& cqe) {
+            if (cqe.user_data == URING_PREFETCH_TAG) return;
+            done++;
+            if (cqe.res >= 0) {
+                datagrams += batch.datagrams((int)cqe.user_data);
+            } else if (!reported) {
+                fprintf(stderr, "io_uring sendmsg failed: %s\n", strerror(-cqe.res));
+                reported = true;
+            }
+        });
+    }
+    batch.clear();
+    return datagrams;
+}
+
+// Queue an asynchronous readahead of [offset, offset + len); it is
+// submitted with the next batch, and the read runs off the sending thread
+inline void uring_prefetch(IoUring& ring, int fd, uint64_t offset, uint64_t len) {
+    struct io_uring_sqe* sqe = ring.get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->len = (uint32_t)std::min<uint64_t>(len, UINT32_MAX);
+    sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+    sqe->user_data = URING_PREFETCH_TAG;
+}
+
+#endif // URING_H